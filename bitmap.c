@@ -24,6 +24,9 @@
 /* indent is confused by this file */
 /* *INDENT-OFF* */
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "rdesktop.h"
 
 #define CVAL(p)   (*(p++))
@@ -52,6 +55,15 @@
 	} \
 }
 
+/* Hand a finished scanline to the caller's row function while it is
+   still in cache */
+#define ROW_DONE(row, Bpp) \
+{ \
+	if (row_func != NULL && line != NULL) \
+		row_func((uint8 *) output + (row) * width * (Bpp), row_output + (row) * row_line, \
+			 row_output + ((row) + 1) * row_line); \
+}
+
 #define MASK_UPDATE() \
 { \
 	mixmask <<= 1; \
@@ -62,14 +74,37 @@
 	} \
 }
 
+/* replicate one pixel over count pixels, doubling the copied span each
+   round so that long runs are handled by a few memcpy calls */
+static void
+bitmap_fill_pattern(uint8 * dst, const uint8 * pixel, int Bpp, int count)
+{
+	int total = count * Bpp;
+	int done, chunk;
+
+	if (count <= 0)
+		return;
+
+	memcpy(dst, pixel, Bpp);
+	done = Bpp;
+	while (done < total)
+	{
+		chunk = MIN(done, total - done);
+		memcpy(dst + done, dst, chunk);
+		done += chunk;
+	}
+}
+
 /* 1 byte bitmap decompress */
 static RD_BOOL
-bitmap_decompress1(uint8 * output, int width, int height, uint8 * input, int size)
+bitmap_decompress1(uint8 * output, int width, int height, uint8 * input, int size,
+		   bitmap_row_func row_func, uint8 * row_output, int row_line)
 {
 	uint8 *end = input + size;
 	uint8 *prevline = NULL, *line = NULL;
 	int opcode, count, offset, isfillormix, x = width;
 	int lastopcode = -1, insertmix = False, bicolour = False;
+	int i, n;
 	uint8 code;
 	uint8 colour1 = 0, colour2 = 0;
 	uint8 mixmask, mask = 0;
@@ -158,79 +193,75 @@ bitmap_decompress1(uint8 * output, int width, int height, uint8 * input, int siz
 		}
 		lastopcode = opcode;
 		mixmask = 0;
-		/* Output body */
+		/* Output body, one span per scanline */
 		while (count > 0)
 		{
 			if (x >= width)
 			{
 				if (height <= 0)
 					return False;
+				ROW_DONE(height, 1);
 				x = 0;
 				height--;
 				prevline = line;
 				line = output + height * width;
 			}
+			if ((opcode == 0) && insertmix)
+			{
+				if (prevline == NULL)
+					line[x] = mix;
+				else
+					line[x] = prevline[x] ^ mix;
+				insertmix = False;
+				count--;
+				x++;
+				continue;
+			}
+			n = MIN(count, width - x);
 			switch (opcode)
 			{
 				case 0:	/* Fill */
-					if (insertmix)
-					{
-						if (prevline == NULL)
-							line[x] = mix;
-						else
-							line[x] = prevline[x] ^ mix;
-						insertmix = False;
-						count--;
-						x++;
-					}
 					if (prevline == NULL)
-					{
-						REPEAT(line[x] = 0)
-					}
+						memset(&line[x], 0, n);
 					else
-					{
-						REPEAT(line[x] = prevline[x])
-					}
+						memcpy(&line[x], &prevline[x], n);
 					break;
 				case 1:	/* Mix */
 					if (prevline == NULL)
 					{
-						REPEAT(line[x] = mix)
+						memset(&line[x], mix, n);
 					}
 					else
 					{
-						REPEAT(line[x] = prevline[x] ^ mix)
+						for (i = x; i < x + n; i++)
+							line[i] = prevline[i] ^ mix;
 					}
 					break;
 				case 2:	/* Fill or Mix */
 					if (prevline == NULL)
 					{
-						REPEAT
-						(
+						for (i = x; i < x + n; i++)
+						{
 							MASK_UPDATE();
-							if (mask & mixmask)
-								line[x] = mix;
-							else
-								line[x] = 0;
-						)
+							line[i] = (mask & mixmask) ? mix : 0;
+						}
 					}
 					else
 					{
-						REPEAT
-						(
+						for (i = x; i < x + n; i++)
+						{
 							MASK_UPDATE();
-							if (mask & mixmask)
-								line[x] = prevline[x] ^ mix;
-							else
-								line[x] = prevline[x];
-						)
+							line[i] = (mask & mixmask) ?
+								prevline[i] ^ mix : prevline[i];
+						}
 					}
 					break;
 				case 3:	/* Colour */
-					REPEAT(line[x] = colour2)
+					memset(&line[x], colour2, n);
 					break;
 				case 4:	/* Copy */
-					REPEAT(line[x] = CVAL(input))
+					memcpy(&line[x], input, n);
+					input += n;
 					break;
 				case 8:	/* Bicolour */
 					REPEAT
@@ -246,30 +277,36 @@ bitmap_decompress1(uint8 * output, int width, int height, uint8 * input, int siz
 							bicolour = True; count++;
 						}
 					)
+					n = 0;
 					break;
 				case 0xd:	/* White */
-					REPEAT(line[x] = 0xff)
+					memset(&line[x], 0xff, n);
 					break;
 				case 0xe:	/* Black */
-					REPEAT(line[x] = 0)
+					memset(&line[x], 0, n);
 					break;
 				default:
 					logger(Core, Warning, "bitmap_decompress(), unhandled bitmap opcode 0x%x", opcode);
 					return False;
 			}
+			count -= n;
+			x += n;
 		}
 	}
+	ROW_DONE(height, 1);
 	return True;
 }
 
 /* 2 byte bitmap decompress */
 static RD_BOOL
-bitmap_decompress2(uint8 * output, int width, int height, uint8 * input, int size)
+bitmap_decompress2(uint8 * output, int width, int height, uint8 * input, int size,
+		   bitmap_row_func row_func, uint8 * row_output, int row_line)
 {
 	uint8 *end = input + size;
 	uint16 *prevline = NULL, *line = NULL;
 	int opcode, count, offset, isfillormix, x = width;
 	int lastopcode = -1, insertmix = False, bicolour = False;
+	int i, n;
 	uint8 code;
 	uint16 colour1 = 0, colour2 = 0;
 	uint8 mixmask, mask = 0;
@@ -358,79 +395,76 @@ bitmap_decompress2(uint8 * output, int width, int height, uint8 * input, int siz
 		}
 		lastopcode = opcode;
 		mixmask = 0;
-		/* Output body */
+		/* Output body, one span per scanline */
 		while (count > 0)
 		{
 			if (x >= width)
 			{
 				if (height <= 0)
 					return False;
+				ROW_DONE(height, 2);
 				x = 0;
 				height--;
 				prevline = line;
 				line = ((uint16 *) output) + height * width;
 			}
+			if ((opcode == 0) && insertmix)
+			{
+				if (prevline == NULL)
+					line[x] = mix;
+				else
+					line[x] = prevline[x] ^ mix;
+				insertmix = False;
+				count--;
+				x++;
+				continue;
+			}
+			n = MIN(count, width - x);
 			switch (opcode)
 			{
 				case 0:	/* Fill */
-					if (insertmix)
-					{
-						if (prevline == NULL)
-							line[x] = mix;
-						else
-							line[x] = prevline[x] ^ mix;
-						insertmix = False;
-						count--;
-						x++;
-					}
 					if (prevline == NULL)
-					{
-						REPEAT(line[x] = 0)
-					}
+						memset(&line[x], 0, n * 2);
 					else
-					{
-						REPEAT(line[x] = prevline[x])
-					}
+						memcpy(&line[x], &prevline[x], n * 2);
 					break;
 				case 1:	/* Mix */
 					if (prevline == NULL)
 					{
-						REPEAT(line[x] = mix)
+						bitmap_fill_pattern((uint8 *) &line[x], (uint8 *) &mix, 2, n);
 					}
 					else
 					{
-						REPEAT(line[x] = prevline[x] ^ mix)
+						for (i = x; i < x + n; i++)
+							line[i] = prevline[i] ^ mix;
 					}
 					break;
 				case 2:	/* Fill or Mix */
 					if (prevline == NULL)
 					{
-						REPEAT
-						(
+						for (i = x; i < x + n; i++)
+						{
 							MASK_UPDATE();
-							if (mask & mixmask)
-								line[x] = mix;
-							else
-								line[x] = 0;
-						)
+							line[i] = (mask & mixmask) ? mix : 0;
+						}
 					}
 					else
 					{
-						REPEAT
-						(
+						for (i = x; i < x + n; i++)
+						{
 							MASK_UPDATE();
-							if (mask & mixmask)
-								line[x] = prevline[x] ^ mix;
-							else
-								line[x] = prevline[x];
-						)
+							line[i] = (mask & mixmask) ?
+								prevline[i] ^ mix : prevline[i];
+						}
 					}
 					break;
 				case 3:	/* Colour */
-					REPEAT(line[x] = colour2)
+					bitmap_fill_pattern((uint8 *) &line[x], (uint8 *) &colour2, 2, n);
 					break;
 				case 4:	/* Copy */
-					REPEAT(CVAL2(input, line[x]))
+					/* CVAL2 is a host order load, so is memcpy */
+					memcpy(&line[x], input, n * 2);
+					input += n * 2;
 					break;
 				case 8:	/* Bicolour */
 					REPEAT
@@ -447,30 +481,36 @@ bitmap_decompress2(uint8 * output, int width, int height, uint8 * input, int siz
 							count++;
 						}
 					)
+					n = 0;
 					break;
 				case 0xd:	/* White */
-					REPEAT(line[x] = 0xffff)
+					memset(&line[x], 0xff, n * 2);
 					break;
 				case 0xe:	/* Black */
-					REPEAT(line[x] = 0)
+					memset(&line[x], 0, n * 2);
 					break;
 				default:
 					logger(Core, Warning, "bitmap_decompress2(), unhandled bitmap opcode 0x%x", opcode);
 					return False;
 			}
+			count -= n;
+			x += n;
 		}
 	}
+	ROW_DONE(height, 2);
 	return True;
 }
 
 /* 3 byte bitmap decompress */
 static RD_BOOL
-bitmap_decompress3(uint8 * output, int width, int height, uint8 * input, int size)
+bitmap_decompress3(uint8 * output, int width, int height, uint8 * input, int size,
+		   bitmap_row_func row_func, uint8 * row_output, int row_line)
 {
 	uint8 *end = input + size;
 	uint8 *prevline = NULL, *line = NULL;
 	int opcode, count, offset, isfillormix, x = width;
 	int lastopcode = -1, insertmix = False, bicolour = False;
+	int i, n;
 	uint8 code;
 	uint8 colour1[3] = {0, 0, 0}, colour2[3] = {0, 0, 0};
 	uint8 mixmask, mask = 0;
@@ -568,145 +608,111 @@ bitmap_decompress3(uint8 * output, int width, int height, uint8 * input, int siz
 		}
 		lastopcode = opcode;
 		mixmask = 0;
-		/* Output body */
+		/* Output body, one span per scanline */
 		while (count > 0)
 		{
 			if (x >= width)
 			{
 				if (height <= 0)
 					return False;
+				ROW_DONE(height, 3);
 				x = 0;
 				height--;
 				prevline = line;
 				line = output + height * (width * 3);
 			}
+			if ((opcode == 0) && insertmix)
+			{
+				if (prevline == NULL)
+				{
+					line[x * 3] = mix[0];
+					line[x * 3 + 1] = mix[1];
+					line[x * 3 + 2] = mix[2];
+				}
+				else
+				{
+					line[x * 3] =
+					 prevline[x * 3] ^ mix[0];
+					line[x * 3 + 1] =
+					 prevline[x * 3 + 1] ^ mix[1];
+					line[x * 3 + 2] =
+					 prevline[x * 3 + 2] ^ mix[2];
+				}
+				insertmix = False;
+				count--;
+				x++;
+				continue;
+			}
+			n = MIN(count, width - x);
 			switch (opcode)
 			{
 				case 0:	/* Fill */
-					if (insertmix)
-					{
-						if (prevline == NULL)
-						{
-							line[x * 3] = mix[0];
-							line[x * 3 + 1] = mix[1];
-							line[x * 3 + 2] = mix[2];
-						}
-						else
-						{
-							line[x * 3] =
-							 prevline[x * 3] ^ mix[0];
-							line[x * 3 + 1] =
-							 prevline[x * 3 + 1] ^ mix[1];
-							line[x * 3 + 2] =
-							 prevline[x * 3 + 2] ^ mix[2];
-						}
-						insertmix = False;
-						count--;
-						x++;
-					}
 					if (prevline == NULL)
-					{
-						REPEAT
-						(
-							line[x * 3] = 0;
-							line[x * 3 + 1] = 0;
-							line[x * 3 + 2] = 0;
-						)
-					}
+						memset(&line[x * 3], 0, n * 3);
 					else
-					{
-						REPEAT
-						(
-							line[x * 3] = prevline[x * 3];
-							line[x * 3 + 1] = prevline[x * 3 + 1];
-							line[x * 3 + 2] = prevline[x * 3 + 2];
-						)
-					}
+						memcpy(&line[x * 3], &prevline[x * 3], n * 3);
 					break;
 				case 1:	/* Mix */
 					if (prevline == NULL)
 					{
-						REPEAT
-						(
-							line[x * 3] = mix[0];
-							line[x * 3 + 1] = mix[1];
-							line[x * 3 + 2] = mix[2];
-						)
+						bitmap_fill_pattern(&line[x * 3], mix, 3, n);
 					}
 					else
 					{
-						REPEAT
-						(
-							line[x * 3] =
-							 prevline[x * 3] ^ mix[0];
-							line[x * 3 + 1] =
-							 prevline[x * 3 + 1] ^ mix[1];
-							line[x * 3 + 2] =
-							 prevline[x * 3 + 2] ^ mix[2];
-						)
+						for (i = x * 3; i < (x + n) * 3; i += 3)
+						{
+							line[i] = prevline[i] ^ mix[0];
+							line[i + 1] = prevline[i + 1] ^ mix[1];
+							line[i + 2] = prevline[i + 2] ^ mix[2];
+						}
 					}
 					break;
 				case 2:	/* Fill or Mix */
 					if (prevline == NULL)
 					{
-						REPEAT
-						(
+						for (i = x * 3; i < (x + n) * 3; i += 3)
+						{
 							MASK_UPDATE();
 							if (mask & mixmask)
 							{
-								line[x * 3] = mix[0];
-								line[x * 3 + 1] = mix[1];
-								line[x * 3 + 2] = mix[2];
+								line[i] = mix[0];
+								line[i + 1] = mix[1];
+								line[i + 2] = mix[2];
 							}
 							else
 							{
-								line[x * 3] = 0;
-								line[x * 3 + 1] = 0;
-								line[x * 3 + 2] = 0;
+								line[i] = 0;
+								line[i + 1] = 0;
+								line[i + 2] = 0;
 							}
-						)
+						}
 					}
 					else
 					{
-						REPEAT
-						(
+						for (i = x * 3; i < (x + n) * 3; i += 3)
+						{
 							MASK_UPDATE();
 							if (mask & mixmask)
 							{
-								line[x * 3] = 
-								 prevline[x * 3] ^ mix [0];
-								line[x * 3 + 1] =
-								 prevline[x * 3 + 1] ^ mix [1];
-								line[x * 3 + 2] =
-								 prevline[x * 3 + 2] ^ mix [2];
+								line[i] = prevline[i] ^ mix[0];
+								line[i + 1] = prevline[i + 1] ^ mix[1];
+								line[i + 2] = prevline[i + 2] ^ mix[2];
 							}
 							else
 							{
-								line[x * 3] =
-								 prevline[x * 3];
-								line[x * 3 + 1] =
-								 prevline[x * 3 + 1];
-								line[x * 3 + 2] =
-								 prevline[x * 3 + 2];
+								line[i] = prevline[i];
+								line[i + 1] = prevline[i + 1];
+								line[i + 2] = prevline[i + 2];
 							}
-						)
+						}
 					}
 					break;
 				case 3:	/* Colour */
-					REPEAT
-					(
-						line[x * 3] = colour2 [0];
-						line[x * 3 + 1] = colour2 [1];
-						line[x * 3 + 2] = colour2 [2];
-					)
+					bitmap_fill_pattern(&line[x * 3], colour2, 3, n);
 					break;
 				case 4:	/* Copy */
-					REPEAT
-					(
-						line[x * 3] = CVAL(input);
-						line[x * 3 + 1] = CVAL(input);
-						line[x * 3 + 2] = CVAL(input);
-					)
+					memcpy(&line[x * 3], input, n * 3);
+					input += n * 3;
 					break;
 				case 8:	/* Bicolour */
 					REPEAT
@@ -727,37 +733,30 @@ bitmap_decompress3(uint8 * output, int width, int height, uint8 * input, int siz
 							count++;
 						}
 					)
+					n = 0;
 					break;
 				case 0xd:	/* White */
-					REPEAT
-					(
-						line[x * 3] = 0xff;
-						line[x * 3 + 1] = 0xff;
-						line[x * 3 + 2] = 0xff;
-					)
+					memset(&line[x * 3], 0xff, n * 3);
 					break;
 				case 0xe:	/* Black */
-					REPEAT
-					(
-						line[x * 3] = 0;
-						line[x * 3 + 1] = 0;
-						line[x * 3 + 2] = 0;
-					)
+					memset(&line[x * 3], 0, n * 3);
 					break;
 				default:
 					logger(Core, Warning, "bitmap_decompress3(), unhandled bitmap opcode 0x%x", opcode);
 					return False;
 			}
+			count -= n;
+			x += n;
 		}
 	}
+	ROW_DONE(height, 3);
 	return True;
 }
 
-/* decompress a colour plane */
+/* decompress a colour plane, returns the number of bytes used or -1 */
 static int
-process_plane(uint8 * in, int width, int height, uint8 * out, int size)
+process_plane(uint8 * in, int width, int height, uint8 * out, int size, RD_BOOL bottom_up)
 {
-	UNUSED(size);
 	int indexw;
 	int indexh;
 	int code;
@@ -770,14 +769,19 @@ process_plane(uint8 * in, int width, int height, uint8 * out, int size)
 	uint8 * this_line;
 	uint8 * org_in;
 	uint8 * org_out;
+	uint8 * end;
 
 	org_in = in;
 	org_out = out;
+	end = in + size;
 	last_line = 0;
 	indexh = 0;
 	while (indexh < height)
 	{
-		out = (org_out + width * height * 4) - ((indexh + 1) * width * 4);
+		if (bottom_up)
+			out = (org_out + width * height * 4) - ((indexh + 1) * width * 4);
+		else
+			out = org_out + indexh * width * 4;
 		color = 0;
 		this_line = out;
 		indexw = 0;
@@ -785,6 +789,8 @@ process_plane(uint8 * in, int width, int height, uint8 * out, int size)
 		{
 			while (indexw < width)
 			{
+				if (in >= end)
+					return -1;
 				code = CVAL(in);
 				replen = code & 0xf;
 				collen = (code >> 4) & 0xf;
@@ -794,6 +800,8 @@ process_plane(uint8 * in, int width, int height, uint8 * out, int size)
 					replen = revcode;
 					collen = 0;
 				}
+				if (end - in < collen)
+					return -1;
 				while (indexw < width && collen > 0)
 				{
 					color = CVAL(in);
@@ -815,6 +823,8 @@ process_plane(uint8 * in, int width, int height, uint8 * out, int size)
 		{
 			while (indexw < width)
 			{
+				if (in >= end)
+					return -1;
 				code = CVAL(in);
 				replen = code & 0xf;
 				collen = (code >> 4) & 0xf;
@@ -824,6 +834,8 @@ process_plane(uint8 * in, int width, int height, uint8 * out, int size)
 					replen = revcode;
 					collen = 0;
 				}
+				if (end - in < collen)
+					return -1;
 				while (indexw < width && collen > 0)
 				{
 					x = CVAL(in);
@@ -867,6 +879,7 @@ bitmap_decompress4(uint8 * output, int width, int height, uint8 * input, int siz
 	int code;
 	int bytes_pro;
 	int total_pro;
+	int i;
 
 	code = CVAL(input);
 	if (code != 0x10)
@@ -874,45 +887,261 @@ bitmap_decompress4(uint8 * output, int width, int height, uint8 * input, int siz
 		return False;
 	}
 	total_pro = 1;
-	bytes_pro = process_plane(input, width, height, output + 3, size - total_pro);
-	total_pro += bytes_pro;
-	input += bytes_pro;
-	bytes_pro = process_plane(input, width, height, output + 2, size - total_pro);
-	total_pro += bytes_pro;
-	input += bytes_pro;
-	bytes_pro = process_plane(input, width, height, output + 1, size - total_pro);
-	total_pro += bytes_pro;
-	input += bytes_pro;
-	bytes_pro = process_plane(input, width, height, output + 0, size - total_pro);
-	total_pro += bytes_pro;
+	for (i = 3; i >= 0; i--)
+	{
+		bytes_pro = process_plane(input, width, height, output + i, size - total_pro, True);
+		if (bytes_pro < 0)
+			return False;
+		total_pro += bytes_pro;
+		input += bytes_pro;
+	}
 	return size == total_pro;
 }
 
-/* main decompress function */
+/* Planar codec bitmap as sent in graphics pipeline updates,
+   [MS-RDPEGDI] 2.2.2.5.1, to top-down 32 bpp. Only the ARGB colour
+   planes are handled, not the lossy YCoCg ones. */
 RD_BOOL
-bitmap_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp)
+bitmap_decompress_planar(uint8 * output, int width, int height, uint8 * input, int size)
+{
+	uint8 header, *end = input + size;
+	int i, x, y, first, bytes;
+
+	/* the server sends the size, keep the pixel offsets in range */
+	if (size < 1 || width <= 0 || height <= 0 || (size_t) width * height > INT_MAX / 4)
+		return False;
+
+	header = *input++;
+	if (header & PLANAR_HEADER_CLL_MASK)
+		return False;
+
+	/* planes are stored as A, R, G, B while the output is BGRA */
+	first = (header & PLANAR_HEADER_NO_ALPHA) ? 2 : 3;
+	if (first == 2)
+		for (i = 0; i < width * height; i++)
+			output[i * 4 + 3] = 0xff;
+
+	for (i = first; i >= 0; i--)
+	{
+		if (header & PLANAR_HEADER_RLE)
+		{
+			bytes = process_plane(input, width, height, output + i, end - input, False);
+			if (bytes < 0)
+				return False;
+			input += bytes;
+		}
+		else
+		{
+			if (end - input < width * height)
+				return False;
+			for (y = 0; y < height; y++)
+				for (x = 0; x < width; x++)
+					output[(y * width + x) * 4 + i] = *input++;
+		}
+	}
+
+	return True;
+}
+
+/* Decompress, passing each scanline to row_func as it is finished so
+   that it can be converted into row_output, of row_Bpp bytes per pixel,
+   in the same pass. row_func may be NULL. */
+RD_BOOL
+bitmap_decompress_rows(uint8 * output, int width, int height, uint8 * input, int size, int Bpp,
+		       bitmap_row_func row_func, uint8 * row_output, int row_Bpp)
 {
 	RD_BOOL rv = False;
+	uint64 start = stats_now();
+	int row_line = width * row_Bpp;
 
 	switch (Bpp)
 	{
 		case 1:
-			rv = bitmap_decompress1(output, width, height, input, size);
+			rv = bitmap_decompress1(output, width, height, input, size, row_func,
+						row_output, row_line);
 			break;
 		case 2:
-			rv = bitmap_decompress2(output, width, height, input, size);
+			rv = bitmap_decompress2(output, width, height, input, size, row_func,
+						row_output, row_line);
 			break;
 		case 3:
-			rv = bitmap_decompress3(output, width, height, input, size);
+			rv = bitmap_decompress3(output, width, height, input, size, row_func,
+						row_output, row_line);
 			break;
 		case 4:
 			rv = bitmap_decompress4(output, width, height, input, size);
+			/* the planes are decoded one after the other, so
+			   rows are only complete at the end */
+			if (rv && row_func != NULL)
+				row_func(output, row_output, row_output + height * row_line);
 			break;
 		default:
 			logger(Core, Debug, "bitmap_decompress(), unhandled BPP %d", Bpp);
 			break;
 	}
+	stats_record(STATS_DECODE_INTERLEAVED, start);
 	return rv;
 }
 
+/* main decompress function */
+RD_BOOL
+bitmap_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp)
+{
+	return bitmap_decompress_rows(output, width, height, input, size, Bpp, NULL, NULL, 0);
+}
+
+/* Decoder pool for independent pieces of one update, such as the
+   rectangles of a bitmap update or the tiles of a RemoteFX frame. The
+   jobs are shared with the workers under g_pool_lock, the calling
+   thread takes part and returns once all of them are done. Without
+   pthreads the pool stays empty and the jobs run one after another. */
+static int g_pool_size;
+#ifdef HAVE_PTHREAD_H
+static pthread_t *g_pool_threads;
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_pool_done = PTHREAD_COND_INITIALIZER;
+static bitmap_job_func g_pool_func;
+static uint8 *g_pool_jobs;
+static int g_pool_job_size;
+static int g_pool_count, g_pool_next, g_pool_finished;
+#endif
+
+static void
+bitmap_run_job(void *arg)
+{
+	BITMAP_JOB *job = (BITMAP_JOB *) arg;
+	int y, line = job->width * job->Bpp;
+	int row_line = job->width * job->row_Bpp;
+	uint8 *row;
+
+	if (job->compressed)
+	{
+		job->ok = bitmap_decompress_rows(job->output, job->width, job->height, job->input,
+						 job->size, job->Bpp, job->row_func,
+						 job->row_output, job->row_Bpp);
+		return;
+	}
+
+	/* uncompressed data is stored bottom-up */
+	for (y = 0; y < job->height; y++)
+	{
+		if (job->row_func != NULL)
+		{
+			row = &job->row_output[(job->height - y - 1) * row_line];
+			job->row_func(&job->input[y * line], row, row + row_line);
+		}
+		else
+			memcpy(&job->output[(job->height - y - 1) * line], &job->input[y * line],
+			       line);
+	}
+	job->ok = True;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Take and run jobs until none are left, called with g_pool_lock held */
+static void
+bitmap_pool_drain(void)
+{
+	void *job;
+
+	while (g_pool_next < g_pool_count)
+	{
+		job = g_pool_jobs + (g_pool_next++) * g_pool_job_size;
+		pthread_mutex_unlock(&g_pool_lock);
+		g_pool_func(job);
+		pthread_mutex_lock(&g_pool_lock);
+
+		if (++g_pool_finished == g_pool_count)
+			pthread_cond_signal(&g_pool_done);
+	}
+}
+
+static void *
+bitmap_pool_thread(void *arg)
+{
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_pool_lock);
+	while (1)
+	{
+		while (g_pool_next >= g_pool_count)
+			pthread_cond_wait(&g_pool_work, &g_pool_lock);
+		bitmap_pool_drain();
+	}
+
+	return NULL;
+}
+#endif
+
+/* Start threads - 1 decoder threads, the caller being the last one */
+void
+bitmap_init_workers(int threads)
+{
+#ifdef HAVE_PTHREAD_H
+	int i;
+#endif
+
+	if (g_pool_size != 0 || threads < 2)
+		return;
+
+#ifndef HAVE_PTHREAD_H
+	logger(Core, Warning, "bitmap_init_workers(), not compiled with thread support");
+#else
+
+	g_pool_threads = (pthread_t *) xmalloc((threads - 1) * sizeof(pthread_t));
+	for (i = 0; i < threads - 1; i++)
+	{
+		if (pthread_create(&g_pool_threads[i], NULL, bitmap_pool_thread, NULL) != 0)
+		{
+			logger(Core, Warning, "bitmap_init_workers(), only %d of %d threads started",
+			       i + 1, threads);
+			break;
+		}
+		pthread_detach(g_pool_threads[i]);
+	}
+	g_pool_size = i;
+#endif
+}
+
+/* Run func on each of count jobs of size bytes, in parallel when
+   workers are running */
+void
+bitmap_run_jobs(bitmap_job_func func, void *jobs, int size, int count)
+{
+	int i;
+
+	if (g_pool_size == 0 || count < 2)
+	{
+		for (i = 0; i < count; i++)
+			func((uint8 *) jobs + i * size);
+		return;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&g_pool_lock);
+	g_pool_func = func;
+	g_pool_jobs = (uint8 *) jobs;
+	g_pool_job_size = size;
+	g_pool_count = count;
+	g_pool_next = g_pool_finished = 0;
+	pthread_cond_broadcast(&g_pool_work);
+
+	bitmap_pool_drain();
+	while (g_pool_finished < g_pool_count)
+		pthread_cond_wait(&g_pool_done, &g_pool_lock);
+
+	g_pool_jobs = NULL;
+	g_pool_count = g_pool_next = g_pool_finished = 0;
+	pthread_mutex_unlock(&g_pool_lock);
+#endif
+}
+
+/* Decode a set of independent bitmaps, in parallel when workers are running */
+void
+bitmap_decompress_batch(BITMAP_JOB * jobs, int count)
+{
+	bitmap_run_jobs(bitmap_run_job, jobs, sizeof(BITMAP_JOB), count);
+}
+
 /* *INDENT-ON* */
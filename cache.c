@@ -23,26 +23,31 @@
 
 /* BITMAP CACHE */
 extern int g_pstcache_fd[];
+extern int g_server_depth;
+extern uint32 g_bitmap_cache_size;
 
 #define NUM_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
 #define IS_PERSISTENT(id) (g_pstcache_fd[id] > 0)
-#define TO_TOP -1
 #define NOT_SET -1
 #define IS_SET(idx) (idx >= 0)
 
-/*
- * TODO: Test for optimal value of BUMP_COUNT. TO_TOP gives lowest CPU utilisation but using
- * a positive value will hopefully result in less frequently used bitmaps having a greater chance
- * of being evicted from the cache, and thereby reducing the need to load bitmaps from disk.
- * (Jeroen)
- */
-#define BUMP_COUNT 40
+/* largest bitmap cache v2 cell, 64x64 pixels */
+#define BMPCACHE2_MAX_CELL_PIXELS (64 * 64)
+#define BMPCACHE2_MIN_CELLS 16
 
 struct bmpcache_entry
 {
 	RD_HBITMAP bitmap;
 	sint16 previous;
 	sint16 next;
+	uint32 size;		/* pixel bytes */
+};
+
+struct bmpcache_stats
+{
+	uint32 hits;
+	uint32 misses;
+	uint32 evictions;
 };
 
 static struct bmpcache_entry g_bmpcache[3][0xa00];
@@ -52,6 +57,35 @@ static int g_bmpcache_lru[3] = { NOT_SET, NOT_SET, NOT_SET };
 static int g_bmpcache_mru[3] = { NOT_SET, NOT_SET, NOT_SET };
 
 static int g_bmpcache_count[3];
+static uint32 g_bmpcache_bytes[3];
+static struct bmpcache_stats g_bmpcache_stats[3];
+
+/* Pixel bytes of bitmaps kept in memory for a persistent cache, the
+   rest is loaded from disk when needed. Set with -o bitmap-cache-size,
+   defaults to what BMPCACHE2_C2_CELLS full size cells would use. */
+static uint32
+cache_bitmap_capacity(void)
+{
+	if (g_bitmap_cache_size != 0)
+		return g_bitmap_cache_size;
+
+	return BMPCACHE2_C2_CELLS * BMPCACHE2_MAX_CELL_PIXELS * ((g_server_depth + 7) / 8);
+}
+
+/* Number of cells to advertise for the non persistent bitmap cache 2 */
+uint32
+cache_get_bmpcache2_cells(void)
+{
+	uint32 cells;
+
+	if (g_bitmap_cache_size == 0)
+		return BMPCACHE2_C2_CELLS;
+
+	cells = g_bitmap_cache_size / (BMPCACHE2_MAX_CELL_PIXELS * ((g_server_depth + 7) / 8));
+	cells = MAX(cells, BMPCACHE2_MIN_CELLS);
+	cells = MIN(cells, NUM_ELEMENTS(g_bmpcache[0]));
+	return cells;
+}
 
 /* Setup the bitmap cache lru/mru linked list */
 void
@@ -100,11 +134,11 @@ cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count)
 	}
 }
 
-/* Move a bitmap to a new position in the linked list. */
+/* Move a bitmap to the most recently used end of the linked list */
 void
-cache_bump_bitmap(uint8 id, uint16 idx, int bump)
+cache_bump_bitmap(uint8 id, uint16 idx)
 {
-	int p_idx, n_idx, n;
+	int p_idx, n_idx;
 
 	if (!IS_PERSISTENT(id))
 		return;
@@ -112,71 +146,49 @@ cache_bump_bitmap(uint8 id, uint16 idx, int bump)
 	if (g_bmpcache_mru[id] == idx)
 		return;
 
-	logger(Core, Debug, "cache_bump_bitmap(), id=%d, idx=%d, bump=%d", id, idx, bump);
+	logger(Core, Debug, "cache_bump_bitmap(), id=%d, idx=%d", id, idx);
 
 	n_idx = g_bmpcache[id][idx].next;
 	p_idx = g_bmpcache[id][idx].previous;
 
+	/* unlink, entries not yet in the list have no successor */
 	if (IS_SET(n_idx))
 	{
-		/* remove */
 		--g_bmpcache_count[id];
 		if (IS_SET(p_idx))
 			g_bmpcache[id][p_idx].next = n_idx;
 		else
 			g_bmpcache_lru[id] = n_idx;
-		if (IS_SET(n_idx))
-			g_bmpcache[id][n_idx].previous = p_idx;
-		else
-			g_bmpcache_mru[id] = p_idx;
-	}
-	else
-	{
-		p_idx = NOT_SET;
-		n_idx = g_bmpcache_lru[id];
-	}
-
-	if (bump >= 0)
-	{
-		for (n = 0; n < bump && IS_SET(n_idx); n++)
-		{
-			p_idx = n_idx;
-			n_idx = g_bmpcache[id][p_idx].next;
-		}
-	}
-	else
-	{
-		p_idx = g_bmpcache_mru[id];
-		n_idx = NOT_SET;
+		g_bmpcache[id][n_idx].previous = p_idx;
 	}
 
-	/* insert */
+	/* insert at the top */
 	++g_bmpcache_count[id];
+	p_idx = g_bmpcache_mru[id];
 	g_bmpcache[id][idx].previous = p_idx;
-	g_bmpcache[id][idx].next = n_idx;
+	g_bmpcache[id][idx].next = NOT_SET;
 
-	if (p_idx >= 0)
+	if (IS_SET(p_idx))
 		g_bmpcache[id][p_idx].next = idx;
 	else
 		g_bmpcache_lru[id] = idx;
 
-	if (n_idx >= 0)
-		g_bmpcache[id][n_idx].previous = idx;
-	else
-		g_bmpcache_mru[id] = idx;
+	g_bmpcache_mru[id] = idx;
 }
 
 /* Evict the least-recently used bitmap from the cache */
 void
 cache_evict_bitmap(uint8 id)
 {
-	uint16 idx;
-	int n_idx;
+	int idx, n_idx;
 
 	if (!IS_PERSISTENT(id))
 		return;
 
 	idx = g_bmpcache_lru[id];
+	if (!IS_SET(idx))
+		return;
+
 	n_idx = g_bmpcache[id][idx].next;
 
 	logger(Core, Debug, "cache_evict_bitmap(), id=%d idx=%d n_idx=%d bmp=%p", id, idx, n_idx,
@@ -184,10 +196,16 @@ cache_evict_bitmap(uint8 id)
 
 	ui_destroy_bitmap(g_bmpcache[id][idx].bitmap);
 	--g_bmpcache_count[id];
+	g_bmpcache_bytes[id] -= g_bmpcache[id][idx].size;
+	g_bmpcache_stats[id].evictions++;
 	g_bmpcache[id][idx].bitmap = 0;
+	g_bmpcache[id][idx].size = 0;
 
 	g_bmpcache_lru[id] = n_idx;
-	g_bmpcache[id][n_idx].previous = NOT_SET;
+	if (IS_SET(n_idx))
+		g_bmpcache[id][n_idx].previous = NOT_SET;
+	else
+		g_bmpcache_mru[id] = NOT_SET;
 
 	pstcache_touch_bitmap(id, idx, 0);
 }
@@ -198,13 +216,18 @@ cache_get_bitmap(uint8 id, uint16 idx)
 {
 	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < NUM_ELEMENTS(g_bmpcache[0])))
 	{
-		if (g_bmpcache[id][idx].bitmap || pstcache_load_bitmap(id, idx))
+		if (g_bmpcache[id][idx].bitmap)
 		{
-			if (IS_PERSISTENT(id))
-				cache_bump_bitmap(id, idx, BUMP_COUNT);
-
+			g_bmpcache_stats[id].hits++;
+			stats_add(STATS_BITMAP_CACHE_HITS, 1);
+			cache_bump_bitmap(id, idx);
 			return g_bmpcache[id][idx].bitmap;
 		}
+
+		g_bmpcache_stats[id].misses++;
+		stats_add(STATS_BITMAP_CACHE_MISSES, 1);
+		if (pstcache_load_bitmap(id, idx))
+			return g_bmpcache[id][idx].bitmap;
 	}
 	else if ((id < NUM_ELEMENTS(g_volatile_bc)) && (idx == 0x7fff))
 	{
@@ -216,28 +239,52 @@ cache_get_bitmap(uint8 id, uint16 idx)
 	return NULL;
 }
 
+/* Check if a bitmap is in memory, without loading it */
+RD_BOOL
+cache_has_bitmap(uint8 id, uint16 idx)
+{
+	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < NUM_ELEMENTS(g_bmpcache[0])))
+		return g_bmpcache[id][idx].bitmap != NULL;
+
+	return False;
+}
+
 /* Store a bitmap in the cache */
 void
-cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap)
+cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap, int width, int height)
 {
 	RD_HBITMAP old;
+	struct bmpcache_entry *entry;
+	uint32 capacity;
 
 	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < NUM_ELEMENTS(g_bmpcache[0])))
 	{
-		old = g_bmpcache[id][idx].bitmap;
+		entry = &g_bmpcache[id][idx];
+		old = entry->bitmap;
 		if (old != NULL)
 			ui_destroy_bitmap(old);
-		g_bmpcache[id][idx].bitmap = bitmap;
+		g_bmpcache_bytes[id] -= entry->size;
+
+		entry->bitmap = bitmap;
+		entry->size = width * height * ((g_server_depth + 7) / 8);
+		g_bmpcache_bytes[id] += entry->size;
 
 		if (IS_PERSISTENT(id))
 		{
 			if (old == NULL)
-				g_bmpcache[id][idx].previous = g_bmpcache[id][idx].next = NOT_SET;
+				entry->previous = entry->next = NOT_SET;
 
-			cache_bump_bitmap(id, idx, TO_TOP);
-			if (g_bmpcache_count[id] > BMPCACHE2_C2_CELLS)
+			cache_bump_bitmap(id, idx);
+
+			capacity = cache_bitmap_capacity();
+			while (g_bmpcache_bytes[id] > capacity && g_bmpcache_lru[id] != idx)
 				cache_evict_bitmap(id);
 		}
+		/* the server evicts from the others by overwriting cells */
+		else if (old == NULL && bitmap != NULL)
+			++g_bmpcache_count[id];
+		else if (old != NULL && bitmap == NULL)
+			--g_bmpcache_count[id];
 	}
 	else if ((id < NUM_ELEMENTS(g_volatile_bc)) && (idx == 0x7fff))
 	{
@@ -252,6 +299,19 @@ cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap)
 	}
 }
 
+/* Log the bitmap cache hit rates */
+void
+cache_log_bitmap_stats(void)
+{
+	uint32 id;
+
+	for (id = 0; id < NUM_ELEMENTS(g_bmpcache); id++)
+		logger(Core, Verbose,
+		       "cache_log_bitmap_stats(), id=%d, hits=%u, misses=%u, evictions=%u, %u bytes in %d bitmaps",
+		       id, g_bmpcache_stats[id].hits, g_bmpcache_stats[id].misses,
+		       g_bmpcache_stats[id].evictions, g_bmpcache_bytes[id], g_bmpcache_count[id]);
+}
+
 /* Updates the persistent bitmap cache MRU information on exit */
 void
 cache_save_state(void)
@@ -272,6 +332,66 @@ cache_save_state(void)
 			}
 			logger(Core, Debug, "cache_save_state(), %d stamps written", t);
 		}
+
+	pstcache_flush();
+}
+
+
+/* OFFSCREEN BITMAP CACHE */
+struct offscreen_entry
+{
+	RD_HBITMAP bitmap;
+	int width;
+	int height;
+};
+
+static struct offscreen_entry g_offscreen_cache[OFFSCREEN_CACHE_ENTRIES];
+
+/* Retrieve an offscreen bitmap, width and height may be NULL */
+RD_HBITMAP
+cache_get_offscreen_bitmap(uint16 idx, int *width, int *height)
+{
+	struct offscreen_entry *entry;
+
+	if (idx < NUM_ELEMENTS(g_offscreen_cache))
+	{
+		entry = &g_offscreen_cache[idx];
+		if (entry->bitmap != NULL)
+		{
+			if (width != NULL)
+				*width = entry->width;
+			if (height != NULL)
+				*height = entry->height;
+			return entry->bitmap;
+		}
+	}
+
+	logger(Core, Debug, "cache_get_offscreen_bitmap(), idx=%d", idx);
+	return NULL;
+}
+
+/* Store an offscreen bitmap, or delete it when bitmap is NULL */
+void
+cache_put_offscreen_bitmap(uint16 idx, RD_HBITMAP bitmap, int width, int height)
+{
+	struct offscreen_entry *entry;
+
+	if (idx < NUM_ELEMENTS(g_offscreen_cache))
+	{
+		entry = &g_offscreen_cache[idx];
+		if (entry->bitmap != NULL)
+			ui_destroy_bitmap(entry->bitmap);
+
+		entry->bitmap = bitmap;
+		entry->width = width;
+		entry->height = height;
+	}
+	else
+	{
+		logger(Core, Error, "cache_put_offscreen_bitmap(), failed, idx=%d", idx);
+		if (bitmap != NULL)
+			ui_destroy_bitmap(bitmap);
+	}
 }
 
 
@@ -287,32 +407,39 @@ cache_get_font(uint8 font, uint16 character)
 	if ((font < NUM_ELEMENTS(g_fontcache)) && (character < NUM_ELEMENTS(g_fontcache[0])))
 	{
 		glyph = &g_fontcache[font][character];
-		if (glyph->pixmap != NULL)
+		if (glyph->data != NULL)
+		{
+			stats_add(STATS_GLYPH_CACHE_HITS, 1);
 			return glyph;
+		}
 	}
 
+	stats_add(STATS_GLYPH_CACHE_MISSES, 1);
 	logger(Core, Debug, "cache_get_font(), font=%d, char=%d", font, character);
 	return NULL;
 }
 
-/* Store a glyph in the font cache */
+/* Store a glyph in the font cache, data is a 1 bpp bitmap with rows
+   padded to whole bytes */
 void
-cache_put_font(uint8 font, uint16 character, uint16 offset,
-	       uint16 baseline, uint16 width, uint16 height, RD_HGLYPH pixmap)
+cache_put_font(uint8 font, uint16 character, sint16 offset,
+	       sint16 baseline, uint16 width, uint16 height, uint8 * data)
 {
 	FONTGLYPH *glyph;
+	int size;
 
 	if ((font < NUM_ELEMENTS(g_fontcache)) && (character < NUM_ELEMENTS(g_fontcache[0])))
 	{
 		glyph = &g_fontcache[font][character];
-		if (glyph->pixmap != NULL)
-			ui_destroy_glyph(glyph->pixmap);
+		xfree(glyph->data);
 
+		size = height * ((width + 7) / 8);
 		glyph->offset = offset;
 		glyph->baseline = baseline;
 		glyph->width = width;
 		glyph->height = height;
-		glyph->pixmap = pixmap;
+		glyph->data = xmalloc(MAX(size, 1));
+		memcpy(glyph->data, data, size);
 	}
 	else
 	{
@@ -409,9 +536,14 @@ cache_get_cursor(uint16 cache_idx)
 	{
 		cursor = g_cursorcache[cache_idx];
 		if (cursor != NULL)
+		{
+			stats_add(STATS_CURSOR_CACHE_HITS, 1);
 			return cursor;
+		}
 	}
 
+	stats_add(STATS_CURSOR_CACHE_MISSES, 1);
+
 	logger(Core, Debug, "cache_get_cursor(), idx=%d", cache_idx);
 	return NULL;
 }
@@ -447,8 +579,11 @@ cache_get_brush_data(uint8 colour_code, uint8 idx)
 	colour_code = colour_code == 1 ? 0 : 1;
 	if (idx < NUM_ELEMENTS(g_brushcache[0]))
 	{
+		stats_add(g_brushcache[colour_code][idx].data != NULL ?
+			  STATS_BRUSH_CACHE_HITS : STATS_BRUSH_CACHE_MISSES, 1);
 		return &g_brushcache[colour_code][idx];
 	}
+	stats_add(STATS_BRUSH_CACHE_MISSES, 1);
 	logger(Core, Debug, "cache_get_brush_data(), colour=%d, idx=%d", colour_code, idx);
 	return NULL;
 }
@@ -26,12 +26,17 @@
 #define CHANNEL_FLAG_FIRST		0x01
 #define CHANNEL_FLAG_LAST		0x02
 #define CHANNEL_FLAG_SHOW_PROTOCOL	0x10
+#define CHANNEL_PACKET_COMPR_SHIFT	16	/* mppc flags in the upper half */
 
 extern RDP_VERSION g_rdp_version;
 extern RD_BOOL g_encryption;
 
 uint32 vc_chunk_size = CHANNEL_CHUNK_LENGTH;
 
+/* client to server compression, one context for all channels */
+RD_BOOL g_channel_compress = False;
+static RDPCOMP_ENC g_channel_enc;
+
 VCHANNEL g_channels[MAX_CHANNELS];
 unsigned int g_num_channels;
 
@@ -69,6 +74,15 @@ channel_register(char *name, uint32 flags, void (*callback) (STREAM))
 	return channel;
 }
 
+/* Compress client to server channel data from now on */
+void
+channel_enable_compression(RD_BOOL enable)
+{
+	g_channel_compress = enable;
+	if (enable)
+		mppc_enc_reset(&g_channel_enc);
+}
+
 STREAM
 channel_init(VCHANNEL * channel, uint32 length)
 {
@@ -84,9 +98,10 @@ static void
 channel_send_chunk(STREAM s, VCHANNEL * channel, uint32 length)
 {
 	uint32 flags;
-	uint32 thislength;
+	uint32 thislength, clen;
 	RD_BOOL inplace;
 	STREAM chunk;
+	uint8 ctype;
 
 	/* Note: In the original clipboard implementation, this number was
 	   1592, not 1600. However, I don't remember the reason and 1600 seems
@@ -116,10 +131,20 @@ channel_send_chunk(STREAM s, VCHANNEL * channel, uint32 length)
 	logger(Protocol, Debug, "channel_send_chunk(), sending %d bytes with flags 0x%x",
 	       thislength, flags);
 
-	/* first fragment sent in-place */
+	ctype = 0;
+	clen = thislength;
+	if (g_channel_compress)
+	{
+		ctype = mppc_compress(&g_channel_enc, s->p, thislength, &clen);
+		if (!(ctype & RDP_MPPC_COMPRESSED))
+			clen = thislength;
+		flags |= (uint32) ctype << CHANNEL_PACKET_COMPR_SHIFT;
+	}
+
+	/* first fragment sent in-place, unless it has been compressed */
 	inplace = False;
 	if ((flags & (CHANNEL_FLAG_FIRST|CHANNEL_FLAG_LAST)) ==
-	    (CHANNEL_FLAG_FIRST|CHANNEL_FLAG_LAST))
+	    (CHANNEL_FLAG_FIRST|CHANNEL_FLAG_LAST) && !(ctype & RDP_MPPC_COMPRESSED))
 	{
 		inplace = True;
 	}
@@ -131,16 +156,23 @@ channel_send_chunk(STREAM s, VCHANNEL * channel, uint32 length)
 	}
 	else
 	{
-		chunk = sec_init(g_encryption ? SEC_ENCRYPT : 0, thislength + 8);
+		chunk = sec_init(g_encryption ? SEC_ENCRYPT : 0, clen + 8);
 	}
 
 	out_uint32_le(chunk, length);
 	out_uint32_le(chunk, flags);
-	if (!inplace)
+	if (ctype & RDP_MPPC_COMPRESSED)
+	{
+		in_uint8s(s, thislength);
+		out_uint8a(chunk, g_channel_enc.out, clen);
+		s_mark_end(chunk);
+	}
+	else if (!inplace)
 	{
 		out_uint8stream(chunk, s, thislength);
 		s_mark_end(chunk);
 	}
+	channel->bytes_out += thislength;
 	sec_send_to_channel(chunk, g_encryption ? SEC_ENCRYPT : 0, channel->mcs_id);
 
 	/* Sending modifies the current offset, so make it is marked as
@@ -203,6 +235,7 @@ channel_process(STREAM s, uint16 mcs_channel)
 
 	in_uint32_le(s, length);
 	in_uint32_le(s, flags);
+	channel->bytes_in += s_remaining(s);
 	if ((flags & CHANNEL_FLAG_FIRST) && (flags & CHANNEL_FLAG_LAST))
 	{
 		/* single fragment - pass straight up */
@@ -61,6 +61,76 @@
 
 #define RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE 65535
 
+/* [MS-RDPBCGR] 2.2.8.1.2 */
+#define FASTPATH_INPUT_ACTION_FASTPATH	0x0
+#define FASTPATH_INPUT_ENCRYPTED	(0x2 << 6)
+#define FASTPATH_INPUT_MAX_EVENTS	15
+
+/* [MS-RDPBCGR] 2.2.8.1.2.2 */
+#define FASTPATH_INPUT_EVENT_SCANCODE	0x0
+#define FASTPATH_INPUT_EVENT_MOUSE	0x1
+#define FASTPATH_INPUT_EVENT_MOUSEX	0x2
+#define FASTPATH_INPUT_EVENT_SYNC	0x3
+#define FASTPATH_INPUT_EVENT_UNICODE	0x4
+
+#define FASTPATH_INPUT_KBDFLAGS_RELEASE		0x01
+#define FASTPATH_INPUT_KBDFLAGS_EXTENDED	0x02
+#define FASTPATH_INPUT_KBDFLAGS_EXTENDED1	0x04
+
+/* [MS-RDPBCGR] 2.2.9.2 */
+#define CMDTYPE_SET_SURFACE_BITS	0x0001
+#define CMDTYPE_FRAME_MARKER		0x0004
+#define CMDTYPE_STREAM_SURFACE_BITS	0x0006
+
+/* [MS-RDPBCGR] 2.2.7.2.9 */
+#define SURFCMDS_SET_SURFACE_BITS	0x00000002
+#define SURFCMDS_FRAME_MARKER		0x00000010
+#define SURFCMDS_STREAM_SURFACE_BITS	0x00000040
+
+/* [MS-RDPBCGR] 2.2.9.2.2.1 */
+#define SURFACECMD_FRAMEACTION_BEGIN	0x0000
+#define SURFACECMD_FRAMEACTION_END	0x0001
+
+/* [MS-RDPBCGR] 2.2.9.2.1.1 */
+#define EX_COMPRESSED_BITMAP_HEADER_PRESENT	0x01
+
+/* Codec ids assigned by us in the bitmap codecs capability set */
+#define RDP_CODEC_ID_NONE	0x00
+#define RDP_CODEC_ID_NSCODEC	0x01
+#define RDP_CODEC_ID_REMOTEFX	0x03
+
+/* Planar codec FormatHeader, [MS-RDPEGDI] 2.2.2.5.1 */
+#define PLANAR_HEADER_CLL_MASK	0x07
+#define PLANAR_HEADER_CS	0x08
+#define PLANAR_HEADER_RLE	0x10
+#define PLANAR_HEADER_NO_ALPHA	0x20
+
+/* [MS-RDPRFX] 2.2.2 */
+#define WBT_SYNC		0xCCC0
+#define WBT_CODEC_VERSIONS	0xCCC1
+#define WBT_CHANNELS		0xCCC2
+#define WBT_CONTEXT		0xCCC3
+#define WBT_FRAME_BEGIN		0xCCC4
+#define WBT_FRAME_END		0xCCC5
+#define WBT_REGION		0xCCC6
+#define WBT_EXTENSION		0xCCC7
+#define CBT_REGION		0xCAC1
+#define CBT_TILESET		0xCAC2
+#define CBT_TILE		0xCAC3
+#define CBY_CAPS		0xCBC0
+#define CBY_CAPSET		0xCBC1
+#define CLY_CAPSET		0xCFC0
+
+#define WF_MAGIC		0xCACCACCA
+#define WF_VERSION_1_0		0x0100
+#define CT_TILE_64x64		0x0040
+#define CLW_COL_CONV_ICT	0x1
+#define CLW_XFORM_DWT_53_A	0x1
+#define CLW_ENTROPY_RLGR1	0x1
+#define CLW_ENTROPY_RLGR3	0x4
+#define CODEC_MODE_IMAGE	0x02
+#define CARDP_CAPS_CAPTURE_NON_CAC	0x00000001
+
 /* ISO PDU codes */
 enum ISO_PDU_CODE
 {
@@ -228,6 +298,7 @@ enum RDP_DATA_PDU_TYPE
 	RDP_DATA_PDU_KEYBOARD_INDICATORS = 0x29,	/* PDUTYPE2_SET_KEYBOARD_INDICATORS */
 	RDP_DATA_PDU_SET_ERROR_INFO = 0x2f,	/* PDUTYPE2_SET_ERROR_INFO */
 	RDP_DATA_PDU_AUTORECONNECT_STATUS = 0x32,	/* PDUTYPE2_ARC_STATUS_PDU */
+	RDP_DATA_PDU_FRAME_ACKNOWLEDGE = 0x38,	/* PDUTYPE2_FRAME_ACKNOWLEDGE */
 };
 
 enum RDP_SAVE_SESSION_PDU_TYPE
@@ -389,6 +460,11 @@ enum RDP_INPUT_DEVICE
 #define RDP_CAPSET_GLYPHCACHE	16
 #define RDP_CAPLEN_GLYPHCACHE	52
 
+#define RDP_CAPSET_OFFSCREEN_CACHE	17
+#define RDP_CAPLEN_OFFSCREEN_CACHE	12
+#define OFFSCREEN_CACHE_MAX_SIZE	7680	/* kilobytes */
+#define OFFSCREEN_CACHE_ENTRIES	500
+
 #define RDP_CAPSET_BMPCACHE2	19
 #define RDP_CAPLEN_BMPCACHE2	0x28
 #define BMPCACHE2_FLAG_PERSIST	((uint32)1<<31)
@@ -402,6 +478,15 @@ enum RDP_INPUT_DEVICE
 #define RDP_CAPSET_VC	20
 #define RDP_CAPLEN_VC	0x08
 
+#define RDP_CAPSET_SURFACE_COMMANDS	28
+#define RDP_CAPLEN_SURFACE_COMMANDS	12
+
+#define RDP_CAPSET_BITMAP_CODECS	29
+#define RDP_CAPLEN_BITMAP_CODECS	(5 + 2 * 19 + 3 + 49)
+
+#define RDP_CAPSET_FRAME_ACKNOWLEDGE	30
+#define RDP_CAPLEN_FRAME_ACKNOWLEDGE	8
+
 #define RDP_SOURCE		"MSTSC"
 
 /* Logon flags */
@@ -413,6 +498,8 @@ enum RDP_INPUT_DEVICE
 #define RDP_INFO_COMPRESSION	      0x00000080	/* mppc compression with 8kB history buffer */
 #define RDP_INFO_ENABLEWINDOWSKEY     0x00000100
 #define RDP_INFO_COMPRESSION2	      0x00000200	/* rdp5 mppc compression with 64kB history buffer */
+#define RDP_INFO_COMPRESSION_RDP6     0x00000400	/* rdp 6.0 bulk compression (ncrush) */
+#define RDP_INFO_COMPRESSION_RDP61    0x00000600	/* rdp 6.1 bulk compression (xcrush) */
 #define RDP_INFO_REMOTE_CONSOLE_AUDIO 0x00002000
 #define RDP_INFO_PASSWORD_IS_SC_PIN   0x00040000
 
@@ -426,11 +513,22 @@ enum RDP_INPUT_DEVICE
 #define PERF_ENABLE_FONT_SMOOTHING	0x80
 
 /* compression types */
+#define RDP_MPPC_TYPE_MASK	0x0f
 #define RDP_MPPC_BIG		0x01
+#define RDP_MPPC_TYPE_RDP6	0x02
+#define RDP_MPPC_TYPE_RDP61	0x03
 #define RDP_MPPC_COMPRESSED	0x20
 #define RDP_MPPC_RESET		0x40
 #define RDP_MPPC_FLUSH		0x80
 #define RDP_MPPC_DICT_SIZE      65536
+#define RDP_MPPC_8K_HIST_SIZE	8192
+
+/* rdp 6.1 level 1 compression flags */
+#define RDP61_L1_COMPRESSED		0x01
+#define RDP61_L1_NO_COMPRESSION		0x02
+#define RDP61_L1_PACKET_AT_FRONT	0x04
+#define RDP61_L1_INNER_COMPRESSION	0x10
+#define RDP61_HIST_SIZE			2000000
 
 #define RDP5_COMPRESSED		0x80
 
@@ -501,6 +599,8 @@ enum RDP_INPUT_DEVICE
 #define WAVE_FORMAT_ADPCM	2
 #define WAVE_FORMAT_ALAW	6
 #define WAVE_FORMAT_MULAW	7
+#define WAVE_FORMAT_IMA_ADPCM	0x11
+#define WAVE_FORMAT_OPUS	0x704f
 
 /* Virtual channel options */
 #define CHANNEL_OPTION_INITIALIZED	0x80000000
@@ -508,6 +608,10 @@ enum RDP_INPUT_DEVICE
 #define CHANNEL_OPTION_COMPRESS_RDP	0x00800000
 #define CHANNEL_OPTION_SHOW_PROTOCOL	0x00200000
 
+/* Virtual channel capability flags */
+#define VCCAPS_COMPR_SC			0x00000001
+#define VCCAPS_COMPR_CS_8K		0x00000002
+
 /* NT status codes for RDPDR */
 #define RD_STATUS_SUCCESS                  0x00000000
 #define RD_STATUS_NOT_IMPLEMENTED          0x00000001
@@ -789,6 +893,9 @@ enum RDP_DESKTOP_ORIENTATION
 #define TS_NEG_ELLIPSE_CB_INDEX		0x1A
 #define TS_NEG_INDEX_INDEX		0x1B
 
+/* rectangles of a multi drawing order, [MS-RDPEGDI] 2.2.2.2.1.1.2.3 */
+#define MAX_DELTA_RECTS			45
+
 /* [MS-RDPBCGR] 2.2.7.1.6 */
 #define INPUT_FLAG_SCANCODES		0x0001
 #define INPUT_FLAG_MOUSEX		0x0004
@@ -822,4 +929,8 @@ enum RDP_SUPPRESS_STATUS
 	ALLOW_DISPLAY_UPDATES = 0x01
 };
 
+/* reactor events */
+#define REACTOR_READ	0x01
+#define REACTOR_WRITE	0x02
+
 #endif /* _CONSTANTS_H */
@@ -48,6 +48,7 @@ static char ctrlsock_name[PATH_MAX];
 static struct _ctrl_slave_t *_ctrl_slaves;
 
 #define CMD_SEAMLESS_SPAWN "seamless.spawn"
+#define CMD_STATS "stats"
 
 typedef struct _ctrl_slave_t
 {
@@ -56,6 +57,8 @@ typedef struct _ctrl_slave_t
 	char linebuf[CTRL_LINEBUF_SIZE];
 } _ctrl_slave_t;
 
+static void _ctrl_slave_read(int sock, int events, void *data);
+static void _ctrl_accept(int sock, int events, void *data);
 
 static void
 _ctrl_slave_new(int sock)
@@ -85,6 +88,8 @@ _ctrl_slave_new(int sock)
 		/* no elements in list, lets add first */
 		_ctrl_slaves = ns;
 	}
+
+	reactor_add(sock, REACTOR_READ, _ctrl_slave_read, ns);
 }
 
 static void
@@ -104,6 +109,7 @@ _ctrl_slave_disconnect(int sock)
 	if (it->sock == sock)
 	{
 		/* shutdown socket */
+		reactor_remove(sock);
 		shutdown(sock, SHUT_RDWR);
 		close(sock);
 
@@ -150,6 +156,7 @@ _ctrl_dispatch_command(_ctrl_slave_t * slave)
 {
 	char *p;
 	char *cmd;
+	char *json;
 	unsigned int res;
 
 	/* unescape linebuffer */
@@ -168,6 +175,16 @@ _ctrl_dispatch_command(_ctrl_slave_t * slave)
 		if (seamless_send_spawn(p) == (unsigned int) -1)
 			res = 1;
 	}
+	else if (strncmp(cmd, CMD_STATS, strlen(CMD_STATS)) == 0
+		 && (cmd[strlen(CMD_STATS)] == ' ' || cmd[strlen(CMD_STATS)] == '\0'))
+	{
+		/* performance counters as one line of JSON, before the result */
+		json = stats_json();
+		send(slave->sock, json, strlen(json), 0);
+		send(slave->sock, "\n", 1, 0);
+		xfree(json);
+		res = ERR_RESULT_OK;
+	}
 	else
 	{
 		res = ERR_RESULT_NO_SUCH_COMMAND;
@@ -318,6 +335,8 @@ ctrl_init(const char *user, const char *domain, const char *host)
 		exit(1);
 	}
 
+	reactor_add(ctrlsock, REACTOR_READ, _ctrl_accept, NULL);
+
 	/* add ctrl cleanup func to exit hooks */
 	atexit(ctrl_cleanup);
 
@@ -329,6 +348,7 @@ ctrl_cleanup()
 {
 	if (ctrlsock)
 	{
+		reactor_remove(ctrlsock);
 		close(ctrlsock);
 		unlink(ctrlsock_name);
 	}
@@ -341,110 +361,74 @@ ctrl_is_slave()
 }
 
 
-void
-ctrl_add_fds(int *n, fd_set * rfds)
+static void
+_ctrl_slave_read(int sock, int events, void *data)
 {
-	_ctrl_slave_t *it;
-	if (ctrlsock == 0)
+	int res, offs;
+	char *p;
+	_ctrl_slave_t *it = (_ctrl_slave_t *) data;
+	UNUSED(events);
+
+	offs = strlen(it->linebuf);
+	res = recv(sock, it->linebuf + offs, CTRL_LINEBUF_SIZE - offs, 0);
+
+	/* linebuffer full let's disconnect slave */
+	if (it->linebuf[CTRL_LINEBUF_SIZE - 1] != '\0' &&
+	    it->linebuf[CTRL_LINEBUF_SIZE - 1] != '\n')
+	{
+		_ctrl_slave_disconnect(sock);
 		return;
+	}
 
-	FD_SET(ctrlsock, rfds);
-	*n = MAX(*n, ctrlsock);
+	if (res <= 0)
+	{
+		/* Peer disconnected or socket error */
+		_ctrl_slave_disconnect(sock);
+		return;
+	}
 
+	/* Check if we got full command line */
+	if ((p = strchr(it->linebuf, '\n')) == NULL)
+		return;
 
-	/* add connected slaves to fd set */
-	it = _ctrl_slaves;
-	while (it)
+	/* iterate over string and check against escaped \n */
+	while (p)
 	{
-		FD_SET(it->sock, rfds);
-		*n = MAX(*n, it->sock);
-		it = it->next;
+		/* Check if newline is escaped */
+		if (p > it->linebuf && *(p - 1) != '\\')
+			break;
+		p = strchr(p + 1, '\n');
 	}
+
+	/* If we haven't found a nonescaped \n we need more data */
+	if (p == NULL)
+		return;
+
+	/* strip new linebuf and dispatch command */
+	*p = '\0';
+	_ctrl_dispatch_command(it);
+	memset(it->linebuf, 0, CTRL_LINEBUF_SIZE);
 }
 
-void
-ctrl_check_fds(fd_set * rfds, fd_set * wfds)
+static void
+_ctrl_accept(int sock, int events, void *data)
 {
-	UNUSED(wfds);
-	int ns, res, offs;
+	int ns;
 	struct sockaddr_un fsaun;
 	socklen_t fromlen;
-	_ctrl_slave_t *it;
-
-	if (ctrlsock == 0)
-		return;
+	UNUSED(events);
+	UNUSED(data);
 
 	memset(&fsaun, 0, sizeof(struct sockaddr_un));
-
-	/* check if we got any connections on server socket */
-	if (FD_ISSET(ctrlsock, rfds))
+	fromlen = sizeof(fsaun);
+	ns = accept(sock, (struct sockaddr *) &fsaun, &fromlen);
+	if (ns < 0)
 	{
-		FD_CLR(ctrlsock, rfds);
-		fromlen = sizeof(fsaun);
-		ns = accept(ctrlsock, (struct sockaddr *) &fsaun, &fromlen);
-		if (ns < 0)
-		{
-			logger(Core, Error, "ctrl_check_fds(), accept() failed: %s",
-			       strerror(errno));
-			exit(1);
-		}
-
-		_ctrl_slave_new(ns);
-		return;
+		logger(Core, Error, "_ctrl_accept(), accept() failed: %s", strerror(errno));
+		exit(1);
 	}
 
-	/* check if any of our slaves fds has data */
-	it = _ctrl_slaves;
-	while (it)
-	{
-		if (FD_ISSET(it->sock, rfds))
-		{
-			offs = strlen(it->linebuf);
-			res = recv(it->sock, it->linebuf + offs, CTRL_LINEBUF_SIZE - offs, 0);
-			FD_CLR(it->sock, rfds);
-
-			/* linebuffer full let's disconnect slave */
-			if (it->linebuf[CTRL_LINEBUF_SIZE - 1] != '\0' &&
-			    it->linebuf[CTRL_LINEBUF_SIZE - 1] != '\n')
-			{
-				_ctrl_slave_disconnect(it->sock);
-				break;
-			}
-
-			if (res > 0)
-			{
-				/* Check if we got full command line */
-				char *p;
-				if ((p = strchr(it->linebuf, '\n')) == NULL)
-					continue;
-
-				/* iterate over string and check against escaped \n */
-				while (p)
-				{
-					/* Check if newline is escaped */
-					if (p > it->linebuf && *(p - 1) != '\\')
-						break;
-					p = strchr(p + 1, '\n');
-				}
-
-				/* If we haven't found a nonescaped \n we need more data */
-				if (p == NULL)
-					continue;
-
-				/* strip new linebuf and dispatch command */
-				*p = '\0';
-				_ctrl_dispatch_command(it);
-				memset(it->linebuf, 0, CTRL_LINEBUF_SIZE);
-			}
-			else
-			{
-				/* Peer disconnected or socket error */
-				_ctrl_slave_disconnect(it->sock);
-				break;
-			}
-		}
-		it = it->next;
-	}
+	_ctrl_slave_new(ns);
 }
 
 int
@@ -494,13 +478,29 @@ ctrl_send_command(const char *cmd, const char *arg)
 	send(s, escaped, strlen(escaped), 0);
 	send(s, "\n", 1, 0);
 
-	/* read result from master */
+	/* read result from master, printing any output lines before it */
 	fp = fdopen(s, "r");
-	index = 0;
-	while ((c = fgetc(fp)) != EOF && index < CTRL_RESULT_SIZE && c != '\n')
+	while (1)
 	{
-		result[index] = c;
-		index++;
+		index = 0;
+		while ((c = fgetc(fp)) != EOF && index < CTRL_RESULT_SIZE && c != '\n')
+		{
+			result[index] = c;
+			index++;
+		}
+
+		if (c == EOF || (index >= 2 && strncmp(result, "OK", 2) == 0)
+		    || (index >= 6 && strncmp(result, "ERROR ", 6) == 0))
+			break;
+
+		/* an output line, possibly longer than the result buffer */
+		fwrite(result, 1, index, stdout);
+		while (c != EOF && c != '\n')
+		{
+			fputc(c, stdout);
+			c = fgetc(fp);
+		}
+		fputc('\n', stdout);
 	}
 	result[index - 1] = '\0';
 
@@ -35,6 +35,10 @@
 #include <utime.h>
 #include <time.h>		/* ctime */
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 #if (defined(HAVE_DIRFD) || (HAVE_DECL_DIRFD == 1))
 #define DIRFD(a) (dirfd(a))
 #else
@@ -143,6 +147,7 @@ dummy_statfs(struct dummy_statfs_t *buf)
 #endif
 
 extern RDPDR_DEVICE g_rdpdr_device[];
+extern uint32 g_dir_batch_size;
 
 FILEINFO g_fileinfo[MAX_OPEN_FILES];
 RD_BOOL g_notify_stamp = False;
@@ -156,6 +161,19 @@ typedef struct
 } FsInfoType;
 
 static RD_NTSTATUS NotifyInfo(RD_NTHANDLE handle, uint32 info_class, NOTIFY * p);
+static void disk_notify_remove(FILEINFO * pfinfo);
+static void disk_dir_cache_free(FILEINFO * pfinfo);
+
+/* Overwrite a field written earlier, such as a NextEntryOffset */
+static void
+disk_patch_uint32(STREAM s, size_t offset, uint32 value)
+{
+	uint8 *p = s->p;
+
+	s->p = s->data + offset;
+	out_uint32_le(s, value);
+	s->p = p;
+}
 
 static time_t
 get_create_time(struct stat *filestat)
@@ -542,6 +560,8 @@ disk_close(RD_NTHANDLE handle)
 		g_notify_stamp = True;
 
 	rdpdr_abort_io(handle, 0, RD_STATUS_CANCELLED);
+	disk_notify_remove(pfinfo);
+	disk_dir_cache_free(pfinfo);
 
 	if (pfinfo->pdir)
 	{
@@ -949,8 +969,320 @@ disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM ou
 	return RD_STATUS_SUCCESS;
 }
 
+/* Directory change notifications come from inotify where available.
+   Handles that cannot be watched, or systems without inotify, fall
+   back to comparing a summary of the directory on every change rdesktop
+   makes itself (NotifyInfo), which only reports STATUS_NOTIFY_ENUM_DIR. */
+
+/* Queued FILE_NOTIFY_INFORMATION beyond this are dropped, and the server
+   told to enumerate the directory again instead */
+#define NOTIFY_BUFFER_SIZE	4096
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int g_notify_fd = -1;
+
+/* An IN_MOVED_FROM waiting for its IN_MOVED_TO */
+static struct
+{
+	int wd;
+	uint32 cookie;
+	uint32 mask;
+	char name[PATH_MAX];
+} g_notify_move;
+
+/* Queue a FILE_NOTIFY_INFORMATION for the next notify request */
+static void
+disk_notify_append(FILEINFO * pfinfo, uint32 action, const char *name)
+{
+	STREAM s = pfinfo->notify_events;
+	size_t start, length;
+
+	if (pfinfo->notify_overflow)
+		return;
+
+	/* UTF-16 takes at most twice the bytes of UTF-8 */
+	if (s_tell(s) + 12 + 2 * strlen(name) + 4 > s->size)
+	{
+		pfinfo->notify_overflow = True;
+		return;
+	}
+
+	start = s_tell(s);
+	out_uint32_le(s, 0);	/* NextEntryOffset */
+	out_uint32_le(s, action);
+	out_uint32_le(s, 0);	/* FileNameLength */
+	out_utf16s_no_eos(s, name);
+	disk_patch_uint32(s, start + 8, s_tell(s) - start - 12);
+	while (s_tell(s) % 4)
+		out_uint8(s, 0);
+
+	if (start == 0)
+	{
+		pfinfo->notify_last = start;
+		return;
+	}
+
+	/* a file written in many pieces is reported once */
+	length = s_tell(s) - start;
+	if (action == FILE_ACTION_MODIFIED && start - pfinfo->notify_last == length
+	    && memcmp(s->data + pfinfo->notify_last + 4, s->data + start + 4, length - 4) == 0)
+	{
+		s->p = s->data + start;
+		return;
+	}
+
+	disk_patch_uint32(s, pfinfo->notify_last, start - pfinfo->notify_last);
+	pfinfo->notify_last = start;
+}
+
+/* Queue an event for every handle watching wd whose completion filter
+   asks for it */
+static void
+disk_notify_queue(int wd, uint32 mask, uint32 action, const char *name)
+{
+	FILEINFO *pfinfo;
+	uint32 filter;
+	int i;
+
+	switch (action)
+	{
+		case FILE_ACTION_MODIFIED:
+			filter = 0;
+			if (mask & IN_MODIFY)
+				filter |= FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+			if (mask & IN_ATTRIB)
+				filter |= FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_LAST_WRITE |
+					FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_EA |
+					FILE_NOTIFY_CHANGE_SECURITY;
+			if (mask & IN_ACCESS)
+				filter |= FILE_NOTIFY_CHANGE_LAST_ACCESS;
+			break;
+		default:
+			filter = (mask & IN_ISDIR) ? FILE_NOTIFY_CHANGE_DIR_NAME :
+				FILE_NOTIFY_CHANGE_FILE_NAME;
+			break;
+	}
+
+	for (i = 0; i < MAX_OPEN_FILES; i++)
+	{
+		pfinfo = &g_fileinfo[i];
+		if (pfinfo->notify_wd == wd && (pfinfo->info_class & filter))
+		{
+			disk_notify_append(pfinfo, action, name);
+			g_notify_stamp = True;
+		}
+	}
+}
+
+/* A move whose other half did not follow is a remove */
+static void
+disk_notify_flush_move(void)
+{
+	if (g_notify_move.wd == 0)
+		return;
+
+	disk_notify_queue(g_notify_move.wd, g_notify_move.mask, FILE_ACTION_REMOVED,
+			  g_notify_move.name);
+	g_notify_move.wd = 0;
+}
+
+/* Have every handle watching wd enumerate its directory again */
+static void
+disk_notify_overflow(int wd)
+{
+	int i;
+
+	for (i = 0; i < MAX_OPEN_FILES; i++)
+	{
+		if (g_fileinfo[i].notify_wd == 0 || (wd != -1 && g_fileinfo[i].notify_wd != wd))
+			continue;
+		g_fileinfo[i].notify_overflow = True;
+		/* the kernel dropped the watch with the directory */
+		if (wd != -1)
+			g_fileinfo[i].notify_wd = 0;
+		g_notify_stamp = True;
+	}
+}
+
+static void
+disk_notify_event(struct inotify_event *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW)
+	{
+		disk_notify_flush_move();
+		disk_notify_overflow(-1);
+		return;
+	}
+
+	if (ev->mask & IN_IGNORED)
+	{
+		disk_notify_flush_move();
+		disk_notify_overflow(ev->wd);
+		return;
+	}
+
+	if (ev->len == 0)
+		return;		/* about the directory itself */
+
+	if (ev->mask & IN_MOVED_TO && g_notify_move.wd != 0 && g_notify_move.cookie == ev->cookie)
+	{
+		if (g_notify_move.wd == ev->wd)
+		{
+			disk_notify_queue(ev->wd, ev->mask, FILE_ACTION_RENAMED_OLD_NAME,
+					  g_notify_move.name);
+			disk_notify_queue(ev->wd, ev->mask, FILE_ACTION_RENAMED_NEW_NAME, ev->name);
+			g_notify_move.wd = 0;
+			return;
+		}
+
+		/* moved to another watched directory */
+		disk_notify_flush_move();
+		disk_notify_queue(ev->wd, ev->mask, FILE_ACTION_ADDED, ev->name);
+		return;
+	}
+
+	disk_notify_flush_move();
+
+	if (ev->mask & IN_MOVED_FROM)
+	{
+		g_notify_move.wd = ev->wd;
+		g_notify_move.cookie = ev->cookie;
+		g_notify_move.mask = ev->mask;
+		STRNCPY(g_notify_move.name, ev->name, sizeof(g_notify_move.name));
+	}
+	else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+		disk_notify_queue(ev->wd, ev->mask, FILE_ACTION_ADDED, ev->name);
+	else if (ev->mask & IN_DELETE)
+		disk_notify_queue(ev->wd, ev->mask, FILE_ACTION_REMOVED, ev->name);
+	else if (ev->mask & (IN_MODIFY | IN_ATTRIB | IN_ACCESS))
+		disk_notify_queue(ev->wd, ev->mask, FILE_ACTION_MODIFIED, ev->name);
+}
+
+static void
+disk_notify_ready(int fd, int events, void *data)
+{
+	union
+	{
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct inotify_event *ev;
+	ssize_t n, i;
+
+	UNUSED(events);
+	UNUSED(data);
+
+	while ((n = read(fd, u.buf, sizeof(u.buf))) > 0)
+	{
+		for (i = 0; i < n; i += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (struct inotify_event *) (u.buf + i);
+			disk_notify_event(ev);
+		}
+	}
+
+	/* a rename split over two reads is reported as remove and add */
+	disk_notify_flush_move();
+}
+
+/* Watch the directory of pfinfo for the changes in filter */
+static RD_BOOL
+disk_notify_add(FILEINFO * pfinfo, uint32 filter)
+{
+	uint32 mask = IN_ONLYDIR | IN_MASK_ADD;
+	int wd;
+
+	if (g_notify_fd == -1)
+	{
+		g_notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (g_notify_fd == -1)
+		{
+			logger(Disk, Warning, "disk_notify_add(), inotify_init1() failed: %s",
+			       strerror(errno));
+			g_notify_fd = -2;
+		}
+		else
+			reactor_add(g_notify_fd, REACTOR_READ, disk_notify_ready, NULL);
+	}
+	if (g_notify_fd < 0)
+		return False;
+
+	if (filter & (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME))
+		mask |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+	if (filter & (FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE))
+		mask |= IN_MODIFY;
+	if (filter & (FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_LAST_WRITE |
+		      FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_EA |
+		      FILE_NOTIFY_CHANGE_SECURITY))
+		mask |= IN_ATTRIB;
+	if (filter & FILE_NOTIFY_CHANGE_LAST_ACCESS)
+		mask |= IN_ACCESS;
+
+	wd = inotify_add_watch(g_notify_fd, pfinfo->path, mask);
+	if (wd == -1)
+	{
+		logger(Disk, Warning, "disk_notify_add(), inotify_add_watch() failed for %s: %s",
+		       pfinfo->path, strerror(errno));
+		disk_notify_remove(pfinfo);
+		return False;
+	}
+
+	if (pfinfo->notify_events == NULL)
+	{
+		pfinfo->notify_events = s_alloc(NOTIFY_BUFFER_SIZE);
+		pfinfo->notify_overflow = False;
+	}
+	pfinfo->notify_wd = wd;
+	return True;
+}
+
+/* Hand the queued changes to the server */
+static RD_NTSTATUS
+disk_notify_send(FILEINFO * pfinfo, STREAM out)
+{
+	STREAM s = pfinfo->notify_events;
+
+	if (pfinfo->notify_overflow)
+	{
+		pfinfo->notify_overflow = False;
+		s_reset(s);
+		return RD_STATUS_NOTIFY_ENUM_DIR;
+	}
+
+	if (s_tell(s) == 0)
+		return RD_STATUS_PENDING;
+
+	s_realloc(out, s_tell(out) + s_tell(s));
+	out_uint8a(out, s->data, s_tell(s));
+	s_reset(s);
+	return RD_STATUS_SUCCESS;
+}
+#endif
+
+static void
+disk_notify_remove(FILEINFO * pfinfo)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	int i;
+
+	if (pfinfo->notify_wd != 0)
+	{
+		/* handles of the same directory share the watch */
+		for (i = 0; i < MAX_OPEN_FILES; i++)
+			if (&g_fileinfo[i] != pfinfo && g_fileinfo[i].notify_wd == pfinfo->notify_wd)
+				break;
+		if (i == MAX_OPEN_FILES)
+			inotify_rm_watch(g_notify_fd, pfinfo->notify_wd);
+		pfinfo->notify_wd = 0;
+	}
+#endif
+	s_free(pfinfo->notify_events);
+	pfinfo->notify_events = NULL;
+	pfinfo->notify_overflow = False;
+}
+
 RD_NTSTATUS
-disk_check_notify(RD_NTHANDLE handle)
+disk_check_notify(RD_NTHANDLE handle, STREAM out)
 {
 	struct fileinfo *pfinfo;
 	RD_NTSTATUS status = RD_STATUS_PENDING;
@@ -962,7 +1294,12 @@ disk_check_notify(RD_NTHANDLE handle)
 	if (!pfinfo->pdir)
 		return RD_STATUS_INVALID_DEVICE_REQUEST;
 
-
+#ifdef HAVE_SYS_INOTIFY_H
+	if (pfinfo->notify_events != NULL)
+		return disk_notify_send(pfinfo, out);
+#else
+	UNUSED(out);
+#endif
 
 	status = NotifyInfo(handle, pfinfo->info_class, &notify);
 
@@ -982,19 +1319,29 @@ disk_check_notify(RD_NTHANDLE handle)
 }
 
 RD_NTSTATUS
-disk_create_notify(RD_NTHANDLE handle, uint32 info_class)
+disk_create_notify(RD_NTHANDLE handle, RD_BOOL watch_tree, uint32 info_class, STREAM out)
 {
 	struct fileinfo *pfinfo;
 	RD_NTSTATUS ret = RD_STATUS_PENDING;
 
-	logger(Disk, Debug, "disk_create_notify(handle=0x%x, info_class=0x%x)", handle, info_class);
+	logger(Disk, Debug, "disk_create_notify(handle=0x%x, watch_tree=%d, info_class=0x%x)",
+	       handle, watch_tree, info_class);
 
 	pfinfo = &(g_fileinfo[handle]);
 	pfinfo->info_class = info_class;
 
+#ifdef HAVE_SYS_INOTIFY_H
+	/* inotify does not watch subdirectories, only the directory
+	   itself is reported on even when the server asks for the tree */
+	if (disk_notify_add(pfinfo, info_class))
+		return disk_notify_send(pfinfo, out);
+#else
+	UNUSED(out);
+#endif
+
 	ret = NotifyInfo(handle, info_class, &pfinfo->notify);
 
-	if (info_class & 0x1000)
+	if (info_class & FILE_NOTIFY_CHANGE_LAST_WRITE)
 	{			/* ???? */
 		if (ret == RD_STATUS_PENDING)
 			return RD_STATUS_SUCCESS;
@@ -1208,120 +1555,142 @@ disk_query_volume_information(RD_NTHANDLE handle, uint32 info_class, STREAM out)
 	return RD_STATUS_SUCCESS;
 }
 
-RD_NTSTATUS
-disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREAM out)
+/* Directory entries read ahead of the queries, so that a reply can be
+   filled without a readdir and stat round per entry, and an entry that
+   did not fit is kept for the next reply */
+#define DIR_CACHE_ENTRIES	64
+
+/* Largest fixed part of a FILE_*_INFORMATION entry, before the name */
+#define DIR_ENTRY_MAX_FIXED	104
+
+struct dir_cache_entry
 {
-	uint32 file_attributes, ft_low, ft_high;
-	char *dirname, fullpath[PATH_MAX];
-	DIR *pdir;
-	struct dirent *pdirent;
+	char *name;
 	struct stat filestat;
-	struct fileinfo *pfinfo;
-	STREAM stmp;
+	int error;		/* errno of a fatal stat() failure */
+};
 
-	logger(Disk, Debug, "disk_query_directory(handle=0x%x, info_class=0x%x, pattern=%s, ...)",
-	       handle, info_class, pattern);
+struct dir_cache
+{
+	struct dir_cache_entry entries[DIR_CACHE_ENTRIES];
+	int next, count;
+};
 
-	pfinfo = &(g_fileinfo[handle]);
-	pdir = pfinfo->pdir;
-	dirname = pfinfo->path;
-	file_attributes = 0;
+static void
+disk_dir_cache_clear(FILEINFO * pfinfo)
+{
+	struct dir_cache *c = pfinfo->dir_cache;
 
-	switch (info_class)
-	{
-		case FileBothDirectoryInformation:
-		case FileDirectoryInformation:
-		case FileFullDirectoryInformation:
-		case FileNamesInformation:
+	if (c == NULL)
+		return;
 
-			/* If a search pattern is received, remember this pattern, and restart search */
-			if (pattern != NULL && pattern[0] != 0)
-			{
-				strncpy(pfinfo->pattern, 1 + strrchr(pattern, '/'), PATH_MAX - 1);
-				rewinddir(pdir);
-			}
+	while (c->next < c->count)
+		xfree(c->entries[c->next++].name);
+	c->next = c->count = 0;
+}
 
-			/* find next dirent matching pattern */
-			pdirent = readdir(pdir);
-			while (pdirent && fnmatch(pfinfo->pattern, pdirent->d_name, 0) != 0)
-				pdirent = readdir(pdir);
+static void
+disk_dir_cache_free(FILEINFO * pfinfo)
+{
+	disk_dir_cache_clear(pfinfo);
+	xfree(pfinfo->dir_cache);
+	pfinfo->dir_cache = NULL;
+}
 
-			if (pdirent == NULL)
-				return RD_STATUS_NO_MORE_FILES;
+/* Read and stat the next entries matching the search pattern */
+static void
+disk_dir_cache_fill(FILEINFO * pfinfo)
+{
+	struct dir_cache *c;
+	struct dir_cache_entry *e;
+	struct dirent *pdirent;
+	int ret;
+#ifndef AT_FDCWD
+	char fullpath[PATH_MAX];
+#endif
 
-			/* Get information for directory entry */
-			sprintf(fullpath, "%s/%s", dirname, pdirent->d_name);
+	if (pfinfo->dir_cache == NULL)
+		pfinfo->dir_cache = xmalloc(sizeof(struct dir_cache));
+	c = pfinfo->dir_cache;
+	c->next = c->count = 0;
 
-			if (stat(fullpath, &filestat))
-			{
-				switch (errno)
-				{
-					case ENOENT:
-					case ELOOP:
-					case EACCES:
-						/* These are non-fatal errors. */
-						memset(&filestat, 0, sizeof(filestat));
-						break;
-					default:
-						/* Fatal error. By returning STATUS_NO_SUCH_FILE, 
-						   the directory list operation will be aborted */
-						logger(Disk, Error,
-						       "disk_query_directory(), stat() failed: %s",
-						       strerror(errno));
-						out_uint8(out, 0);
-						return RD_STATUS_NO_SUCH_FILE;
-				}
-			}
+	while (c->count < DIR_CACHE_ENTRIES && (pdirent = readdir(pfinfo->pdir)) != NULL)
+	{
+		if (fnmatch(pfinfo->pattern, pdirent->d_name, 0) != 0)
+			continue;
 
-			if (S_ISDIR(filestat.st_mode))
-				file_attributes |= FILE_ATTRIBUTE_DIRECTORY;
-			if (pdirent->d_name[0] == '.')
-				file_attributes |= FILE_ATTRIBUTE_HIDDEN;
-			if (!file_attributes)
-				file_attributes |= FILE_ATTRIBUTE_NORMAL;
-			if (!(filestat.st_mode & S_IWUSR))
-				file_attributes |= FILE_ATTRIBUTE_READONLY;
+		e = &c->entries[c->count++];
+		e->name = xstrdup(pdirent->d_name);
+		e->error = 0;
 
-			/* Return requested information */
-			out_uint32_le(out, 0);	/* NextEntryOffset */
-			out_uint32_le(out, 0);	/* FileIndex zero */
-			break;
+#ifdef AT_FDCWD
+		ret = fstatat(DIRFD(pfinfo->pdir), pdirent->d_name, &e->filestat, 0);
+#else
+		snprintf(fullpath, sizeof(fullpath), "%s/%s", pfinfo->path, pdirent->d_name);
+		ret = stat(fullpath, &e->filestat);
+#endif
+		if (ret == 0)
+			continue;
 
-		default:
-			logger(Disk, Warning,
-			       "disk_query_directory(), unhandled directory info class 0x%x",
-			       info_class);
-			return RD_STATUS_INVALID_PARAMETER;
+		switch (errno)
+		{
+			case ENOENT:
+			case ELOOP:
+			case EACCES:
+				/* These are non-fatal errors. */
+				memset(&e->filestat, 0, sizeof(e->filestat));
+				break;
+			default:
+				e->error = errno;
+				break;
+		}
 	}
+}
 
-	// Write entry name as utf16 into stmp
-	stmp = s_alloc(PATH_MAX * 4);
-	out_utf16s_no_eos(stmp, pdirent->d_name);
-	s_mark_end(stmp);
+/* Write one FILE_*_INFORMATION entry, NextEntryOffset left zero */
+static void
+disk_query_directory_entry(STREAM out, uint32 info_class, const char *name,
+			   struct stat *filestat, STREAM stmp)
+{
+	uint32 file_attributes, ft_low, ft_high;
+
+	file_attributes = 0;
+	if (S_ISDIR(filestat->st_mode))
+		file_attributes |= FILE_ATTRIBUTE_DIRECTORY;
+	if (name[0] == '.')
+		file_attributes |= FILE_ATTRIBUTE_HIDDEN;
+	if (!file_attributes)
+		file_attributes |= FILE_ATTRIBUTE_NORMAL;
+	if (!(filestat->st_mode & S_IWUSR))
+		file_attributes |= FILE_ATTRIBUTE_READONLY;
+
+	/* Return requested information */
+	out_uint32_le(out, 0);	/* NextEntryOffset */
+	out_uint32_le(out, 0);	/* FileIndex zero */
 
 	switch (info_class)
 	{
 		case FileBothDirectoryInformation:
 
-			seconds_since_1970_to_filetime(get_create_time(&filestat), &ft_high,
+			seconds_since_1970_to_filetime(get_create_time(filestat), &ft_high,
 						       &ft_low);
 			out_uint32_le(out, ft_low);	/* create time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_atime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_atime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_access_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_mtime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_mtime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_write_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_ctime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_ctime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* change_write_time */
 			out_uint32_le(out, ft_high);
 
-			out_uint64_le(out, filestat.st_size);	/* filesize */
-			out_uint64_le(out, filestat.st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
 			out_uint32_le(out, file_attributes);	/* FileAttributes */
 			out_uint32_le(out, s_length(stmp));	/* length of dir entry name string */
 			out_uint32_le(out, 0);	/* EaSize */
@@ -1333,25 +1702,25 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 
 		case FileDirectoryInformation:
 
-			seconds_since_1970_to_filetime(get_create_time(&filestat), &ft_high,
+			seconds_since_1970_to_filetime(get_create_time(filestat), &ft_high,
 						       &ft_low);
 			out_uint32_le(out, ft_low);	/* create time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_atime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_atime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_access_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_mtime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_mtime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_write_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_ctime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_ctime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* change_write_time */
 			out_uint32_le(out, ft_high);
 
-			out_uint64_le(out, filestat.st_size);	/* filesize */
-			out_uint64_le(out, filestat.st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
 			out_uint32_le(out, file_attributes);
 			out_uint32_le(out, s_length(stmp));	/* dir entry name string length */
 			out_stream(out, stmp);	/* dir entry name */
@@ -1360,25 +1729,25 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 
 		case FileFullDirectoryInformation:
 
-			seconds_since_1970_to_filetime(get_create_time(&filestat), &ft_high,
+			seconds_since_1970_to_filetime(get_create_time(filestat), &ft_high,
 						       &ft_low);
 			out_uint32_le(out, ft_low);	/* create time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_atime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_atime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_access_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_mtime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_mtime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_write_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_ctime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_ctime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* change_write_time */
 			out_uint32_le(out, ft_high);
 
-			out_uint64_le(out, filestat.st_size);	/* filesize */
-			out_uint64_le(out, filestat.st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
 			out_uint32_le(out, file_attributes);
 			out_uint32_le(out, s_length(stmp));	/* dir entry name string length */
 			out_uint32_le(out, 0);	/* EaSize */
@@ -1393,15 +1762,120 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 			break;
 
 
+		default:
+			break;
+	}
+
+}
+
+/* Reply with as many entries as fit in g_dir_batch_size bytes, chained
+   by NextEntryOffset, or with a single one when that is zero */
+RD_NTSTATUS
+disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREAM out)
+{
+	static STREAM stmp = NULL;
+	struct fileinfo *pfinfo;
+	struct dir_cache *c;
+	struct dir_cache_entry *e;
+	size_t base, start, last, end;
+	int count;
+
+	logger(Disk, Debug, "disk_query_directory(handle=0x%x, info_class=0x%x, pattern=%s, ...)",
+	       handle, info_class, pattern);
+
+	pfinfo = &(g_fileinfo[handle]);
+
+	switch (info_class)
+	{
+		case FileBothDirectoryInformation:
+		case FileDirectoryInformation:
+		case FileFullDirectoryInformation:
+		case FileNamesInformation:
+			break;
+
 		default:
 			logger(Disk, Warning,
 			       "disk_query_directory(), unhandled directory info class 0x%x",
 			       info_class);
-			s_free(stmp);
 			return RD_STATUS_INVALID_PARAMETER;
 	}
 
-	s_free(stmp);
+	/* If a search pattern is received, remember this pattern, and restart search */
+	if (pattern != NULL && pattern[0] != 0)
+	{
+		strncpy(pfinfo->pattern, 1 + strrchr(pattern, '/'), PATH_MAX - 1);
+		rewinddir(pfinfo->pdir);
+		disk_dir_cache_clear(pfinfo);
+	}
+
+	if (stmp == NULL)
+		stmp = s_alloc(PATH_MAX * 4);
+
+	base = last = end = s_tell(out);
+	count = 0;
+	while (1)
+	{
+		c = pfinfo->dir_cache;
+		if (c == NULL || c->next == c->count)
+		{
+			disk_dir_cache_fill(pfinfo);
+			c = pfinfo->dir_cache;
+			if (c->count == 0)
+				break;
+		}
+		e = &c->entries[c->next];
+
+		if (e->error != 0)
+		{
+			/* report it on its own */
+			if (count > 0)
+				break;
+
+			/* Fatal error. By returning STATUS_NO_SUCH_FILE,
+			   the directory list operation will be aborted */
+			logger(Disk, Error, "disk_query_directory(), stat() failed: %s",
+			       strerror(e->error));
+			xfree(e->name);
+			c->next++;
+			out_uint8(out, 0);
+			return RD_STATUS_NO_SUCH_FILE;
+		}
+
+		// Write entry name as utf16 into stmp
+		s_reset(stmp);
+		out_utf16s_no_eos(stmp, e->name);
+		s_mark_end(stmp);
+
+		s_realloc(out, s_tell(out) + 8 + DIR_ENTRY_MAX_FIXED + s_length(stmp));
+
+		/* entries are 8 byte aligned */
+		while ((s_tell(out) - base) % 8)
+			out_uint8(out, 0);
+		start = s_tell(out);
+		disk_query_directory_entry(out, info_class, e->name, &e->filestat, stmp);
+
+		if (count > 0 && s_tell(out) - base > g_dir_batch_size)
+		{
+			/* keep it for the next query */
+			out->p = out->data + end;
+			break;
+		}
+
+		if (count > 0)
+			disk_patch_uint32(out, last, start - last);
+		last = start;
+		end = s_tell(out);
+		count++;
+
+		xfree(e->name);
+		c->next++;
+
+		if (s_tell(out) - base >= g_dir_batch_size)
+			break;
+	}
+
+	if (count == 0)
+		return RD_STATUS_NO_MORE_FILES;
 
 	return RD_STATUS_SUCCESS;
 }
@@ -49,6 +49,9 @@ typedef struct dvc_channel_t
 	uint32 hash;
 	uint32 channel_id;
 	dvc_channel_process_fn handler;
+	dvc_channel_open_fn open_handler;
+	STREAM fragments;	/* message being reassembled */
+	uint32 fragments_length;	/* its total length */
 } dvc_channel_t;
 
 static VCHANNEL *dvc_channel;
@@ -71,7 +74,7 @@ dvc_channels_exists(const char *name)
 	return False;
 }
 
-static const dvc_channel_t *
+static dvc_channel_t *
 dvc_channels_get_by_id(uint32 id)
 {
 	int i;
@@ -114,6 +117,8 @@ dvc_channels_remove_by_id(uint32 channelid)
 	{
 		if (channels[i].channel_id == channelid)
 		{
+			if (channels[i].fragments != NULL)
+				s_free(channels[i].fragments);
 			memset(&channels[i], 0, sizeof(dvc_channel_t));
 			return True;
 		}
@@ -122,7 +127,8 @@ dvc_channels_remove_by_id(uint32 channelid)
 }
 
 static RD_BOOL
-dvc_channels_add(const char *name, dvc_channel_process_fn handler, uint32 channel_id)
+dvc_channels_add(const char *name, dvc_channel_process_fn handler,
+		 dvc_channel_open_fn open_handler, uint32 channel_id)
 {
 	int i;
 	uint32 hash;
@@ -141,6 +147,7 @@ dvc_channels_add(const char *name, dvc_channel_process_fn handler, uint32 channe
 			hash = utils_djb2_hash(name);
 			channels[i].hash = hash;
 			channels[i].handler = handler;
+			channels[i].open_handler = open_handler;
 			channels[i].channel_id = channel_id;
 			logger(Core, Debug,
 			       "dvc_channels_add(), Added hash=%x, channel_id=%d, name=%s, handler=%p",
@@ -197,7 +204,16 @@ dvc_channels_is_available(const char *name)
 RD_BOOL
 dvc_channels_register(const char *name, dvc_channel_process_fn handler)
 {
-	return dvc_channels_add(name, handler, INVALID_CHANNEL);
+	return dvc_channels_add(name, handler, NULL, INVALID_CHANNEL);
+}
+
+/* As dvc_channels_register(), open_handler is called once the server
+   has opened the channel, for protocols where the client speaks first */
+RD_BOOL
+dvc_channels_register_with_open(const char *name, dvc_channel_process_fn handler,
+				dvc_channel_open_fn open_handler)
+{
+	return dvc_channels_add(name, handler, open_handler, INVALID_CHANNEL);
 }
 
 
@@ -328,6 +344,7 @@ dvc_send_create_response(RD_BOOL success, dvc_hdr_t hdr, uint32 channelid)
 static void
 dvc_process_create_pdu(STREAM s, dvc_hdr_t hdr)
 {
+	dvc_channel_t *ch;
 	char name[512];
 	uint32 channelid;
 
@@ -344,6 +361,10 @@ dvc_process_create_pdu(STREAM s, dvc_hdr_t hdr)
 
 		dvc_channels_set_id(name, channelid);
 		dvc_send_create_response(True, hdr, channelid);
+
+		ch = dvc_channels_get_by_id(channelid);
+		if (ch->open_handler != NULL)
+			ch->open_handler();
 	}
 	else
 	{
@@ -374,10 +395,73 @@ dvc_in_channelid(STREAM s, dvc_hdr_t hdr)
 	return id;
 }
 
+/* Add a fragment to the message being reassembled, and dispatch the
+   message once it is complete */
+static void
+dvc_append_fragment(dvc_channel_t * ch, STREAM s)
+{
+	if (s_remaining(s) > ch->fragments_length - s_tell(ch->fragments))
+	{
+		logger(Protocol, Warning,
+		       "dvc_append_fragment(), fragment overruns message on channel %d",
+		       ch->channel_id);
+		ch->fragments_length = 0;
+		return;
+	}
+
+	out_uint8stream(ch->fragments, s, s_remaining(s));
+	if (s_tell(ch->fragments) < ch->fragments_length)
+		return;
+
+	s_mark_end(ch->fragments);
+	s_seek(ch->fragments, 0);
+	ch->fragments_length = 0;
+	ch->handler(ch->fragments);
+}
+
+/* DYNVC_DATA_FIRST, the first fragment of a message and its length */
+static void
+dvc_process_data_first_pdu(STREAM s, dvc_hdr_t hdr)
+{
+	dvc_channel_t *ch;
+	uint32 channelid, length = 0;
+
+	channelid = dvc_in_channelid(s, hdr);
+	switch (hdr.hdr.sp)
+	{
+		case 0:
+			in_uint8(s, length);
+			break;
+		case 1:
+			in_uint16_le(s, length);
+			break;
+		default:
+			in_uint32_le(s, length);
+			break;
+	}
+
+	ch = dvc_channels_get_by_id(channelid);
+	if (ch == NULL)
+	{
+		logger(Protocol, Warning,
+		       "dvc_process_data_first(), Received data on unregistered channel %d",
+		       channelid);
+		return;
+	}
+
+	if (ch->fragments == NULL)
+		ch->fragments = s_alloc(length);
+	s_realloc(ch->fragments, length);
+	s_reset(ch->fragments);
+	ch->fragments_length = length;
+
+	dvc_append_fragment(ch, s);
+}
+
 static void
 dvc_process_data_pdu(STREAM s, dvc_hdr_t hdr)
 {
-	const dvc_channel_t *ch;
+	dvc_channel_t *ch;
 	uint32 channelid;
 
 	channelid = dvc_in_channelid(s, hdr);
@@ -389,8 +473,15 @@ dvc_process_data_pdu(STREAM s, dvc_hdr_t hdr)
 		return;
 	}
 
-	/* dispatch packet to channel handler */
-	ch->handler(s);
+	if (ch->fragments_length == 0)
+	{
+		/* dispatch packet to channel handler */
+		ch->handler(s);
+		return;
+	}
+
+	/* continuation of a DYNVC_DATA_FIRST */
+	dvc_append_fragment(ch, s);
 }
 
 static void
@@ -427,6 +518,10 @@ dvc_process_pdu(STREAM s)
 			dvc_process_create_pdu(s, hdr);
 			break;
 
+		case DYNVC_DATA_FIRST:
+			dvc_process_data_first_pdu(s, hdr);
+			break;
+
 		case DYNVC_DATA:
 			dvc_process_data_pdu(s, hdr);
 			break;
@@ -437,8 +532,6 @@ dvc_process_pdu(STREAM s)
 
 #if 0				/* Unimplemented */
 
-		case DYNVC_DATA_FIRST:
-			break;
 		case DYNVC_DATA_FIRST_COMPRESSED:
 			break;
 		case DYNVC_DATA_COMPRESSED:
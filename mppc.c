@@ -38,6 +38,9 @@
 
 /* decompression is alright as long as we   */
 /* don't compress data                      */
+/* (the LZS patents referred to have since  */
+/* expired, client to server virtual        */
+/* channel data is now compressed too)      */
 
 /* Algorithm: */
 
@@ -54,24 +57,141 @@
 
 RDPCOMP g_mppc_dict;
 
-int
-mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen)
+/* Compressed data is appended here for replay by tests/mppc_bench */
+static FILE *g_mppc_capture = NULL;
+
+void
+mppc_set_capture(char *filename)
 {
-	int k, walker_len = 0, walker;
-	uint32 i = 0;
-	int next_offset, match_off;
-	int match_len;
-	int old_offset, match_bits;
-	RD_BOOL big = ctype & RDP_MPPC_BIG ? True : False;
+	g_mppc_capture = fopen(filename, "wb");
+	if (g_mppc_capture == NULL)
+		logger(Protocol, Error, "mppc_set_capture(), failed to open %s", filename);
+}
 
-	uint8 *dict = g_mppc_dict.hist;
+/* record: ctype, length as 32 bit little endian, data */
+static void
+mppc_capture(uint8 * data, uint32 clen, uint8 ctype)
+{
+	uint8 hdr[5];
+
+	if (g_mppc_capture == NULL)
+		return;
+
+	hdr[0] = ctype;
+	hdr[1] = clen & 0xff;
+	hdr[2] = (clen >> 8) & 0xff;
+	hdr[3] = (clen >> 16) & 0xff;
+	hdr[4] = (clen >> 24) & 0xff;
+	fwrite(hdr, 1, sizeof(hdr), g_mppc_capture);
+	fwrite(data, 1, clen, g_mppc_capture);
+}
 
-	if ((ctype & RDP_MPPC_COMPRESSED) == 0)
+/* Decoding works on a 32 bit window, most significant bit first, kept
+   filled with at least 25 bits while there is input left. */
+struct bitreader
+{
+	const uint8 *p, *end;
+	uint32 bits;
+	int nbits;
+};
+
+#define REFILL(br) \
+	while ((br)->nbits <= 24 && (br)->p < (br)->end) \
+	{ \
+		(br)->bits |= (uint32) *(br)->p++ << (24 - (br)->nbits); \
+		(br)->nbits += 8; \
+	}
+
+#define CONSUME(br, n) \
+	{ \
+		(br)->bits <<= (n); \
+		(br)->nbits -= (n); \
+	}
+
+/* Copy-offset prefixes, indexed by the top 5 bits of a code starting
+   with 11: prefix length, number of value bits and base. */
+struct offset_code
+{
+	uint8 prefix;
+	uint8 bits;
+	uint16 base;
+};
+
+static const struct offset_code offset_codes_64k[8] = {
+	/* 110xx: 2368-65535 */
+	{3, 16, 2368}, {3, 16, 2368}, {3, 16, 2368}, {3, 16, 2368},
+	/* 1110x: 320-2367 */
+	{4, 11, 320}, {4, 11, 320},
+	/* 11110: 64-319, 11111: 0-63 */
+	{5, 8, 64}, {5, 6, 0}
+};
+
+static const struct offset_code offset_codes_8k[8] = {
+	/* 110xx: 320-8191 */
+	{3, 13, 320}, {3, 13, 320}, {3, 13, 320}, {3, 13, 320},
+	/* 1110x: 64-319 */
+	{4, 8, 64}, {4, 8, 64},
+	/* 1111x: 0-63 */
+	{4, 6, 0}, {4, 6, 0}
+};
+
+/* Number of leading one bits of a byte */
+static uint8 leading_ones[256];
+
+static void
+mppc_init_tables(void)
+{
+	int i, n;
+
+	for (i = 0; i < 256; i++)
 	{
-		*roff = 0;
-		*rlen = clen;
-		return 0;
+		for (n = 0; n < 8 && (i & (0x80 >> n)); n++);
+		leading_ones[i] = n;
+	}
+}
+
+/* Copy a match within the history, the areas may overlap */
+static void
+mppc_copy_match(uint8 * dict, int dst, int src, int len)
+{
+	int n, dist;
+
+	if (src + len <= dst)
+	{
+		memcpy(dict + dst, dict + src, len);
+		return;
+	}
+
+	if (src >= dst)
+	{
+		memmove(dict + dst, dict + src, len);
+		return;
+	}
+
+	/* repeating pattern, copy it in growing non overlapping chunks */
+	dist = dst - src;
+	while (len > 0)
+	{
+		n = MIN(len, dist);
+		memcpy(dict + dst, dict + src, n);
+		dst += n;
+		len -= n;
+		dist += n;
 	}
+}
+
+/* RDP 4.0 and 5.0 bulk compression, 8K or 64K history */
+static int
+mppc_decompress(uint8 * data, uint32 clen, uint8 ctype, uint8 ** rdata, uint32 * rlen)
+{
+	struct bitreader br;
+	const struct offset_code *code;
+	int next_offset, old_offset, match_off, match_len, ones, k;
+	RD_BOOL big = ctype & RDP_MPPC_BIG ? True : False;
+	int max_ones = big ? 14 : 11;
+	int mask = big ? 65535 : 8191;
+
+	uint8 *dict = g_mppc_dict.hist;
 
 	if ((ctype & RDP_MPPC_RESET) != 0)
 	{
@@ -84,296 +204,602 @@ mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen
 		g_mppc_dict.roff = 0;
 	}
 
-	*roff = 0;
-	*rlen = 0;
+	if ((ctype & RDP_MPPC_COMPRESSED) == 0)
+	{
+		*rdata = data;
+		*rlen = clen;
+		return 0;
+	}
 
-	walker = g_mppc_dict.roff;
+	next_offset = old_offset = g_mppc_dict.roff;
+	*rdata = dict + old_offset;
+	*rlen = 0;
 
-	next_offset = walker;
-	old_offset = next_offset;
-	*roff = old_offset;
-	if (clen == 0)
-		return 0;
-	clen += i;
+	br.p = data;
+	br.end = data + clen;
+	br.bits = 0;
+	br.nbits = 0;
 
-	do
+	while (1)
 	{
-		if (walker_len == 0)
-		{
-			if (i >= clen)
-				break;
-			walker = data[i++] << 24;
-			walker_len = 8;
-		}
-		if (walker >= 0)
+		REFILL(&br);
+		if (br.nbits == 0)
+			break;
+
+		/* literal 0x00-0x7f: 0 followed by 7 bits */
+		if ((br.bits & 0x80000000) == 0)
 		{
-			if (walker_len < 8)
+			if (br.nbits < 8)
 			{
-				if (i >= clen)
-				{
-					if (walker != 0)
-						return -1;
-					break;
-				}
-				walker |= (data[i++] & 0xff) << (24 - walker_len);
-				walker_len += 8;
+				/* padding at the end of the data */
+				if (br.bits != 0)
+					return -1;
+				break;
 			}
 			if (next_offset >= RDP_MPPC_DICT_SIZE)
 				return -1;
-			dict[next_offset++] = (((uint32) walker) >> ((uint32) 24));
-			walker <<= 8;
-			walker_len -= 8;
+			dict[next_offset++] = br.bits >> 24;
+			CONSUME(&br, 8);
 			continue;
 		}
-		walker <<= 1;
-		/* fetch next 8-bits */
-		if (--walker_len == 0)
+
+		/* literal 0x80-0xff: 10 followed by 7 bits */
+		if ((br.bits & 0x40000000) == 0)
 		{
-			if (i >= clen)
+			if (br.nbits < 9 || next_offset >= RDP_MPPC_DICT_SIZE)
 				return -1;
-			walker = data[i++] << 24;
-			walker_len = 8;
+			dict[next_offset++] = (br.bits >> 23) | 0x80;
+			CONSUME(&br, 9);
+			continue;
 		}
-		/* literal decoding */
-		if (walker >= 0)
+
+		/* copy offset: 11 followed by an offset prefix and value */
+		code = &(big ? offset_codes_64k : offset_codes_8k)[(br.bits >> 27) & 7];
+		if (br.nbits < code->prefix + code->bits)
+			return -1;
+		CONSUME(&br, code->prefix);
+		match_off = (br.bits >> (32 - code->bits)) + code->base;
+		CONSUME(&br, code->bits);
+
+		/* length of match: 0 for 3, otherwise n ones, a zero and
+		   n + 1 bits of the value without its leading one */
+		REFILL(&br);
+		if (br.nbits == 0)
+			return -1;
+		if ((br.bits & 0x80000000) == 0)
 		{
-			if (walker_len < 8)
-			{
-				if (i >= clen)
-					return -1;
-				walker |= (data[i++] & 0xff) << (24 - walker_len);
-				walker_len += 8;
-			}
-			if (next_offset >= RDP_MPPC_DICT_SIZE)
+			match_len = 3;
+			CONSUME(&br, 1);
+		}
+		else
+		{
+			ones = leading_ones[br.bits >> 24];
+			if (ones == 8)
+				ones += leading_ones[(br.bits >> 16) & 0xff];
+			if (ones > max_ones)
 				return -1;
-			dict[next_offset++] = (uint8) (walker >> 24 | 0x80);
-			walker <<= 8;
-			walker_len -= 8;
-			continue;
+			if (br.nbits < ones + 1)
+				return -1;
+			CONSUME(&br, ones + 1);
+
+			REFILL(&br);
+			if (br.nbits < ones + 1)
+				return -1;
+			match_len = (1 << (ones + 1)) | (br.bits >> (31 - ones));
+			CONSUME(&br, ones + 1);
 		}
 
-		/* decode offset  */
-		/* length pair    */
-		walker <<= 1;
-		if (--walker_len < (big ? 3 : 2))
+		if (next_offset + match_len >= RDP_MPPC_DICT_SIZE)
+			return -1;
+
+		k = (next_offset - match_off) & mask;
+		if (k + match_len > RDP_MPPC_DICT_SIZE)
+			return -1;
+		mppc_copy_match(dict, next_offset, k, match_len);
+		next_offset += match_len;
+	}
+
+	/* store history offset */
+	g_mppc_dict.roff = next_offset;
+
+	*rlen = next_offset - old_offset;
+
+	return 0;
+}
+
+/* RDP 6.0 bulk compression (NCRUSH), MS-RDPEGDI 3.1.8.1. Huffman coded
+   literals, copy offsets and lengths of match over a 64K history, read
+   least significant bit first. The codes are canonical, so the decoding
+   tables are generated from the code lengths. */
+
+/* literal (0-255), end of stream (256), copy offset (257-288) and
+   offset cache (289-292) */
+static const uint8 ncrush_lec_lengths[294] = {
+	 6,  6,  6,  7,  7,  7,  7,  7,  7,  7,  7,  8,  8,  8,  8,  8,
+	 8,  8,  9,  8,  9,  9,  9,  9,  8,  8,  9,  9,  9,  9,  9,  9,
+	 8,  9,  9, 10,  9,  9,  9,  9,  9,  9,  9, 10,  9, 10, 10, 10,
+	 9,  9, 10,  9, 10,  9, 10,  9,  9,  9, 10, 10,  9, 10,  9,  9,
+	 8,  9,  9,  9,  9, 10, 10, 10,  9,  9, 10, 10, 10, 10, 10, 10,
+	 9,  9, 10, 10, 10, 10, 10, 10, 10,  9, 10, 10, 10, 10, 10, 10,
+	 8, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+	10, 10, 10, 10, 10, 10, 10,  9, 10, 10, 10, 10, 10, 10,  9,  7,
+	 7,  9,  9, 10,  9, 10, 10, 10,  9, 10, 10, 10, 10, 10, 10, 10,
+	 9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+	 8, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+	 9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+	 9,  9,  9, 10, 10, 10, 10, 10,  9, 10, 10, 10, 10, 10, 10, 10,
+	 9, 10, 10, 10, 10, 10, 10, 10,  9, 10, 10, 10, 10, 10, 10, 10,
+	 9, 10, 10, 10, 10, 10, 10, 10,  9, 10, 10, 10, 10, 10,  9, 10,
+	 9, 10, 10, 10, 10, 10, 10, 10,  9, 10, 10, 10, 11, 12,  9,  7,
+	13, 13,  6,  8,  7,  7,  7,  8,  6,  6,  6,  5,  6,  6,  6,  5,
+	 6,  5,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,  6,
+	 6,  5,  7,  7, 11, 11
+};
+
+static const uint8 ncrush_lom_lengths[32] = {
+	4, 2, 3, 4, 3, 4, 4, 5, 4, 5, 5, 6, 6, 7, 7, 8,
+	7, 8, 8, 9, 9, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9
+};
+
+static const uint8 ncrush_offset_bits[32] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14
+};
+
+static const uint32 ncrush_offset_base[32] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+	32769, 49153
+};
+
+#define NCRUSH_LOM_CODES	30
+
+static const uint8 ncrush_lom_bits[NCRUSH_LOM_CODES] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 6, 6, 8, 8, 14, 14
+};
+
+static const uint16 ncrush_lom_base[NCRUSH_LOM_CODES] = {
+	2, 3, 4, 5, 6, 7, 8, 9, 10, 12, 14, 16, 18, 22, 26, 30,
+	34, 42, 50, 58, 66, 82, 98, 114, 130, 194, 258, 514, 2, 2
+};
+
+/* indexed by the next 13 (9) input bits: code length << 12 | symbol */
+static uint16 ncrush_lec_table[1 << 13];
+static uint16 ncrush_lom_table[1 << 9];
+
+static void
+ncrush_build_table(uint16 * table, int bits, const uint8 * lengths, int count)
+{
+	int len, sym, i, rev;
+	uint32 code = 0;
+
+	for (len = 1; len <= bits; len++)
+	{
+		for (sym = 0; sym < count; sym++)
 		{
-			if (i >= clen)
+			if (lengths[sym] != len)
+				continue;
+
+			/* the table is indexed by the code as it is read,
+			   first bit lowest */
+			for (i = 0, rev = 0; i < len; i++)
+				rev |= ((code >> i) & 1) << (len - 1 - i);
+			for (i = rev; i < (1 << bits); i += 1 << len)
+				table[i] = (len << 12) | sym;
+			code++;
+		}
+		code <<= 1;
+	}
+}
+
+/* Decoding keeps at least 25 bits in a 32 bit window, zero bits are
+   shifted in past the end of the input and counted in 'over'. */
+struct lsb_bitreader
+{
+	const uint8 *p, *end;
+	uint32 bits;
+	int nbits, over;
+};
+
+#define LSB_REFILL(br) \
+	while ((br)->nbits <= 24) \
+	{ \
+		if ((br)->p < (br)->end) \
+			(br)->bits |= (uint32) *(br)->p++ << (br)->nbits; \
+		else \
+			(br)->over += 8; \
+		(br)->nbits += 8; \
+	}
+
+#define LSB_CONSUME(br, n) \
+	{ \
+		(br)->bits >>= (n); \
+		(br)->nbits -= (n); \
+	}
+
+/* read past the end of the input */
+#define LSB_OVERRUN(br) ((br)->over > (br)->nbits)
+
+static int
+ncrush_decompress(uint8 * data, uint32 clen, uint8 ctype, uint8 ** rdata, uint32 * rlen)
+{
+	struct lsb_bitreader br;
+	uint8 *dict = g_mppc_dict.hist;
+	uint32 *cache = g_mppc_dict.offset_cache;
+	int next_offset, old_offset, match_off, match_len, sym, n;
+	uint16 entry;
+
+	if (ncrush_lec_table[0] == 0)
+	{
+		ncrush_build_table(ncrush_lec_table, 13, ncrush_lec_lengths,
+				   sizeof(ncrush_lec_lengths));
+		ncrush_build_table(ncrush_lom_table, 9, ncrush_lom_lengths,
+				   sizeof(ncrush_lom_lengths));
+	}
+
+	/* keep the last 32K of history */
+	if ((ctype & RDP_MPPC_RESET) != 0)
+	{
+		if (g_mppc_dict.roff < 32768)
+			return -1;
+		memmove(dict, dict + g_mppc_dict.roff - 32768, 32768);
+		memset(dict + 32768, 0, RDP_MPPC_DICT_SIZE - 32768);
+		g_mppc_dict.roff = 32768;
+	}
+
+	if ((ctype & RDP_MPPC_FLUSH) != 0)
+	{
+		memset(dict, 0, RDP_MPPC_DICT_SIZE);
+		memset(cache, 0, sizeof(g_mppc_dict.offset_cache));
+		g_mppc_dict.roff = 0;
+	}
+
+	if ((ctype & RDP_MPPC_COMPRESSED) == 0)
+	{
+		*rdata = data;
+		*rlen = clen;
+		return 0;
+	}
+
+	next_offset = old_offset = g_mppc_dict.roff;
+
+	br.p = data;
+	br.end = data + clen;
+	br.bits = 0;
+	br.nbits = 0;
+	br.over = 0;
+
+	while (1)
+	{
+		LSB_REFILL(&br);
+		entry = ncrush_lec_table[br.bits & 0x1fff];
+		LSB_CONSUME(&br, entry >> 12);
+		if (LSB_OVERRUN(&br))
+			return -1;
+		sym = entry & 0xfff;
+
+		if (sym < 256)
+		{
+			if (next_offset >= RDP_MPPC_DICT_SIZE)
 				return -1;
-			walker |= (data[i++] & 0xff) << (24 - walker_len);
-			walker_len += 8;
+			dict[next_offset++] = sym;
+			continue;
 		}
 
-		if (big)
+		/* end of stream */
+		if (sym == 256)
+			break;
+
+		if (sym < 289)
 		{
-			/* offset decoding where offset len is:
-			   -63: 11111 followed by the lower 6 bits of the value
-			   64-319: 11110 followed by the lower 8 bits of the value ( value - 64 )
-			   320-2367: 1110 followed by lower 11 bits of the value ( value - 320 )
-			   2368-65535: 110 followed by lower 16 bits of the value ( value - 2368 )
-			 */
-			switch (((uint32) walker) >> ((uint32) 29))
-			{
-				case 7:	/* - 63 */
-					for (; walker_len < 9; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-					walker <<= 3;
-					match_off = ((uint32) walker) >> ((uint32) 26);
-					walker <<= 6;
-					walker_len -= 9;
-					break;
-
-				case 6:	/* 64 - 319 */
-					for (; walker_len < 11; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					walker <<= 3;
-					match_off = (((uint32) walker) >> ((uint32) 24)) + 64;
-					walker <<= 8;
-					walker_len -= 11;
-					break;
-
-				case 5:
-				case 4:	/* 320 - 2367 */
-					for (; walker_len < 13; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					walker <<= 2;
-					match_off = (((uint32) walker) >> ((uint32) 21)) + 320;
-					walker <<= 11;
-					walker_len -= 13;
-					break;
-
-				default:	/* 2368 - 65535 */
-					for (; walker_len < 17; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					walker <<= 1;
-					match_off = (((uint32) walker) >> ((uint32) 16)) + 2368;
-					walker <<= 16;
-					walker_len -= 17;
-					break;
-			}
+			/* copy offset, pushed onto the offset cache */
+			sym -= 257;
+			n = ncrush_offset_bits[sym];
+			match_off = ncrush_offset_base[sym] - 1 + (br.bits & ((1 << n) - 1));
+			LSB_CONSUME(&br, n);
+			memmove(cache + 1, cache, 3 * sizeof(uint32));
+			cache[0] = match_off;
 		}
 		else
 		{
-			/* offset decoding where offset len is:
-			   -63: 1111 followed by the lower 6 bits of the value
-			   64-319: 1110 followed by the lower 8 bits of the value ( value - 64 )
-			   320-8191: 110 followed by the lower 13 bits of the value ( value - 320 )
-			 */
-			switch (((uint32) walker) >> ((uint32) 30))
-			{
-				case 3:	/* - 63 */
-					if (walker_len < 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-						walker_len += 8;
-					}
-					walker <<= 2;
-					match_off = ((uint32) walker) >> ((uint32) 26);
-					walker <<= 6;
-					walker_len -= 8;
-					break;
-
-				case 2:	/* 64 - 319 */
-					for (; walker_len < 10; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					walker <<= 2;
-					match_off = (((uint32) walker) >> ((uint32) 24)) + 64;
-					walker <<= 8;
-					walker_len -= 10;
-					break;
-
-				default:	/* 320 - 8191 */
-					for (; walker_len < 14; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					match_off = (walker >> 18) + 320;
-					walker <<= 14;
-					walker_len -= 14;
-					break;
-			}
+			/* offset cache hit, swapped to the front */
+			sym -= 289;
+			if (sym >= 4)
+				return -1;
+			match_off = cache[sym];
+			cache[sym] = cache[0];
+			cache[0] = match_off;
 		}
-		if (walker_len == 0)
+
+		LSB_REFILL(&br);
+		entry = ncrush_lom_table[br.bits & 0x1ff];
+		LSB_CONSUME(&br, entry >> 12);
+		sym = entry & 0xfff;
+		if (sym >= NCRUSH_LOM_CODES)
+			return -1;
+		n = ncrush_lom_bits[sym];
+		match_len = ncrush_lom_base[sym] + (br.bits & ((1 << n) - 1));
+		LSB_CONSUME(&br, n);
+		if (LSB_OVERRUN(&br))
+			return -1;
+
+		if (match_off == 0 || match_off > next_offset
+		    || next_offset + match_len > RDP_MPPC_DICT_SIZE)
+			return -1;
+		mppc_copy_match(dict, next_offset, next_offset - match_off, match_len);
+		next_offset += match_len;
+	}
+
+	g_mppc_dict.roff = next_offset;
+
+	*rdata = dict + old_offset;
+	*rlen = next_offset - old_offset;
+
+	return 0;
+}
+
+/* RDP 6.1 bulk compression (XCRUSH), MS-RDPEGDI 3.1.8.2. Level 1 copies
+   matches from a 2 MB history, its output may have been compressed once
+   more with RDP 5.0 MPPC at level 2. */
+static int
+xcrush_decompress(uint8 * data, uint32 clen, uint8 ctype, uint8 ** rdata, uint32 * rlen)
+{
+	uint8 l1_flags, l2_flags, *hist, *literals, *end, *match;
+	uint32 count, out, hoff, start, n, match_len, match_out, match_off;
+
+	UNUSED(ctype);
+
+	if (clen < 2)
+		return -1;
+	l1_flags = data[0];
+	l2_flags = data[1];
+	data += 2;
+	clen -= 2;
+
+	if ((l1_flags & RDP61_L1_INNER_COMPRESSION) != 0)
+	{
+		l2_flags = (l2_flags & ~RDP_MPPC_TYPE_MASK) | RDP_MPPC_BIG;
+		if (mppc_decompress(data, clen, l2_flags, &data, &clen) == -1)
+			return -1;
+	}
+
+	if (g_mppc_dict.l1_hist == NULL)
+	{
+		g_mppc_dict.l1_hist = (uint8 *) xmalloc(RDP61_HIST_SIZE);
+		g_mppc_dict.l1_off = 0;
+	}
+	hist = g_mppc_dict.l1_hist;
+
+	if ((l1_flags & RDP61_L1_PACKET_AT_FRONT) != 0)
+		g_mppc_dict.l1_off = 0;
+
+	hoff = start = g_mppc_dict.l1_off;
+	literals = data;
+	end = data + clen;
+
+	if ((l1_flags & RDP61_L1_NO_COMPRESSION) == 0)
+	{
+		if ((l1_flags & RDP61_L1_COMPRESSED) == 0 || clen < 2)
+			return -1;
+
+		/* match count, then length, output offset and history
+		   offset of each match, then the literals in between */
+		count = data[0] | (data[1] << 8);
+		match = data + 2;
+		literals = match + 8 * count;
+		if (literals > end)
+			return -1;
+
+		for (out = 0; count > 0; count--, match += 8)
 		{
-			if (i >= clen)
+			match_len = match[0] | (match[1] << 8);
+			match_out = match[2] | (match[3] << 8);
+			match_off = match[4] | (match[5] << 8) | (match[6] << 16)
+				| ((uint32) match[7] << 24);
+
+			if (match_out < out)
 				return -1;
-			walker = data[i++] << 24;
-			walker_len = 8;
+			n = match_out - out;
+			if (n > (uint32) (end - literals) || hoff + n + match_len > RDP61_HIST_SIZE
+			    || match_off + match_len > RDP61_HIST_SIZE)
+				return -1;
+
+			memcpy(hist + hoff, literals, n);
+			literals += n;
+			hoff += n;
+
+			mppc_copy_match(hist, hoff, match_off, match_len);
+			hoff += match_len;
+			out = match_out + match_len;
 		}
+	}
 
-		/* decode length of match */
-		match_len = 0;
-		if (walker >= 0)
-		{		/* special case - length of 3 is in bit 0 */
-			match_len = 3;
-			walker <<= 1;
-			walker_len--;
+	n = end - literals;
+	if (hoff + n > RDP61_HIST_SIZE)
+		return -1;
+	memcpy(hist + hoff, literals, n);
+	hoff += n;
+
+	g_mppc_dict.l1_off = hoff;
+
+	*rdata = hist + start;
+	*rlen = hoff - start;
+
+	return 0;
+}
+
+/* Decompress data from the server with the bulk compressor named in
+   ctype, the result is valid until the next call */
+int
+mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint8 ** rdata, uint32 * rlen)
+{
+	if (leading_ones[0xff] == 0)
+		mppc_init_tables();
+
+	mppc_capture(data, clen, ctype);
+
+	switch (ctype & RDP_MPPC_TYPE_MASK)
+	{
+		case RDP_MPPC_TYPE_RDP6:
+			return ncrush_decompress(data, clen, ctype, rdata, rlen);
+
+		case RDP_MPPC_TYPE_RDP61:
+			return xcrush_decompress(data, clen, ctype, rdata, rlen);
+
+		default:
+			return mppc_decompress(data, clen, ctype, rdata, rlen);
+	}
+}
+
+/* Forget the history of the connection and free the RDP 6.1 one */
+void
+mppc_reset_state(void)
+{
+	xfree(g_mppc_dict.l1_hist);
+	g_mppc_dict.l1_hist = NULL;
+	g_mppc_dict.l1_off = 0;
+	g_mppc_dict.roff = 0;
+	memset(g_mppc_dict.offset_cache, 0, sizeof(g_mppc_dict.offset_cache));
+}
+
+/* mppc compression, 8K history only */
+
+struct bitwriter
+{
+	uint8 *p, *end;
+	uint32 bits;
+	int nbits;
+	RD_BOOL overflow;
+};
+
+static void
+put_bits(struct bitwriter *bw, uint32 value, int n)
+{
+	bw->bits |= value << (32 - bw->nbits - n);
+	bw->nbits += n;
+	while (bw->nbits >= 8)
+	{
+		if (bw->p >= bw->end)
+		{
+			bw->overflow = True;
+			bw->nbits = 0;
+			bw->bits = 0;
+			return;
 		}
-		else
+		*bw->p++ = bw->bits >> 24;
+		bw->bits <<= 8;
+		bw->nbits -= 8;
+	}
+}
+
+#define HASH3(p) ((((p)[0] << 4) ^ ((p)[1] << 2) ^ (p)[2] ^ ((p)[0] >> 4)) & 4095)
+
+void
+mppc_enc_reset(RDPCOMP_ENC * enc)
+{
+	enc->hoff = 0;
+	memset(enc->hash, 0xff, sizeof(enc->hash));
+}
+
+/* Compress data into enc->out, returns the compression flags. Without
+   RDP_MPPC_COMPRESSED in them the data has to be sent as it was. */
+uint8
+mppc_compress(RDPCOMP_ENC * enc, uint8 * data, uint32 len, uint32 * clen)
+{
+	struct bitwriter bw;
+	uint8 flags = RDP_MPPC_COMPRESSED;
+	uint8 *hist = enc->hist;
+	int pos, end, cand, match_len, max_len, off, nbits, h;
+
+	*clen = 0;
+	if (len == 0 || len > RDP_MPPC_8K_HIST_SIZE)
+		return 0;
+
+	/* start over at the front of the history when the data does not fit */
+	if (enc->hoff + len > RDP_MPPC_8K_HIST_SIZE)
+		mppc_enc_reset(enc);
+
+	/* the receiver may still have history from before a reset */
+	if (enc->hoff == 0)
+		flags |= RDP_MPPC_RESET | RDP_MPPC_FLUSH;
+
+	pos = enc->hoff;
+	end = pos + len;
+	memcpy(hist + pos, data, len);
+
+	bw.p = enc->out;
+	bw.end = enc->out + len;
+	bw.bits = 0;
+	bw.nbits = 0;
+	bw.overflow = False;
+
+	while (pos < end && !bw.overflow)
+	{
+		match_len = 0;
+		if (end - pos >= 3)
 		{
-			/* this is how it works len of:
-			   4-7: 10 followed by 2 bits of the value
-			   8-15: 110 followed by 3 bits of the value
-			   16-31: 1110 followed by 4 bits of the value
-			   32-63: .... and so forth
-			   64-127:
-			   128-255:
-			   256-511:
-			   512-1023:
-			   1024-2047:
-			   2048-4095:
-			   4096-8191:
-
-			   i.e. 4097 is encoded as: 111111111110 000000000001
-			   meaning 4096 + 1...
-			 */
-			match_bits = big ? 14 : 11;	/* 11 or 14 bits of value at most */
-			do
+			h = HASH3(hist + pos);
+			cand = enc->hash[h];
+			enc->hash[h] = pos;
+			if (cand >= 0 && hist[cand] == hist[pos] && hist[cand + 1] == hist[pos + 1]
+			    && hist[cand + 2] == hist[pos + 2])
 			{
-				walker <<= 1;
-				if (--walker_len == 0)
-				{
-					if (i >= clen)
-						return -1;
-					walker = data[i++] << 24;
-					walker_len = 8;
-				}
-				if (walker >= 0)
-					break;
-				if (--match_bits == 0)
-				{
-					return -1;
-				}
-			}
-			while (1);
-			match_len = (big ? 16 : 13) - match_bits;
-			walker <<= 1;
-			if (--walker_len < match_len)
-			{
-				for (; walker_len < match_len; walker_len += 8)
-				{
-					if (i >= clen)
-					{
-						return -1;
-					}
-					walker |= (data[i++] & 0xff) << (24 - walker_len);
-				}
+				max_len = MIN(end - pos, RDP_MPPC_8K_HIST_SIZE - 1);
+				for (match_len = 3;
+				     match_len < max_len && hist[cand + match_len] == hist[pos + match_len];
+				     match_len++);
 			}
+		}
 
-			match_bits = match_len;
-			match_len = (walker >> (32 - match_bits));
-			match_len &= ((1 << match_bits) - 1);
-			match_len |= (1 << match_bits);
-			walker <<= match_bits;
-			walker_len -= match_bits;
+		if (match_len == 0)
+		{
+			if (hist[pos] < 0x80)
+				put_bits(&bw, hist[pos], 8);
+			else
+				put_bits(&bw, 0x100 | (hist[pos] & 0x7f), 9);
+			pos++;
+			continue;
 		}
-		if (next_offset + match_len >= RDP_MPPC_DICT_SIZE)
+
+		/* copy offset */
+		off = pos - cand;
+		if (off < 64)
+			put_bits(&bw, 0x3c0 | off, 10);
+		else if (off < 320)
+			put_bits(&bw, 0xe00 | (off - 64), 12);
+		else
+			put_bits(&bw, 0xc000 | (off - 320), 16);
+
+		/* length of match */
+		if (match_len == 3)
 		{
-			return -1;
+			put_bits(&bw, 0, 1);
 		}
-		/* memory areas can overlap - meaning we can't use memXXX functions */
-		k = (next_offset - match_off) & (big ? 65535 : 8191);
-		do
+		else
 		{
-			dict[next_offset++] = dict[k++];
+			for (nbits = 1; (match_len >> (nbits + 1)) != 0; nbits++);
+			put_bits(&bw, ((1 << (nbits - 1)) - 1) << 1, nbits);
+			put_bits(&bw, match_len & ((1 << nbits) - 1), nbits);
 		}
-		while (--match_len != 0);
+
+		for (h = 1; h < match_len && pos + h + 2 < end; h++)
+			enc->hash[HASH3(hist + pos + h)] = pos + h;
+		pos += match_len;
 	}
-	while (1);
 
-	/* store history offset */
-	g_mppc_dict.roff = next_offset;
+	/* pad to a byte with zero bits */
+	if (bw.nbits > 0)
+		put_bits(&bw, 0, 8 - bw.nbits);
 
-	*roff = old_offset;
-	*rlen = next_offset - old_offset;
+	if (bw.overflow)
+	{
+		/* did not compress, the receiver drops its history */
+		mppc_enc_reset(enc);
+		return RDP_MPPC_FLUSH;
+	}
 
-	return 0;
+	enc->hoff = end;
+	*clen = bw.p - enc->out;
+	return flags;
 }
@@ -0,0 +1,170 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   NSCodec decoder [MS-RDPNSC]
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+
+#define ROUND_UP(v, n)	(((v) + (n) - 1) & ~((n) - 1))
+
+/* Decode one RLE compressed plane, 3.1.9.1.1. The last four bytes are
+   always stored raw. */
+static RD_BOOL
+nsc_rle_decode(uint8 * in, uint32 insize, uint8 * out, uint32 outsize)
+{
+	uint8 *end = in + insize;
+	uint32 left = outsize, len;
+	uint8 value;
+
+	while (left > 4)
+	{
+		if (end - in < 2)
+			return False;
+
+		value = *in++;
+		if (left == 5 || value != *in)
+		{
+			*out++ = value;
+			left--;
+			continue;
+		}
+
+		/* a repeated byte starts a run */
+		in++;
+		if (end - in < 1)
+			return False;
+		if (*in < 0xff)
+		{
+			len = *in++ + 2;
+		}
+		else
+		{
+			if (end - in < 5)
+				return False;
+			in++;
+			len = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32) in[3] << 24);
+			in += 4;
+		}
+
+		if (len > left)
+			return False;
+		memset(out, value, len);
+		out += len;
+		left -= len;
+	}
+
+	if (end - in < 4)
+		return False;
+	memcpy(out, in, 4);
+	return True;
+}
+
+/* Decode a TS_NSCODEC_BITMAP_STREAM to width x height top-down BGRA */
+RD_BOOL
+nsc_decode(uint8 * output, int width, int height, uint8 * data, uint32 length)
+{
+	uint32 plane_size[4], orig_size[4], total;
+	uint8 *planes[4], *p, *yp, *cop, *cgp, *ap, *out;
+	uint8 loss, subsampling;
+	int i, x, y, rw, shift, yv, co, cg;
+	RD_BOOL ok = True;
+
+	if (length < 20)
+		return False;
+
+	total = 20;
+	for (i = 0; i < 4; i++)
+	{
+		plane_size[i] = data[4 * i] | (data[4 * i + 1] << 8) | (data[4 * i + 2] << 16) |
+			((uint32) data[4 * i + 3] << 24);
+		if (plane_size[i] > length - total)
+			return False;
+		total += plane_size[i];
+	}
+	loss = data[16];
+	subsampling = data[17];
+	if (loss < 1 || loss > 7)
+		return False;
+
+	/* chroma planes are at quarter resolution when subsampled */
+	rw = ROUND_UP(width, 8);
+	for (i = 0; i < 4; i++)
+		orig_size[i] = width * height;
+	if (subsampling)
+	{
+		orig_size[0] = rw * height;
+		orig_size[1] = orig_size[2] = (rw / 2) * (ROUND_UP(height, 2) / 2);
+	}
+
+	p = data + 20;
+	for (i = 0; i < 4 && ok; i++)
+	{
+		planes[i] = xmalloc(orig_size[i]);
+		if (plane_size[i] == 0)
+			memset(planes[i], 0xff, orig_size[i]);
+		else if (plane_size[i] < orig_size[i])
+			ok = nsc_rle_decode(p, plane_size[i], planes[i], orig_size[i]);
+		else
+			memcpy(planes[i], p, orig_size[i]);
+		p += plane_size[i];
+	}
+
+	if (!ok)
+	{
+		while (i-- > 0)
+			xfree(planes[i]);
+		return False;
+	}
+
+	/* YCoCg to RGB, the chroma planes were shifted by the colour loss
+	   level to drop their low bits */
+	shift = loss - 1;
+	out = output;
+	for (y = 0; y < height; y++)
+	{
+		if (subsampling)
+		{
+			yp = planes[0] + y * rw;
+			cop = planes[1] + (y >> 1) * (rw >> 1);
+			cgp = planes[2] + (y >> 1) * (rw >> 1);
+		}
+		else
+		{
+			yp = planes[0] + y * width;
+			cop = planes[1] + y * width;
+			cgp = planes[2] + y * width;
+		}
+		ap = planes[3] + y * width;
+
+		for (x = 0; x < width; x++)
+		{
+			i = subsampling ? x >> 1 : x;
+			yv = yp[x];
+			co = (sint8) (cop[i] << shift);
+			cg = (sint8) (cgp[i] << shift);
+
+			out[0] = MIN(MAX(yv - co - cg, 0), 255);
+			out[1] = MIN(MAX(yv + cg, 0), 255);
+			out[2] = MIN(MAX(yv + co - cg, 0), 255);
+			out[3] = ap[x];
+			out += 4;
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		xfree(planes[i]);
+	return True;
+}
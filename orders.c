@@ -404,6 +404,17 @@ process_desksave(STREAM s, DESKSAVE_ORDER * os, uint32 present, RD_BOOL delta)
 		ui_desktop_restore(os->offset, os->left, os->top, width, height);
 }
 
+/* Get the source of a memory or 3-way blt, which is an offscreen bitmap
+   for the offscreen cache id */
+static RD_HBITMAP
+get_source_bitmap(uint8 cache_id, uint16 cache_idx)
+{
+	if (cache_id == OFFSCREEN_CACHE_ID)
+		return cache_get_offscreen_bitmap(cache_idx, NULL, NULL);
+
+	return cache_get_bitmap(cache_id, cache_idx);
+}
+
 /* Process a memory blt order */
 static void
 process_memblt(STREAM s, MEMBLT_ORDER * os, uint32 present, RD_BOOL delta)
@@ -444,7 +455,7 @@ process_memblt(STREAM s, MEMBLT_ORDER * os, uint32 present, RD_BOOL delta)
 	       "process_memblt(), op=0x%x, x=%d, y=%d, cx=%d, cy=%d, id=%d, idx=%d", os->opcode,
 	       os->x, os->y, os->cx, os->cy, os->cache_id, os->cache_idx);
 
-	bitmap = cache_get_bitmap(os->cache_id, os->cache_idx);
+	bitmap = get_source_bitmap(os->cache_id, os->cache_idx);
 	if (bitmap == NULL)
 		return;
 
@@ -504,7 +515,7 @@ process_triblt(STREAM s, TRIBLT_ORDER * os, uint32 present, RD_BOOL delta)
 	       os->opcode, os->x, os->y, os->cx, os->cy, os->cache_id, os->cache_idx,
 	       os->brush.style, os->bgcolour, os->fgcolour);
 
-	bitmap = cache_get_bitmap(os->cache_id, os->cache_idx);
+	bitmap = get_source_bitmap(os->cache_id, os->cache_idx);
 	if (bitmap == NULL)
 		return;
 
@@ -514,6 +525,273 @@ process_triblt(STREAM s, TRIBLT_ORDER * os, uint32 present, RD_BOOL delta)
 		  bitmap, os->srcx, os->srcy, &brush, os->bgcolour, os->fgcolour);
 }
 
+/* Read one delta of a delta rectangle list, without running past size */
+static RD_BOOL
+parse_rect_delta(uint8 * buffer, int size, int *offset, sint16 * value)
+{
+	if (*offset >= size || ((buffer[*offset] & 0x80) && *offset + 1 >= size))
+		return False;
+
+	*value = parse_delta(buffer, offset);
+	return True;
+}
+
+/* Parse the delta rectangle list of a multi order. Left and top are
+   relative to the previous rectangle, a zero width or height repeats
+   the previous one. */
+static RD_BOOL
+parse_delta_rects(uint8 * buffer, int size, int count, RD_RECT * rects)
+{
+	int i, data;
+	uint8 flags = 0;
+
+	if (count > MAX_DELTA_RECTS)
+		return False;
+
+	data = (count + 1) / 2;
+	if (data > size)
+		return False;
+
+	memset(rects, 0, count * sizeof(RD_RECT));
+	for (i = 0; i < count; i++)
+	{
+		if (i % 2 == 0)
+			flags = buffer[i / 2];
+
+		if (i > 0)
+			rects[i] = rects[i - 1];
+
+		if (flags & 0x80)
+			rects[i].x = 0;
+		else if (!parse_rect_delta(buffer, size, &data, &rects[i].x))
+			return False;
+
+		if (flags & 0x40)
+			rects[i].y = 0;
+		else if (!parse_rect_delta(buffer, size, &data, &rects[i].y))
+			return False;
+
+		if ((~flags & 0x20) && !parse_rect_delta(buffer, size, &data, &rects[i].cx))
+			return False;
+
+		if ((~flags & 0x10) && !parse_rect_delta(buffer, size, &data, &rects[i].cy))
+			return False;
+
+		if (i > 0)
+		{
+			rects[i].x += rects[i - 1].x;
+			rects[i].y += rects[i - 1].y;
+		}
+
+		flags <<= 4;
+	}
+
+	return True;
+}
+
+/* Read the rectangle count and delta list fields of a multi order */
+static void
+rdp_in_delta_rects(STREAM s, uint8 * nrects, uint16 * datasize, uint8 * data,
+		   uint32 present, uint32 nrects_bit)
+{
+	if (present & nrects_bit)
+		in_uint8(s, *nrects);
+
+	if (present & (nrects_bit << 1))
+	{
+		in_uint16_le(s, *datasize);
+		if (*datasize > MAX_DELTA_DATA)
+		{
+			/* skip it, parse_delta_rects then fails on the size */
+			in_uint8s(s, *datasize);
+			*datasize = 0;
+			return;
+		}
+		in_uint8a(s, data, *datasize);
+	}
+}
+
+/* Process a multi destination blt order */
+static void
+process_multi_destblt(STREAM s, MULTI_DESTBLT_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	RD_RECT rects[MAX_DELTA_RECTS];
+
+	if (present & 0x01)
+		rdp_in_coord(s, &os->x, delta);
+
+	if (present & 0x02)
+		rdp_in_coord(s, &os->y, delta);
+
+	if (present & 0x04)
+		rdp_in_coord(s, &os->cx, delta);
+
+	if (present & 0x08)
+		rdp_in_coord(s, &os->cy, delta);
+
+	if (present & 0x10)
+		in_uint8(s, os->opcode);
+
+	rdp_in_delta_rects(s, &os->nrects, &os->datasize, os->data, present, 0x20);
+
+	logger(Graphics, Debug, "process_multi_destblt(), op=0x%x, x=%d, y=%d, cx=%d, cy=%d, n=%d",
+	       os->opcode, os->x, os->y, os->cx, os->cy, os->nrects);
+
+	if (!parse_delta_rects(os->data, os->datasize, os->nrects, rects))
+	{
+		logger(Graphics, Error, "process_multi_destblt(), parse error");
+		return;
+	}
+
+	ui_multi_destblt(ROP2_S(os->opcode), rects, os->nrects);
+}
+
+/* Process a multi pattern blt order */
+static void
+process_multi_patblt(STREAM s, MULTI_PATBLT_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	RD_RECT rects[MAX_DELTA_RECTS];
+	BRUSH brush;
+
+	if (present & 0x0001)
+		rdp_in_coord(s, &os->x, delta);
+
+	if (present & 0x0002)
+		rdp_in_coord(s, &os->y, delta);
+
+	if (present & 0x0004)
+		rdp_in_coord(s, &os->cx, delta);
+
+	if (present & 0x0008)
+		rdp_in_coord(s, &os->cy, delta);
+
+	if (present & 0x0010)
+		in_uint8(s, os->opcode);
+
+	if (present & 0x0020)
+		rdp_in_colour(s, &os->bgcolour);
+
+	if (present & 0x0040)
+		rdp_in_colour(s, &os->fgcolour);
+
+	rdp_parse_brush(s, &os->brush, present >> 7);
+
+	rdp_in_delta_rects(s, &os->nrects, &os->datasize, os->data, present, 0x1000);
+
+	logger(Graphics, Debug,
+	       "process_multi_patblt(), op=0x%x, x=%d, y=%d, cx=%d, cy=%d, bs=%d, bg=0x%x, fg=0x%x, n=%d",
+	       os->opcode, os->x, os->y, os->cx, os->cy, os->brush.style, os->bgcolour,
+	       os->fgcolour, os->nrects);
+
+	if (!parse_delta_rects(os->data, os->datasize, os->nrects, rects))
+	{
+		logger(Graphics, Error, "process_multi_patblt(), parse error");
+		return;
+	}
+
+	setup_brush(&brush, &os->brush);
+
+	ui_multi_patblt(ROP2_P(os->opcode), rects, os->nrects, &brush, os->bgcolour,
+			os->fgcolour);
+}
+
+/* Process a multi screen blt order */
+static void
+process_multi_screenblt(STREAM s, MULTI_SCREENBLT_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	RD_RECT rects[MAX_DELTA_RECTS];
+	int i;
+
+	if (present & 0x0001)
+		rdp_in_coord(s, &os->x, delta);
+
+	if (present & 0x0002)
+		rdp_in_coord(s, &os->y, delta);
+
+	if (present & 0x0004)
+		rdp_in_coord(s, &os->cx, delta);
+
+	if (present & 0x0008)
+		rdp_in_coord(s, &os->cy, delta);
+
+	if (present & 0x0010)
+		in_uint8(s, os->opcode);
+
+	if (present & 0x0020)
+		rdp_in_coord(s, &os->srcx, delta);
+
+	if (present & 0x0040)
+		rdp_in_coord(s, &os->srcy, delta);
+
+	rdp_in_delta_rects(s, &os->nrects, &os->datasize, os->data, present, 0x0080);
+
+	logger(Graphics, Debug,
+	       "process_multi_screenblt(), op=0x%x, x=%d, y=%d, cx=%d, cy=%d, srcx=%d, srcy=%d, n=%d",
+	       os->opcode, os->x, os->y, os->cx, os->cy, os->srcx, os->srcy, os->nrects);
+
+	if (!parse_delta_rects(os->data, os->datasize, os->nrects, rects))
+	{
+		logger(Graphics, Error, "process_multi_screenblt(), parse error");
+		return;
+	}
+
+	/* copies may overlap each other, so they stay in order */
+	for (i = 0; i < os->nrects; i++)
+		ui_screenblt(ROP2_S(os->opcode), rects[i].x, rects[i].y, rects[i].cx, rects[i].cy,
+			     os->srcx + rects[i].x - os->x, os->srcy + rects[i].y - os->y);
+}
+
+/* Process a multi opaque rectangle order */
+static void
+process_multi_rect(STREAM s, MULTI_RECT_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	RD_RECT rects[MAX_DELTA_RECTS];
+	uint32 i;
+
+	if (present & 0x01)
+		rdp_in_coord(s, &os->x, delta);
+
+	if (present & 0x02)
+		rdp_in_coord(s, &os->y, delta);
+
+	if (present & 0x04)
+		rdp_in_coord(s, &os->cx, delta);
+
+	if (present & 0x08)
+		rdp_in_coord(s, &os->cy, delta);
+
+	if (present & 0x10)
+	{
+		in_uint8(s, i);
+		os->colour = (os->colour & 0xffffff00) | i;
+	}
+
+	if (present & 0x20)
+	{
+		in_uint8(s, i);
+		os->colour = (os->colour & 0xffff00ff) | (i << 8);
+	}
+
+	if (present & 0x40)
+	{
+		in_uint8(s, i);
+		os->colour = (os->colour & 0xff00ffff) | (i << 16);
+	}
+
+	rdp_in_delta_rects(s, &os->nrects, &os->datasize, os->data, present, 0x80);
+
+	logger(Graphics, Debug, "process_multi_rect(), x=%d, y=%d, cx=%d, cy=%d, fg=0x%x, n=%d",
+	       os->x, os->y, os->cx, os->cy, os->colour, os->nrects);
+
+	if (!parse_delta_rects(os->data, os->datasize, os->nrects, rects))
+	{
+		logger(Graphics, Error, "process_multi_rect(), parse error");
+		return;
+	}
+
+	ui_multi_rect(rects, os->nrects, os->colour);
+}
+
 /* Process a polygon order */
 static void
 process_polygon(STREAM s, POLYGON_ORDER * os, uint32 present, RD_BOOL delta)
@@ -894,6 +1172,208 @@ process_text2(STREAM s, TEXT2_ORDER * os, uint32 present, RD_BOOL delta)
 		     &brush, os->bgcolour, os->fgcolour, os->text, os->length);
 }
 
+/* Read a two byte signed value of a glyph cache v2 order */
+static sint16
+rdp_in_2byte_signed(STREAM s)
+{
+	uint8 first, second;
+	sint16 value;
+
+	in_uint8(s, first);
+	value = first & 0x3f;
+	if (first & 0x80)
+	{
+		in_uint8(s, second);
+		value = (value << 8) | second;
+	}
+
+	return (first & 0x40) ? -value : value;
+}
+
+/* Read a two byte unsigned value of a glyph cache v2 order */
+static uint16
+rdp_in_2byte_unsigned(STREAM s)
+{
+	uint8 first, second;
+	uint16 value;
+
+	in_uint8(s, first);
+	value = first & 0x7f;
+	if (first & 0x80)
+	{
+		in_uint8(s, second);
+		value = (value << 8) | second;
+	}
+
+	return value;
+}
+
+/* Read a glyph of a glyph cache v2 or fast glyph order and cache it */
+static void
+rdp_in_glyph2(STREAM s, uint8 font, uint8 character)
+{
+	sint16 offset, baseline;
+	uint16 width, height;
+	uint8 *data;
+	int datasize;
+
+	offset = rdp_in_2byte_signed(s);
+	baseline = rdp_in_2byte_signed(s);
+	width = rdp_in_2byte_unsigned(s);
+	height = rdp_in_2byte_unsigned(s);
+
+	datasize = height * ((width + 7) / 8);
+	in_uint8p(s, data, datasize);
+	/* padding to four bytes, which a fast glyph may leave out */
+	in_uint8s(s, MIN((size_t) (-datasize & 3), s_remaining(s)));
+
+	cache_put_font(font, character, offset, baseline, width, height, data);
+}
+
+/* Read the fields shared by fast index and fast glyph orders */
+static void
+rdp_parse_fast_text(STREAM s, FAST_INDEX_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	if (present & 0x0001)
+		in_uint8(s, os->font);
+
+	if (present & 0x0002)
+	{
+		in_uint8(s, os->charinc);
+		in_uint8(s, os->flags);
+	}
+
+	if (present & 0x0004)
+		rdp_in_colour(s, &os->fgcolour);
+
+	if (present & 0x0008)
+		rdp_in_colour(s, &os->bgcolour);
+
+	if (present & 0x0010)
+		rdp_in_coord(s, &os->clipleft, delta);
+
+	if (present & 0x0020)
+		rdp_in_coord(s, &os->cliptop, delta);
+
+	if (present & 0x0040)
+		rdp_in_coord(s, &os->clipright, delta);
+
+	if (present & 0x0080)
+		rdp_in_coord(s, &os->clipbottom, delta);
+
+	if (present & 0x0100)
+		rdp_in_coord(s, &os->boxleft, delta);
+
+	if (present & 0x0200)
+		rdp_in_coord(s, &os->boxtop, delta);
+
+	if (present & 0x0400)
+		rdp_in_coord(s, &os->boxright, delta);
+
+	if (present & 0x0800)
+		rdp_in_coord(s, &os->boxbottom, delta);
+
+	if (present & 0x1000)
+		rdp_in_coord(s, &os->x, delta);
+
+	if (present & 0x2000)
+		rdp_in_coord(s, &os->y, delta);
+
+	if (present & 0x4000)
+	{
+		in_uint8(s, os->length);
+		in_uint8a(s, os->text, os->length);
+	}
+}
+
+/* Draw the text of a fast index or fast glyph order. Zero and
+   FAST_TEXT_DEFAULT values take the background rectangle. */
+static void
+draw_fast_text(FAST_INDEX_ORDER * os, uint8 * text, int length)
+{
+	BRUSH brush;
+	int left, top, right, bottom, x, y;
+	uint8 same;
+
+	left = os->boxleft;
+	top = os->boxtop;
+	right = os->boxright;
+	bottom = os->boxbottom;
+	if (bottom == FAST_TEXT_DEFAULT)
+	{
+		/* the top holds which sides are the same */
+		same = top & 0x0f;
+		if (same & 0x01)
+			bottom = os->clipbottom;
+		if (same & 0x02)
+			right = os->clipright;
+		if (same & 0x04)
+			top = os->cliptop;
+		if (same & 0x08)
+			left = os->clipleft;
+	}
+	if (left == 0)
+		left = os->clipleft;
+	if (right == 0)
+		right = os->clipright;
+	if (bottom <= top)
+		right = left;	/* no opaque rectangle */
+
+	x = (os->x == FAST_TEXT_DEFAULT) ? os->clipleft : os->x;
+	y = (os->y == FAST_TEXT_DEFAULT) ? os->cliptop : os->y;
+
+	memset(&brush, 0, sizeof(brush));
+	ui_draw_text(os->font, os->flags, ROP2_COPY, MIX_TRANSPARENT, x, y,
+		     os->clipleft, os->cliptop, os->clipright - os->clipleft,
+		     os->clipbottom - os->cliptop, left, top, right - left, bottom - top,
+		     &brush, os->bgcolour, os->fgcolour, text, length);
+}
+
+/* Process a fast index order */
+static void
+process_fast_index(STREAM s, FAST_INDEX_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	rdp_parse_fast_text(s, os, present, delta);
+
+	logger(Graphics, Debug,
+	       "process_fast_index(), x=%d, y=%d, font=%d, fl=0x%x, inc=%d, bg=0x%x, fg=0x%x, n=%d",
+	       os->x, os->y, os->font, os->flags, os->charinc, os->bgcolour, os->fgcolour,
+	       os->length);
+
+	draw_fast_text(os, os->text, os->length);
+}
+
+/* Process a fast glyph order, which may cache its glyph first */
+static void
+process_fast_glyph(STREAM s, FAST_INDEX_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	struct stream glyph;
+	uint8 text[2];
+
+	rdp_parse_fast_text(s, os, present, delta);
+
+	logger(Graphics, Debug,
+	       "process_fast_glyph(), x=%d, y=%d, font=%d, fl=0x%x, bg=0x%x, fg=0x%x, n=%d",
+	       os->x, os->y, os->font, os->flags, os->bgcolour, os->fgcolour, os->length);
+
+	if (os->length < 1)
+		return;
+
+	if ((present & 0x4000) && os->length > 1)
+	{
+		memset(&glyph, 0, sizeof(glyph));
+		glyph.data = glyph.p = os->text + 1;
+		glyph.end = glyph.p + os->length - 1;
+		glyph.size = os->length - 1;
+		rdp_in_glyph2(&glyph, os->font, os->text[0]);
+	}
+
+	/* a one glyph run, with a zero offset unless it is implicit */
+	text[0] = os->text[0];
+	text[1] = 0;
+	draw_fast_text(os, text, (os->flags & TEXT2_IMPLICIT_X) ? 1 : 2);
+}
+
 /* Process a raw bitmap cache order */
 static void
 process_raw_bmpcache(STREAM s)
@@ -925,7 +1405,7 @@ process_raw_bmpcache(STREAM s)
 
 	bitmap = ui_create_bitmap(width, height, inverted);
 	xfree(inverted);
-	cache_put_bitmap(cache_id, cache_idx, bitmap);
+	cache_put_bitmap(cache_id, cache_idx, bitmap, width, height);
 }
 
 /* Process a bitmap cache order */
@@ -976,7 +1456,7 @@ process_bmpcache(STREAM s)
 	if (bitmap_decompress(bmpdata, width, height, data, size, Bpp))
 	{
 		bitmap = ui_create_bitmap(width, height, bmpdata);
-		cache_put_bitmap(cache_id, cache_idx, bitmap);
+		cache_put_bitmap(cache_id, cache_idx, bitmap, width, height);
 	}
 	else
 	{
@@ -1055,7 +1535,7 @@ process_bmpcache2(STREAM s, uint16 flags, RD_BOOL compressed)
 
 	if (bitmap)
 	{
-		cache_put_bitmap(cache_id, cache_idx, bitmap);
+		cache_put_bitmap(cache_id, cache_idx, bitmap, width, height);
 		if (flags & PERSIST)
 			pstcache_save_bitmap(cache_id, cache_idx, bitmap_id, width, height,
 					     width * height * Bpp, bmpdata);
@@ -1106,7 +1586,6 @@ process_colcache(STREAM s)
 static void
 process_fontcache(STREAM s)
 {
-	RD_HGLYPH bitmap;
 	uint8 font, nglyphs;
 	uint16 character, offset, baseline, width, height;
 	int i, datasize;
@@ -1128,11 +1607,32 @@ process_fontcache(STREAM s)
 		datasize = (height * ((width + 7) / 8) + 3) & ~3;
 		in_uint8p(s, data, datasize);
 
-		bitmap = ui_create_glyph(width, height, data);
-		cache_put_font(font, character, offset, baseline, width, height, bitmap);
+		cache_put_font(font, character, offset, baseline, width, height, data);
 	}
 }
 
+/* Process a glyph cache v2 order */
+static void
+process_fontcache2(STREAM s, uint16 flags)
+{
+	uint8 font, nglyphs, character;
+	int i;
+
+	font = flags & 0x0f;
+	nglyphs = flags >> 8;
+
+	logger(Graphics, Debug, "process_fontcache2(), font=%d, n=%d", font, nglyphs);
+
+	for (i = 0; i < nglyphs; i++)
+	{
+		in_uint8(s, character);
+		rdp_in_glyph2(s, font, character);
+	}
+
+	/* the unicode characters that follow with GLYPH_UNICODE_PRESENT
+	   are not needed for drawing */
+}
+
 static void
 process_compressed_8x8_brush_data(uint8 * in, uint8 * out, int Bpp)
 {
@@ -1286,7 +1786,11 @@ process_secondary_order(STREAM s)
 			break;
 
 		case RDP_ORDER_FONTCACHE:
-			process_fontcache(s);
+			/* glyph cache v2 goes with GLYPH_SUPPORT_ENCODE */
+			if (g_rdp_version >= RDP_V5)
+				process_fontcache2(s, flags);
+			else
+				process_fontcache(s);
 			break;
 
 		case RDP_ORDER_RAW_BMPCACHE2:
@@ -1309,9 +1813,112 @@ process_secondary_order(STREAM s)
 	s_seek(s, next_order);
 }
 
-/* Process an order PDU */
-void
-process_orders(STREAM s, uint16 num_orders)
+/* Make the surface with the given id the target of drawing orders */
+static void
+select_surface(uint16 id)
+{
+	RD_HBITMAP bitmap = NULL;
+	int width = 0, height = 0;
+
+	if (id != SCREEN_BITMAP_SURFACE)
+	{
+		bitmap = cache_get_offscreen_bitmap(id, &width, &height);
+		if (bitmap == NULL)
+			logger(Graphics, Warning, "select_surface(), no offscreen bitmap %d", id);
+	}
+
+	ui_set_surface(bitmap, width, height);
+}
+
+/* Process a switch surface order */
+static void
+process_switch_surface(STREAM s)
+{
+	RDP_ORDER_STATE *os = &g_order_state;
+
+	in_uint16_le(s, os->surface);
+
+	logger(Graphics, Debug, "process_switch_surface(), id=%d", os->surface);
+
+	select_surface(os->surface);
+}
+
+/* Process a create offscreen bitmap order */
+static void
+process_create_offscreen_bitmap(STREAM s)
+{
+	RDP_ORDER_STATE *os = &g_order_state;
+	uint16 flags, id, cx, cy, count, idx, i;
+
+	in_uint16_le(s, flags);
+	in_uint16_le(s, cx);
+	in_uint16_le(s, cy);
+	id = flags & ~OFFSCREEN_DELETE_LIST;
+
+	logger(Graphics, Debug, "process_create_offscreen_bitmap(), id=%d, cx=%d, cy=%d", id, cx,
+	       cy);
+
+	/* bitmaps the server evicted to make room */
+	if (flags & OFFSCREEN_DELETE_LIST)
+	{
+		in_uint16_le(s, count);
+		for (i = 0; i < count; i++)
+		{
+			in_uint16_le(s, idx);
+			cache_put_offscreen_bitmap(idx, NULL, 0, 0);
+		}
+	}
+
+	if (cx == 0 || cy == 0)
+	{
+		logger(Graphics, Warning,
+		       "process_create_offscreen_bitmap(), empty bitmap %d ignored", id);
+		return;
+	}
+
+	cache_put_offscreen_bitmap(id, ui_create_surface(cx, cy), cx, cy);
+
+	/* the old pixmap of a replaced target surface is gone */
+	if (id == os->surface)
+		select_surface(id);
+}
+
+/* Process an alternate secondary order, returns False if the rest of
+   the PDU can not be parsed */
+static RD_BOOL
+process_altsec_order(STREAM s, uint8 type)
+{
+	uint32 action;
+
+	switch (type)
+	{
+		case RDP_ORDER_SWITCH_SURFACE:
+			process_switch_surface(s);
+			break;
+
+		case RDP_ORDER_CREATE_OFFSCR_BITMAP:
+			process_create_offscreen_bitmap(s);
+			break;
+
+		case RDP_ORDER_FRAME_MARKER:
+			in_uint32_le(s, action);
+			logger(Graphics, Debug, "process_altsec_order(), frame marker %u", action);
+			break;
+
+		default:
+			/* the length is implied by the type, so give up */
+			logger(Graphics, Warning,
+			       "process_altsec_order(), unhandled alternate secondary order %d",
+			       type);
+			return False;
+	}
+
+	return True;
+}
+
+/* Process the orders of an order PDU */
+static void
+process_order_list(STREAM s, uint16 num_orders)
 {
 	RDP_ORDER_STATE *os = &g_order_state;
 	uint32 present;
@@ -1323,6 +1930,15 @@ process_orders(STREAM s, uint16 num_orders)
 	{
 		in_uint8(s, order_flags);
 
+		if ((order_flags & RDP_ORDER_CLASS_MASK) == RDP_ORDER_SECONDARY)
+		{
+			if (!process_altsec_order(s, order_flags >> RDP_ORDER_TYPE_SHIFT))
+				break;
+
+			processed++;
+			continue;
+		}
+
 		if (!(order_flags & RDP_ORDER_STANDARD))
 		{
 			logger(Graphics, Error, "process_orders(), order parsing failed");
@@ -1350,8 +1966,13 @@ process_orders(STREAM s, uint16 num_orders)
 				case RDP_ORDER_PATBLT:
 				case RDP_ORDER_MEMBLT:
 				case RDP_ORDER_LINE:
+				case RDP_ORDER_MULTIPATBLT:
+				case RDP_ORDER_MULTISCRBLT:
+				case RDP_ORDER_MULTIRECT:
 				case RDP_ORDER_POLYGON2:
 				case RDP_ORDER_ELLIPSE2:
+				case RDP_ORDER_FAST_INDEX:
+				case RDP_ORDER_FAST_GLYPH:
 					size = 2;
 					break;
 
@@ -1409,6 +2030,23 @@ process_orders(STREAM s, uint16 num_orders)
 					process_triblt(s, &os->triblt, present, delta);
 					break;
 
+				case RDP_ORDER_MULTIDSTBLT:
+					process_multi_destblt(s, &os->multi_destblt, present, delta);
+					break;
+
+				case RDP_ORDER_MULTIPATBLT:
+					process_multi_patblt(s, &os->multi_patblt, present, delta);
+					break;
+
+				case RDP_ORDER_MULTISCRBLT:
+					process_multi_screenblt(s, &os->multi_screenblt, present,
+								delta);
+					break;
+
+				case RDP_ORDER_MULTIRECT:
+					process_multi_rect(s, &os->multi_rect, present, delta);
+					break;
+
 				case RDP_ORDER_POLYGON:
 					process_polygon(s, &os->polygon, present, delta);
 					break;
@@ -1433,6 +2071,14 @@ process_orders(STREAM s, uint16 num_orders)
 					process_text2(s, &os->text2, present, delta);
 					break;
 
+				case RDP_ORDER_FAST_INDEX:
+					process_fast_index(s, &os->fast_index, present, delta);
+					break;
+
+				case RDP_ORDER_FAST_GLYPH:
+					process_fast_glyph(s, &os->fast_glyph, present, delta);
+					break;
+
 				default:
 					logger(Graphics, Warning,
 					       "process_orders(), unhandled order type %d",
@@ -1455,10 +2101,25 @@ process_orders(STREAM s, uint16 num_orders)
 
 }
 
+/* Process an order PDU */
+void
+process_orders(STREAM s, uint16 num_orders)
+{
+	/* only drawing orders go to an offscreen surface, other updates
+	   always target the screen */
+	if (g_order_state.surface != SCREEN_BITMAP_SURFACE)
+		select_surface(g_order_state.surface);
+
+	process_order_list(s, num_orders);
+
+	ui_set_surface(NULL, 0, 0);
+}
+
 /* Reset order state */
 void
 reset_order_state(void)
 {
 	memset(&g_order_state, 0, sizeof(g_order_state));
 	g_order_state.order_type = RDP_ORDER_PATBLT;
+	g_order_state.surface = SCREEN_BITMAP_SURFACE;
 }
@@ -26,6 +26,10 @@
 #define RDP_ORDER_SMALL      0x40
 #define RDP_ORDER_TINY       0x80
 
+/* alternate secondary orders have the order type in the upper six bits */
+#define RDP_ORDER_CLASS_MASK 0x03
+#define RDP_ORDER_TYPE_SHIFT 2
+
 enum RDP_ORDER_TYPE
 {
 	RDP_ORDER_DESTBLT = 0,
@@ -36,9 +40,15 @@ enum RDP_ORDER_TYPE
 	RDP_ORDER_DESKSAVE = 11,
 	RDP_ORDER_MEMBLT = 13,
 	RDP_ORDER_TRIBLT = 14,
+	RDP_ORDER_MULTIDSTBLT = 15,
+	RDP_ORDER_MULTIPATBLT = 16,
+	RDP_ORDER_MULTISCRBLT = 17,
+	RDP_ORDER_MULTIRECT = 18,
+	RDP_ORDER_FAST_INDEX = 19,
 	RDP_ORDER_POLYGON = 20,
 	RDP_ORDER_POLYGON2 = 21,
 	RDP_ORDER_POLYLINE = 22,
+	RDP_ORDER_FAST_GLYPH = 24,
 	RDP_ORDER_ELLIPSE = 25,
 	RDP_ORDER_ELLIPSE2 = 26,
 	RDP_ORDER_TEXT2 = 27
@@ -55,6 +65,17 @@ enum RDP_SECONDARY_ORDER_TYPE
 	RDP_ORDER_BRUSHCACHE = 7
 };
 
+enum RDP_ALTSEC_ORDER_TYPE
+{
+	RDP_ORDER_SWITCH_SURFACE = 0,
+	RDP_ORDER_CREATE_OFFSCR_BITMAP = 1,
+	RDP_ORDER_FRAME_MARKER = 13
+};
+
+#define SCREEN_BITMAP_SURFACE	0xffff
+#define OFFSCREEN_DELETE_LIST	0x8000
+#define OFFSCREEN_CACHE_ID	0xff
+
 typedef struct _DESTBLT_ORDER
 {
 	sint16 x;
@@ -93,6 +114,70 @@ typedef struct _SCREENBLT_ORDER
 }
 SCREENBLT_ORDER;
 
+/* delta encoded rectangles of the multi orders */
+#define MAX_DELTA_DATA (((MAX_DELTA_RECTS + 1) / 2) + MAX_DELTA_RECTS * 8)
+
+typedef struct _MULTI_DESTBLT_ORDER
+{
+	sint16 x;
+	sint16 y;
+	sint16 cx;
+	sint16 cy;
+	uint8 opcode;
+	uint8 nrects;
+	uint16 datasize;
+	uint8 data[MAX_DELTA_DATA];
+
+}
+MULTI_DESTBLT_ORDER;
+
+typedef struct _MULTI_PATBLT_ORDER
+{
+	sint16 x;
+	sint16 y;
+	sint16 cx;
+	sint16 cy;
+	uint8 opcode;
+	uint32 bgcolour;
+	uint32 fgcolour;
+	BRUSH brush;
+	uint8 nrects;
+	uint16 datasize;
+	uint8 data[MAX_DELTA_DATA];
+
+}
+MULTI_PATBLT_ORDER;
+
+typedef struct _MULTI_SCREENBLT_ORDER
+{
+	sint16 x;
+	sint16 y;
+	sint16 cx;
+	sint16 cy;
+	uint8 opcode;
+	sint16 srcx;
+	sint16 srcy;
+	uint8 nrects;
+	uint16 datasize;
+	uint8 data[MAX_DELTA_DATA];
+
+}
+MULTI_SCREENBLT_ORDER;
+
+typedef struct _MULTI_RECT_ORDER
+{
+	sint16 x;
+	sint16 y;
+	sint16 cx;
+	sint16 cy;
+	uint32 colour;
+	uint8 nrects;
+	uint16 datasize;
+	uint8 data[MAX_DELTA_DATA];
+
+}
+MULTI_RECT_ORDER;
+
 typedef struct _LINE_ORDER
 {
 	uint16 mixmode;
@@ -266,10 +351,41 @@ typedef struct _TEXT2_ORDER
 }
 TEXT2_ORDER;
 
+/* fast index and fast glyph orders */
+typedef struct _FAST_INDEX_ORDER
+{
+	uint8 font;
+	uint8 charinc;
+	uint8 flags;
+	uint32 bgcolour;
+	uint32 fgcolour;
+	sint16 clipleft;
+	sint16 cliptop;
+	sint16 clipright;
+	sint16 clipbottom;
+	sint16 boxleft;
+	sint16 boxtop;
+	sint16 boxright;
+	sint16 boxbottom;
+	sint16 x;
+	sint16 y;
+	uint8 length;
+	uint8 text[MAX_TEXT];
+
+}
+FAST_INDEX_ORDER;
+
+/* a text position or opaque rectangle bottom of this value in fast
+   index and fast glyph orders refers to the background rectangle */
+#define FAST_TEXT_DEFAULT	-32768
+
+#define GLYPH_UNICODE_PRESENT	0x0010
+
 typedef struct _RDP_ORDER_STATE
 {
 	uint8 order_type;
 	BOUNDS bounds;
+	uint16 surface;		/* SCREEN_BITMAP_SURFACE or an offscreen bitmap */
 
 	DESTBLT_ORDER destblt;
 	PATBLT_ORDER patblt;
@@ -279,12 +395,18 @@ typedef struct _RDP_ORDER_STATE
 	DESKSAVE_ORDER desksave;
 	MEMBLT_ORDER memblt;
 	TRIBLT_ORDER triblt;
+	MULTI_DESTBLT_ORDER multi_destblt;
+	MULTI_PATBLT_ORDER multi_patblt;
+	MULTI_SCREENBLT_ORDER multi_screenblt;
+	MULTI_RECT_ORDER multi_rect;
 	POLYGON_ORDER polygon;
 	POLYGON2_ORDER polygon2;
 	POLYLINE_ORDER polyline;
 	ELLIPSE_ORDER ellipse;
 	ELLIPSE2_ORDER ellipse2;
 	TEXT2_ORDER text2;
+	FAST_INDEX_ORDER fast_index;
+	FAST_INDEX_ORDER fast_glyph;
 
 }
 RDP_ORDER_STATE;
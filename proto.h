@@ -32,16 +32,27 @@ extern "C" {
 #endif // __GNUC__
 /* bitmap.c */
 RD_BOOL bitmap_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp);
+RD_BOOL bitmap_decompress_rows(uint8 * output, int width, int height, uint8 * input, int size, int Bpp,
+			       bitmap_row_func row_func, uint8 * row_output, int row_Bpp);
+RD_BOOL bitmap_decompress_planar(uint8 * output, int width, int height, uint8 * input, int size);
+void bitmap_init_workers(int threads);
+void bitmap_run_jobs(bitmap_job_func func, void *jobs, int size, int count);
+void bitmap_decompress_batch(BITMAP_JOB * jobs, int count);
 /* cache.c */
 void cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count);
-void cache_bump_bitmap(uint8 id, uint16 idx, int bump);
+uint32 cache_get_bmpcache2_cells(void);
+void cache_bump_bitmap(uint8 id, uint16 idx);
 void cache_evict_bitmap(uint8 id);
 RD_HBITMAP cache_get_bitmap(uint8 id, uint16 idx);
-void cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap);
+RD_BOOL cache_has_bitmap(uint8 id, uint16 idx);
+void cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap, int width, int height);
+void cache_log_bitmap_stats(void);
 void cache_save_state(void);
+RD_HBITMAP cache_get_offscreen_bitmap(uint16 idx, int *width, int *height);
+void cache_put_offscreen_bitmap(uint16 idx, RD_HBITMAP bitmap, int width, int height);
 FONTGLYPH *cache_get_font(uint8 font, uint16 character);
-void cache_put_font(uint8 font, uint16 character, uint16 offset, uint16 baseline, uint16 width,
-		    uint16 height, RD_HGLYPH pixmap);
+void cache_put_font(uint8 font, uint16 character, sint16 offset, sint16 baseline, uint16 width,
+		    uint16 height, uint8 * data);
 DATABLOB *cache_get_text(uint8 cache_id);
 void cache_put_text(uint8 cache_id, void *data, int length);
 uint8 *cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel);
@@ -53,6 +64,7 @@ BRUSHDATA *cache_get_brush_data(uint8 colour_code, uint8 idx);
 void cache_put_brush_data(uint8 colour_code, uint8 idx, BRUSHDATA * brush_data);
 /* channels.c */
 VCHANNEL *channel_register(char *name, uint32 flags, void (*callback) (STREAM));
+void channel_enable_compression(RD_BOOL enable);
 STREAM channel_init(VCHANNEL * channel, uint32 length);
 void channel_send(STREAM s, VCHANNEL * channel);
 void channel_process(STREAM s, uint16 mcs_channel);
@@ -68,19 +80,22 @@ int ctrl_init(const char *user, const char *domain, const char *host);
 void ctrl_cleanup();
 RD_BOOL ctrl_is_slave();
 int ctrl_send_command(const char *cmd, const char *args);
-void ctrl_add_fds(int *n, fd_set * rfds);
-void ctrl_check_fds(fd_set * rfds, fd_set * wfds);
 
 /* disk.c */
 int disk_enum_devices(uint32 * id, char *optarg);
 RD_NTSTATUS disk_query_information(RD_NTHANDLE handle, uint32 info_class, STREAM out);
 RD_NTSTATUS disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM out);
-RD_NTSTATUS disk_check_notify(RD_NTHANDLE handle);
-RD_NTSTATUS disk_create_notify(RD_NTHANDLE handle, uint32 info_class);
+RD_NTSTATUS disk_check_notify(RD_NTHANDLE handle, STREAM out);
+RD_NTSTATUS disk_create_notify(RD_NTHANDLE handle, RD_BOOL watch_tree, uint32 info_class,
+			       STREAM out);
 RD_NTSTATUS disk_query_volume_information(RD_NTHANDLE handle, uint32 info_class, STREAM out);
 RD_NTSTATUS disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREAM out);
 /* mppc.c */
-int mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen);
+void mppc_set_capture(char *filename);
+int mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint8 ** rdata, uint32 * rlen);
+void mppc_reset_state(void);
+void mppc_enc_reset(RDPCOMP_ENC * enc);
+uint8 mppc_compress(RDPCOMP_ENC * enc, uint8 * data, uint32 len, uint32 * clen);
 /* ewmhints.c */
 int get_current_workarea(uint32 * x, uint32 * y, uint32 * width, uint32 * height);
 void ewmh_init(void);
@@ -122,7 +137,20 @@ RD_BOOL pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx);
 RD_BOOL pstcache_save_bitmap(uint8 cache_id, uint16 cache_idx, uint8 * key, uint8 width,
 			     uint8 height, uint16 length, uint8 * data);
 int pstcache_enumerate(uint8 id, HASH_KEY * keylist);
+void pstcache_flush(void);
 RD_BOOL pstcache_init(uint8 cache_id);
+/* nsc.c */
+RD_BOOL nsc_decode(uint8 * output, int width, int height, uint8 * data, uint32 length);
+/* reactor.c */
+RD_BOOL reactor_has(int fd);
+void reactor_add(int fd, int events, reactor_callback callback, void *data);
+void reactor_remove(int fd);
+void reactor_set_timer(reactor_timer_callback callback, void *data, uint32 ms);
+void reactor_cancel_timer(reactor_timer_callback callback, void *data);
+int reactor_wait(int ms);
+/* rfx.c */
+RD_BOOL rfx_process_message(uint8 * data, uint32 length, int left, int top, int width,
+			    int height);
 /* rdesktop.c */
 int main(int argc, char *argv[]);
 void generate_random(uint8 * random);
@@ -149,13 +177,18 @@ void rd_close_file(int fd);
 int rd_read_file(int fd, void *ptr, int len);
 int rd_write_file(int fd, void *ptr, int len);
 int rd_lseek_file(int fd, int offset);
+int rd_pread_file(int fd, void *ptr, int len, int offset);
 RD_BOOL rd_lock_file(int fd, int start, int len);
+void *rd_map_file(int fd, int len);
+void rd_sync_map(void *ptr, int len);
 /* rdp5.c */
 void process_ts_fp_updates(STREAM s);
 /* rdp.c */
 void rdp_in_unistr(STREAM s, int in_len, char **string, uint32 * str_size);
 void rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1,
 		    uint16 param2);
+void rdp_begin_input_batch(void);
+void rdp_end_input_batch(void);
 void rdp_send_suppress_output_pdu(enum RDP_SUPPRESS_STATUS allowupdates);
 void process_colour_pointer_pdu(STREAM s);
 void process_new_pointer_pdu(STREAM s);
@@ -164,6 +197,7 @@ void process_system_pointer_pdu(STREAM s);
 void set_system_pointer(uint32 ptr);
 void process_bitmap_updates(STREAM s);
 void process_palette(STREAM s);
+void process_surface_cmds(STREAM s);
 void rdp_main_loop(RD_BOOL * deactivated, uint32 * ext_disc_reason);
 RD_BOOL rdp_loop(RD_BOOL * deactivated, uint32 * ext_disc_reason);
 RD_BOOL rdp_connect(char *server, uint32 flags, char *domain, char *password, char *command,
@@ -179,17 +213,15 @@ void convert_to_unix_filename(char *filename);
 void rdpdr_send_completion(uint32 device, uint32 id, uint32 status, uint32 result, uint8 * buffer,
 			   uint32 length);
 RD_BOOL rdpdr_init();
-void rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL * timeout);
 struct async_iorequest *rdpdr_remove_iorequest(struct async_iorequest *prev,
 					       struct async_iorequest *iorq);
-void rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out);
+void rdpdr_check_events(void);
 RD_BOOL rdpdr_abort_io(uint32 fd, uint32 major, RD_NTSTATUS status);
 /* rdpsnd.c */
 void rdpsnd_record(const void *data, unsigned int size);
 RD_BOOL rdpsnd_init(char *optarg);
 void rdpsnd_show_help(void);
-void rdpsnd_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv);
-void rdpsnd_check_fds(fd_set * rfds, fd_set * wfds);
+void rdpsnd_watch_fd(int fd, int events, int playback_events);
 struct audio_packet *rdpsnd_queue_current_packet(void);
 RD_BOOL rdpsnd_queue_empty(void);
 void rdpsnd_queue_next(unsigned long completed_in_us);
@@ -207,6 +239,7 @@ void sec_decrypt(uint8 * data, int length);
 STREAM sec_init(uint32 flags, int maxlen);
 void sec_send_to_channel(STREAM s, uint32 flags, uint16 channel);
 void sec_send(STREAM s, uint32 flags);
+void sec_send_fastpath_input(int numevents, uint8 * data, int datalen);
 void sec_process_mcs_data(STREAM s);
 STREAM sec_recv(RD_BOOL * is_fastpath);
 RD_BOOL sec_connect(char *server, char *username, char *domain, char *password, RD_BOOL reconnect);
@@ -217,6 +250,13 @@ int serial_enum_devices(uint32 * id, char *optarg);
 RD_BOOL serial_get_event(RD_NTHANDLE handle, uint32 * result);
 RD_BOOL serial_get_timeout(RD_NTHANDLE handle, uint32 length, uint32 * timeout,
 			   uint32 * itv_timeout);
+/* stats.c */
+uint64 stats_now(void);
+void stats_init(void);
+void stats_add(STATS_COUNTER counter, uint32 n);
+void stats_record(STATS_TIMER timer, uint64 start);
+char *stats_json(void);
+void stats_dump_at_exit(const char *path);
 /* tcp.c */
 STREAM tcp_init(uint32 maxlen);
 void tcp_send(STREAM s);
@@ -277,10 +317,16 @@ void ui_update_window_sizehints(uint32 width, uint32 height);
 RD_BOOL ui_have_window(void);
 void xwin_toggle_fullscreen(void);
 void ui_select(int rdp_socket);
+void ui_poll(int rdp_socket);
 void ui_move_pointer(int x, int y);
 RD_HBITMAP ui_create_bitmap(int width, int height, uint8 * data);
 void ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * data);
+bitmap_row_func ui_bitmap_row_func(int *Bpp);
+uint8 *ui_image_buffer(size_t size);
+void ui_paint_image(int x, int y, int cx, int cy, int width, int height, uint8 * data);
 void ui_destroy_bitmap(RD_HBITMAP bmp);
+RD_HBITMAP ui_create_surface(int width, int height);
+void ui_set_surface(RD_HBITMAP surface, int width, int height);
 RD_HGLYPH ui_create_glyph(int width, int height, uint8 * data);
 void ui_destroy_glyph(RD_HGLYPH glyph);
 RD_HCURSOR ui_create_cursor(unsigned int x, unsigned int y, uint32 width, uint32 height,
@@ -296,14 +342,18 @@ void ui_set_clip(int x, int y, int cx, int cy);
 void ui_reset_clip(void);
 void ui_bell(void);
 void ui_destblt(uint8 opcode, int x, int y, int cx, int cy);
+void ui_multi_destblt(uint8 opcode, RD_RECT * rects, int count);
 void ui_patblt(uint8 opcode, int x, int y, int cx, int cy, BRUSH * brush, uint32 bgcolour,
 	       uint32 fgcolour);
+void ui_multi_patblt(uint8 opcode, RD_RECT * rects, int count, BRUSH * brush, uint32 bgcolour,
+		     uint32 fgcolour);
 void ui_screenblt(uint8 opcode, int x, int y, int cx, int cy, int srcx, int srcy);
 void ui_memblt(uint8 opcode, int x, int y, int cx, int cy, RD_HBITMAP src, int srcx, int srcy);
 void ui_triblt(uint8 opcode, int x, int y, int cx, int cy, RD_HBITMAP src, int srcx, int srcy,
 	       BRUSH * brush, uint32 bgcolour, uint32 fgcolour);
 void ui_line(uint8 opcode, int startx, int starty, int endx, int endy, PEN * pen);
 void ui_rect(int x, int y, int cx, int cy, uint32 colour);
+void ui_multi_rect(RD_RECT * rects, int count, uint32 colour);
 void ui_polygon(uint8 opcode, uint8 fillmode, RD_POINT * point, int npoints, BRUSH * brush,
 		uint32 bgcolour, uint32 fgcolour);
 void ui_polyline(uint8 opcode, RD_POINT * points, int npoints, PEN * pen);
@@ -343,10 +393,18 @@ RD_BOOL lspci_init(void);
 void rdpedisp_init(void);
 RD_BOOL rdpedisp_is_available();
 void rdpedisp_set_session_size(uint32 width, uint32 height);
+/* rdpgfx.c */
+void rdpgfx_init(void);
+/* zgfx.c */
+RD_BOOL zgfx_decompress(STREAM s, STREAM out);
+void zgfx_reset(void);
 /* dvc.c */
 typedef void (*dvc_channel_process_fn) (STREAM s);
+typedef void (*dvc_channel_open_fn) (void);
 RD_BOOL dvc_init(void);
 RD_BOOL dvc_channels_register(const char *name, dvc_channel_process_fn handler);
+RD_BOOL dvc_channels_register_with_open(const char *name, dvc_channel_process_fn handler,
+					dvc_channel_open_fn open_handler);
 RD_BOOL dvc_channels_is_available(const char *name);
 void dvc_send(const char *name, STREAM s);
 /* seamless.c */
@@ -356,7 +414,6 @@ unsigned int seamless_send_sync(void);
 unsigned int seamless_send_state(unsigned long id, unsigned int state, unsigned long flags);
 unsigned int seamless_send_position(unsigned long id, int x, int y, int width, int height,
 				    unsigned long flags);
-void seamless_select_timeout(struct timeval *tv);
 unsigned int seamless_send_zchange(unsigned long id, unsigned long below, unsigned long flags);
 unsigned int seamless_send_focus(unsigned long id, unsigned long flags);
 unsigned int seamless_send_destroy(unsigned long id);
@@ -17,12 +17,28 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "rdesktop.h"
 
 #define MAX_CELL_SIZE		0x1000	/* pixels */
 
+#define PSTCACHE_MAGIC		0x32435052	/* "RPC2" */
+#define PSTCACHE_VERSION	2
+
+/* The header and cell index are mapped, the payload follows page aligned */
+#define INDEX_SIZE		(sizeof(PSTCACHE_HEADER) + BMPCACHE2_NUM_PSTCELLS * sizeof(CELLHEADER))
+#define PAYLOAD_OFFSET		((INDEX_SIZE + 0xfff) & ~0xfff)
+#define CELL_OFFSET(idx)	(PAYLOAD_OFFSET + (idx) * g_pstcache_Bpp * MAX_CELL_SIZE)
+
 #define IS_PERSISTENT(id) (id < 8 && g_pstcache_fd[id] > 0)
 
+/* cells read ahead by the precache loader, and uploaded per main loop turn */
+#define PRECACHE_MAX_READY	128
+#define PRECACHE_BATCH		32
+
 extern int g_server_depth;
 extern RD_BOOL g_bitmap_cache;
 extern RD_BOOL g_bitmap_cache_persist_enable;
@@ -33,19 +49,62 @@ int g_pstcache_Bpp;
 RD_BOOL g_pstcache_enumerated = False;
 uint8 zero_key[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 
+static PSTCACHE_HEADER *g_pstcache_index[8];
+
+#define CELL(id, idx) (((CELLHEADER *) (g_pstcache_index[id] + 1)) + (idx))
+
+/* Background precache loader. The loader thread reads cells from disk,
+   the main loop creates the bitmaps as they become ready since the UI
+   may only be used from there. One byte is written to the pipe for
+   every cell that is ready, and one more when the loader is done. */
+typedef struct _PRECACHE_CELL
+{
+	uint16 idx;
+	uint8 width, height;
+	uint16 length;
+	uint8 *data;
+}
+PRECACHE_CELL;
 
-/* Update mru stamp/index for a bitmap */
+static struct
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	RD_BOOL running;
+	RD_BOOL stop;
+	RD_BOOL done;		/* loader has exited, finished or failed */
+	uint8 id;
+	int pipe[2];
+	PRECACHE_CELL *cells;
+	int count;		/* cells to load */
+	int loaded;		/* read by the loader */
+	int uploaded;		/* handed to the cache */
+	uint8 cancelled[BMPCACHE2_NUM_PSTCELLS];	/* overwritten since queued */
+} g_precache;
+
+/* FNV-1a over the cell index */
+static uint32
+pstcache_checksum(uint8 cache_id)
+{
+	uint8 *p = (uint8 *) CELL(cache_id, 0);
+	uint8 *end = p + BMPCACHE2_NUM_PSTCELLS * sizeof(CELLHEADER);
+	uint32 hash = 0x811c9dc5;
+
+	while (p < end)
+		hash = (hash ^ *p++) * 0x01000193;
+
+	return hash;
+}
+
+/* Update mru stamp/index for a bitmap, written back by pstcache_flush */
 void
 pstcache_touch_bitmap(uint8 cache_id, uint16 cache_idx, uint32 stamp)
 {
-	int fd;
-
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return;
 
-	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, 12 + cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_write_file(fd, &stamp, sizeof(stamp));
+	CELL(cache_id, cache_idx)->stamp = stamp;
 }
 
 /* Load a bitmap from the persistent cache */
@@ -54,7 +113,7 @@ pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx)
 {
 	uint8 *celldata;
 	int fd;
-	CELLHEADER cellhdr;
+	CELLHEADER *cellhdr;
 	RD_HBITMAP bitmap;
 
 	if (!g_bitmap_cache_persist_enable)
@@ -63,16 +122,25 @@ pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx)
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return False;
 
+	cellhdr = CELL(cache_id, cache_idx);
+	if (cellhdr->length == 0)
+		return False;
+
 	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_read_file(fd, &cellhdr, sizeof(CELLHEADER));
-	celldata = (uint8 *) xmalloc(cellhdr.length);
-	rd_read_file(fd, celldata, cellhdr.length);
+	celldata = (uint8 *) xmalloc(cellhdr->length);
+	rd_lseek_file(fd, CELL_OFFSET(cache_idx));
+	if (rd_read_file(fd, celldata, cellhdr->length) != cellhdr->length)
+	{
+		logger(Core, Warning, "pstcache_load_bitmap(), short read, id=%d, idx=%d",
+		       cache_id, cache_idx);
+		xfree(celldata);
+		return False;
+	}
 
-	bitmap = ui_create_bitmap(cellhdr.width, cellhdr.height, celldata);
+	bitmap = ui_create_bitmap(cellhdr->width, cellhdr->height, celldata);
 	logger(Core, Debug, "pstcache_load_bitmap(), load bitmap from disk: id=%d, idx=%d, bmp=%p)",
 	       cache_id, cache_idx, bitmap);
-	cache_put_bitmap(cache_id, cache_idx, bitmap);
+	cache_put_bitmap(cache_id, cache_idx, bitmap, cellhdr->width, cellhdr->height);
 
 	xfree(celldata);
 	return True;
@@ -84,34 +152,58 @@ pstcache_save_bitmap(uint8 cache_id, uint16 cache_idx, uint8 * key,
 		     uint8 width, uint8 height, uint16 length, uint8 * data)
 {
 	int fd;
-	CELLHEADER cellhdr;
+	CELLHEADER *cellhdr;
 
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return False;
 
-	memcpy(cellhdr.key, key, sizeof(HASH_KEY));
-	cellhdr.width = width;
-	cellhdr.height = height;
-	cellhdr.length = length;
-	cellhdr.stamp = 0;
+	/* invalidate the cell until its payload is in place */
+	if (g_precache.running && cache_id == g_precache.id)
+	{
+		pthread_mutex_lock(&g_precache.lock);
+		g_precache.cancelled[cache_idx] = True;
+		pthread_mutex_unlock(&g_precache.lock);
+	}
+	cellhdr = CELL(cache_id, cache_idx);
+	cellhdr->length = 0;
 
 	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_write_file(fd, &cellhdr, sizeof(CELLHEADER));
-	rd_write_file(fd, data, length);
+	rd_lseek_file(fd, CELL_OFFSET(cache_idx));
+	if (rd_write_file(fd, data, length) != length)
+		return False;
+
+	memcpy(cellhdr->key, key, sizeof(HASH_KEY));
+	cellhdr->width = width;
+	cellhdr->height = height;
+	cellhdr->length = length;
+	cellhdr->stamp = 0;
 
 	return True;
 }
 
-/* List the bitmap keys from the persistent cache file */
+static void pstcache_precache_start(uint8 id, uint32 mru[][2], int count);
+static void pstcache_precache_ready(int fd, int events, void *data);
+
+static int
+pstcache_stamp_cmp(const void *a, const void *b)
+{
+	const uint32 *x = a, *y = b;
+
+	/* stamp, then cell index */
+	if (x[0] != y[0])
+		return (x[0] < y[0]) ? -1 : 1;
+	return (x[1] < y[1]) ? -1 : (x[1] > y[1]);
+}
+
+/* List the bitmap keys from the persistent cache index */
 int
 pstcache_enumerate(uint8 id, HASH_KEY * keylist)
 {
-	int fd, n;
+	int n;
 	uint16 idx;
 	sint16 mru_idx[0xa00];
-	uint32 mru_stamp[0xa00];
-	CELLHEADER cellhdr;
+	uint32 mru[0xa00][2];
+	CELLHEADER *cellhdr;
 
 	if (!(g_bitmap_cache && g_bitmap_cache_persist_enable && IS_PERSISTENT(id)))
 		return 0;
@@ -123,40 +215,257 @@ pstcache_enumerate(uint8 id, HASH_KEY * keylist)
 	logger(Core, Debug, "pstcache_enumerate(), start enumeration");
 	for (idx = 0; idx < BMPCACHE2_NUM_PSTCELLS; idx++)
 	{
-		fd = g_pstcache_fd[id];
-		rd_lseek_file(fd, idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-		if (rd_read_file(fd, &cellhdr, sizeof(CELLHEADER)) <= 0)
+		cellhdr = CELL(id, idx);
+		if (memcmp(cellhdr->key, zero_key, sizeof(HASH_KEY)) == 0)
 			break;
 
-		if (memcmp(cellhdr.key, zero_key, sizeof(HASH_KEY)) != 0)
+		memcpy(keylist[idx], cellhdr->key, sizeof(HASH_KEY));
+		mru[idx][0] = cellhdr->stamp;
+		mru[idx][1] = idx;
+	}
+
+	logger(Core, Debug, "pstcache_enumerate(), %d cached bitmaps", idx);
+
+	qsort(mru, idx, sizeof(mru[0]), pstcache_stamp_cmp);
+
+	for (n = 0; n < idx; n++)
+		mru_idx[n] = mru[n][1];
+
+	cache_rebuild_bmpcache_linked_list(id, mru_idx, idx);
+	g_pstcache_enumerated = True;
+
+	/* Pre-cache, oldest first so the capacity keeps the most recent
+	   (not possible for 8-bit colour depth cause it needs a colourmap) */
+	if (g_bitmap_cache_precache && g_server_depth > 8)
+		pstcache_precache_start(id, mru, idx);
+
+	return idx;
+}
+
+/* Wake the main loop, called with the precache lock held */
+static RD_BOOL
+pstcache_precache_wakeup(void)
+{
+	ssize_t n;
+
+	do
+		n = write(g_precache.pipe[1], "", 1);
+	while (n == -1 && errno == EINTR);
+
+	return n == 1;
+}
+
+static void *
+pstcache_precache_thread(void *arg)
+{
+	PRECACHE_CELL *cell;
+	int fd = g_pstcache_fd[g_precache.id];
+	uint8 *data;
+	RD_BOOL cancelled;
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_precache.lock);
+	while (!g_precache.stop && g_precache.loaded < g_precache.count)
+	{
+		if (g_precache.loaded - g_precache.uploaded >= PRECACHE_MAX_READY)
 		{
-			memcpy(keylist[idx], cellhdr.key, sizeof(HASH_KEY));
+			pthread_cond_wait(&g_precache.cond, &g_precache.lock);
+			continue;
+		}
 
-			/* Pre-cache (not possible for 8-bit colour depth cause it needs a colourmap) */
-			if (g_bitmap_cache_precache && cellhdr.stamp && g_server_depth > 8)
-				pstcache_load_bitmap(id, idx);
+		cell = &g_precache.cells[g_precache.loaded];
+		cancelled = g_precache.cancelled[cell->idx];
+		pthread_mutex_unlock(&g_precache.lock);
 
-			/* Sort by stamp */
-			for (n = idx; n > 0 && cellhdr.stamp < mru_stamp[n - 1]; n--)
+		data = NULL;
+		if (!cancelled)
+		{
+			data = (uint8 *) xmalloc(cell->length);
+			if (rd_pread_file(fd, data, cell->length, CELL_OFFSET(cell->idx)) !=
+			    cell->length)
 			{
-				mru_idx[n] = mru_idx[n - 1];
-				mru_stamp[n] = mru_stamp[n - 1];
+				xfree(data);
+				data = NULL;
 			}
-
-			mru_idx[n] = idx;
-			mru_stamp[n] = cellhdr.stamp;
 		}
-		else
+
+		pthread_mutex_lock(&g_precache.lock);
+		cell->data = data;
+		g_precache.loaded++;
+		if (!pstcache_precache_wakeup())
 		{
+			logger(Core, Error, "pstcache_precache_thread(), write() failed: %s",
+			       strerror(errno));
 			break;
 		}
 	}
 
-	logger(Core, Debug, "pstcache_enumerate(), %d cached bitmaps", idx);
+	/* let the main loop finish with what has been loaded so far */
+	g_precache.done = True;
+	pstcache_precache_wakeup();
+	pthread_mutex_unlock(&g_precache.lock);
 
-	cache_rebuild_bmpcache_linked_list(id, mru_idx, idx);
-	g_pstcache_enumerated = True;
-	return idx;
+	return NULL;
+}
+
+/* Queue stamped cells, ordered by stamp, for loading in the background */
+static void
+pstcache_precache_start(uint8 id, uint32 mru[][2], int count)
+{
+	CELLHEADER *cellhdr;
+	int n;
+
+	g_precache.cells = (PRECACHE_CELL *) xmalloc(count * sizeof(PRECACHE_CELL));
+	g_precache.count = 0;
+	for (n = 0; n < count; n++)
+	{
+		cellhdr = CELL(id, mru[n][1]);
+		if (mru[n][0] == 0 || cellhdr->length == 0)
+			continue;
+
+		g_precache.cells[g_precache.count].idx = mru[n][1];
+		g_precache.cells[g_precache.count].width = cellhdr->width;
+		g_precache.cells[g_precache.count].height = cellhdr->height;
+		g_precache.cells[g_precache.count].length = cellhdr->length;
+		g_precache.cells[g_precache.count].data = NULL;
+		g_precache.count++;
+	}
+
+	if (g_precache.count == 0)
+	{
+		xfree(g_precache.cells);
+		return;
+	}
+
+	g_precache.id = id;
+	g_precache.loaded = g_precache.uploaded = 0;
+	g_precache.stop = g_precache.done = False;
+	memset(g_precache.cancelled, 0, sizeof(g_precache.cancelled));
+
+	if (pipe(g_precache.pipe) == -1)
+	{
+		logger(Core, Error, "pstcache_precache_start(), pipe() failed: %s",
+		       strerror(errno));
+		xfree(g_precache.cells);
+		return;
+	}
+	fcntl(g_precache.pipe[0], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_init(&g_precache.lock, NULL);
+	pthread_cond_init(&g_precache.cond, NULL);
+	if (pthread_create(&g_precache.thread, NULL, pstcache_precache_thread, NULL) != 0)
+	{
+		logger(Core, Error, "pstcache_precache_start(), failed to start loader thread");
+		pthread_cond_destroy(&g_precache.cond);
+		pthread_mutex_destroy(&g_precache.lock);
+		close(g_precache.pipe[0]);
+		close(g_precache.pipe[1]);
+		xfree(g_precache.cells);
+		return;
+	}
+
+	g_precache.running = True;
+	reactor_add(g_precache.pipe[0], REACTOR_READ, pstcache_precache_ready, NULL);
+	logger(Core, Debug, "pstcache_precache_start(), loading %d cells in background",
+	       g_precache.count);
+}
+
+/* Stop the loader and drop the cells not uploaded yet */
+static void
+pstcache_precache_stop(void)
+{
+	int n;
+
+	if (!g_precache.running)
+		return;
+
+	pthread_mutex_lock(&g_precache.lock);
+	g_precache.stop = True;
+	pthread_cond_signal(&g_precache.cond);
+	pthread_mutex_unlock(&g_precache.lock);
+	pthread_join(g_precache.thread, NULL);
+
+	for (n = g_precache.uploaded; n < g_precache.loaded; n++)
+		xfree(g_precache.cells[n].data);
+
+	logger(Core, Debug, "pstcache_precache_stop(), %d of %d cells precached",
+	       g_precache.uploaded, g_precache.count);
+
+	pthread_cond_destroy(&g_precache.cond);
+	pthread_mutex_destroy(&g_precache.lock);
+	reactor_remove(g_precache.pipe[0]);
+	close(g_precache.pipe[0]);
+	close(g_precache.pipe[1]);
+	xfree(g_precache.cells);
+	g_precache.running = False;
+}
+
+/* Create bitmaps for a batch of cells read by the loader */
+static void
+pstcache_precache_ready(int fd, int events, void *data)
+{
+	PRECACHE_CELL *cell;
+	uint8 buf[PRECACHE_BATCH];
+	RD_HBITMAP bitmap;
+	RD_BOOL done, cancelled;
+	int ready, i;
+	UNUSED(events);
+	UNUSED(data);
+
+	/* the pipe only wakes us up, the loader's counters say what is ready */
+	if (read(fd, buf, sizeof(buf)) == -1 && errno != EAGAIN && errno != EINTR)
+		logger(Core, Warning, "pstcache_precache_ready(), read() failed: %s",
+		       strerror(errno));
+
+	pthread_mutex_lock(&g_precache.lock);
+	ready = g_precache.loaded;
+	done = g_precache.done;
+	pthread_mutex_unlock(&g_precache.lock);
+
+	for (i = 0; g_precache.uploaded < ready && (done || i < PRECACHE_BATCH); i++)
+	{
+		cell = &g_precache.cells[g_precache.uploaded];
+
+		pthread_mutex_lock(&g_precache.lock);
+		cancelled = g_precache.cancelled[cell->idx];
+		pthread_mutex_unlock(&g_precache.lock);
+
+		/* skip cells the server has overwritten or that are already loaded */
+		if (cell->data != NULL && !cancelled
+		    && !cache_has_bitmap(g_precache.id, cell->idx))
+		{
+			bitmap = ui_create_bitmap(cell->width, cell->height, cell->data);
+			cache_put_bitmap(g_precache.id, cell->idx, bitmap, cell->width,
+					 cell->height);
+		}
+		xfree(cell->data);
+
+		pthread_mutex_lock(&g_precache.lock);
+		g_precache.uploaded++;
+		pthread_cond_signal(&g_precache.cond);
+		pthread_mutex_unlock(&g_precache.lock);
+	}
+
+	if (done && g_precache.uploaded == ready)
+		pstcache_precache_stop();
+}
+
+/* Write back stamps and cells saved since the last flush */
+void
+pstcache_flush(void)
+{
+	uint8 id;
+
+	pstcache_precache_stop();
+
+	for (id = 0; id < 8; id++)
+	{
+		if (!IS_PERSISTENT(id))
+			continue;
+
+		g_pstcache_index[id]->checksum = pstcache_checksum(id);
+		rd_sync_map(g_pstcache_index[id], INDEX_SIZE);
+	}
 }
 
 /* initialise the persistent bitmap cache */
@@ -165,6 +474,7 @@ pstcache_init(uint8 cache_id)
 {
 	int fd;
 	char filename[256];
+	PSTCACHE_HEADER *hdr;
 
 	if (g_pstcache_enumerated)
 		return True;
@@ -197,6 +507,35 @@ pstcache_init(uint8 cache_id)
 		return False;
 	}
 
+	hdr = rd_map_file(fd, INDEX_SIZE);
+	if (hdr == NULL)
+	{
+		logger(Core, Error,
+		       "pstcache_init(), failed to map persistent cache index, disabling feature");
+		rd_close_file(fd);
+		return False;
+	}
+
 	g_pstcache_fd[cache_id] = fd;
+	g_pstcache_index[cache_id] = hdr;
+
+	/* start over with an old format, foreign or not cleanly flushed cache */
+	if (hdr->magic != PSTCACHE_MAGIC || hdr->version != PSTCACHE_VERSION
+	    || hdr->cells != BMPCACHE2_NUM_PSTCELLS || hdr->Bpp != (uint32) g_pstcache_Bpp
+	    || hdr->checksum != pstcache_checksum(cache_id))
+	{
+		logger(Core, Notice, "pstcache_init(), discarding invalid persistent cache %s",
+		       filename);
+		memset(hdr, 0, INDEX_SIZE);
+		hdr->magic = PSTCACHE_MAGIC;
+		hdr->version = PSTCACHE_VERSION;
+		hdr->cells = BMPCACHE2_NUM_PSTCELLS;
+		hdr->Bpp = g_pstcache_Bpp;
+	}
+
+	/* the index is only trusted again after pstcache_flush */
+	hdr->checksum = ~pstcache_checksum(cache_id);
+	rd_sync_map(hdr, INDEX_SIZE);
+
 	return True;
 }
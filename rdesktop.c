@@ -26,6 +26,7 @@
 #include <pwd.h>		/* getpwuid */
 #include <termios.h>		/* tcgetattr tcsetattr */
 #include <sys/stat.h>		/* stat */
+#include <sys/mman.h>		/* mmap msync */
 #include <sys/time.h>		/* gettimeofday */
 #include <sys/times.h>		/* times */
 #include <ctype.h>		/* toupper */
@@ -90,9 +91,16 @@ int g_server_depth = -1;
 int g_win_button_size = 0;	/* If zero, disable single app mode */
 RD_BOOL g_network_error = False;
 RD_BOOL g_sendmotion = True;
+RD_BOOL g_compression = False;
 RD_BOOL g_bitmap_cache = True;
 RD_BOOL g_bitmap_cache_persist_enable = False;
 RD_BOOL g_bitmap_cache_precache = True;
+uint32 g_bitmap_cache_size = 0;	/* bytes, zero for default */
+int g_bitmap_decode_threads = 0;	/* bitmap update decoders, zero for none */
+uint32 g_offscreen_cache_size = OFFSCREEN_CACHE_MAX_SIZE;	/* kilobytes, zero to disable */
+int g_receive_queue_size = 0;	/* PDUs read ahead on a thread, zero for none */
+uint32 g_dir_batch_size = 2048;	/* bytes per directory query reply, zero for one entry */
+RD_BOOL g_gfx = False;		/* graphics pipeline, 32 bpp only */
 RD_BOOL g_use_ctrl = True;
 RD_BOOL g_encryption = True;
 RD_BOOL g_encryption_initial = True;
@@ -250,8 +258,28 @@ usage(char *program)
 	fprintf(stderr, "   -0: attach to console\n");
 	fprintf(stderr, "   -4: use RDP version 4\n");
 	fprintf(stderr, "   -5: use RDP version 5 (default)\n");
-#ifdef WITH_SCARD
 	fprintf(stderr, "   -o: name=value: Adds an additional option to rdesktop.\n");
+	fprintf(stderr,
+		"           bitmap-cache-size  Kilobytes of bitmaps to keep in memory for the bitmap cache\n");
+	fprintf(stderr,
+		"           bitmap-decode-threads  Threads decoding bitmap updates, off by default\n");
+	fprintf(stderr,
+		"           bulk-compression   Highest type offered with -z: mppc, rdp6 or rdp61\n");
+	fprintf(stderr,
+		"           dir-batch-size     Bytes of entries per directory listing reply, 0 for one\n");
+	fprintf(stderr,
+		"           gfx                on to use the graphics pipeline, needs -a 32\n");
+	fprintf(stderr,
+		"           mppc-capture       Record compressed PDUs to a file for tests/mppc_bench\n");
+	fprintf(stderr,
+		"           offscreen-cache-size  Kilobytes of offscreen bitmaps, 0 to disable\n");
+	fprintf(stderr,
+		"           receive-queue      PDUs to receive ahead on a thread, off by default\n");
+	fprintf(stderr,
+		"           stats[=<file>]     Serve performance counters on the control socket,\n");
+	fprintf(stderr,
+		"                              and write them to <file> as JSON on exit\n");
+#ifdef WITH_SCARD
 	fprintf(stderr,
 		"           sc-csp-name        Specifies the Crypto Service Provider name which\n");
 	fprintf(stderr,
@@ -776,9 +804,11 @@ main(int argc, char *argv[])
 	char domain[256];
 	char shell[256];
 	char directory[256];
-	RD_BOOL prompt_password, deactivated;
+	char stats_file[PATH_MAX];
+	RD_BOOL prompt_password, deactivated, stats;
 	struct passwd *pw;
 	uint32 flags, ext_disc_reason = 0;
+	uint32 compression_type = RDP_INFO_COMPRESSION2;
 	char *p;
 	int c;
 	char *locale = NULL;
@@ -815,6 +845,9 @@ main(int argc, char *argv[])
 
 	prompt_password = False;
 	g_seamless_spawn_cmd[0] = g_tls_version[0] = domain[0] = g_password[0] = shell[0] = directory[0] = 0;
+	stats_file[0] = 0;
+	stats = False;
+	stats_init();
 	g_embed_wnd = 0;
 
 	g_num_devices = 0;
@@ -980,7 +1013,7 @@ main(int argc, char *argv[])
 
 			case 'z':
 				logger(Core, Debug, "rdp compression enabled");
-				flags |= (RDP_INFO_COMPRESSION | RDP_INFO_COMPRESSION2);
+				g_compression = True;
 				break;
 
 			case 'x':
@@ -1129,10 +1162,15 @@ main(int argc, char *argv[])
 			case '5':
 				g_rdp_version = RDP_V5;
 				break;
-#if WITH_SCARD
+
 			case 'o':
 				{
 					char *p = strchr(optarg, '=');
+					if (p == NULL && strcmp(optarg, "stats") == 0)
+					{
+						stats = True;
+						continue;
+					}
 					if (p == NULL)
 					{
 						logger(Core, Warning,
@@ -1141,8 +1179,51 @@ main(int argc, char *argv[])
 						continue;
 					}
 
-					if (strncmp(optarg, "sc-csp-name", strlen("sc-scp-name")) ==
-					    0)
+					if (strncmp
+					    (optarg, "bitmap-cache-size",
+					     strlen("bitmap-cache-size")) == 0)
+						g_bitmap_cache_size = strtoul(p + 1, NULL, 10) * 1024;
+					else if (strncmp
+						 (optarg, "bitmap-decode-threads",
+						  strlen("bitmap-decode-threads")) == 0)
+						g_bitmap_decode_threads = strtol(p + 1, NULL, 10);
+					else if (strncmp
+						 (optarg, "bulk-compression",
+						  strlen("bulk-compression")) == 0)
+					{
+						if (strcmp(p + 1, "rdp6") == 0)
+							compression_type = RDP_INFO_COMPRESSION_RDP6;
+						else if (strcmp(p + 1, "rdp61") == 0)
+							compression_type = RDP_INFO_COMPRESSION_RDP61;
+						else if (strcmp(p + 1, "mppc") == 0)
+							compression_type = RDP_INFO_COMPRESSION2;
+						else
+							logger(Core, Warning,
+							       "Unknown bulk compression '%s'", p + 1);
+					}
+					else if (strncmp
+						 (optarg, "dir-batch-size", strlen("dir-batch-size")) == 0)
+						g_dir_batch_size = strtoul(p + 1, NULL, 10);
+					else if (strncmp(optarg, "gfx", strlen("gfx")) == 0)
+						g_gfx = (strcmp(p + 1, "on") == 0);
+					else if (strncmp
+						 (optarg, "offscreen-cache-size",
+						  strlen("offscreen-cache-size")) == 0)
+						g_offscreen_cache_size = strtoul(p + 1, NULL, 10);
+					else if (strncmp
+						 (optarg, "receive-queue", strlen("receive-queue")) == 0)
+						g_receive_queue_size = strtol(p + 1, NULL, 10);
+					else if (strncmp
+						 (optarg, "mppc-capture", strlen("mppc-capture")) == 0)
+						mppc_set_capture(p + 1);
+					else if (strncmp(optarg, "stats", strlen("stats")) == 0)
+					{
+						stats = True;
+						STRNCPY(stats_file, p + 1, sizeof(stats_file));
+					}
+#ifdef WITH_SCARD
+					else if (strncmp
+						 (optarg, "sc-csp-name", strlen("sc-scp-name")) == 0)
 						g_sc_csp_name = strdup(p + 1);
 					else if (strncmp
 						 (optarg, "sc-reader-name",
@@ -1156,10 +1237,13 @@ main(int argc, char *argv[])
 						 (optarg, "sc-container-name",
 						  strlen("sc-container-name")) == 0)
 						g_sc_container_name = strdup(p + 1);
-
+#endif
+					else
+						logger(Core, Warning,
+						       "Unknown -o option '%s'", optarg);
 				}
 				break;
-#endif
+
 			case 'v':
 				logger_set_verbose(1);
 				break;
@@ -1176,6 +1260,8 @@ main(int argc, char *argv[])
 		usage(argv[0]);
 		return EX_USAGE;
 	}
+	if (g_compression)
+		flags |= (RDP_INFO_COMPRESSION | compression_type);
 	if (g_local_cursor)
 	{
 		/* there is no point wasting bandwidth on cursor shadows
@@ -1305,8 +1391,8 @@ main(int argc, char *argv[])
 		strncat(g_title, server, sizeof(g_title) - sizeof("rdesktop - "));
 	}
 
-	/* Only startup ctrl functionality is seamless are used for now. */
-	if (g_use_ctrl && g_seamless_rdp)
+	/* Only startup ctrl functionality if seamless or stats are used for now. */
+	if (g_use_ctrl && (g_seamless_rdp || stats))
 	{
 		if (ctrl_init(server, domain, g_username) < 0)
 		{
@@ -1322,14 +1408,23 @@ main(int argc, char *argv[])
 			if (g_seamless_spawn_cmd[0])
 				return ctrl_send_command("seamless.spawn", g_seamless_spawn_cmd);
 
+			/* print the counters of the master */
+			if (stats)
+				return ctrl_send_command("stats", "");
+
 			logger(Core, Notice, "No command specified to be spawned in seamless mode");
 			return EX_USAGE;
 		}
 	}
 
+	if (stats_file[0])
+		stats_dump_at_exit(stats_file);
+
 	if (!ui_init())
 		return EX_OSERR;
 
+	bitmap_init_workers(g_bitmap_decode_threads);
+
 #ifdef WITH_RDPSND
 	if (!rdpsnd_init(rdpsnd_optarg))
 		logger(Core, Warning, "Initializing sound-support failed");
@@ -1343,6 +1438,14 @@ main(int argc, char *argv[])
 	dvc_init();
 	rdpedisp_init();
 
+	if (g_gfx && g_server_depth != 32)
+	{
+		logger(Core, Warning, "The graphics pipeline needs a colour depth of 32");
+		g_gfx = False;
+	}
+	if (g_gfx)
+		rdpgfx_init();
+
 	setup_user_requested_session_size();
 
 	g_reconnect_loop = False;
@@ -1492,6 +1595,7 @@ main(int argc, char *argv[])
 	ui_destroy_window();
 
 	cache_save_state();
+	cache_log_bitmap_stats();
 	ui_deinit();
 
 	if (g_user_quit)
@@ -2150,6 +2254,13 @@ rd_lseek_file(int fd, int offset)
 	return lseek(fd, offset, SEEK_SET);
 }
 
+/* read from a file position, without moving the file pointer */
+int
+rd_pread_file(int fd, void *ptr, int len, int offset)
+{
+	return pread(fd, ptr, len, offset);
+}
+
 /* do a write lock on a file */
 RD_BOOL
 rd_lock_file(int fd, int start, int len)
@@ -2164,3 +2275,36 @@ rd_lock_file(int fd, int start, int len)
 		return False;
 	return True;
 }
+
+/* map the first len bytes of a file, growing it if needed */
+void *
+rd_map_file(int fd, int len)
+{
+	struct stat st;
+	void *ptr;
+
+	if (fstat(fd, &st) == -1)
+		return NULL;
+
+	if (st.st_size < len && ftruncate(fd, len) == -1)
+	{
+		logger(Core, Error, "rd_map_file(), ftruncate() failed: %s", strerror(errno));
+		return NULL;
+	}
+
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		logger(Core, Error, "rd_map_file(), mmap() failed: %s", strerror(errno));
+		return NULL;
+	}
+
+	return ptr;
+}
+
+/* schedule write back of a mapped file */
+void
+rd_sync_map(void *ptr, int len)
+{
+	msync(ptr, len, MS_ASYNC);
+}
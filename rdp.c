@@ -48,6 +48,7 @@ extern uint32 g_requested_session_width;
 extern uint32 g_requested_session_height;
 extern RD_BOOL g_bitmap_cache;
 extern RD_BOOL g_bitmap_cache_persist_enable;
+extern uint32 g_offscreen_cache_size;
 extern RD_BOOL g_numlock_sync;
 extern RD_BOOL g_pending_resize;
 extern RD_BOOL g_pending_resize_defer;
@@ -65,6 +66,7 @@ uint32 g_rdp_shareid;
 extern RDPCOMP g_mppc_dict;
 
 extern uint32 vc_chunk_size;
+extern RD_BOOL g_compression;
 
 /* Session Directory support */
 extern RD_BOOL g_redirect;
@@ -98,6 +100,12 @@ uint16 g_session_height;
 
 static void rdp_out_unistr(STREAM s, char *string, int len);
 
+/* scratch buffer for decoded bitmap updates, reused between updates */
+static uint8 *g_bitmap_buffer = NULL;
+static size_t g_bitmap_buffer_size = 0;
+static BITMAP_JOB *g_bitmap_jobs = NULL;
+static int g_bitmap_jobs_size = 0;
+
 /* reads a TS_SHARECONTROLHEADER from stream, returns True of there is
    a PDU available otherwise False */
 static RD_BOOL
@@ -606,28 +614,165 @@ rdp_send_synchronise(void)
 	s_free(s);
 }
 
-/* Send a single input event */
-void
-rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1, uint16 param2)
+/* Input events held back while an input batch is open */
+typedef struct
+{
+	uint32 time;
+	uint16 message_type;
+	uint16 device_flags;
+	uint16 param1;
+	uint16 param2;
+}
+RDP_INPUT_EVENT;
+
+static RDP_INPUT_EVENT g_input_queue[FASTPATH_INPUT_MAX_EVENTS];
+static int g_input_queued = 0;
+static RD_BOOL g_input_batch = False;
+static RD_BOOL g_fastpath_input = False;
+
+/* Surface commands and bitmap codecs were advertised */
+static RD_BOOL g_surface_commands = False;
+static RD_BOOL g_frame_ack = False;
+
+/* Output an input event in fast-path encoding */
+static void
+rdp_out_fastpath_input_event(STREAM s, RDP_INPUT_EVENT * ev)
+{
+	uint8 flags = 0;
+
+	if (ev->device_flags & KBD_FLAG_UP)
+		flags |= FASTPATH_INPUT_KBDFLAGS_RELEASE;
+
+	switch (ev->message_type)
+	{
+		case RDP_INPUT_SCANCODE:
+			if (ev->device_flags & KBD_FLAG_EXT)
+				flags |= FASTPATH_INPUT_KBDFLAGS_EXTENDED;
+			if (ev->device_flags & KBD_FLAG_EXT1)
+				flags |= FASTPATH_INPUT_KBDFLAGS_EXTENDED1;
+			out_uint8(s, (FASTPATH_INPUT_EVENT_SCANCODE << 5) | flags);
+			out_uint8(s, ev->param1);
+			break;
+
+		case RDP_INPUT_CODEPOINT:
+			out_uint8(s, (FASTPATH_INPUT_EVENT_UNICODE << 5) | flags);
+			out_uint16_le(s, ev->param1);
+			break;
+
+		case RDP_INPUT_MOUSE:
+		case RDP_INPUT_MOUSEX:
+			out_uint8(s, (ev->message_type == RDP_INPUT_MOUSE ?
+				      FASTPATH_INPUT_EVENT_MOUSE : FASTPATH_INPUT_EVENT_MOUSEX) << 5);
+			out_uint16_le(s, ev->device_flags);
+			out_uint16_le(s, ev->param1);
+			out_uint16_le(s, ev->param2);
+			break;
+
+		case RDP_INPUT_SYNCHRONIZE:
+			out_uint8(s, (FASTPATH_INPUT_EVENT_SYNC << 5) | (ev->param1 & 0x1f));
+			break;
+
+		default:
+			logger(Protocol, Warning,
+			       "rdp_out_fastpath_input_event(), unhandled input type 0x%x",
+			       ev->message_type);
+	}
+}
+
+/* Send all queued input events in one PDU */
+static void
+rdp_flush_input(void)
 {
 	STREAM s;
+	int i;
+	RDP_INPUT_EVENT *ev;
 
-	logger(Protocol, Debug, "%s()", __func__);
+	if (g_input_queued == 0)
+		return;
 
-	s = rdp_init_data(16);
+	logger(Protocol, Debug, "%s(), %d events", __func__, g_input_queued);
 
-	out_uint16_le(s, 1);	/* number of events */
-	out_uint16(s, 0);	/* pad */
+	if (g_fastpath_input)
+	{
+		s = s_alloc(g_input_queued * 7);
+		for (i = 0; i < g_input_queued; i++)
+			rdp_out_fastpath_input_event(s, &g_input_queue[i]);
+		s_mark_end(s);
+		sec_send_fastpath_input(g_input_queued, s->data, s_length(s));
+		s_free(s);
+	}
+	else
+	{
+		s = rdp_init_data(4 + g_input_queued * 12);
 
-	out_uint32_le(s, time);
-	out_uint16_le(s, message_type);
-	out_uint16_le(s, device_flags);
-	out_uint16_le(s, param1);
-	out_uint16_le(s, param2);
+		out_uint16_le(s, g_input_queued);	/* number of events */
+		out_uint16(s, 0);	/* pad */
 
-	s_mark_end(s);
-	rdp_send_data(s, RDP_DATA_PDU_INPUT);
-	s_free(s);
+		for (i = 0; i < g_input_queued; i++)
+		{
+			ev = &g_input_queue[i];
+			out_uint32_le(s, ev->time);
+			out_uint16_le(s, ev->message_type);
+			out_uint16_le(s, ev->device_flags);
+			out_uint16_le(s, ev->param1);
+			out_uint16_le(s, ev->param2);
+		}
+
+		s_mark_end(s);
+		rdp_send_data(s, RDP_DATA_PDU_INPUT);
+		s_free(s);
+	}
+
+	g_input_queued = 0;
+}
+
+/* Hold back input events until rdp_end_input_batch() */
+void
+rdp_begin_input_batch(void)
+{
+	g_input_batch = True;
+}
+
+/* Send the input events queued since rdp_begin_input_batch() */
+void
+rdp_end_input_batch(void)
+{
+	g_input_batch = False;
+	rdp_flush_input();
+}
+
+/* Send an input event, or queue it while an input batch is open */
+void
+rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1, uint16 param2)
+{
+	RDP_INPUT_EVENT *ev;
+
+	/* only the last of consecutive pointer moves matters */
+	if (g_input_queued > 0 && message_type == RDP_INPUT_MOUSE
+	    && device_flags == MOUSE_FLAG_MOVE)
+	{
+		ev = &g_input_queue[g_input_queued - 1];
+		if (ev->message_type == RDP_INPUT_MOUSE && ev->device_flags == MOUSE_FLAG_MOVE)
+		{
+			ev->time = time;
+			ev->param1 = param1;
+			ev->param2 = param2;
+			return;
+		}
+	}
+
+	if (g_input_queued == FASTPATH_INPUT_MAX_EVENTS)
+		rdp_flush_input();
+
+	ev = &g_input_queue[g_input_queued++];
+	ev->time = time;
+	ev->message_type = message_type;
+	ev->device_flags = device_flags;
+	ev->param1 = param1;
+	ev->param2 = param2;
+
+	if (!g_input_batch)
+		rdp_flush_input();
 }
 
 /* Send a Suppress Output PDU */
@@ -801,12 +946,25 @@ rdp_out_ts_order_capabilityset(STREAM s)
 	order_caps[TS_NEG_PATBLT_INDEX] = 1;
 	order_caps[TS_NEG_SCRBLT_INDEX] = 1;
 	order_caps[TS_NEG_LINETO_INDEX] = 1;
-	order_caps[TS_NEG_MULTI_DRAWNINEGRID_INDEX] = 1;
+	order_caps[TS_NEG_MULTIDSTBLT_INDEX] = 1;
+	order_caps[TS_NEG_MULTIPATBLT_INDEX] = 1;
+	order_caps[TS_NEG_MULTISCRBLT_INDEX] = 1;
+	order_caps[TS_NEG_MULTIOPAQUERECT_INDEX] = 1;
 	order_caps[TS_NEG_POLYLINE_INDEX] = 1;
 	order_caps[TS_NEG_INDEX_INDEX] = 1;
 
+	/* these need glyph cache v2 */
+	if (g_rdp_version >= RDP_V5)
+	{
+		order_caps[TS_NEG_FAST_INDEX_INDEX] = 1;
+		order_caps[TS_NEG_FAST_GLYPH_INDEX] = 1;
+	}
+
 	if (g_bitmap_cache)
+	{
 		order_caps[TS_NEG_MEMBLT_INDEX] = 1;
+		order_caps[TS_NEG_MEM3BLT_INDEX] = 1;
+	}
 
 	if (g_desktop_save)
 	{
@@ -884,11 +1042,24 @@ rdp_out_bmpcache2_caps(STREAM s)
 	}
 	else
 	{
-		out_uint32_le(s, BMPCACHE2_C2_CELLS);
+		out_uint32_le(s, cache_get_bmpcache2_cells());
 	}
 	out_uint8s(s, 20);	/* other bitmap caches not used */
 }
 
+/* Output offscreen bitmap cache capability set */
+static void
+rdp_out_offscreen_cache_caps(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_OFFSCREEN_CACHE);
+	out_uint16_le(s, RDP_CAPLEN_OFFSCREEN_CACHE);
+
+	out_uint32_le(s, 1);	/* offscreenSupportLevel */
+	/* offscreenCacheSize, in kilobytes */
+	out_uint16_le(s, MIN(g_offscreen_cache_size, OFFSCREEN_CACHE_MAX_SIZE));
+	out_uint16_le(s, OFFSCREEN_CACHE_ENTRIES);	/* offscreenCacheEntries */
+}
+
 /* Output control capability set */
 static void
 rdp_out_control_caps(STREAM s)
@@ -976,19 +1147,25 @@ rdp_out_virtchan_caps(STREAM s)
 {
 	out_uint16_le(s, RDP_CAPSET_VC);
 	out_uint16_le(s, RDP_CAPLEN_VC);
-	/* VCCAPS_COMPR_SC */
-	out_uint32_le(s, 0x00000001);	/* compression flags */
+	out_uint32_le(s, VCCAPS_COMPR_SC);	/* compression flags */
 }
 
 static void
-rdp_process_virtchan_caps(STREAM s)
+rdp_process_virtchan_caps(STREAM s, uint16 length)
 {
 	uint32 flags, chunk_size;
 
 	in_uint32_le(s, flags);
+
+	/* compress channel data we send when compression is on */
+	channel_enable_compression(g_compression && (flags & VCCAPS_COMPR_CS_8K));
+
+	/* VCChunkSize is optional */
+	if (length <= 8)
+		return;
+
 	in_uint32_le(s, chunk_size);
 
-	UNUSED(flags);
 	vc_chunk_size = chunk_size;
 }
 
@@ -998,6 +1175,7 @@ rdp_out_ts_input_capabilityset(STREAM s)
 {
 	uint16 inputflags = 0;
 	inputflags |= INPUT_FLAG_SCANCODES;
+	inputflags |= INPUT_FLAG_FASTPATH_INPUT | INPUT_FLAG_FASTPATH_INPUT2;
 
 	out_uint16_le(s, RDP_CAPSET_INPUT);
 	out_uint16_le(s, RDP_CAPLEN_INPUT);
@@ -1048,7 +1226,8 @@ rdp_out_ts_cache_definition(STREAM s, uint16 entries, uint16 maxcellsize)
 static void
 rdp_out_ts_glyphcache_capabilityset(STREAM s)
 {
-	uint16 supportlvl = GLYPH_SUPPORT_FULL;
+	/* glyph cache v2 and the fast glyph orders */
+	uint16 supportlvl = (g_rdp_version >= RDP_V5) ? GLYPH_SUPPORT_ENCODE : GLYPH_SUPPORT_FULL;
 	uint32 fragcache = 0x01000100;
 	out_uint16_le(s, RDP_CAPSET_GLYPHCACHE);
 	out_uint16_le(s, RDP_CAPLEN_GLYPHCACHE);
@@ -1073,9 +1252,95 @@ rdp_out_ts_glyphcache_capabilityset(STREAM s)
 static void
 rdp_out_ts_multifragmentupdate_capabilityset(STREAM s)
 {
+	uint32 size = RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE;
+
+	/* a RemoteFX frame of the whole desktop must fit */
+	if (g_surface_commands)
+		size = MAX(size, (uint32) (((g_session_width + 63) / 64) *
+					   ((g_session_height + 63) / 64) * 16384 + 16384));
+
 	out_uint16_le(s, RDP_CAPSET_MULTIFRAGMENTUPDATE);
 	out_uint16_le(s, RDP_CAPLEN_MULTIFRAGMENTUPDATE);
-	out_uint32_le(s, RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE);	/* MaxRequestSize */
+	out_uint32_le(s, size);	/* MaxRequestSize */
+}
+
+/* Output Surface Commands Capability Set */
+static void
+rdp_out_ts_surfcmds_capabilityset(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_SURFACE_COMMANDS);
+	out_uint16_le(s, RDP_CAPLEN_SURFACE_COMMANDS);
+	out_uint32_le(s, SURFCMDS_SET_SURFACE_BITS | SURFCMDS_FRAME_MARKER |
+		      SURFCMDS_STREAM_SURFACE_BITS);	/* cmdFlags */
+	out_uint32_le(s, 0);	/* reserved */
+}
+
+/* Output Bitmap Codecs Capability Set */
+static void
+rdp_out_ts_bitmapcodecs_capabilityset(STREAM s)
+{
+	static const uint8 guid_nscodec[16] = {
+		0xb9, 0x1b, 0x8d, 0xca, 0x0f, 0x00, 0x4f, 0x15,
+		0x58, 0x9f, 0xae, 0x2d, 0x1a, 0x87, 0xe2, 0xd6
+	};
+	static const uint8 guid_remotefx[16] = {
+		0x12, 0x2f, 0x77, 0x76, 0x72, 0xbd, 0x63, 0x44,
+		0xaf, 0xb3, 0xb7, 0x3c, 0x9c, 0x6f, 0x78, 0x86
+	};
+	int i;
+
+	out_uint16_le(s, RDP_CAPSET_BITMAP_CODECS);
+	out_uint16_le(s, RDP_CAPLEN_BITMAP_CODECS);
+	out_uint8(s, 2);	/* bitmapCodecCount */
+
+	/* TS_NSCODEC_CAPABILITYSET */
+	out_uint8a(s, guid_nscodec, 16);
+	out_uint8(s, RDP_CODEC_ID_NSCODEC);
+	out_uint16_le(s, 3);	/* codecPropertiesLength */
+	out_uint8(s, 1);	/* fAllowDynamicFidelity */
+	out_uint8(s, 1);	/* fAllowSubsampling */
+	out_uint8(s, 3);	/* colorLossLevel */
+
+	/* TS_RFX_CLNT_CAPS_CONTAINER */
+	out_uint8a(s, guid_remotefx, 16);
+	out_uint8(s, RDP_CODEC_ID_REMOTEFX);
+	out_uint16_le(s, 49);	/* codecPropertiesLength */
+	out_uint32_le(s, 49);	/* length */
+	out_uint32_le(s, CARDP_CAPS_CAPTURE_NON_CAC);	/* captureFlags */
+	out_uint32_le(s, 37);	/* capsLength */
+
+	/* TS_RFX_CAPS */
+	out_uint16_le(s, CBY_CAPS);	/* blockType */
+	out_uint32_le(s, 8);	/* blockLen */
+	out_uint16_le(s, 1);	/* numCapsets */
+
+	/* TS_RFX_CAPSET */
+	out_uint16_le(s, CBY_CAPSET);	/* blockType */
+	out_uint32_le(s, 29);	/* blockLen */
+	out_uint8(s, 1);	/* codecId */
+	out_uint16_le(s, CLY_CAPSET);	/* capsetType */
+	out_uint16_le(s, 2);	/* numIcaps */
+	out_uint16_le(s, 8);	/* icapLen */
+
+	/* TS_RFX_ICAP, one for each entropy coder */
+	for (i = 0; i < 2; i++)
+	{
+		out_uint16_le(s, WF_VERSION_1_0);	/* version */
+		out_uint16_le(s, CT_TILE_64x64);	/* tileSize */
+		out_uint8(s, CODEC_MODE_IMAGE);	/* flags */
+		out_uint8(s, CLW_COL_CONV_ICT);	/* colConvBits */
+		out_uint8(s, CLW_XFORM_DWT_53_A);	/* transformBits */
+		out_uint8(s, i == 0 ? CLW_ENTROPY_RLGR1 : CLW_ENTROPY_RLGR3);	/* entropyBits */
+	}
+}
+
+/* Output Frame Acknowledge Capability Set */
+static void
+rdp_out_ts_frame_ack_capabilityset(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_FRAME_ACKNOWLEDGE);
+	out_uint16_le(s, RDP_CAPLEN_FRAME_ACKNOWLEDGE);
+	out_uint32_le(s, 2);	/* maxUnacknowledgedFrameCount */
 }
 
 static void
@@ -1095,6 +1360,7 @@ rdp_send_confirm_active(void)
 {
 	STREAM s;
 	uint32 sec_flags = g_encryption ? (RDP5_FLAG | SEC_ENCRYPT) : RDP5_FLAG;
+	uint16 num_caps = 17;
 	uint16 caplen =
 		RDP_CAPLEN_GENERAL +
 		RDP_CAPLEN_BITMAP +
@@ -1114,6 +1380,22 @@ rdp_send_confirm_active(void)
 
 	logger(Protocol, Debug, "%s()", __func__);
 
+	/* the codecs decode to 32 bpp only */
+	g_surface_commands = (g_server_depth == 32);
+	if (g_surface_commands)
+	{
+		caplen += RDP_CAPLEN_SURFACE_COMMANDS;
+		caplen += RDP_CAPLEN_BITMAP_CODECS;
+		caplen += RDP_CAPLEN_FRAME_ACKNOWLEDGE;
+		num_caps += 3;
+	}
+
+	if (g_offscreen_cache_size != 0)
+	{
+		caplen += RDP_CAPLEN_OFFSCREEN_CACHE;
+		num_caps++;
+	}
+
 	if (g_rdp_version >= RDP_V5)
 	{
 		caplen += RDP_CAPLEN_BMPCACHE2;
@@ -1137,7 +1419,7 @@ rdp_send_confirm_active(void)
 	out_uint16_le(s, caplen);
 
 	out_uint8a(s, RDP_SOURCE, sizeof(RDP_SOURCE));
-	out_uint16_le(s, 17);	/* num_caps */
+	out_uint16_le(s, num_caps);
 	out_uint8s(s, 2);	/* pad */
 
 	rdp_out_ts_general_capabilityset(s);
@@ -1166,6 +1448,14 @@ rdp_send_confirm_active(void)
 	rdp_out_ts_glyphcache_capabilityset(s);
 	rdp_out_ts_multifragmentupdate_capabilityset(s);
 	rdp_out_ts_large_pointer_capabilityset(s);
+	if (g_surface_commands)
+	{
+		rdp_out_ts_surfcmds_capabilityset(s);
+		rdp_out_ts_bitmapcodecs_capabilityset(s);
+		rdp_out_ts_frame_ack_capabilityset(s);
+	}
+	if (g_offscreen_cache_size != 0)
+		rdp_out_offscreen_cache_caps(s);
 
 	s_mark_end(s);
 	sec_send(s, sec_flags);
@@ -1247,6 +1537,20 @@ rdp_process_bitmap_caps(STREAM s)
 	ui_resize_window(g_session_width, g_session_height);
 }
 
+/* Process server input capabilities */
+static void
+rdp_process_input_caps(STREAM s)
+{
+	uint16 inputflags;
+
+	in_uint16_le(s, inputflags);
+
+	g_fastpath_input =
+		(inputflags & (INPUT_FLAG_FASTPATH_INPUT | INPUT_FLAG_FASTPATH_INPUT2)) != 0;
+	logger(Protocol, Debug, "rdp_process_input_caps(), fast-path input %s",
+	       g_fastpath_input ? "enabled" : "disabled");
+}
+
 /* Process server capabilities */
 static void
 rdp_process_server_caps(STREAM s, uint16 length)
@@ -1258,6 +1562,8 @@ rdp_process_server_caps(STREAM s, uint16 length)
 	logger(Protocol, Debug, "%s()", __func__);
 
 	start = s_tell(s);
+	g_fastpath_input = False;
+	g_frame_ack = False;
 
 	in_uint16_le(s, ncapsets);
 	in_uint8s(s, 2);	/* pad */
@@ -1282,10 +1588,15 @@ rdp_process_server_caps(STREAM s, uint16 length)
 				rdp_process_bitmap_caps(s);
 				break;
 			case RDP_CAPSET_VC:
-				/* Parse only if we got VCChunkSize */
-				if (capset_length > 8) {
-					rdp_process_virtchan_caps(s);
-				}
+				rdp_process_virtchan_caps(s, capset_length);
+				break;
+
+			case RDP_CAPSET_INPUT:
+				rdp_process_input_caps(s);
+				break;
+
+			case RDP_CAPSET_FRAME_ACKNOWLEDGE:
+				g_frame_ack = True;
 				break;
 		}
 
@@ -1483,13 +1794,26 @@ process_pointer_pdu(STREAM s)
 	}
 }
 
+/* Scratch buffer for decoded bitmap data, grown as needed */
+static uint8 *
+rdp_bitmap_buffer(size_t size)
+{
+	if (size > g_bitmap_buffer_size)
+	{
+		g_bitmap_buffer = (uint8 *) xrealloc(g_bitmap_buffer, size);
+		g_bitmap_buffer_size = size;
+	}
+	return g_bitmap_buffer;
+}
+
 /* Process TS_BITMAP_DATA */
 static void
-process_bitmap_data(STREAM s)
+process_bitmap_data(STREAM s, BITMAP_JOB * job)
 {
 	uint16 left, top, right, bottom, width, height;
-	uint16 cx, cy, bpp, Bpp, flags, bufsize, size;
-	uint8 *data, *bmpdata;
+	uint16 bpp, Bpp, flags, bufsize, size;
+	uint32 length;
+	uint8 *data;
 	
 	logger(Protocol, Debug, "%s()", __func__);
 
@@ -1506,9 +1830,6 @@ process_bitmap_data(STREAM s)
 	in_uint16_le(s, flags); /* flags */
 	in_uint16_le(s, bufsize); /* bitmapLength */
 
-	cx = right - left + 1;
-	cy = bottom - top + 1;
-
 	/* FIXME: There are a assumtion that we do not consider in
 		this code. The value of bpp is not passed to
 		ui_paint_bitmap() which relies on g_server_bpp for drawing
@@ -1530,25 +1851,25 @@ process_bitmap_data(STREAM s)
 				left, top, right, bottom, width, height, bpp, flags);
 		rdp_protocol_error("TS_BITMAP_DATA, unsafe size of bitmap data received from server", &packet);
 	}
+
+	job->x = left;
+	job->y = top;
+	job->cx = right - left + 1;
+	job->cy = bottom - top + 1;
+	job->width = width;
+	job->height = height;
+	job->Bpp = Bpp;
+	job->compressed = (flags != 0);
+	job->ok = False;
  
 	if (flags == 0)
 	{
-		/* read uncompressed bitmap data */
-		int y;
-		bmpdata = (uint8 *) xmalloc(width * height * Bpp);
-		for (y = 0; y < height; y++)
-		{
-			in_uint8a(s, &bmpdata[(height - y - 1) * (width * Bpp)], width * Bpp);
-		}
-		
-		ui_paint_bitmap(left, top, cx, cy, width, height, bmpdata);
-		xfree(bmpdata);
-		return;
+		/* uncompressed bitmap data */
+		length = width * height * Bpp;
 	}
-
-	if (flags & NO_BITMAP_COMPRESSION_HDR)
+	else if (flags & NO_BITMAP_COMPRESSION_HDR)
 	{
-		size = bufsize;
+		length = bufsize;
 	}
 	else
 	{
@@ -1557,39 +1878,205 @@ process_bitmap_data(STREAM s)
 		in_uint16_le(s, size);  /* cbCompMainBodySize */
 		in_uint8s(s, 2);        /* skip cbScanWidth */
 		in_uint8s(s, 2);        /* skip cbUncompressedSize */
+		length = size;
 	}
 
-	/* read compressed bitmap data */
-	if (!s_check_rem(s, size))
+	/* read bitmap data */
+	if (!s_check_rem(s, length))
 	{
 		rdp_protocol_error("consume of bitmap data from stream would overrun", &packet);
 	}
-	in_uint8p(s, data, size);
-	bmpdata = (uint8 *) xmalloc(width * height * Bpp);
-	if (bitmap_decompress(bmpdata, width, height, data, size, Bpp))
-	{
-		ui_paint_bitmap(left, top, cx, cy, width, height, bmpdata);
-	}
-	else
-	{
-		logger(Protocol, Warning, "%s(), failed to decompress bitmap", __func__);
-	}
-
-	xfree(bmpdata);
+	in_uint8p(s, data, length);
+	job->input = data;
+	job->size = length;
 }
 
 /* Process TS_UPDATE_BITMAP_DATA */
 void
 process_bitmap_updates(STREAM s)
 {
-	int i;
+	int i, row_Bpp = 0;
 	uint16 num_updates;
+	size_t offset, row_offset;
+	bitmap_row_func row_func;
+	uint8 *row_output = NULL;
+	BITMAP_JOB *job;
 	
 	in_uint16_le(s, num_updates);   /* rectangles */
 
+	if (num_updates > g_bitmap_jobs_size)
+	{
+		g_bitmap_jobs = (BITMAP_JOB *) xrealloc(g_bitmap_jobs,
+							num_updates * sizeof(BITMAP_JOB));
+		g_bitmap_jobs_size = num_updates;
+	}
+
+	/* the rectangles are independent, parse all of them and decode at once */
+	offset = 0;
+	for (i = 0; i < num_updates; i++)
+	{
+		job = &g_bitmap_jobs[i];
+		process_bitmap_data(s, job);
+		offset += job->width * job->height * job->Bpp;
+	}
+
+	rdp_bitmap_buffer(offset);
+
+	/* convert to the display format while decoding, rather than in a
+	   second pass over the whole update */
+	row_func = ui_bitmap_row_func(&row_Bpp);
+	if (row_func != NULL)
+	{
+		row_offset = 0;
+		for (i = 0; i < num_updates; i++)
+			row_offset += g_bitmap_jobs[i].width * g_bitmap_jobs[i].height * row_Bpp;
+		row_output = ui_image_buffer(row_offset);
+	}
+
+	offset = row_offset = 0;
 	for (i = 0; i < num_updates; i++)
 	{
-		process_bitmap_data(s);
+		job = &g_bitmap_jobs[i];
+		job->output = g_bitmap_buffer + offset;
+		offset += job->width * job->height * job->Bpp;
+		job->row_func = row_func;
+		job->row_output = row_output + row_offset;
+		job->row_Bpp = row_Bpp;
+		row_offset += job->width * job->height * row_Bpp;
+	}
+
+	bitmap_decompress_batch(g_bitmap_jobs, num_updates);
+
+	/* paint in the order received */
+	for (i = 0; i < num_updates; i++)
+	{
+		job = &g_bitmap_jobs[i];
+		if (!job->ok)
+			logger(Protocol, Warning, "%s(), failed to decompress bitmap", __func__);
+		else if (row_func != NULL)
+			ui_paint_image(job->x, job->y, job->cx, job->cy, job->width,
+				       job->height, job->row_output);
+		else
+			ui_paint_bitmap(job->x, job->y, job->cx, job->cy, job->width,
+					job->height, job->output);
+	}
+}
+
+/* Send a TS_FRAME_ACKNOWLEDGE_PDU */
+static void
+rdp_send_frame_ack(uint32 frame_id)
+{
+	STREAM s;
+
+	s = rdp_init_data(4);
+	out_uint32_le(s, frame_id);
+	s_mark_end(s);
+	rdp_send_data(s, RDP_DATA_PDU_FRAME_ACKNOWLEDGE);
+	s_free(s);
+}
+
+/* Process TS_SURFCMD_SET_SURF_BITS and TS_SURFCMD_STREAM_SURF_BITS */
+static void
+process_surface_bits(STREAM s)
+{
+	uint16 left, top, right, bottom, width, height;
+	uint8 bpp, flags, codec_id, *data, *output;
+	uint32 length;
+	uint64 start;
+	RD_BOOL ok = False;
+	struct stream packet = *s;
+
+	in_uint16_le(s, left);
+	in_uint16_le(s, top);
+	in_uint16_le(s, right);
+	in_uint16_le(s, bottom);
+
+	/* TS_BITMAP_DATA_EX */
+	in_uint8(s, bpp);
+	in_uint8(s, flags);
+	in_uint8s(s, 1);	/* reserved */
+	in_uint8(s, codec_id);
+	in_uint16_le(s, width);
+	in_uint16_le(s, height);
+	in_uint32_le(s, length);
+	if (flags & EX_COMPRESSED_BITMAP_HEADER_PRESENT)
+		in_uint8s(s, 24);	/* exBitmapDataHeader */
+
+	if (!s_check_rem(s, length))
+		rdp_protocol_error("consume of surface bits from stream would overrun", &packet);
+	in_uint8p(s, data, length);
+
+	logger(Graphics, Debug, "process_surface_bits(), [%d,%d,%d,%d], %dx%d, codec %d",
+	       left, top, right, bottom, width, height, codec_id);
+
+	if (width == 0 || height == 0)
+		return;
+
+	switch (codec_id)
+	{
+		case RDP_CODEC_ID_REMOTEFX:
+			start = stats_now();
+			ok = rfx_process_message(data, length, left, top, width, height);
+			stats_record(STATS_DECODE_REMOTEFX, start);
+			break;
+
+		case RDP_CODEC_ID_NSCODEC:
+			output = rdp_bitmap_buffer(width * height * 4);
+			start = stats_now();
+			ok = nsc_decode(output, width, height, data, length);
+			stats_record(STATS_DECODE_NSCODEC, start);
+			if (ok)
+				ui_paint_bitmap(left, top, width, height, width, height, output);
+			break;
+
+		case RDP_CODEC_ID_NONE:
+			/* unlike bitmap updates, uncompressed surface bits are top-down */
+			if (bpp != g_server_depth || length < (uint32) (width * height * ((bpp + 7) / 8)))
+				break;
+			ui_paint_bitmap(left, top, width, height, width, height, data);
+			ok = True;
+			break;
+
+		default:
+			logger(Graphics, Warning, "process_surface_bits(), unhandled codec %d",
+			       codec_id);
+			return;
+	}
+
+	if (!ok)
+		logger(Graphics, Warning, "process_surface_bits(), failed to decode codec %d",
+		       codec_id);
+}
+
+/* Process TS_FP_SURFCMDS */
+void
+process_surface_cmds(STREAM s)
+{
+	uint16 cmd_type, action;
+	uint32 frame_id;
+
+	while (s_check_rem(s, 2))
+	{
+		in_uint16_le(s, cmd_type);
+		switch (cmd_type)
+		{
+			case CMDTYPE_SET_SURFACE_BITS:
+			case CMDTYPE_STREAM_SURFACE_BITS:
+				process_surface_bits(s);
+				break;
+
+			case CMDTYPE_FRAME_MARKER:
+				in_uint16_le(s, action);
+				in_uint32_le(s, frame_id);
+				if (action == SURFACECMD_FRAMEACTION_END && g_frame_ack)
+					rdp_send_frame_ack(frame_id);
+				break;
+
+			default:
+				logger(Protocol, Warning,
+				       "process_surface_cmds(), unhandled command type 0x%x", cmd_type);
+				return;
+		}
 	}
 }
 
@@ -1759,8 +2246,8 @@ process_data_pdu(STREAM s, uint32 * ext_disc_reason)
 	uint16 clen;
 	uint32 len;
 
-	uint8 *buf;
-	uint32 roff, rlen;
+	uint8 *buf, *rdata;
+	uint32 rlen;
 
 	struct stream *ns = &(g_mppc_dict.ns);
 
@@ -1777,20 +2264,16 @@ process_data_pdu(STREAM s, uint32 * ext_disc_reason)
 			logger(Protocol, Error,
 			       "process_data_pdu(), error decompressed packet size exceeds max");
 		in_uint8p(s, buf, clen);
-		if (mppc_expand(buf, clen, ctype, &roff, &rlen) == -1)
+		if (mppc_expand(buf, clen, ctype, &rdata, &rlen) == -1)
 			logger(Protocol, Error,
 			       "process_data_pdu(), error while decompressing packet");
+		stats_add(STATS_MPPC_COMPRESSED, clen);
+		stats_add(STATS_MPPC_EXPANDED, rlen);
 
 		/* len -= 18; */
 
-		/* allocate memory and copy the uncompressed data into the temporary stream */
-		s_realloc(ns, rlen);
-		s_reset(ns);
-
-		out_uint8a(ns, (unsigned char *) (g_mppc_dict.hist + roff), rlen);
-
-		s_mark_end(ns);
-		s_seek(ns, 0);
+		/* parse the uncompressed data in place in the history */
+		s_slice(ns, rdata, rlen);
 		s_push_layer(ns, rdp_hdr, 0);
 
 		s = ns;
@@ -2133,6 +2616,9 @@ rdp_reset_state(void)
 	g_rdp_shareid = 0;
 	g_exit_mainloop = False;
 	g_first_bitmap_caps = True;
+	g_fastpath_input = False;
+	g_input_queued = 0;
+	mppc_reset_state();
 	sec_reset_state();
 }
 
@@ -2142,6 +2628,7 @@ rdp_disconnect(void)
 {
 	logger(Protocol, Debug, "%s()", __func__);
 	sec_disconnect();
+	mppc_reset_state();
 }
 
 /* Abort rdesktop upon protocol error
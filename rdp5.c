@@ -47,6 +47,9 @@ process_ts_fp_update_by_code(STREAM s, uint8 code)
 			break;
 		case FASTPATH_UPDATETYPE_SYNCHRONIZE:
 			break;
+		case FASTPATH_UPDATETYPE_SURFCMDS:
+			process_surface_cmds(s);
+			break;
 		case FASTPATH_UPDATETYPE_PTR_NULL:
 			ui_set_null_cursor();
 			break;
@@ -80,8 +83,8 @@ process_ts_fp_updates(STREAM s)
 	uint8 hdr, code, frag, comp, ctype = 0;
 	size_t next;
 
-	uint8 *buf;
-	uint32 roff, rlen;
+	uint8 *buf, *rdata;
+	uint32 rlen;
 	struct stream *ns = &(g_mppc_dict.ns);
 	struct stream *ts;
 
@@ -106,18 +109,14 @@ process_ts_fp_updates(STREAM s)
 		if (ctype & RDP_MPPC_COMPRESSED)
 		{
 			in_uint8p(s, buf, length);
-			if (mppc_expand(buf, length, ctype, &roff, &rlen) == -1)
+			if (mppc_expand(buf, length, ctype, &rdata, &rlen) == -1)
 				logger(Protocol, Error,
 				       "process_ts_fp_update_pdu(), error while decompressing packet");
+			stats_add(STATS_MPPC_COMPRESSED, length);
+			stats_add(STATS_MPPC_EXPANDED, rlen);
 
-			/* allocate memory and copy the uncompressed data into the temporary stream */
-			s_realloc(ns, rlen);
-			s_reset(ns);
-
-			out_uint8a(ns, (unsigned char *) (g_mppc_dict.hist + roff), rlen);
-
-			s_mark_end(ns);
-			s_seek(ns, 0);
+			/* parse the uncompressed data in place in the history */
+			s_slice(ns, rdata, rlen);
 			s_push_layer(ns, rdp_hdr, 0);
 
 			length = rlen;
@@ -142,6 +141,10 @@ process_ts_fp_updates(STREAM s)
 				s_reset(assembled[code]);
 			}
 
+			/* surface commands may exceed the default request size */
+			if (s_left(assembled[code]) < length)
+				s_realloc(assembled[code], s_tell(assembled[code]) + length);
+
 			out_uint8stream(assembled[code], ts, length);
 
 			if (frag == FASTPATH_FRAGMENT_LAST)
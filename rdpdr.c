@@ -58,6 +58,12 @@
 #define IRP_MN_QUERY_DIRECTORY          0x01
 #define IRP_MN_NOTIFY_CHANGE_DIRECTORY  0x02
 
+/* How often to poll for serial events while a wait is pending, in ms.
+   Modem line and transmit queue changes make no descriptor ready, and
+   received data the server has not read yet would keep one ready, so
+   these waits cannot be left to the reactor. */
+#define RDPDR_EVENT_POLL		5
+
 extern char g_hostname[16];
 extern DEVICE_FNS serial_fns;
 extern DEVICE_FNS printer_fns;
@@ -72,8 +78,6 @@ extern RD_BOOL g_notify_stamp;
 static VCHANNEL *rdpdr_channel;
 static uint32 g_epoch;
 
-/* If select() times out, the request for the device with handle g_min_timeout_fd is aborted */
-RD_NTHANDLE g_min_timeout_fd;
 uint32 g_num_devices;
 
 uint32 g_client_id;
@@ -99,6 +103,11 @@ struct async_iorequest
 
 struct async_iorequest *g_iorequest;
 
+static void rdpdr_watch_fd(uint32 fd);
+static void rdpdr_fd_ready(int fd, int events, void *data);
+static void rdpdr_iorequest_timeout(void *data);
+static void rdpdr_event_timer(void *data);
+
 /* Return device_id for a given handle */
 int
 get_device_index(RD_NTHANDLE handle)
@@ -188,6 +197,21 @@ add_async_iorequest(uint32 device, uint32 file, uint32 id, uint32 major, uint32
 	iorq->itv_timeout = interval_timeout;
 	iorq->buffer = buffer;
 	iorq->offset = offset;
+
+	switch (major)
+	{
+		case IRP_MJ_READ:
+			if (total_timeout)
+				reactor_set_timer(rdpdr_iorequest_timeout, iorq, total_timeout);
+			rdpdr_watch_fd(file);
+			break;
+		case IRP_MJ_WRITE:
+			rdpdr_watch_fd(file);
+			break;
+		case IRP_MJ_DEVICE_CONTROL:
+			reactor_set_timer(rdpdr_event_timer, NULL, RDPDR_EVENT_POLL);
+			break;
+	}
 	return True;
 }
 
@@ -424,6 +448,7 @@ rdpdr_process_irp(STREAM s)
 	uint32 filename_len;
 
 	uint8 *pst_buf;
+	uint8 watch_tree;
 	STREAM out;
 	DEVICE_FNS *fns;
 	RD_BOOL rw_blocking = True;
@@ -727,10 +752,14 @@ rdpdr_process_irp(STREAM s)
 					/* JIF
 					   unimpl("IRP major=0x%x minor=0x%x: IRP_MN_NOTIFY_CHANGE_DIRECTORY\n", major, minor);  */
 
-					in_uint32_le(s, info_level);	/* notify mask */
+					/* DR_DRIVE_NOTIFY_CHANGE_DIRECTORY_REQ */
+					in_uint8(s, watch_tree);	/* WatchTree */
+					in_uint32_le(s, info_level);	/* CompletionFilter */
 
-					status = disk_create_notify(file, info_level);
-					result = 0;
+					out = s_alloc(1024);
+					status = disk_create_notify(file, watch_tree, info_level, out);
+					s_mark_end(out);
+					result = s_length(out);
 
 					if (status == RD_STATUS_PENDING)
 						add_async_iorequest(device, file, id, major, length,
@@ -989,85 +1018,42 @@ rdpdr_init()
 	return (rdpdr_channel != NULL);
 }
 
-/* Add file descriptors of pending io request to select() */
-void
-rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL * timeout)
+/* Wait for fd as long as reads or writes are pending on it */
+static void
+rdpdr_watch_fd(uint32 fd)
 {
-	uint32 select_timeout = 0;	/* Timeout value to be used for select() (in milliseconds). */
 	struct async_iorequest *iorq;
-	char c;
+	int events = 0;
 
-	iorq = g_iorequest;
-	while (iorq != NULL)
+	for (iorq = g_iorequest; iorq != NULL; iorq = iorq->next)
 	{
-		if (iorq->fd != 0)
-		{
-			switch (iorq->major)
-			{
-				case IRP_MJ_READ:
-					/* Is this FD valid? FDs will
-					   be invalid when
-					   reconnecting. FIXME: Real
-					   support for reconnects. */
-
-					FD_SET(iorq->fd, rfds);
-					*n = MAX(*n, (int) iorq->fd);
-
-					/* Check if io request timeout is smaller than current (but not 0). */
-					if (iorq->timeout
-					    && (select_timeout == 0
-						|| iorq->timeout < select_timeout))
-					{
-						/* Set new timeout */
-						select_timeout = iorq->timeout;
-						g_min_timeout_fd = iorq->fd;	/* Remember fd */
-						tv->tv_sec = select_timeout / 1000;
-						tv->tv_usec = (select_timeout % 1000) * 1000;
-						*timeout = True;
-						break;
-					}
-					if (iorq->itv_timeout && iorq->partial_len > 0
-					    && (select_timeout == 0
-						|| iorq->itv_timeout < select_timeout))
-					{
-						/* Set new timeout */
-						select_timeout = iorq->itv_timeout;
-						g_min_timeout_fd = iorq->fd;	/* Remember fd */
-						tv->tv_sec = select_timeout / 1000;
-						tv->tv_usec = (select_timeout % 1000) * 1000;
-						*timeout = True;
-						break;
-					}
-					break;
-
-				case IRP_MJ_WRITE:
-					/* FD still valid? See above. */
-					if ((write(iorq->fd, &c, 0) != 0) && (errno == EBADF))
-						break;
+		if (iorq->fd != fd)
+			continue;
 
-					FD_SET(iorq->fd, wfds);
-					*n = MAX(*n, (int) iorq->fd);
-					break;
-
-				case IRP_MJ_DEVICE_CONTROL:
-					if (select_timeout > 5)
-						select_timeout = 5;	/* serial event queue */
-					break;
-
-			}
-
-		}
-
-		iorq = iorq->next;
+		if (iorq->major == IRP_MJ_READ)
+			events |= REACTOR_READ;
+		else if (iorq->major == IRP_MJ_WRITE)
+			events |= REACTOR_WRITE;
 	}
+
+	if (events)
+		reactor_add(fd, events, rdpdr_fd_ready, NULL);
+	else
+		reactor_remove(fd);
 }
 
 struct async_iorequest *
 rdpdr_remove_iorequest(struct async_iorequest *prev, struct async_iorequest *iorq)
 {
+	uint32 fd, major;
+
 	if (!iorq)
 		return NULL;
 
+	fd = iorq->fd;
+	major = iorq->major;
+	reactor_cancel_timer(rdpdr_iorequest_timeout, iorq);
+
 	if (iorq->buffer)
 		xfree(iorq->buffer);
 	if (prev)
@@ -1083,12 +1069,16 @@ rdpdr_remove_iorequest(struct async_iorequest *prev, struct async_iorequest *ior
 		xfree(iorq);
 		iorq = NULL;
 	}
+
+	if (major == IRP_MJ_READ || major == IRP_MJ_WRITE)
+		rdpdr_watch_fd(fd);
 	return iorq;
 }
 
-/* Check if select() returned with one of the rdpdr file descriptors, and complete io if it did */
+/* Complete io on fd if it is ready for events, and poll serial event
+   waits. With fd -1 only the serial event waits are looked at. */
 static void
-_rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
+rdpdr_check_io(int fd, int events)
 {
 	RD_NTSTATUS status;
 	uint32 result = 0;
@@ -1100,53 +1090,6 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 	struct stream out;
 	uint8 *buffer = NULL;
 
-
-	if (timed_out)
-	{
-		/* check serial iv_timeout */
-
-		iorq = g_iorequest;
-		prev = NULL;
-		while (iorq != NULL)
-		{
-			if (iorq->fd == g_min_timeout_fd)
-			{
-				if ((iorq->partial_len > 0) &&
-				    (g_rdpdr_device[iorq->device].device_type ==
-				     DEVICE_TYPE_SERIAL))
-				{
-
-					/* iv_timeout between 2 chars, send partial_len */
-					/*printf("RDPDR: IVT total %u bytes read of %u\n", iorq->partial_len, iorq->length); */
-					rdpdr_send_completion(iorq->device,
-							      iorq->id, RD_STATUS_SUCCESS,
-							      iorq->partial_len,
-							      iorq->buffer, iorq->partial_len);
-					iorq = rdpdr_remove_iorequest(prev, iorq);
-					return;
-				}
-				else
-				{
-					break;
-				}
-
-			}
-			else
-			{
-				break;
-			}
-
-
-			prev = iorq;
-			if (iorq)
-				iorq = iorq->next;
-
-		}
-
-		rdpdr_abort_io(g_min_timeout_fd, 0, RD_STATUS_TIMEOUT);
-		return;
-	}
-
 	iorq = g_iorequest;
 	prev = NULL;
 	while (iorq != NULL)
@@ -1156,7 +1099,7 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 			switch (iorq->major)
 			{
 				case IRP_MJ_READ:
-					if (FD_ISSET(iorq->fd, rfds))
+					if ((int) iorq->fd == fd && (events & REACTOR_READ))
 					{
 						/* Read the data */
 						fns = iorq->fns;
@@ -1174,10 +1117,18 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 						{
 							iorq->partial_len += result;
 							iorq->offset += result;
+
+							/* restart the wait between characters */
+							if (iorq->itv_timeout
+							    && (iorq->timeout == 0
+								|| iorq->itv_timeout < iorq->timeout))
+								reactor_set_timer(rdpdr_iorequest_timeout,
+										  iorq,
+										  iorq->itv_timeout);
 						}
 
 						logger(Protocol, Debug,
-						       "_rdpdr_check_fds(), %d bytes of data read",
+						       "rdpdr_check_io(), %d bytes of data read",
 						       result);
 
 						/* only delete link if all data has been transfered */
@@ -1186,7 +1137,7 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 						    (result == 0))
 						{
 							logger(Protocol, Debug,
-							       "_rdpdr_check_fds(), AIO total %u bytes read of %u",
+							       "rdpdr_check_io(), AIO total %u bytes read of %u",
 							       iorq->partial_len, iorq->length);
 							rdpdr_send_completion(iorq->device,
 									      iorq->id, status,
@@ -1198,7 +1149,7 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 					}
 					break;
 				case IRP_MJ_WRITE:
-					if (FD_ISSET(iorq->fd, wfds))
+					if ((int) iorq->fd == fd && (events & REACTOR_WRITE))
 					{
 						/* Write data. */
 						fns = iorq->fns;
@@ -1221,7 +1172,7 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 						}
 
 						logger(Protocol, Debug,
-						       "_rdpdr_check_fds(), %d bytes of data written",
+						       "rdpdr_check_io(), %d bytes of data written",
 						       result);
 
 						/* only delete link if all data has been transfered */
@@ -1230,7 +1181,7 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 						    || (result == 0))
 						{
 							logger(Protocol, Debug,
-							       "_rdpdr_check_fds(), AIO total %u bytes written of %u",
+							       "rdpdr_check_io(), AIO total %u bytes written of %u",
 							       iorq->partial_len, iorq->length);
 							rdpdr_send_completion(iorq->device,
 									      iorq->id, status,
@@ -1266,7 +1217,21 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 			iorq = iorq->next;
 	}
 
-	/* Check notify */
+}
+
+/* Complete directory change notifications */
+static void
+rdpdr_check_notify(void)
+{
+	RD_NTSTATUS status;
+	struct async_iorequest *iorq;
+	struct async_iorequest *prev;
+	STREAM notify;
+
+	if (!g_notify_stamp)
+		return;
+	g_notify_stamp = False;
+
 	iorq = g_iorequest;
 	prev = NULL;
 	while (iorq != NULL)
@@ -1280,21 +1245,20 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 					if (g_rdpdr_device[iorq->device].device_type ==
 					    DEVICE_TYPE_DISK)
 					{
-
-						if (g_notify_stamp)
+						notify = s_alloc(1024);
+						status = disk_check_notify(iorq->fd, notify);
+						if (status != RD_STATUS_PENDING)
 						{
-							g_notify_stamp = False;
-							status = disk_check_notify(iorq->fd);
-							if (status != RD_STATUS_PENDING)
-							{
-								rdpdr_send_completion(iorq->device,
-										      iorq->id,
-										      status, 0,
-										      NULL, 0);
-								iorq = rdpdr_remove_iorequest(prev,
-											      iorq);
-							}
+							s_mark_end(notify);
+							rdpdr_send_completion(iorq->device,
+									      iorq->id,
+									      status,
+									      s_length(notify),
+									      notify->data,
+									      s_length(notify));
+							iorq = rdpdr_remove_iorequest(prev, iorq);
 						}
+						s_free(notify);
 					}
 					break;
 
@@ -1310,21 +1274,75 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 
 }
 
-void
-rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
+static void
+rdpdr_fd_ready(int fd, int events, void *data)
 {
-	fd_set dummy;
-
-
-	FD_ZERO(&dummy);
-
+	UNUSED(data);
 
 	/* fist check event queue only,
 	   any serial wait event must be done before read block will be sent
 	 */
+	rdpdr_check_io(-1, 0);
+	rdpdr_check_io(fd, events);
+}
 
-	_rdpdr_check_fds(&dummy, &dummy, False);
-	_rdpdr_check_fds(rfds, wfds, timed_out);
+/* A read timed out, either in total or between two characters */
+static void
+rdpdr_iorequest_timeout(void *data)
+{
+	struct async_iorequest *iorq;
+	struct async_iorequest *prev;
+
+	prev = NULL;
+	for (iorq = g_iorequest; iorq != NULL && iorq != data; iorq = iorq->next)
+		prev = iorq;
+
+	if (iorq == NULL)
+		return;
+
+	if ((iorq->partial_len > 0) &&
+	    (g_rdpdr_device[iorq->device].device_type == DEVICE_TYPE_SERIAL))
+	{
+		/* iv_timeout between 2 chars, send partial_len */
+		rdpdr_send_completion(iorq->device, iorq->id, RD_STATUS_SUCCESS,
+				      iorq->partial_len, iorq->buffer, iorq->partial_len);
+	}
+	else
+	{
+		rdpdr_send_completion(iorq->device, iorq->id, RD_STATUS_TIMEOUT, 0,
+				      (uint8 *) "", 1);
+	}
+	rdpdr_remove_iorequest(prev, iorq);
+}
+
+/* Serial event waits have no descriptor, poll them only while one is
+   pending */
+static void
+rdpdr_event_timer(void *data)
+{
+	struct async_iorequest *iorq;
+
+	UNUSED(data);
+
+	rdpdr_check_io(-1, 0);
+
+	for (iorq = g_iorequest; iorq != NULL; iorq = iorq->next)
+	{
+		if (iorq->fd != 0 && iorq->major == IRP_MJ_DEVICE_CONTROL)
+		{
+			reactor_set_timer(rdpdr_event_timer, NULL, RDPDR_EVENT_POLL);
+			break;
+		}
+	}
+}
+
+/* Complete io requests that do not wait for a descriptor, to be
+   called on every pass of the main loop */
+void
+rdpdr_check_events(void)
+{
+	rdpdr_check_io(-1, 0);
+	rdpdr_check_notify();
 }
 
 
@@ -0,0 +1,698 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Graphics Pipeline Extension [MS-RDPEGFX]
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The server draws into surfaces kept here, as 32 bpp top-down BGRX.
+   Whatever changed in the surfaces mapped to the output is painted
+   once per frame, and the frame is acknowledged after that so that the
+   server does not run ahead of what we manage to decode and paint. */
+
+#include "rdesktop.h"
+
+#define RDPGFX_CHANNEL_NAME "Microsoft::Windows::RDS::Graphics"
+
+/* [MS-RDPEGFX] 2.2.1.5 */
+#define RDPGFX_CMDID_WIRETOSURFACE_1		0x0001
+#define RDPGFX_CMDID_WIRETOSURFACE_2		0x0002
+#define RDPGFX_CMDID_DELETEENCODINGCONTEXT	0x0003
+#define RDPGFX_CMDID_SOLIDFILL			0x0004
+#define RDPGFX_CMDID_SURFACETOSURFACE		0x0005
+#define RDPGFX_CMDID_SURFACETOCACHE		0x0006
+#define RDPGFX_CMDID_CACHETOSURFACE		0x0007
+#define RDPGFX_CMDID_EVICTCACHEENTRY		0x0008
+#define RDPGFX_CMDID_CREATESURFACE		0x0009
+#define RDPGFX_CMDID_DELETESURFACE		0x000a
+#define RDPGFX_CMDID_STARTFRAME			0x000b
+#define RDPGFX_CMDID_ENDFRAME			0x000c
+#define RDPGFX_CMDID_FRAMEACKNOWLEDGE		0x000d
+#define RDPGFX_CMDID_RESETGRAPHICS		0x000e
+#define RDPGFX_CMDID_MAPSURFACETOOUTPUT		0x000f
+#define RDPGFX_CMDID_CACHEIMPORTREPLY		0x0011
+#define RDPGFX_CMDID_CAPSADVERTISE		0x0012
+#define RDPGFX_CMDID_CAPSCONFIRM		0x0013
+
+/* [MS-RDPEGFX] 2.2.3.1 */
+#define RDPGFX_CAPVERSION_8			0x00080004
+#define RDPGFX_CAPS_FLAG_SMALL_CACHE		0x00000002
+
+/* [MS-RDPEGFX] 2.2.1.1 */
+#define RDPGFX_CODECID_UNCOMPRESSED		0x0000
+#define RDPGFX_CODECID_PLANAR			0x000a
+
+#define RDPGFX_HEADER_SIZE	8
+
+/* with RDPGFX_CAPS_FLAG_SMALL_CACHE */
+#define RDPGFX_CACHE_SLOTS	4096
+
+/* largest surface or update accepted from the server, in bytes */
+#define RDPGFX_MAX_IMAGE_SIZE	(256 * 1024 * 1024)
+
+typedef struct _RDPGFX_SURFACE
+{
+	uint16 id;
+	int width, height;
+	uint8 *data;
+	RD_BOOL mapped;
+	int output_x, output_y;
+	/* bounding box of what changed since the last paint */
+	int dirty_left, dirty_top, dirty_right, dirty_bottom;
+}
+RDPGFX_SURFACE;
+
+typedef struct _RDPGFX_CACHE_ENTRY
+{
+	int width, height;
+	uint8 *data;
+}
+RDPGFX_CACHE_ENTRY;
+
+typedef struct _RDPGFX_RECT
+{
+	uint16 left, top, right, bottom;
+}
+RDPGFX_RECT;
+
+extern int g_server_depth;
+
+static RDPGFX_SURFACE **g_surfaces;
+static int g_surfaces_size;
+
+static RDPGFX_CACHE_ENTRY g_cache[RDPGFX_CACHE_SLOTS];
+
+static uint32 g_frames_decoded;
+
+/* decompressed messages */
+static STREAM g_message;
+
+static RDPGFX_SURFACE *
+rdpgfx_get_surface(uint16 id)
+{
+	if (id >= g_surfaces_size || g_surfaces[id] == NULL)
+	{
+		logger(Graphics, Warning, "rdpgfx_get_surface(), no surface %d", id);
+		return NULL;
+	}
+	return g_surfaces[id];
+}
+
+static void
+rdpgfx_delete_surface(uint16 id)
+{
+	if (id >= g_surfaces_size || g_surfaces[id] == NULL)
+		return;
+
+	xfree(g_surfaces[id]->data);
+	xfree(g_surfaces[id]);
+	g_surfaces[id] = NULL;
+}
+
+static void
+rdpgfx_evict_cache_entry(int slot)
+{
+	xfree(g_cache[slot].data);
+	memset(&g_cache[slot], 0, sizeof(RDPGFX_CACHE_ENTRY));
+}
+
+static void
+rdpgfx_reset(void)
+{
+	int i;
+
+	for (i = 0; i < g_surfaces_size; i++)
+		rdpgfx_delete_surface(i);
+	for (i = 0; i < RDPGFX_CACHE_SLOTS; i++)
+		rdpgfx_evict_cache_entry(i);
+}
+
+static void
+rdpgfx_in_rect(STREAM s, RDPGFX_RECT * r)
+{
+	in_uint16_le(s, r->left);
+	in_uint16_le(s, r->top);
+	in_uint16_le(s, r->right);
+	in_uint16_le(s, r->bottom);
+}
+
+/* Clip a rectangle with exclusive right and bottom edges to the surface */
+static RD_BOOL
+rdpgfx_clip_rect(RDPGFX_SURFACE * surface, RDPGFX_RECT * r)
+{
+	r->right = MIN(r->right, surface->width);
+	r->bottom = MIN(r->bottom, surface->height);
+	return r->left < r->right && r->top < r->bottom;
+}
+
+static void
+rdpgfx_invalidate(RDPGFX_SURFACE * surface, int left, int top, int right, int bottom)
+{
+	if (surface->dirty_right <= surface->dirty_left)
+	{
+		surface->dirty_left = left;
+		surface->dirty_top = top;
+		surface->dirty_right = right;
+		surface->dirty_bottom = bottom;
+		return;
+	}
+
+	surface->dirty_left = MIN(surface->dirty_left, left);
+	surface->dirty_top = MIN(surface->dirty_top, top);
+	surface->dirty_right = MAX(surface->dirty_right, right);
+	surface->dirty_bottom = MAX(surface->dirty_bottom, bottom);
+}
+
+/* Copy a cx x cy block of pixels, rows may overlap */
+static void
+rdpgfx_blit(uint8 * dst, int dst_stride, uint8 * src, int src_stride, int cx, int cy)
+{
+	int y;
+
+	if (dst > src)
+	{
+		for (y = cy - 1; y >= 0; y--)
+			memmove(dst + y * dst_stride, src + y * src_stride, cx * 4);
+	}
+	else
+	{
+		for (y = 0; y < cy; y++)
+			memmove(dst + y * dst_stride, src + y * src_stride, cx * 4);
+	}
+}
+
+/* Paint what changed in the mapped surfaces */
+static void
+rdpgfx_flush(void)
+{
+	RDPGFX_SURFACE *surface;
+	uint8 *buf;
+	int i, cx, cy;
+
+	if (g_server_depth != 32)
+		return;
+
+	ui_begin_update();
+	for (i = 0; i < g_surfaces_size; i++)
+	{
+		surface = g_surfaces[i];
+		if (surface == NULL || !surface->mapped
+		    || surface->dirty_right <= surface->dirty_left)
+			continue;
+
+		cx = surface->dirty_right - surface->dirty_left;
+		cy = surface->dirty_bottom - surface->dirty_top;
+		buf = xmalloc(cx * cy * 4);
+		rdpgfx_blit(buf, cx * 4,
+			    surface->data + (surface->dirty_top * surface->width +
+					     surface->dirty_left) * 4, surface->width * 4, cx, cy);
+		ui_paint_bitmap(surface->output_x + surface->dirty_left,
+				surface->output_y + surface->dirty_top, cx, cy, cx, cy, buf);
+		xfree(buf);
+
+		surface->dirty_left = surface->dirty_right = 0;
+	}
+	ui_end_update();
+}
+
+static void
+rdpgfx_send(uint16 cmd, STREAM data)
+{
+	STREAM s;
+
+	s = s_alloc(RDPGFX_HEADER_SIZE + s_length(data));
+	out_uint16_le(s, cmd);
+	out_uint16_le(s, 0);	/* flags */
+	out_uint32_le(s, RDPGFX_HEADER_SIZE + s_length(data));
+	out_uint8a(s, data->data, s_length(data));
+	s_mark_end(s);
+
+	dvc_send(RDPGFX_CHANNEL_NAME, s);
+	s_free(s);
+}
+
+static void
+rdpgfx_send_caps_advertise(void)
+{
+	STREAM s;
+
+	logger(Protocol, Debug, "%s()", __func__);
+
+	s = s_alloc(14);
+	out_uint16_le(s, 1);	/* capsSetCount */
+	out_uint32_le(s, RDPGFX_CAPVERSION_8);	/* version */
+	out_uint32_le(s, 4);	/* capsDataLength */
+	out_uint32_le(s, RDPGFX_CAPS_FLAG_SMALL_CACHE);	/* flags */
+	s_mark_end(s);
+
+	rdpgfx_send(RDPGFX_CMDID_CAPSADVERTISE, s);
+	s_free(s);
+}
+
+static void
+rdpgfx_send_frame_acknowledge(uint32 frame_id)
+{
+	STREAM s;
+
+	s = s_alloc(12);
+	out_uint32_le(s, 0);	/* queueDepth, QUEUE_DEPTH_UNAVAILABLE */
+	out_uint32_le(s, frame_id);
+	out_uint32_le(s, g_frames_decoded);	/* totalFramesDecoded */
+	s_mark_end(s);
+
+	rdpgfx_send(RDPGFX_CMDID_FRAMEACKNOWLEDGE, s);
+	s_free(s);
+}
+
+/* Bytes of a 32 bpp image, 0 if it is empty or too large */
+static size_t
+rdpgfx_image_size(int width, int height)
+{
+	if (width <= 0 || height <= 0 || (size_t) width * height > RDPGFX_MAX_IMAGE_SIZE / 4)
+		return 0;
+	return (size_t) width * height * 4;
+}
+
+static void
+rdpgfx_process_create_surface(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	uint16 id, width, height;
+	size_t bytes;
+	int size;
+
+	in_uint16_le(s, id);
+	in_uint16_le(s, width);
+	in_uint16_le(s, height);
+	in_uint8s(s, 1);	/* pixelFormat, alpha is not used */
+
+	logger(Graphics, Debug, "rdpgfx_process_create_surface(), id %d, %dx%d", id, width,
+	       height);
+
+	bytes = rdpgfx_image_size(width, height);
+	if (bytes == 0)
+	{
+		logger(Graphics, Warning, "rdpgfx_process_create_surface(), invalid size %dx%d",
+		       width, height);
+		return;
+	}
+
+	if (id >= g_surfaces_size)
+	{
+		size = MAX(id + 1, g_surfaces_size * 2);
+		g_surfaces = xrealloc(g_surfaces, size * sizeof(RDPGFX_SURFACE *));
+		memset(g_surfaces + g_surfaces_size, 0,
+		       (size - g_surfaces_size) * sizeof(RDPGFX_SURFACE *));
+		g_surfaces_size = size;
+	}
+
+	rdpgfx_delete_surface(id);
+
+	surface = xmalloc(sizeof(RDPGFX_SURFACE));
+	memset(surface, 0, sizeof(RDPGFX_SURFACE));
+	surface->id = id;
+	surface->width = width;
+	surface->height = height;
+	surface->data = xmalloc(bytes);
+	memset(surface->data, 0, bytes);
+	g_surfaces[id] = surface;
+}
+
+static void
+rdpgfx_process_map_surface_to_output(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	uint16 id;
+	uint32 x, y;
+
+	in_uint16_le(s, id);
+	in_uint8s(s, 2);	/* reserved */
+	in_uint32_le(s, x);
+	in_uint32_le(s, y);
+
+	surface = rdpgfx_get_surface(id);
+	if (surface == NULL)
+		return;
+
+	surface->mapped = True;
+	surface->output_x = x;
+	surface->output_y = y;
+	rdpgfx_invalidate(surface, 0, 0, surface->width, surface->height);
+}
+
+static void
+rdpgfx_process_wire_to_surface_1(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	RDPGFX_RECT r;
+	uint16 id, codec;
+	uint32 length;
+	uint8 *data, *buf;
+	int cx, cy;
+	size_t bytes;
+	RD_BOOL ok = False;
+	uint64 start;
+
+	in_uint16_le(s, id);
+	in_uint16_le(s, codec);
+	in_uint8s(s, 1);	/* pixelFormat */
+	rdpgfx_in_rect(s, &r);
+	in_uint32_le(s, length);
+	in_uint8p(s, data, length);
+
+	surface = rdpgfx_get_surface(id);
+	if (surface == NULL || r.right <= r.left || r.bottom <= r.top)
+		return;
+
+	cx = r.right - r.left;
+	cy = r.bottom - r.top;
+	bytes = rdpgfx_image_size(cx, cy);
+	if (bytes == 0)
+		return;
+	buf = xmalloc(bytes);
+
+	switch (codec)
+	{
+		case RDPGFX_CODECID_UNCOMPRESSED:
+			ok = length >= bytes;
+			if (ok)
+				memcpy(buf, data, bytes);
+			break;
+
+		case RDPGFX_CODECID_PLANAR:
+			start = stats_now();
+			ok = bitmap_decompress_planar(buf, cx, cy, data, length);
+			stats_record(STATS_DECODE_PLANAR, start);
+			break;
+
+		default:
+			logger(Graphics, Warning,
+			       "rdpgfx_process_wire_to_surface_1(), unhandled codec 0x%x", codec);
+			xfree(buf);
+			return;
+	}
+
+	if (ok && rdpgfx_clip_rect(surface, &r))
+	{
+		rdpgfx_blit(surface->data + (r.top * surface->width + r.left) * 4,
+			    surface->width * 4, buf, cx * 4, r.right - r.left, r.bottom - r.top);
+		rdpgfx_invalidate(surface, r.left, r.top, r.right, r.bottom);
+	}
+	else if (!ok)
+	{
+		logger(Graphics, Warning,
+		       "rdpgfx_process_wire_to_surface_1(), failed to decode codec 0x%x", codec);
+	}
+
+	xfree(buf);
+}
+
+static void
+rdpgfx_process_solid_fill(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	RDPGFX_RECT r;
+	uint16 id, count;
+	uint8 pixel[4], *p;
+	int i, x, y;
+
+	in_uint16_le(s, id);
+	in_uint8a(s, pixel, 4);	/* B, G, R, XA */
+	pixel[3] = 0xff;
+	in_uint16_le(s, count);
+
+	surface = rdpgfx_get_surface(id);
+	if (surface == NULL)
+		return;
+
+	for (i = 0; i < count; i++)
+	{
+		rdpgfx_in_rect(s, &r);
+		if (!rdpgfx_clip_rect(surface, &r))
+			continue;
+
+		for (y = r.top; y < r.bottom; y++)
+		{
+			p = surface->data + (y * surface->width + r.left) * 4;
+			for (x = r.left; x < r.right; x++, p += 4)
+				memcpy(p, pixel, 4);
+		}
+		rdpgfx_invalidate(surface, r.left, r.top, r.right, r.bottom);
+	}
+}
+
+static void
+rdpgfx_process_surface_to_surface(STREAM s)
+{
+	RDPGFX_SURFACE *src, *dst;
+	RDPGFX_RECT r, d;
+	uint16 src_id, dst_id, count, x, y;
+	int i;
+
+	in_uint16_le(s, src_id);
+	in_uint16_le(s, dst_id);
+	rdpgfx_in_rect(s, &r);
+	in_uint16_le(s, count);
+
+	src = rdpgfx_get_surface(src_id);
+	dst = rdpgfx_get_surface(dst_id);
+	if (src == NULL || dst == NULL || !rdpgfx_clip_rect(src, &r))
+		return;
+
+	for (i = 0; i < count; i++)
+	{
+		in_uint16_le(s, x);
+		in_uint16_le(s, y);
+
+		d.left = x;
+		d.top = y;
+		d.right = x + (r.right - r.left);
+		d.bottom = y + (r.bottom - r.top);
+		if (!rdpgfx_clip_rect(dst, &d))
+			continue;
+
+		rdpgfx_blit(dst->data + (d.top * dst->width + d.left) * 4, dst->width * 4,
+			    src->data + (r.top * src->width + r.left) * 4, src->width * 4,
+			    d.right - d.left, d.bottom - d.top);
+		rdpgfx_invalidate(dst, d.left, d.top, d.right, d.bottom);
+	}
+}
+
+static void
+rdpgfx_process_surface_to_cache(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	RDPGFX_CACHE_ENTRY *entry;
+	RDPGFX_RECT r;
+	uint16 id, slot;
+
+	in_uint16_le(s, id);
+	in_uint8s(s, 8);	/* cacheKey */
+	in_uint16_le(s, slot);
+	rdpgfx_in_rect(s, &r);
+
+	surface = rdpgfx_get_surface(id);
+	if (surface == NULL || slot == 0 || slot > RDPGFX_CACHE_SLOTS
+	    || !rdpgfx_clip_rect(surface, &r))
+		return;
+
+	rdpgfx_evict_cache_entry(slot - 1);
+	entry = &g_cache[slot - 1];
+	entry->width = r.right - r.left;
+	entry->height = r.bottom - r.top;
+	entry->data = xmalloc(entry->width * entry->height * 4);
+	rdpgfx_blit(entry->data, entry->width * 4,
+		    surface->data + (r.top * surface->width + r.left) * 4, surface->width * 4,
+		    entry->width, entry->height);
+}
+
+static void
+rdpgfx_process_cache_to_surface(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	RDPGFX_CACHE_ENTRY *entry;
+	RDPGFX_RECT d;
+	uint16 slot, id, count, x, y;
+	int i;
+
+	in_uint16_le(s, slot);
+	in_uint16_le(s, id);
+	in_uint16_le(s, count);
+
+	surface = rdpgfx_get_surface(id);
+	if (surface == NULL || slot == 0 || slot > RDPGFX_CACHE_SLOTS)
+		return;
+
+	entry = &g_cache[slot - 1];
+	if (entry->data == NULL)
+	{
+		logger(Graphics, Warning, "rdpgfx_process_cache_to_surface(), empty slot %d",
+		       slot);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		in_uint16_le(s, x);
+		in_uint16_le(s, y);
+
+		d.left = x;
+		d.top = y;
+		d.right = x + entry->width;
+		d.bottom = y + entry->height;
+		if (!rdpgfx_clip_rect(surface, &d))
+			continue;
+
+		rdpgfx_blit(surface->data + (d.top * surface->width + d.left) * 4,
+			    surface->width * 4, entry->data, entry->width * 4,
+			    d.right - d.left, d.bottom - d.top);
+		rdpgfx_invalidate(surface, d.left, d.top, d.right, d.bottom);
+	}
+}
+
+static void
+rdpgfx_process_pdu(uint16 cmd, STREAM s)
+{
+	uint16 id;
+	uint32 frame_id, version;
+
+	switch (cmd)
+	{
+		case RDPGFX_CMDID_CAPSCONFIRM:
+			in_uint32_le(s, version);
+			logger(Protocol, Debug, "rdpgfx_process_pdu(), server confirmed version 0x%x",
+			       version);
+			break;
+
+		case RDPGFX_CMDID_RESETGRAPHICS:
+			rdpgfx_reset();
+			break;
+
+		case RDPGFX_CMDID_CREATESURFACE:
+			rdpgfx_process_create_surface(s);
+			break;
+
+		case RDPGFX_CMDID_DELETESURFACE:
+			in_uint16_le(s, id);
+			rdpgfx_delete_surface(id);
+			break;
+
+		case RDPGFX_CMDID_MAPSURFACETOOUTPUT:
+			rdpgfx_process_map_surface_to_output(s);
+			break;
+
+		case RDPGFX_CMDID_STARTFRAME:
+			break;
+
+		case RDPGFX_CMDID_ENDFRAME:
+			in_uint32_le(s, frame_id);
+			rdpgfx_flush();
+			g_frames_decoded++;
+			rdpgfx_send_frame_acknowledge(frame_id);
+			break;
+
+		case RDPGFX_CMDID_WIRETOSURFACE_1:
+			rdpgfx_process_wire_to_surface_1(s);
+			break;
+
+		case RDPGFX_CMDID_SOLIDFILL:
+			rdpgfx_process_solid_fill(s);
+			break;
+
+		case RDPGFX_CMDID_SURFACETOSURFACE:
+			rdpgfx_process_surface_to_surface(s);
+			break;
+
+		case RDPGFX_CMDID_SURFACETOCACHE:
+			rdpgfx_process_surface_to_cache(s);
+			break;
+
+		case RDPGFX_CMDID_CACHETOSURFACE:
+			rdpgfx_process_cache_to_surface(s);
+			break;
+
+		case RDPGFX_CMDID_EVICTCACHEENTRY:
+			in_uint16_le(s, id);
+			if (id > 0 && id <= RDPGFX_CACHE_SLOTS)
+				rdpgfx_evict_cache_entry(id - 1);
+			break;
+
+		case RDPGFX_CMDID_DELETEENCODINGCONTEXT:
+		case RDPGFX_CMDID_CACHEIMPORTREPLY:
+			break;
+
+		default:
+			logger(Protocol, Warning, "rdpgfx_process_pdu(), unhandled command 0x%x",
+			       cmd);
+			break;
+	}
+}
+
+static void
+rdpgfx_process(STREAM s)
+{
+	uint16 cmd;
+	uint32 length;
+	size_t next;
+	struct stream packet;
+
+	if (g_message == NULL)
+		g_message = s_alloc(65536);
+	s_reset(g_message);
+
+	if (!zgfx_decompress(s, g_message))
+	{
+		logger(Protocol, Error, "rdpgfx_process(), failed to decompress message");
+		return;
+	}
+	s_mark_end(g_message);
+	s_seek(g_message, 0);
+
+	/* a message may hold several PDUs */
+	while (s_check_rem(g_message, RDPGFX_HEADER_SIZE))
+	{
+		in_uint16_le(g_message, cmd);
+		in_uint8s(g_message, 2);	/* flags */
+		in_uint32_le(g_message, length);
+		if (length < RDPGFX_HEADER_SIZE
+		    || !s_check_rem(g_message, length - RDPGFX_HEADER_SIZE))
+		{
+			logger(Protocol, Error, "rdpgfx_process(), invalid PDU length %d", length);
+			return;
+		}
+		next = s_tell(g_message) + length - RDPGFX_HEADER_SIZE;
+
+		/* each PDU is parsed from a stream of its own */
+		packet = *g_message;
+		packet.end = packet.data + next;
+		rdpgfx_process_pdu(cmd, &packet);
+
+		s_seek(g_message, next);
+	}
+}
+
+static void
+rdpgfx_open(void)
+{
+	zgfx_reset();
+	rdpgfx_reset();
+	g_frames_decoded = 0;
+	rdpgfx_send_caps_advertise();
+}
+
+void
+rdpgfx_init(void)
+{
+	dvc_channels_register_with_open(RDPGFX_CHANNEL_NAME, rdpgfx_process, rdpgfx_open);
+}
@@ -42,9 +42,18 @@
 #define SNDC_QUALITYMODE	0x0C
 #define SNDC_WAVE2		0x0D
 
-#define MAX_FORMATS		10
+#define MAX_FORMATS		32
 #define MAX_QUEUE		50
 
+/* Playout buffer depth in ms, from the arrival jitter */
+#define MIN_TARGET		20
+#define MAX_TARGET		500
+#define UNDERRUN_PENALTY	20
+/* a longer gap between packets is silence rather than an underrun */
+#define UNDERRUN_GAP		500
+#define MAX_DRIFT_PPM		5000
+#define MAX_WATCH		64
+
 extern RD_BOOL g_rdpsnd;
 
 static VCHANNEL *rdpsnd_channel;
@@ -57,23 +66,55 @@ static RD_BOOL rdpsnd_negotiated;
 static RD_BOOL device_open;
 
 static RD_WAVEFORMATEX formats[MAX_FORMATS];
+/* what each format is played as, the PCM a compressed one decodes to */
+static RD_WAVEFORMATEX device_formats[MAX_FORMATS];
 static unsigned int format_count;
 static unsigned int current_format;
 
 unsigned int queue_hi, queue_lo, queue_pending;
 struct audio_packet packet_queue[MAX_QUEUE];
 
+/* Packets from queue_hi to queue_held are held back from the driver
+   until enough audio is buffered to ride out the arrival jitter */
+static unsigned int queue_held;
+static RD_BOOL queue_buffering;
+static struct timeval queue_release_tv;
+static struct timeval queue_last_completion_tv;
+
+static long jitter_transit;	/* ms from the server tick to arrival */
+static RD_BOOL jitter_have_transit;
+static uint32 jitter;		/* mean deviation in ms, times 16 */
+static uint32 jitter_underruns;	/* ms added to the target by underruns */
+static struct timeval jitter_underrun_tv;
+static long drift_queued;	/* mean queued audio in us */
+
+/* Driver descriptors, playback_events are only waited for while
+   there is audio to play. fd -1 is a driver without descriptors that
+   wants to be called on every pass. */
+struct rdpsnd_watch
+{
+	int fd;
+	int events;
+	int playback_events;
+	int active;		/* what the reactor waits for */
+};
+static struct rdpsnd_watch watches[MAX_WATCH];
+static unsigned int watch_count;
+
 static uint8 packet_opcode;
 static size_t packet_len;
 static struct stream packet;
 
 void (*wave_out_play) (void);
 
-static void rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index);
+static void rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index, uint32 duration);
 static void rdpsnd_queue_init(void);
 static void rdpsnd_queue_clear(void);
 static void rdpsnd_queue_complete_pending(void);
 static long rdpsnd_queue_next_completion(void);
+static void rdpsnd_queue_release(void);
+static long rdpsnd_queue_next_release(void);
+static void rdpsnd_queue_update(void);
 
 static STREAM
 rdpsnd_init_packet(uint8 type, uint16 size)
@@ -148,6 +189,21 @@ rdpsnd_auto_select(void)
 	return False;
 }
 
+/* Formats the driver plays, or that rdpsnd_dsp_decode turns into PCM
+   the driver plays */
+static RD_BOOL
+rdpsnd_format_supported(RD_WAVEFORMATEX * format, RD_WAVEFORMATEX * device_format)
+{
+	if (format->wFormatTag != WAVE_FORMAT_PCM && rdpsnd_dsp_decode_supported(format))
+	{
+		rdpsnd_dsp_decode_format(format, device_format);
+		return current_driver->wave_out_format_supported(device_format);
+	}
+
+	*device_format = *format;
+	return current_driver->wave_out_format_supported(format);
+}
+
 static void
 rdpsnd_process_negotiate(STREAM in)
 {
@@ -159,6 +215,8 @@ rdpsnd_process_negotiate(STREAM in)
 	RD_BOOL device_available = False;
 	int readcnt;
 	int discardcnt;
+	unsigned int compressed_count, size;
+	RD_WAVEFORMATEX compressed, device_format;
 
 	in_uint8s(in, 14);	/* initial bytes not valid from server */
 	in_uint16_le(in, in_format_count);
@@ -185,7 +243,7 @@ rdpsnd_process_negotiate(STREAM in)
 		device_available = True;
 	}
 
-	format_count = 0;
+	format_count = compressed_count = 0;
 	if (s_check_rem(in, 18 * in_format_count))
 	{
 		for (i = 0; i < in_format_count; i++)
@@ -213,8 +271,26 @@ rdpsnd_process_negotiate(STREAM in)
 			in_uint8a(in, format->cb, readcnt);
 			in_uint8s(in, discardcnt);
 
-			if (current_driver && current_driver->wave_out_format_supported(format))
+			if (current_driver
+			    && rdpsnd_format_supported(format, &device_formats[format_count]))
 			{
+				/* offer compressed formats first, to save bandwidth */
+				if (format->wFormatTag != WAVE_FORMAT_PCM)
+				{
+					compressed = formats[format_count];
+					device_format = device_formats[format_count];
+					memmove(&formats[compressed_count + 1], &formats[compressed_count],
+						(format_count - compressed_count) *
+						sizeof(RD_WAVEFORMATEX));
+					memmove(&device_formats[compressed_count + 1],
+						&device_formats[compressed_count],
+						(format_count - compressed_count) *
+						sizeof(RD_WAVEFORMATEX));
+					formats[compressed_count] = compressed;
+					device_formats[compressed_count] = device_format;
+					compressed_count++;
+				}
+
 				format_count++;
 				if (format_count == MAX_FORMATS)
 					break;
@@ -222,7 +298,11 @@ rdpsnd_process_negotiate(STREAM in)
 		}
 	}
 
-	out = rdpsnd_init_packet(SNDC_FORMATS, 20 + 18 * format_count);
+	size = 20;
+	for (i = 0; i < format_count; i++)
+		size += 18 + MIN(formats[i].cbSize, MAX_CBSIZE);
+
+	out = rdpsnd_init_packet(SNDC_FORMATS, size);
 
 	uint32 flags = TSSNDCAPS_VOLUME;
 
@@ -252,7 +332,9 @@ rdpsnd_process_negotiate(STREAM in)
 		out_uint32_le(out, format->nAvgBytesPerSec);
 		out_uint16_le(out, format->nBlockAlign);
 		out_uint16_le(out, format->wBitsPerSample);
-		out_uint16(out, 0);	/* cbSize */
+		/* ADPCM needs its block parameters echoed */
+		out_uint16_le(out, MIN(format->cbSize, MAX_CBSIZE));
+		out_uint8a(out, format->cb, MIN(format->cbSize, MAX_CBSIZE));
 	}
 
 	s_mark_end(out);
@@ -301,6 +383,7 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 	uint8 packet_index;
 	unsigned int size;
 	unsigned char *data;
+	STREAM decoded;
 
 	switch (opcode)
 	{
@@ -312,9 +395,9 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 			logger(Sound, Debug,
 			       "rdpsnd_process_packet(), RDPSND_WRITE(tick: %u, format: %u, index: %u, data: %u bytes)\n",
 			       (unsigned) tick, (unsigned) format, (unsigned) packet_index,
-			       (unsigned) s->size - 8);
+			       (unsigned) s_length(s) - 8);
 
-			if (format >= MAX_FORMATS)
+			if (format >= format_count)
 			{
 				logger(Sound, Error,
 				       "rdpsnd_process_packet(), invalid format index");
@@ -338,7 +421,7 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 					rdpsnd_send_waveconfirm(tick, packet_index);
 					break;
 				}
-				if (!current_driver->wave_out_set_format(&formats[format]))
+				if (!current_driver->wave_out_set_format(&device_formats[format]))
 				{
 					rdpsnd_send_waveconfirm(tick, packet_index);
 					current_driver->wave_out_close();
@@ -351,10 +434,28 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 
 			size = s_remaining(s);
 			in_uint8p(s, data, size);
+
+			decoded = NULL;
+			if (formats[current_format].wFormatTag != WAVE_FORMAT_PCM)
+			{
+				decoded = rdpsnd_dsp_decode(data, size, &formats[current_format]);
+				if (decoded == NULL)
+				{
+					rdpsnd_send_waveconfirm(tick, packet_index);
+					break;
+				}
+				size = s_remaining(decoded);
+				in_uint8p(decoded, data, size);
+			}
+
 			rdpsnd_queue_write(rdpsnd_dsp_process(data, size,
 							      current_driver,
-							      &formats[current_format]),
-					   tick, packet_index);
+							      &device_formats[current_format]),
+					   tick, packet_index,
+					   (uint64) size * 1000000 /
+					   MAX(1, device_formats[current_format].nAvgBytesPerSec));
+			if (decoded != NULL)
+				s_free(decoded);
 			return;
 			break;
 		case SNDC_CLOSE:
@@ -600,56 +701,283 @@ rdpsnd_show_help(void)
 	}
 }
 
+static void
+rdpsnd_fd_ready(int fd, int events, void *data)
+{
+	UNUSED(data);
+
+	current_driver->fd_ready(fd, events);
+	rdpsnd_queue_update();
+}
+
+static void
+rdpsnd_poll(void *data)
+{
+	unsigned int i;
+
+	UNUSED(data);
+
+	current_driver->fd_ready(-1, REACTOR_WRITE);
+	rdpsnd_queue_update();
+
+	for (i = 0; i < watch_count; i++)
+	{
+		if (watches[i].fd == -1 && watches[i].active)
+			reactor_set_timer(rdpsnd_poll, NULL, 0);
+	}
+}
+
+static void
+rdpsnd_watch_update(struct rdpsnd_watch *w)
+{
+	int events;
+
+	events = w->events;
+	if (!rdpsnd_queue_empty())
+		events |= w->playback_events;
+
+	if (events == w->active)
+		return;
+	w->active = events;
+
+	if (w->fd == -1)
+	{
+		if (events)
+			reactor_set_timer(rdpsnd_poll, NULL, 0);
+		else
+			reactor_cancel_timer(rdpsnd_poll, NULL);
+	}
+	else if (events)
+		reactor_add(w->fd, events, rdpsnd_fd_ready, NULL);
+	else
+		reactor_remove(w->fd);
+}
+
+/* Have the driver's fd_ready() called when fd is ready for events, or
+   for playback_events while there is audio queued. Zero for both stops
+   watching fd. */
 void
-rdpsnd_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+rdpsnd_watch_fd(int fd, int events, int playback_events)
 {
-	long next_pending;
+	struct rdpsnd_watch *w;
+	unsigned int i;
 
-	if (device_open)
-		current_driver->add_fds(n, rfds, wfds, tv);
+	for (i = 0; i < watch_count; i++)
+	{
+		if (watches[i].fd == fd)
+			break;
+	}
 
-	next_pending = rdpsnd_queue_next_completion();
-	if (next_pending >= 0)
+	if (i == watch_count)
 	{
-		long cur_timeout;
+		if (events == 0 && playback_events == 0)
+			return;
 
-		cur_timeout = tv->tv_sec * 1000000 + tv->tv_usec;
-		if (cur_timeout > next_pending)
+		if (watch_count == MAX_WATCH)
 		{
-			tv->tv_sec = next_pending / 1000000;
-			tv->tv_usec = next_pending % 1000000;
+			logger(Sound, Error, "rdpsnd_watch_fd(), too many descriptors");
+			return;
 		}
+		watch_count++;
+		watches[i].fd = fd;
+		watches[i].active = 0;
 	}
+
+	w = &watches[i];
+	w->events = events;
+	w->playback_events = playback_events;
+	rdpsnd_watch_update(w);
+
+	if (events == 0 && playback_events == 0)
+		watches[i] = watches[--watch_count];
 }
 
-void
-rdpsnd_check_fds(fd_set * rfds, fd_set * wfds)
+static void
+rdpsnd_queue_timer(void *data)
 {
+	UNUSED(data);
+
+	if (queue_held != queue_hi && rdpsnd_queue_next_release() == 0)
+		rdpsnd_queue_release();
+
 	rdpsnd_queue_complete_pending();
+	rdpsnd_queue_update();
+}
 
-	if (device_open)
-		current_driver->check_fds(rfds, wfds);
+/* Follow a change of the queue with the descriptors and the timer */
+static void
+rdpsnd_queue_update(void)
+{
+	unsigned int i;
+	long next_pending;
+
+	for (i = 0; i < watch_count; i++)
+		rdpsnd_watch_update(&watches[i]);
+
+	next_pending = rdpsnd_queue_next_completion();
+	if (queue_held != queue_hi)
+	{
+		long release = rdpsnd_queue_next_release();
+
+		if (next_pending < 0 || release < next_pending)
+			next_pending = release;
+	}
+
+	if (next_pending >= 0)
+		reactor_set_timer(rdpsnd_queue_timer, NULL, (next_pending + 999) / 1000);
+	else
+		reactor_cancel_timer(rdpsnd_queue_timer, NULL);
+}
+
+static long
+rdpsnd_timeval_diff_us(struct timeval *a, struct timeval *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000 + (a->tv_usec - b->tv_usec);
+}
+
+/* Audio to buffer before playing, in ms */
+static uint32
+rdpsnd_queue_target(void)
+{
+	return MIN(MAX_TARGET, MIN_TARGET + 3 * jitter / 16 + jitter_underruns);
+}
+
+/* Audio from packet first up to last, in us */
+static long
+rdpsnd_queue_duration(unsigned int first, unsigned int last)
+{
+	long duration = 0;
+
+	for (; first != last; first = (first + 1) % MAX_QUEUE)
+		duration += packet_queue[first].duration;
+
+	return duration;
+}
+
+/* Hand the held packets to the driver */
+static void
+rdpsnd_queue_release(void)
+{
+	logger(Sound, Debug,
+	       "rdpsnd_queue_release(), playing %ld ms, target %u ms, jitter %u ms",
+	       rdpsnd_queue_duration(queue_hi, queue_held) / 1000, rdpsnd_queue_target(),
+	       jitter / 16);
+
+	queue_hi = queue_held;
+	queue_buffering = False;
+}
+
+/* Time until held packets are played even if the target is not
+   reached, in us */
+static long
+rdpsnd_queue_next_release(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return MAX(0, rdpsnd_timeval_diff_us(&queue_release_tv, &now));
 }
 
+/* Interarrival jitter as in RFC 3550, with the tick as the server clock */
 static void
-rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index)
+rdpsnd_jitter_update(uint16 tick, struct timeval *arrive)
 {
-	struct audio_packet *packet = &packet_queue[queue_hi];
-	unsigned int next_hi = (queue_hi + 1) % MAX_QUEUE;
+	long transit, deviation;
+
+	transit = (arrive->tv_sec * 1000 + arrive->tv_usec / 1000 - tick) & 0xffff;
+	if (jitter_have_transit)
+	{
+		deviation = (sint16) (transit - jitter_transit);
+		jitter += labs(deviation) - ((jitter + 8) >> 4);
+	}
+	jitter_transit = transit;
+	jitter_have_transit = True;
 
-	if (next_hi == queue_pending)
+	/* let the target come down slowly after underruns */
+	if (jitter_underruns > 0 && arrive->tv_sec > jitter_underrun_tv.tv_sec)
+	{
+		jitter_underruns--;
+		jitter_underrun_tv = *arrive;
+	}
+}
+
+/* Play slightly faster or slower while the queue is off the target, so
+   that differences between the server and device clocks do not build
+   up to latency or underruns */
+static void
+rdpsnd_drift_update(void)
+{
+	long target, error;
+	int ppm;
+
+	target = rdpsnd_queue_target() * 1000;
+	drift_queued += (rdpsnd_queue_duration(queue_lo, queue_held) - drift_queued) / 16;
+
+	/* leave small errors alone, resampling is not free */
+	error = drift_queued - target;
+	if (labs(error) < MAX(20000, target / 2))
+		ppm = 0;
+	else
+		ppm = MAX(-MAX_DRIFT_PPM, MIN(MAX_DRIFT_PPM, error / 20));
+
+	rdpsnd_dsp_drift_set(ppm);
+}
+
+static void
+rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index, uint32 duration)
+{
+	struct audio_packet *packet = &packet_queue[queue_held];
+	unsigned int next_held = (queue_held + 1) % MAX_QUEUE;
+	long gap;
+
+	if (next_held == queue_pending)
 	{
 		logger(Sound, Error, "rdpsnd_queue_write(), no space to queue audio packet");
 		return;
 	}
 
-	queue_hi = next_hi;
-
 	packet->s = s;
 	packet->tick = tick;
 	packet->index = index;
+	packet->duration = duration;
 
 	gettimeofday(&packet->arrive_tv, NULL);
+	rdpsnd_jitter_update(tick, &packet->arrive_tv);
+
+	/* the driver ran dry, buffer up again */
+	if (!queue_buffering && queue_lo == queue_hi)
+	{
+		gap = rdpsnd_timeval_diff_us(&packet->arrive_tv, &queue_last_completion_tv);
+		if (gap > 0)
+		{
+			queue_buffering = True;
+			if (gap < UNDERRUN_GAP * 1000)
+			{
+				jitter_underruns = MIN(MAX_TARGET, jitter_underruns + UNDERRUN_PENALTY);
+				jitter_underrun_tv = packet->arrive_tv;
+				stats_add(STATS_AUDIO_UNDERRUNS, 1);
+				logger(Sound, Debug, "rdpsnd_queue_write(), underrun, %ld ms late",
+				       gap / 1000);
+			}
+		}
+	}
+
+	if (queue_buffering && queue_hi == queue_held)
+	{
+		queue_release_tv = packet->arrive_tv;
+		queue_release_tv.tv_usec += rdpsnd_queue_target() * 1000;
+		queue_release_tv.tv_sec += queue_release_tv.tv_usec / 1000000;
+		queue_release_tv.tv_usec %= 1000000;
+	}
+
+	queue_held = next_held;
+	rdpsnd_drift_update();
+
+	if (!queue_buffering
+	    || rdpsnd_queue_duration(queue_hi, queue_held) >= rdpsnd_queue_target() * 1000)
+		rdpsnd_queue_release();
+
+	rdpsnd_queue_update();
 }
 
 struct audio_packet *
@@ -667,7 +995,13 @@ rdpsnd_queue_empty(void)
 static void
 rdpsnd_queue_init(void)
 {
-	queue_pending = queue_lo = queue_hi = 0;
+	queue_pending = queue_lo = queue_hi = queue_held = 0;
+	queue_buffering = True;
+	jitter_have_transit = False;
+	jitter = jitter_underruns = 0;
+	drift_queued = 0;
+	rdpsnd_dsp_drift_set(0);
+	rdpsnd_queue_update();
 }
 
 static void
@@ -676,7 +1010,7 @@ rdpsnd_queue_clear(void)
 	struct audio_packet *packet;
 
 	/* Go through everything, not just the pending packets */
-	while (queue_pending != queue_hi)
+	while (queue_pending != queue_held)
 	{
 		packet = &packet_queue[queue_pending];
 		s_free(packet->s);
@@ -684,7 +1018,7 @@ rdpsnd_queue_clear(void)
 	}
 
 	/* Reset everything back to the initial state */
-	queue_pending = queue_lo = queue_hi = 0;
+	rdpsnd_queue_init();
 }
 
 void
@@ -701,10 +1035,12 @@ rdpsnd_queue_next(unsigned long completed_in_us)
 	packet->completion_tv.tv_usec += completed_in_us;
 	packet->completion_tv.tv_sec += packet->completion_tv.tv_usec / 1000000;
 	packet->completion_tv.tv_usec %= 1000000;
+	queue_last_completion_tv = packet->completion_tv;
 
 	queue_lo = (queue_lo + 1) % MAX_QUEUE;
 
 	rdpsnd_queue_complete_pending();
+	rdpsnd_queue_update();
 }
 
 int
@@ -740,8 +1076,9 @@ rdpsnd_queue_complete_pending(void)
 		    (now.tv_usec < packet->completion_tv.tv_usec))
 			break;
 
-		elapsed = (packet->completion_tv.tv_sec - packet->arrive_tv.tv_sec) * 1000000 +
-			(packet->completion_tv.tv_usec - packet->arrive_tv.tv_usec);
+		/* from arrival to played, including the playout buffer */
+		elapsed = rdpsnd_timeval_diff_us(&packet->completion_tv, &packet->arrive_tv);
+		stats_record(STATS_AUDIO_LATENCY, stats_now() - elapsed);
 		elapsed /= 1000;
 
 		s_free(packet->s);
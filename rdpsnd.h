@@ -22,6 +22,7 @@ struct audio_packet
 	STREAM s;
 	uint16 tick;
 	uint8 index;
+	uint32 duration;	/* microseconds of audio */
 
 	struct timeval arrive_tv;
 	struct timeval completion_tv;
@@ -29,8 +30,8 @@ struct audio_packet
 
 struct audio_driver
 {
-	void (*add_fds) (int *n, fd_set * rfds, fd_set * wfds, struct timeval * tv);
-	void (*check_fds) (fd_set * rfds, fd_set * wfds);
+	/* a descriptor given to rdpsnd_watch_fd() is ready */
+	void (*fd_ready) (int fd, int events);
 
 	  RD_BOOL(*wave_out_open) (void);
 	void (*wave_out_close) (void);
@@ -56,111 +56,71 @@ static char *pcm_name;
 void alsa_play(void);
 void alsa_record(void);
 
-void
-alsa_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+/* Wait for the poll descriptors of pcm, in place of the old ones */
+static void
+alsa_watch(snd_pcm_t * pcm, struct pollfd *pfds, size_t * num_fds, RD_BOOL playback)
 {
-	UNUSED(tv);
-	int err;
 	struct pollfd *f;
+	int count, events;
 
-	if (out_handle && !rdpsnd_queue_empty())
-	{
-		num_fds_out = snd_pcm_poll_descriptors_count(out_handle);
+	for (f = pfds; f < &pfds[*num_fds]; f++)
+		rdpsnd_watch_fd(f->fd, 0, 0);
+	*num_fds = 0;
 
-		if (num_fds_out > sizeof(pfds_out) / sizeof(*pfds_out))
-			return;
+	if (pcm == NULL)
+		return;
 
-		err = snd_pcm_poll_descriptors(out_handle, pfds_out, num_fds_out);
-		if (err < 0)
-			return;
+	count = snd_pcm_poll_descriptors_count(pcm);
+	if (count <= 0 || count > 32)
+		return;
 
-		for (f = pfds_out; f < &pfds_out[num_fds_out]; f++)
-		{
-			if (f->events & POLLIN)
-				FD_SET(f->fd, rfds);
-			if (f->events & POLLOUT)
-				FD_SET(f->fd, wfds);
-			if (f->fd > *n && (f->events & (POLLIN | POLLOUT)))
-				*n = f->fd;
-		}
-	}
+	count = snd_pcm_poll_descriptors(pcm, pfds, count);
+	if (count < 0)
+		return;
+	*num_fds = count;
 
-	if (in_handle)
+	for (f = pfds; f < &pfds[*num_fds]; f++)
 	{
-		num_fds_in = snd_pcm_poll_descriptors_count(in_handle);
-
-		if (num_fds_in > sizeof(pfds_in) / sizeof(*pfds_in))
-			return;
-
-		err = snd_pcm_poll_descriptors(in_handle, pfds_in, num_fds_in);
-		if (err < 0)
-			return;
-
-		for (f = pfds_in; f < &pfds_in[num_fds_in]; f++)
-		{
-			if (f->events & POLLIN)
-				FD_SET(f->fd, rfds);
-			if (f->events & POLLOUT)
-				FD_SET(f->fd, wfds);
-			if (f->fd > *n && (f->events & (POLLIN | POLLOUT)))
-				*n = f->fd;
-		}
+		events = ((f->events & POLLIN) ? REACTOR_READ : 0) |
+			((f->events & POLLOUT) ? REACTOR_WRITE : 0);
+		rdpsnd_watch_fd(f->fd, playback ? 0 : events, playback ? events : 0);
 	}
 }
 
-void
-alsa_check_fds(fd_set * rfds, fd_set * wfds)
+/* Let ALSA translate the readiness of fd into that of pcm */
+static unsigned short
+alsa_revents(snd_pcm_t * pcm, struct pollfd *pfds, size_t num_fds, int fd, int events)
 {
 	struct pollfd *f;
-	int err;
 	unsigned short revents;
 
-	if (out_handle && !rdpsnd_queue_empty())
+	for (f = pfds; f < &pfds[num_fds]; f++)
 	{
-		for (f = pfds_out; f < &pfds_out[num_fds_out]; f++)
+		f->revents = 0;
+		if (f->fd == fd)
 		{
-			f->revents = 0;
-			if (f->fd != -1)
-			{
-				/* Fixme: This doesn't properly deal with things like POLLHUP */
-				if (FD_ISSET(f->fd, rfds))
-					f->revents |= POLLIN;
-				if (FD_ISSET(f->fd, wfds))
-					f->revents |= POLLOUT;
-			}
+			if (events & REACTOR_READ)
+				f->revents |= POLLIN;
+			if (events & REACTOR_WRITE)
+				f->revents |= POLLOUT;
 		}
-
-		err = snd_pcm_poll_descriptors_revents(out_handle, pfds_out, num_fds_out, &revents);
-		if (err < 0)
-			return;
-
-		if (revents & POLLOUT)
-			alsa_play();
 	}
 
+	if (snd_pcm_poll_descriptors_revents(pcm, pfds, num_fds, &revents) < 0)
+		return 0;
 
-	if (in_handle)
-	{
-		for (f = pfds_in; f < &pfds_in[num_fds_in]; f++)
-		{
-			f->revents = 0;
-			if (f->fd != -1)
-			{
-				/* Fixme: This doesn't properly deal with things like POLLHUP */
-				if (FD_ISSET(f->fd, rfds))
-					f->revents |= POLLIN;
-				if (FD_ISSET(f->fd, wfds))
-					f->revents |= POLLOUT;
-			}
-		}
+	return revents;
+}
 
-		err = snd_pcm_poll_descriptors_revents(in_handle, pfds_in, num_fds_in, &revents);
-		if (err < 0)
-			return;
+void
+alsa_fd_ready(int fd, int events)
+{
+	if (out_handle && !rdpsnd_queue_empty()
+	    && (alsa_revents(out_handle, pfds_out, num_fds_out, fd, events) & POLLOUT))
+		alsa_play();
 
-		if (revents & POLLIN)
-			alsa_record();
-	}
+	if (in_handle && (alsa_revents(in_handle, pfds_in, num_fds_in, fd, events) & POLLIN))
+		alsa_record();
 }
 
 static RD_BOOL
@@ -297,6 +257,7 @@ alsa_close_out(void)
 
 	if (out_handle)
 	{
+		alsa_watch(NULL, pfds_out, &num_fds_out, True);
 		snd_pcm_close(out_handle);
 		out_handle = NULL;
 	}
@@ -349,6 +310,8 @@ alsa_set_format_out(RD_WAVEFORMATEX * pwfx)
 	audiochannels_out = pwfx->nChannels;
 	rate_out = pwfx->nSamplesPerSec;
 
+	alsa_watch(out_handle, pfds_out, &num_fds_out, True);
+
 	return True;
 }
 
@@ -422,7 +385,7 @@ alsa_play(void)
 		}
 
 		if (snd_pcm_delay(out_handle, &delay_frames) < 0)
-			delay_frames = out->size / (samplewidth_out * audiochannels_out);
+			delay_frames = s_length(out) / (samplewidth_out * audiochannels_out);
 		if (delay_frames < 0)
 			delay_frames = 0;
 
@@ -453,6 +416,7 @@ alsa_close_in(void)
 {
 	if (in_handle)
 	{
+		alsa_watch(NULL, pfds_in, &num_fds_in, False);
 		snd_pcm_close(in_handle);
 		in_handle = NULL;
 	}
@@ -477,6 +441,8 @@ alsa_set_format_in(RD_WAVEFORMATEX * pwfx)
 	audiochannels_in = pwfx->nChannels;
 	rate_in = pwfx->nSamplesPerSec;
 
+	alsa_watch(in_handle, pfds_in, &num_fds_in, False);
+
 	return True;
 }
 
@@ -507,8 +473,7 @@ alsa_register(char *options)
 	alsa_driver.name = "alsa";
 	alsa_driver.description = "ALSA output driver, default device: " DEFAULTDEVICE;
 
-	alsa_driver.add_fds = alsa_add_fds;
-	alsa_driver.check_fds = alsa_check_fds;
+	alsa_driver.fd_ready = alsa_fd_ready;
 
 	alsa_driver.wave_out_open = alsa_open_out;
 	alsa_driver.wave_out_close = alsa_close_out;
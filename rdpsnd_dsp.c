@@ -30,6 +30,13 @@
 #define SRC_CONVERTER SRC_SINC_MEDIUM_QUALITY
 #endif
 
+#ifdef HAVE_OPUS
+#include <opus.h>
+
+/* 120 ms at 48 kHz, the longest Opus packet */
+#define OPUS_MAX_FRAME 5760
+#endif
+
 #define MAX_VOLUME 65535
 
 static uint16 softvol_left = MAX_VOLUME;
@@ -37,9 +44,75 @@ static uint16 softvol_right = MAX_VOLUME;
 static uint32 resample_to_srate = 44100;
 static uint16 resample_to_bitspersample = 16;
 static uint16 resample_to_channels = 2;
+/* rates the resampler state is for, and the speed up for clock drift */
+static uint32 resample_from_srate = 44100;
+static uint32 resample_out_srate = 44100;
+static int drift_ppm = 0;
+static RD_BOOL resampling = False;
 #ifdef HAVE_LIBSAMPLERATE
 static SRC_STATE *src_converter = NULL;
+static uint16 src_channels = 0;
+static float *src_in = NULL, *src_out = NULL;
+static unsigned int src_in_size = 0, src_out_size = 0;
+#else
+#define RESAMPLE_HISTORY	3
+#define RESAMPLE_PHASE_BITS	6
+#define RESAMPLE_PHASES		(1 << RESAMPLE_PHASE_BITS)
+static int resample_filter[RESAMPLE_PHASES][4];
+static RD_BOOL resample_filter_ready = False;
+/* position in 16.16 input frames, counting the frames kept from the
+   previous packet, and the step per output frame */
+static uint32 resample_pos, resample_step;
+static sint16 resample_history[RESAMPLE_HISTORY * 2];
 #endif
+static sint16 *dsp_buffer = NULL, *dsp_resampled = NULL;
+static unsigned int dsp_buffer_size = 0, dsp_resampled_size = 0;
+#ifdef HAVE_OPUS
+static OpusDecoder *opus_decoder = NULL;
+static uint32 opus_decoder_srate;
+static uint16 opus_decoder_channels;
+#endif
+
+/* MS-ADPCM, [MS-RDPEA] refers to the RIFF specification */
+static const int ms_adpcm_adaptation[16] = {
+	230, 230, 230, 230, 307, 409, 512, 614,
+	768, 614, 512, 409, 307, 230, 230, 230
+};
+
+static const int ms_adpcm_coefficients[7][2] = {
+	{256, 0}, {512, -256}, {0, 0}, {192, 64}, {240, 0}, {460, -208}, {392, -232}
+};
+
+/* IMA-ADPCM */
+static const int ima_adpcm_index[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int ima_adpcm_step[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+struct ms_adpcm_channel
+{
+	int coef1, coef2;
+	int delta;
+	int sample1, sample2;
+};
+
+static sint16
+rdpsnd_dsp_clamp16(int value)
+{
+	return MAX(-32768, MIN(32767, value));
+}
 
 void
 rdpsnd_dsp_softvol_set(uint16 left, uint16 right)
@@ -49,86 +122,27 @@ rdpsnd_dsp_softvol_set(uint16 left, uint16 right)
 	logger(Sound, Debug, "rdpsnd_dsp_softvol_set(), left: %u, right: %u\n", left, right);
 }
 
-void
-rdpsnd_dsp_softvol(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * format)
+/* Start over, for a new rate or after packets went past the resampler */
+static void
+rdpsnd_dsp_resample_reset(void)
 {
-	unsigned int factor_left, factor_right;
-	unsigned char *posin = buffer;
-	unsigned char *posout = buffer;
-
-	if ((softvol_left == MAX_VOLUME) && (softvol_right == MAX_VOLUME))
-		return;
-
-	factor_left = (softvol_left * 256) / MAX_VOLUME;
-	factor_right = (softvol_right * 256) / MAX_VOLUME;
-
-	if (format->nChannels == 1)
-	{
-		factor_left = factor_right = (factor_left + factor_right) / 2;
-	}
-
-	if (format->wBitsPerSample == 8)
-	{
-		sint8 val;
-
-		while (posout < buffer + size)
-		{
-			/* Left */
-			val = *posin++;
-			val = (val * factor_left) >> 8;
-			*posout++ = val;
-
-			/* Right */
-			val = *posin++;
-			val = (val * factor_right) >> 8;
-			*posout++ = val;
-		}
-	}
-	else
-	{
-		sint16 val;
-
-		while (posout < buffer + size)
-		{
-			/* Left */
-			val = *posin++;
-			val |= *posin++ << 8;
-			val = (val * factor_left) >> 8;
-			*posout++ = val & 0xff;
-			*posout++ = val >> 8;
-
-			/* Right */
-			val = *posin++;
-			val |= *posin++ << 8;
-			val = (val * factor_right) >> 8;
-			*posout++ = val & 0xff;
-			*posout++ = val >> 8;
-		}
-	}
-
-	logger(Sound, Debug,
-	       "rdpsnd_dsp_softvol(), using softvol with factors left: %d, right: %d (%d/%d)",
-	       factor_left, factor_right, format->wBitsPerSample, format->nChannels);
+#ifdef HAVE_LIBSAMPLERATE
+	if (src_converter != NULL)
+		src_reset(src_converter);
+#else
+	memset(resample_history, 0, sizeof(resample_history));
+	resample_pos = (RESAMPLE_HISTORY - 2) << 16;
+#endif
 }
 
+/* Play faster, or slower for negative values, by parts per million to
+   follow the drift between the server and device clocks */
 void
-rdpsnd_dsp_swapbytes(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * format)
+rdpsnd_dsp_drift_set(int ppm)
 {
-	int i;
-	uint8 swap;
-
-	if (format->wBitsPerSample == 8)
-		return;
-
-	if (size & 0x1)
-		logger(Sound, Warning, "rdpsnd_dsp_swapbytes(), badly aligned sound data");
-
-	for (i = 0; i < (int) size; i += 2)
-	{
-		swap = *(buffer + i);
-		*(buffer + i) = *(buffer + i + 1);
-		*(buffer + i + 1) = swap;
-	}
+	if (ppm != drift_ppm)
+		logger(Sound, Debug, "rdpsnd_dsp_drift_set(), %d ppm", ppm);
+	drift_ppm = ppm;
 }
 
 RD_BOOL
@@ -157,7 +171,9 @@ rdpsnd_dsp_resample_set(uint32 device_srate, uint16 device_bitspersample, uint16
 		logger(Sound, Warning, "rdpsnd_dsp_resample_set(), src_new() failed with %d", err);
 		return False;
 	}
+	src_channels = device_channels;
 #endif
+	rdpsnd_dsp_resample_reset();
 
 	return True;
 }
@@ -175,256 +191,558 @@ rdpsnd_dsp_resample_supported(RD_WAVEFORMATEX * format)
 	return True;
 }
 
+/* Scratch space for frames of 16 bit samples, kept between packets */
+static sint16 *
+rdpsnd_dsp_scratch(sint16 ** buffer, unsigned int *size, unsigned int samples)
+{
+	if (*size < samples)
+	{
+		*size = samples;
+		*buffer = (sint16 *) xrealloc(*buffer, samples * sizeof(sint16));
+	}
+	return *buffer;
+}
+
+/* Widen to 16 bit, apply the volume and mix to the output channels in
+   one pass. The common 16 bit stereo case has a loop of its own that
+   the compiler can vectorize. */
+static void
+rdpsnd_dsp_convert(const uint8 * in, unsigned int frames, RD_WAVEFORMATEX * format,
+		   uint16 channels, int left, int right, sint16 * out)
+{
+	unsigned int i;
+	int l, r;
+
+	if (format->wBitsPerSample == 16 && format->nChannels == 2 && channels == 2)
+	{
+		for (i = 0; i < frames; i++)
+		{
+			l = (sint16) (in[4 * i] | in[4 * i + 1] << 8);
+			r = (sint16) (in[4 * i + 2] | in[4 * i + 3] << 8);
+			out[2 * i] = (l * left) >> 8;
+			out[2 * i + 1] = (r * right) >> 8;
+		}
+		return;
+	}
+
+	for (i = 0; i < frames; i++)
+	{
+		if (format->wBitsPerSample == 16)
+		{
+			l = (sint16) (in[0] | in[1] << 8);
+			r = (format->nChannels == 2) ? (sint16) (in[2] | in[3] << 8) : l;
+			in += 2 * format->nChannels;
+		}
+		else
+		{
+			/* 8 bit samples are unsigned */
+			l = (in[0] - 128) << 8;
+			r = (format->nChannels == 2) ? (in[1] - 128) << 8 : l;
+			in += format->nChannels;
+		}
+
+		l = (l * left) >> 8;
+		r = (r * right) >> 8;
+
+		if (channels == 2)
+		{
+			*out++ = l;
+			*out++ = r;
+		}
+		else
+		{
+			*out++ = (l + r) >> 1;
+		}
+	}
+}
+
+/* Narrow to the device sample size and byte order */
+static void
+rdpsnd_dsp_store(const sint16 * in, unsigned int samples, uint16 bits, RD_BOOL native,
+		 uint8 * out)
+{
+	unsigned int i;
+
+	if (bits == 8)
+	{
+		for (i = 0; i < samples; i++)
+			out[i] = (in[i] >> 8) + 128;
+	}
+	else if (native)
+	{
+		memcpy(out, in, samples * sizeof(sint16));
+	}
+	else
+	{
+		for (i = 0; i < samples; i++)
+		{
+			out[2 * i] = in[i] & 0xff;
+			out[2 * i + 1] = (in[i] >> 8) & 0xff;
+		}
+	}
+}
+
+#ifndef HAVE_LIBSAMPLERATE
+/* Four tap polyphase filter, with Catmull-Rom coefficients for each of
+   RESAMPLE_PHASES positions between two input frames */
+static void
+rdpsnd_dsp_resample_init_filter(void)
+{
+	int phase;
+	float t;
+
+	for (phase = 0; phase < RESAMPLE_PHASES; phase++)
+	{
+		t = (float) phase / RESAMPLE_PHASES;
+		resample_filter[phase][0] = (-t * t * t + 2 * t * t - t) / 2 * 16384;
+		resample_filter[phase][1] = (3 * t * t * t - 5 * t * t + 2) / 2 * 16384;
+		resample_filter[phase][2] = (-3 * t * t * t + 4 * t * t + t) / 2 * 16384;
+		resample_filter[phase][3] = (t * t * t - t * t) / 2 * 16384;
+	}
+	resample_filter_ready = True;
+}
+
+/* Resample frames of in, which starts with RESAMPLE_HISTORY frames kept
+   from the previous packet, and keep the last ones for the next */
+static unsigned int
+rdpsnd_dsp_resample(sint16 * in, unsigned int frames, uint16 channels, sint16 * out)
+{
+	unsigned int n, i, ch;
+	const int *filter;
+	const sint16 *x;
+	int v;
+
+	if (!resample_filter_ready)
+		rdpsnd_dsp_resample_init_filter();
+
+	frames += RESAMPLE_HISTORY;
+	memcpy(in, resample_history, RESAMPLE_HISTORY * channels * sizeof(sint16));
+
+	n = 0;
+	while ((i = resample_pos >> 16) + 2 < frames)
+	{
+		filter = resample_filter[(resample_pos & 0xffff) >> (16 - RESAMPLE_PHASE_BITS)];
+		x = in + (i - 1) * channels;
+		for (ch = 0; ch < channels; ch++)
+		{
+			v = (x[ch] * filter[0] + x[channels + ch] * filter[1] +
+			     x[2 * channels + ch] * filter[2] + x[3 * channels + ch] * filter[3]) >> 14;
+			out[n * channels + ch] = rdpsnd_dsp_clamp16(v);
+		}
+		n++;
+		resample_pos += resample_step;
+	}
+
+	resample_pos -= (frames - RESAMPLE_HISTORY) << 16;
+	memcpy(resample_history, in + (frames - RESAMPLE_HISTORY) * channels,
+	       RESAMPLE_HISTORY * channels * sizeof(sint16));
+
+	return n;
+}
+#endif
+
 STREAM
-rdpsnd_dsp_resample(unsigned char *in, unsigned int size,
-		    RD_WAVEFORMATEX * format, RD_BOOL stream_be)
+rdpsnd_dsp_process(unsigned char *data, unsigned int size, struct audio_driver * current_driver,
+		   RD_WAVEFORMATEX * format)
 {
-	UNUSED(stream_be);
+	STREAM out;
+	RD_BOOL native = True, wire_order = True, resample;
+	uint16 channels, bits;
+	uint32 srate;
+	unsigned int frames, samples;
+	int left = 256, right = 256;
+	sint16 *buffer;
+	uint8 *pcm;
 #ifdef HAVE_LIBSAMPLERATE
 	SRC_DATA resample_data;
-	float *infloat, *outfloat;
+	double ratio;
 	int err;
-#else
-	int ratio1k = (resample_to_srate * 1000) / format->nSamplesPerSec;
 #endif
-	int innum, outnum;
-	unsigned char *tmpdata = NULL, *tmp = NULL;
-	int samplewidth = format->wBitsPerSample / 8;
-	STREAM out;
-	int outsize = 0;
-	unsigned char *data;
-	int i;
-
-	if ((resample_to_bitspersample == format->wBitsPerSample) &&
-	    (resample_to_channels == format->nChannels) &&
-	    (resample_to_srate == format->nSamplesPerSec))
-		return NULL;
 
+	/* the driver plays host byte order, or little endian as on the wire */
 #ifdef B_ENDIAN
-	if (!stream_be)
-		rdpsnd_dsp_swapbytes(in, size, format);
+	native = current_driver->need_byteswap_on_be;
+	wire_order = !current_driver->need_byteswap_on_be;
 #endif
 
-	if (resample_to_channels != format->nChannels)
+	if (current_driver->wave_out_volume == rdpsnd_dsp_softvol_set)
 	{
-		int newsize = (size / format->nChannels) * resample_to_channels;
-		tmpdata = (unsigned char *) xmalloc(newsize);
-
-		for (i = 0; i < newsize / samplewidth; i++)
-		{
-			if (format->nChannels > resample_to_channels)
-				memcpy(tmpdata + (i * samplewidth),
-				       in +
-				       (((i * format->nChannels) / resample_to_channels) *
-					samplewidth), samplewidth);
-			else
-				memcpy(tmpdata + (i * samplewidth),
-				       in +
-				       (((i / resample_to_channels) * format->nChannels +
-					 (i % format->nChannels)) * samplewidth), samplewidth);
+		left = (softvol_left * 256) / MAX_VOLUME;
+		right = (softvol_right * 256) / MAX_VOLUME;
+	}
 
-		}
+	channels = format->nChannels;
+	bits = format->wBitsPerSample;
+	srate = format->nSamplesPerSec;
+	if (current_driver->need_resampling)
+	{
+		channels = resample_to_channels;
+		bits = resample_to_bitspersample;
+		srate = resample_to_srate;
+	}
 
-		in = tmpdata;
-		size = newsize;
+	resample = (srate != format->nSamplesPerSec) || (drift_ppm != 0);
+	if (resample && (!resampling || resample_from_srate != format->nSamplesPerSec
+			 || resample_out_srate != srate))
+	{
+		resample_from_srate = format->nSamplesPerSec;
+		resample_out_srate = srate;
+		rdpsnd_dsp_resample_reset();
 	}
+	resampling = resample;
 
+	frames = size / (format->nChannels * format->wBitsPerSample / 8);
 
-	/* Expand 8-bit input-samples to 16-bit */
-#ifndef HAVE_LIBSAMPLERATE	/* libsamplerate needs 16-bit samples */
-	if (format->wBitsPerSample != resample_to_bitspersample)
-#endif
+	/* nothing to do but copying */
+	if (left == 256 && right == 256 && !resample && channels == format->nChannels
+	    && bits == format->wBitsPerSample && (wire_order || bits == 8))
 	{
-		/* source: 8 bit, dest: 16 bit */
-		if (format->wBitsPerSample == 8)
-		{
-			tmp = tmpdata;
-			tmpdata = (unsigned char *) xmalloc(size * 2);
-			for (i = 0; i < (int) size; i++)
-			{
-				tmpdata[i * 2] = in[i];
-				tmpdata[(i * 2) + 1] = 0x00;
-			}
-			in = tmpdata;
-			samplewidth = 16 / 2;
-			size *= 2;
+		out = s_alloc(size);
+		out_uint8a(out, data, size);
+		s_mark_end(out);
+		s_seek(out, 0);
+		return out;
+	}
+
+	if (!resample)
+	{
+		samples = frames * channels;
+		out = s_alloc(MAX(samples, 1) * bits / 8);
+		out_uint8p(out, pcm, samples * bits / 8);
 
-			if (tmp != NULL)
-				xfree(tmp);
+		/* straight into the packet when it is 16 bit in host order */
+		if (bits == 16 && native)
+		{
+			rdpsnd_dsp_convert(data, frames, format, channels, left, right,
+					   (sint16 *) pcm);
+		}
+		else
+		{
+			buffer = rdpsnd_dsp_scratch(&dsp_buffer, &dsp_buffer_size, MAX(samples, 1));
+			rdpsnd_dsp_convert(data, frames, format, channels, left, right, buffer);
+			rdpsnd_dsp_store(buffer, samples, bits, native, pcm);
 		}
-	}
 
-	innum = size / samplewidth;
+		s_mark_end(out);
+		s_seek(out, 0);
+		return out;
+	}
 
-	/* Do the resampling */
 #ifdef HAVE_LIBSAMPLERATE
-	if (src_converter == NULL)
+	/* drivers that need no resampling only get one for drift */
+	if (src_converter == NULL || src_channels != channels)
 	{
-		logger(Sound, Warning,
-		       "rdpsndp_dsp_resample_set(), no sample rate converter available");
-		return NULL;
+		if (src_converter != NULL)
+			src_converter = src_delete(src_converter);
+		if ((src_converter = src_new(SRC_CONVERTER, channels, &err)) == NULL)
+		{
+			logger(Sound, Warning,
+			       "rdpsnd_dsp_process(), no sample rate converter available");
+			return NULL;
+		}
+		src_channels = channels;
 	}
 
-	outnum = ((float) innum * ((float) resample_to_srate / (float) format->nSamplesPerSec)) + 1;
+	buffer = rdpsnd_dsp_scratch(&dsp_buffer, &dsp_buffer_size, MAX(frames * channels, 1));
+	rdpsnd_dsp_convert(data, frames, format, channels, left, right, buffer);
 
-	infloat = (float *) xmalloc(sizeof(float) * innum);
-	outfloat = (float *) xmalloc(sizeof(float) * outnum);
+	ratio = (double) srate / format->nSamplesPerSec / (1.0 + drift_ppm / 1000000.0);
+	samples = ((unsigned int) (frames * ratio) + 2) * channels;
+	if (src_in_size < frames * channels)
+	{
+		src_in_size = frames * channels;
+		src_in = (float *) xrealloc(src_in, src_in_size * sizeof(float));
+	}
+	if (src_out_size < samples)
+	{
+		src_out_size = samples;
+		src_out = (float *) xrealloc(src_out, src_out_size * sizeof(float));
+	}
 
-	src_short_to_float_array((short *) in, infloat, innum);
+	src_short_to_float_array(buffer, src_in, frames * channels);
 
 	bzero(&resample_data, sizeof(resample_data));
-	resample_data.data_in = infloat;
-	resample_data.data_out = outfloat;
-	resample_data.input_frames = innum / resample_to_channels;
-	resample_data.output_frames = outnum / resample_to_channels;
-	resample_data.src_ratio = (double) resample_to_srate / (double) format->nSamplesPerSec;
+	resample_data.data_in = src_in;
+	resample_data.data_out = src_out;
+	resample_data.input_frames = frames;
+	resample_data.output_frames = samples / channels;
+	resample_data.src_ratio = ratio;
 	resample_data.end_of_input = 0;
 
 	if ((err = src_process(src_converter, &resample_data)) != 0)
-		logger(Sound, Warning, "rdpsnd_dsp_resample_set(), src_process(): '%s'",
+		logger(Sound, Warning, "rdpsnd_dsp_process(), src_process(): '%s'",
 		       src_strerror(err));
 
-	xfree(infloat);
+	samples = resample_data.output_frames_gen * channels;
+	buffer = rdpsnd_dsp_scratch(&dsp_resampled, &dsp_resampled_size, MAX(samples, 1));
+	src_float_to_short_array(src_out, buffer, samples);
+#else
+	buffer = rdpsnd_dsp_scratch(&dsp_buffer, &dsp_buffer_size,
+				    (frames + RESAMPLE_HISTORY) * channels);
+	rdpsnd_dsp_convert(data, frames, format, channels, left, right,
+			   buffer + RESAMPLE_HISTORY * channels);
+
+	resample_step = ((uint64) format->nSamplesPerSec << 16) * (1000000 + drift_ppm) /
+		((uint64) srate * 1000000);
+	samples = (((uint64) (frames + RESAMPLE_HISTORY) << 16) / resample_step + 2) * channels;
+	rdpsnd_dsp_scratch(&dsp_resampled, &dsp_resampled_size, samples);
+	samples = rdpsnd_dsp_resample(buffer, frames, channels, dsp_resampled) * channels;
+	buffer = dsp_resampled;
+#endif
+
+	out = s_alloc(MAX(samples, 1) * bits / 8);
+	out_uint8p(out, pcm, samples * bits / 8);
+	rdpsnd_dsp_store(buffer, samples, bits, native, pcm);
+	s_mark_end(out);
+	s_seek(out, 0);
 
-	outsize = resample_data.output_frames_gen * resample_to_channels * samplewidth;
-	out = s_alloc(outsize);
-	out_uint8p(out, data, outsize);
-	src_float_to_short_array(outfloat, (short *) data,
-				 resample_data.output_frames_gen * resample_to_channels);
-	xfree(outfloat);
+	return out;
+}
 
-#else
-	/* Michaels simple linear resampler */
-	if (resample_to_srate < format->nSamplesPerSec)
+static sint16
+rdpsnd_dsp_ms_adpcm_sample(struct ms_adpcm_channel *c, int nibble)
+{
+	int predictor;
+
+	predictor = (c->sample1 * c->coef1 + c->sample2 * c->coef2) >> 8;
+	/* the nibble is a signed 4 bit value */
+	predictor += ((nibble & 0x8) ? nibble - 16 : nibble) * c->delta;
+	predictor = rdpsnd_dsp_clamp16(predictor);
+
+	c->sample2 = c->sample1;
+	c->sample1 = predictor;
+	c->delta = MAX(16, (ms_adpcm_adaptation[nibble] * c->delta) >> 8);
+
+	return predictor;
+}
+
+/* Decode one block, nBlockAlign bytes or less for the last one */
+static void
+rdpsnd_dsp_ms_adpcm_block(uint8 * in, unsigned int size, int channels, STREAM out)
+{
+	struct ms_adpcm_channel c[2];
+	int ch, predictor;
+	uint8 *end = in + size;
+
+	for (ch = 0; ch < channels; ch++, in++)
 	{
-		logger(Sound, Warning,
-		       "rdpsnd_dsp_reasmple_set(), downsampling currently not supported");
-		return 0;
+		predictor = MIN(*in, 6);
+		c[ch].coef1 = ms_adpcm_coefficients[predictor][0];
+		c[ch].coef2 = ms_adpcm_coefficients[predictor][1];
 	}
+	for (ch = 0; ch < channels; ch++, in += 2)
+		c[ch].delta = (sint16) (in[0] | in[1] << 8);
+	for (ch = 0; ch < channels; ch++, in += 2)
+		c[ch].sample1 = (sint16) (in[0] | in[1] << 8);
+	for (ch = 0; ch < channels; ch++, in += 2)
+		c[ch].sample2 = (sint16) (in[0] | in[1] << 8);
+
+	/* the header holds the first two samples, oldest last */
+	for (ch = 0; ch < channels; ch++)
+		out_uint16_le(out, c[ch].sample2);
+	for (ch = 0; ch < channels; ch++)
+		out_uint16_le(out, c[ch].sample1);
+
+	/* high nibble first, channels interleaved */
+	while (in < end)
+	{
+		out_uint16_le(out, rdpsnd_dsp_ms_adpcm_sample(&c[0], *in >> 4));
+		out_uint16_le(out, rdpsnd_dsp_ms_adpcm_sample(&c[channels - 1], *in & 0xf));
+		in++;
+	}
+}
 
-	outnum = (innum * ratio1k) / 1000;
+static sint16
+rdpsnd_dsp_ima_adpcm_sample(int *predictor, int *index, int nibble)
+{
+	int step, diff;
 
-	outsize = outnum * samplewidth;
-	out = s_alloc(outsize);
-	out_uint8p(out, data, outsize);
-	bzero(data, outsize);
+	step = ima_adpcm_step[*index];
+	diff = step >> 3;
+	if (nibble & 4)
+		diff += step;
+	if (nibble & 2)
+		diff += step >> 1;
+	if (nibble & 1)
+		diff += step >> 2;
 
-	for (i = 0; i < outsize / (resample_to_channels * samplewidth); i++)
-	{
-		int source = (i * 1000) / ratio1k;
-#if 0				/* Partial for linear resampler */
-		int part = (i * 100000) / ratio1k - source * 100;
-#endif
-		int j;
+	*predictor = rdpsnd_dsp_clamp16((nibble & 8) ? *predictor - diff : *predictor + diff);
+	*index = MAX(0, MIN(88, *index + ima_adpcm_index[nibble]));
 
-		if (source * resample_to_channels + samplewidth > (int) size)
-			break;
+	return *predictor;
+}
 
-#if 0				/* Linear resampling, TODO: soundquality fixes (LP filter) */
-		if (samplewidth == 1)
-		{
-			sint8 cval1, cval2;
-			for (j = 0; j < resample_to_channels; j++)
-			{
-				memcpy(&cval1,
-				       in + (source * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
-				memcpy(&cval2,
-				       in + ((source + 1) * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
+/* Decode one block, nBlockAlign bytes or less for the last one */
+static void
+rdpsnd_dsp_ima_adpcm_block(uint8 * in, unsigned int size, int channels, STREAM out)
+{
+	int predictor[2], index[2];
+	sint16 samples[2][8];
+	int ch, i;
+	uint8 *end = in + size;
 
-				cval1 += (sint8) (cval2 * part) / 100;
+	for (ch = 0; ch < channels; ch++, in += 4)
+	{
+		predictor[ch] = (sint16) (in[0] | in[1] << 8);
+		index[ch] = MIN(in[2], 88);
+		out_uint16_le(out, predictor[ch]);
+	}
 
-				memcpy(data + (i * resample_to_channels * samplewidth) +
-				       (samplewidth * j), &cval1, samplewidth);
-			}
-		}
-		else
+	/* low nibble first, in runs of 8 samples per channel */
+	while (in + 4 * channels <= end)
+	{
+		for (ch = 0; ch < channels; ch++)
 		{
-			sint16 sval1, sval2;
-			for (j = 0; j < resample_to_channels; j++)
+			for (i = 0; i < 8; i += 2, in++)
 			{
-				memcpy(&sval1,
-				       in + (source * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
-				memcpy(&sval2,
-				       in + ((source + 1) * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
-
-				sval1 += (sint16) (sval2 * part) / 100;
-
-				memcpy(data + (i * resample_to_channels * samplewidth) +
-				       (samplewidth * j), &sval1, samplewidth);
+				samples[ch][i] =
+					rdpsnd_dsp_ima_adpcm_sample(&predictor[ch], &index[ch],
+								    *in & 0xf);
+				samples[ch][i + 1] =
+					rdpsnd_dsp_ima_adpcm_sample(&predictor[ch], &index[ch],
+								    *in >> 4);
 			}
 		}
-#else /* Nearest neighbor search */
-		for (j = 0; j < resample_to_channels; j++)
+
+		for (i = 0; i < 8; i++)
+			for (ch = 0; ch < channels; ch++)
+				out_uint16_le(out, samples[ch][i]);
+	}
+}
+
+#ifdef HAVE_OPUS
+static RD_BOOL
+rdpsnd_dsp_opus_decode(uint8 * in, unsigned int size, RD_WAVEFORMATEX * format, STREAM out)
+{
+	opus_int16 pcm[OPUS_MAX_FRAME * 2];
+	int err, samples, i;
+
+	if (opus_decoder == NULL || opus_decoder_srate != format->nSamplesPerSec
+	    || opus_decoder_channels != format->nChannels)
+	{
+		if (opus_decoder != NULL)
+			opus_decoder_destroy(opus_decoder);
+
+		opus_decoder = opus_decoder_create(format->nSamplesPerSec, format->nChannels, &err);
+		if (opus_decoder == NULL)
 		{
-			memcpy(out + (i * resample_to_channels * samplewidth) + (samplewidth * j),
-			       in + (source * resample_to_channels * samplewidth) +
-			       (samplewidth * j), samplewidth);
+			logger(Sound, Warning,
+			       "rdpsnd_dsp_opus_decode(), opus_decoder_create() failed with %d", err);
+			return False;
 		}
-#endif
+		opus_decoder_srate = format->nSamplesPerSec;
+		opus_decoder_channels = format->nChannels;
 	}
-	outsize = i * resample_to_channels * samplewidth;
-#endif
 
-	if (tmpdata != NULL)
-		xfree(tmpdata);
+	/* one packet per wave PDU */
+	samples = opus_decode(opus_decoder, in, size, pcm, OPUS_MAX_FRAME, 0);
+	if (samples < 0)
+	{
+		logger(Sound, Warning, "rdpsnd_dsp_opus_decode(), opus_decode() failed with %d",
+		       samples);
+		return False;
+	}
 
-	/* Shrink 16-bit output-samples to 8-bit */
-#ifndef HAVE_LIBSAMPLERATE	/* libsamplerate produces 16-bit samples */
-	if (format->wBitsPerSample != resample_to_bitspersample)
+	s_realloc(out, samples * format->nChannels * 2);
+	for (i = 0; i < samples * format->nChannels; i++)
+		out_uint16_le(out, pcm[i]);
+
+	return True;
+}
 #endif
+
+/* Compressed formats that rdpsnd_dsp_decode turns into PCM, whatever
+   the driver supports */
+RD_BOOL
+rdpsnd_dsp_decode_supported(RD_WAVEFORMATEX * format)
+{
+	if ((format->nChannels != 1) && (format->nChannels != 2))
+		return False;
+
+	switch (format->wFormatTag)
 	{
-		/* source: 16 bit, dest: 8 bit */
-		if (resample_to_bitspersample == 8)
-		{
-			for (i = 0; i < outsize; i++)
+		case WAVE_FORMAT_ADPCM:
+			return format->wBitsPerSample == 4
+				&& format->nBlockAlign > 7 * format->nChannels;
+
+		case WAVE_FORMAT_IMA_ADPCM:
+			return format->wBitsPerSample == 4
+				&& format->nBlockAlign > 4 * format->nChannels
+				&& (format->nBlockAlign % (4 * format->nChannels)) == 0;
+
+#ifdef HAVE_OPUS
+		case WAVE_FORMAT_OPUS:
+			switch (format->nSamplesPerSec)
 			{
-				data[i] = data[i * 2];
+				case 8000:
+				case 12000:
+				case 16000:
+				case 24000:
+				case 48000:
+					return True;
 			}
-			outsize /= 2;
-		}
+			return False;
+#endif
 	}
 
-#ifdef B_ENDIAN
-	if (!stream_be)
-		rdpsnd_dsp_swapbytes(data, outsize, format);
-#endif
+	return False;
+}
 
-	return out;
+/* The 16 bit PCM format a supported compressed format decodes to */
+void
+rdpsnd_dsp_decode_format(RD_WAVEFORMATEX * format, RD_WAVEFORMATEX * pcm)
+{
+	memset(pcm, 0, sizeof(*pcm));
+	pcm->wFormatTag = WAVE_FORMAT_PCM;
+	pcm->nChannels = format->nChannels;
+	pcm->nSamplesPerSec = format->nSamplesPerSec;
+	pcm->wBitsPerSample = 16;
+	pcm->nBlockAlign = 2 * format->nChannels;
+	pcm->nAvgBytesPerSec = pcm->nSamplesPerSec * pcm->nBlockAlign;
 }
 
+/* Decode a wave PDU in a compressed format to PCM, NULL if it is
+   damaged */
 STREAM
-rdpsnd_dsp_process(unsigned char *data, unsigned int size, struct audio_driver * current_driver,
-		   RD_WAVEFORMATEX * format)
+rdpsnd_dsp_decode(unsigned char *data, unsigned int size, RD_WAVEFORMATEX * format)
 {
 	STREAM out;
-	RD_BOOL stream_be = False;
+	unsigned int n, header;
 
-	/* softvol and byteswap do not change the amount of data they
-	   return, so they can operate on the input-stream */
-	if (current_driver->wave_out_volume == rdpsnd_dsp_softvol_set)
-		rdpsnd_dsp_softvol(data, size, format);
+	header = (format->wFormatTag == WAVE_FORMAT_ADPCM ? 7 : 4) * format->nChannels;
 
-#ifdef B_ENDIAN
-	if (current_driver->need_byteswap_on_be)
-	{
-		rdpsnd_dsp_swapbytes(data, size, format);
-		stream_be = True;
-	}
-#endif
+	/* ADPCM gives at most two 16 bit samples per byte */
+	out = s_alloc(MAX(size, 1) * 4);
 
-	out = NULL;
+	switch (format->wFormatTag)
+	{
+		case WAVE_FORMAT_ADPCM:
+		case WAVE_FORMAT_IMA_ADPCM:
+			while (size >= header)
+			{
+				n = MIN(size, format->nBlockAlign);
+				if (format->wFormatTag == WAVE_FORMAT_ADPCM)
+					rdpsnd_dsp_ms_adpcm_block(data, n, format->nChannels, out);
+				else
+					rdpsnd_dsp_ima_adpcm_block(data, n, format->nChannels, out);
+				data += n;
+				size -= n;
+			}
+			break;
 
-	if (current_driver->need_resampling)
-		out = rdpsnd_dsp_resample(data, size, format, stream_be);
+#ifdef HAVE_OPUS
+		case WAVE_FORMAT_OPUS:
+			if (!rdpsnd_dsp_opus_decode(data, size, format, out))
+			{
+				s_free(out);
+				return NULL;
+			}
+			break;
+#endif
 
-	if (out == NULL)
-	{
-		out = s_alloc(size);
-		out_uint8a(out, data, size);
+		default:
+			s_free(out);
+			return NULL;
 	}
 
 	s_mark_end(out);
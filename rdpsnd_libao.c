@@ -39,22 +39,10 @@ static char *libao_device = NULL;
 void libao_play(void);
 
 void
-libao_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+libao_fd_ready(int fd, int events)
 {
-	UNUSED(n);
-	UNUSED(rfds);
-	UNUSED(tv);
-
-	/* We need to be called rather often... */
-	if (o_device != NULL && !rdpsnd_queue_empty())
-		FD_SET(0, wfds);
-}
-
-void
-libao_check_fds(fd_set * rfds, fd_set * wfds)
-{
-	UNUSED(rfds);
-	UNUSED(wfds);
+	UNUSED(fd);
+	UNUSED(events);
 
 	if (o_device == NULL)
 		return;
@@ -91,6 +79,9 @@ libao_open(void)
 		return False;
 	}
 
+	/* We need to be called rather often... */
+	rdpsnd_watch_fd(-1, 0, REACTOR_WRITE);
+
 	reopened = True;
 
 	return True;
@@ -109,6 +100,7 @@ libao_close(void)
 		ao_close(o_device);
 
 	o_device = NULL;
+	rdpsnd_watch_fd(-1, 0, 0);
 
 	ao_shutdown();
 }
@@ -199,7 +191,7 @@ libao_play(void)
 
 		}
 
-		delay_us = ((out->size / 4) * (1000000 / 44100));
+		delay_us = ((s_length(out) / 4) * (1000000 / 44100));
 
 		rdpsnd_queue_next(delay_us);
 	}
@@ -215,8 +207,7 @@ libao_register(char *options)
 	libao_driver.name = "libao";
 	libao_driver.description = "libao output driver, default device: system dependent";
 
-	libao_driver.add_fds = libao_add_fds;
-	libao_driver.check_fds = libao_check_fds;
+	libao_driver.fd_ready = libao_fd_ready;
 
 	libao_driver.wave_out_open = libao_open;
 	libao_driver.wave_out_close = libao_close;
@@ -69,27 +69,21 @@ static void oss_record(void);
 static RD_BOOL oss_set_format(RD_WAVEFORMATEX * pwfx);
 
 static void
-oss_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+oss_fd_ready(int fd, int events)
 {
-	UNUSED(tv);
-	if (dsp_fd == -1)
-		return;
+	UNUSED(fd);
 
-	if ((dsp_mode == O_WRONLY || dsp_mode == O_RDWR) && !rdpsnd_queue_empty())
-		FD_SET(dsp_fd, wfds);
-	if (dsp_mode == O_RDONLY || dsp_mode == O_RDWR)
-		FD_SET(dsp_fd, rfds);
-	if (dsp_fd > *n)
-		*n = dsp_fd;
+	if (events & REACTOR_WRITE)
+		oss_play();
+	if (events & REACTOR_READ)
+		oss_record();
 }
 
 static void
-oss_check_fds(fd_set * rfds, fd_set * wfds)
+oss_watch(RD_BOOL on)
 {
-	if (FD_ISSET(dsp_fd, wfds))
-		oss_play();
-	if (FD_ISSET(dsp_fd, rfds))
-		oss_record();
+	rdpsnd_watch_fd(dsp_fd, (on && dsp_mode != O_WRONLY) ? REACTOR_READ : 0,
+			(on && dsp_mode != O_RDONLY) ? REACTOR_WRITE : 0);
 }
 
 static RD_BOOL
@@ -161,6 +155,7 @@ oss_open(int wanted)
 				       "this OSS device is not capable of full duplex operation");
 				return False;
 			}
+			oss_watch(False);
 			close(dsp_fd);
 			dsp_mode = O_RDWR;
 		}
@@ -182,6 +177,7 @@ oss_open(int wanted)
 	}
 
 	in_esddsp = detect_esddsp();
+	oss_watch(True);
 
 	return True;
 }
@@ -189,6 +185,7 @@ oss_open(int wanted)
 static void
 oss_close(void)
 {
+	oss_watch(False);
 	close(dsp_fd);
 	dsp_fd = -1;
 }
@@ -447,7 +444,7 @@ oss_play(void)
 		{
 			/* EsounD has no way of querying buffer status, so we have to
 			 * go with a fixed size. */
-			delay_bytes = out->size;
+			delay_bytes = s_length(out);
 		}
 		else
 		{
@@ -464,7 +461,7 @@ oss_play(void)
 				if (ioctl(dsp_fd, SNDCTL_DSP_GETOSPACE, &info) != -1)
 					delay_bytes = info.fragstotal * info.fragsize - info.bytes;
 				else
-					delay_bytes = out->size;
+					delay_bytes = s_length(out);
 			}
 		}
 
@@ -508,8 +505,7 @@ oss_register(char *options)
 	oss_driver.description =
 		"OSS output driver, default device: " DEFAULTDEVICE " or $AUDIODEV";
 
-	oss_driver.add_fds = oss_add_fds;
-	oss_driver.check_fds = oss_check_fds;
+	oss_driver.fd_ready = oss_fd_ready;
 
 	oss_driver.wave_out_open = oss_open_out;
 	oss_driver.wave_out_close = oss_close_out;
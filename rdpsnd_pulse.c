@@ -213,6 +213,7 @@ pulse_context_init(void)
 			logger(Sound, Error, "pulse_context_init(), fcntl: %s", strerror(errno));
 			break;
 		}
+		rdpsnd_watch_fd(pulse_ctl[0], REACTOR_READ, 0);
 #if PA_CHECK_VERSION(0,9,11)
 		context =
 			pa_context_new_with_proplist(pa_threaded_mainloop_get_api(mainloop), NULL,
@@ -283,6 +284,7 @@ pulse_context_deinit(void)
 
 	if (pulse_ctl[0] != -1)
 	{
+		rdpsnd_watch_fd(pulse_ctl[0], 0, 0);
 		do
 			err = close(pulse_ctl[0]);
 		while (err == -1 && errno == EINTR);
@@ -957,28 +959,17 @@ pulse_update_timing_cb(pa_stream * p, int success, void *userdata)
 }
 
 void
-pulse_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
-{
-	if (pulse_ctl[0] != -1)
-	{
-		if (pulse_ctl[0] > *n)
-			*n = pulse_ctl[0];
-
-		FD_SET(pulse_ctl[0], rfds);
-	}
-}
-
-void
-pulse_check_fds(fd_set * rfds, fd_set * wfds)
+pulse_fd_ready(int fd, int events)
 {
 	char audio_cmd;
 	int n;
 
+	UNUSED(events);
 
 	if (pulse_ctl[0] == -1)
 		return;
 
-	if (FD_ISSET(pulse_ctl[0], rfds))
+	if (fd == pulse_ctl[0])
 	{
 		do
 		{
@@ -991,7 +982,7 @@ pulse_check_fds(fd_set * rfds, fd_set * wfds)
 					break;
 				else
 				{
-					logger(Sound, Error, "pulse_check_fds(), read: %s\n",
+					logger(Sound, Error, "pulse_fd_ready(), read: %s\n",
 					       strerror(errno));
 					return;
 				}
@@ -999,7 +990,7 @@ pulse_check_fds(fd_set * rfds, fd_set * wfds)
 			else if (n == 0)
 			{
 				logger(Sound, Warning,
-				       "pulse_check_fds(), audio control pipe was closed");
+				       "pulse_fd_ready(), audio control pipe was closed");
 				break;
 			}
 			else
@@ -1010,7 +1001,7 @@ pulse_check_fds(fd_set * rfds, fd_set * wfds)
 							if (pulse_recover(&playback_stream) != True)
 							{
 								logger(Sound, Error,
-								       "pulse_check_fds(), PulseAudio playback error");
+								       "pulse_fd_ready(), PulseAudio playback error");
 								return;
 							}
 						break;
@@ -1019,7 +1010,7 @@ pulse_check_fds(fd_set * rfds, fd_set * wfds)
 							if (pulse_recover(&capture_stream) != True)
 							{
 								logger(Sound, Error,
-								       "pulse_check_fds(), PulseAudio capture error");
+								       "pulse_fd_ready(), PulseAudio capture error");
 								return;
 							}
 						break;
@@ -1027,7 +1018,7 @@ pulse_check_fds(fd_set * rfds, fd_set * wfds)
 						if (pulse_recover(&playback_stream) != True)
 						{
 							logger(Sound, Error,
-							       "pulse_check_fds(), an error occured in audio thread with PulseAudio playback stream");
+							       "pulse_fd_ready(), an error occured in audio thread with PulseAudio playback stream");
 							return;
 						}
 						break;
@@ -1035,13 +1026,13 @@ pulse_check_fds(fd_set * rfds, fd_set * wfds)
 						if (pulse_recover(&capture_stream) != True)
 						{
 							logger(Sound, Error,
-							       "pulse_check_fds(), an error occured in audio thread with PulseAudio capture stream");
+							       "pulse_fd_ready(), an error occured in audio thread with PulseAudio capture stream");
 							return;
 						}
 						break;
 					default:
 						logger(Sound, Error,
-						       "pulse_check_fds(), wrong command from the audio thread: %d",
+						       "pulse_fd_ready(), wrong command from the audio thread: %d",
 						       audio_cmd);
 						break;
 				}
@@ -1444,8 +1435,7 @@ pulse_register(char *options)
 	pulse_driver.name = "pulse";
 	pulse_driver.description = "PulseAudio output driver, default device: system dependent";
 
-	pulse_driver.add_fds = pulse_add_fds;
-	pulse_driver.check_fds = pulse_check_fds;
+	pulse_driver.fd_ready = pulse_fd_ready;
 
 	pulse_driver.wave_out_open = pulse_open_out;
 	pulse_driver.wave_out_close = pulse_close_out;
@@ -43,16 +43,11 @@ int combinedFrameSize;
 void sgi_play(void);
 
 void
-sgi_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+sgi_fd_ready(int fd, int events)
 {
-	/* We need to be called rather often... */
-	if (output_port != (ALport) 0 && !rdpsnd_queue_empty())
-		FD_SET(0, wfds);
-}
+	UNUSED(fd);
+	UNUSED(events);
 
-void
-sgi_check_fds(fd_set * rfds, fd_set * wfds)
-{
 	if (output_port == (ALport) 0)
 		return;
 
@@ -105,6 +100,9 @@ sgi_open(void)
 		return False;
 	}
 
+	/* We need to be called rather often... */
+	rdpsnd_watch_fd(-1, 0, REACTOR_WRITE);
+
 	logger(Sound, Debug, "sgi_open(), done");
 	return True;
 }
@@ -121,6 +119,7 @@ sgi_close(void)
 
 	alClosePort(output_port);
 	output_port = (ALport) 0;
+	rdpsnd_watch_fd(-1, 0, 0);
 	alFreeConfig(audioconfig);
 
 	logger(Sound, Debug, "sgi_close(), done");
@@ -289,8 +288,7 @@ sgi_register(char *options)
 	sgi_driver.name = "sgi";
 	sgi_driver.description = "SGI output driver";
 
-	sgi_driver.add_fds = sgi_add_fds;
-	sgi_driver.check_fds = sgi_check_fds;
+	sgi_driver.fd_ready = sgi_fd_ready;
 
 	sgi_driver.wave_out_open = sgi_open;
 	sgi_driver.wave_out_close = sgi_close;
@@ -96,26 +96,21 @@ sun_resume(void)
 }
 
 void
-sun_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+sun_fd_ready(int fd, int events)
 {
-	if (dsp_fd == -1)
-		return;
+	UNUSED(fd);
 
-	if (dsp_out && !rdpsnd_queue_empty())
-		FD_SET(dsp_fd, wfds);
-	if (dsp_in)
-		FD_SET(dsp_fd, rfds);
-	if (dsp_fd > *n)
-		*n = dsp_fd;
+	if (events & REACTOR_WRITE)
+		sun_play();
+	if (events & REACTOR_READ)
+		sun_record();
 }
 
-void
-sun_check_fds(fd_set * rfds, fd_set * wfds)
+static void
+sun_watch(void)
 {
-	if (FD_ISSET(dsp_fd, wfds))
-		sun_play();
-	if (FD_ISSET(dsp_fd, rfds))
-		sun_record();
+	if (dsp_fd != -1)
+		rdpsnd_watch_fd(dsp_fd, dsp_in ? REACTOR_READ : 0, dsp_out ? REACTOR_WRITE : 0);
 }
 
 RD_BOOL
@@ -194,6 +189,7 @@ sun_close(void)
 	if (dsp_refs != 0)
 		return;
 
+	rdpsnd_watch_fd(dsp_fd, 0, 0);
 	close(dsp_fd);
 	dsp_fd = -1;
 }
@@ -205,6 +201,7 @@ sun_open_out(void)
 		return False;
 
 	dsp_out = True;
+	sun_watch();
 
 	return True;
 }
@@ -227,6 +224,7 @@ sun_close_out(void)
 		rdpsnd_queue_next(0);
 
 	dsp_out = False;
+	sun_watch();
 }
 
 RD_BOOL
@@ -260,6 +258,7 @@ sun_open_in(void)
 	}
 
 	dsp_in = True;
+	sun_watch();
 
 	return True;
 }
@@ -275,6 +274,7 @@ sun_close_in(void)
 	sun_close();
 
 	dsp_in = False;
+	sun_watch();
 }
 
 RD_BOOL
@@ -456,7 +456,7 @@ sun_play(void)
 		if (ioctl(dsp_fd, AUDIO_GETINFO, &info) != -1)
 			delay_samples = written_samples - info.play.samples;
 		else
-			delay_samples = out->size / (samplewidth * (stereo ? 2 : 1));
+			delay_samples = s_length(out) / (samplewidth * (stereo ? 2 : 1));
 
 		delay_us = delay_samples * (1000000 / snd_rate);
 		rdpsnd_queue_next(delay_us);
@@ -513,8 +513,7 @@ sun_register(char *options)
 	sun_driver.description =
 		"SUN/BSD output driver, default device: " DEFAULTDEVICE " or $AUDIODEV";
 
-	sun_driver.add_fds = sun_add_fds;
-	sun_driver.check_fds = sun_check_fds;
+	sun_driver.fd_ready = sun_fd_ready;
 
 	sun_driver.wave_out_open = sun_open_out;
 	sun_driver.wave_out_close = sun_close_out;
@@ -0,0 +1,353 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Main loop file descriptor readiness
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Descriptors are registered with a callback while they are of
+   interest, for as long as the RDP socket or only for one rdpdr io
+   request. The registered set is kept in the kernel with epoll where
+   available, and in a persistent pollfd array otherwise, so a pass of
+   the main loop does not depend on how many there are. Timeouts are
+   timers, kept ordered by deadline.
+
+   Readiness is level-triggered. Most callbacks only note that data is
+   there and leave reading to someone else, one PDU at a time. */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "rdesktop.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#define MAX_EVENTS 32
+#else
+#include <poll.h>
+#endif
+
+struct reactor_handler
+{
+	reactor_callback callback;
+	void *data;
+	int events;
+	int slot;		/* index in g_pollfds */
+};
+
+struct reactor_timer
+{
+	struct timeval deadline;
+	reactor_timer_callback callback;
+	void *data;
+};
+
+static struct reactor_handler *g_handlers = NULL;
+static int g_handlers_size = 0;
+
+/* ordered by deadline, the first one is due first */
+static struct reactor_timer *g_timers = NULL;
+static int g_timers_count = 0;
+static int g_timers_size = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+static int g_epfd = -1;
+#else
+static struct pollfd *g_pollfds = NULL;
+static int g_pollfds_count = 0;
+static int g_pollfds_size = 0;
+#endif
+
+static RD_BOOL
+reactor_init(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if (g_epfd != -1)
+		return True;
+
+	g_epfd = epoll_create(MAX_EVENTS);
+	if (g_epfd == -1)
+	{
+		logger(Core, Error, "reactor_init(), epoll_create() failed: %s", strerror(errno));
+		return False;
+	}
+#endif
+	return True;
+}
+
+RD_BOOL
+reactor_has(int fd)
+{
+	return fd >= 0 && fd < g_handlers_size && g_handlers[fd].callback != NULL;
+}
+
+/* Watch fd for events until reactor_remove() */
+void
+reactor_add(int fd, int events, reactor_callback callback, void *data)
+{
+	struct reactor_handler *h;
+	int size;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	int ret;
+#endif
+
+	if (fd < 0 || !reactor_init())
+		return;
+
+	if (fd >= g_handlers_size)
+	{
+		size = MAX(fd + 1, g_handlers_size * 2);
+		g_handlers = xrealloc(g_handlers, size * sizeof(struct reactor_handler));
+		memset(g_handlers + g_handlers_size, 0,
+		       (size - g_handlers_size) * sizeof(struct reactor_handler));
+		g_handlers_size = size;
+	}
+
+	h = &g_handlers[fd];
+
+#ifdef HAVE_SYS_EPOLL_H
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((events & REACTOR_READ) ? EPOLLIN : 0) | ((events & REACTOR_WRITE) ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	ret = epoll_ctl(g_epfd, h->callback ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+	/* closing a descriptor drops it from the epoll set, and the
+	   number may since have been reused */
+	if (ret == -1 && errno == ENOENT)
+		ret = epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (ret == -1)
+	{
+		logger(Core, Error, "reactor_add(), epoll_ctl() failed for fd %d: %s", fd,
+		       strerror(errno));
+		return;
+	}
+#else
+	if (h->callback == NULL)
+	{
+		if (g_pollfds_count == g_pollfds_size)
+		{
+			g_pollfds_size = MAX(16, g_pollfds_size * 2);
+			g_pollfds = xrealloc(g_pollfds, g_pollfds_size * sizeof(struct pollfd));
+		}
+		h->slot = g_pollfds_count++;
+		g_pollfds[h->slot].fd = fd;
+	}
+	g_pollfds[h->slot].events =
+		((events & REACTOR_READ) ? POLLIN : 0) | ((events & REACTOR_WRITE) ? POLLOUT : 0);
+	g_pollfds[h->slot].revents = 0;
+#endif
+
+	h->callback = callback;
+	h->data = data;
+	h->events = events;
+}
+
+/* Stop watching fd, to be called before it is closed */
+void
+reactor_remove(int fd)
+{
+#ifndef HAVE_SYS_EPOLL_H
+	int last;
+#endif
+
+	if (!reactor_has(fd))
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+	/* move the last slot into the hole */
+	last = --g_pollfds_count;
+	if (g_handlers[fd].slot != last)
+	{
+		g_pollfds[g_handlers[fd].slot] = g_pollfds[last];
+		g_handlers[g_pollfds[last].fd].slot = g_handlers[fd].slot;
+	}
+#endif
+
+	memset(&g_handlers[fd], 0, sizeof(struct reactor_handler));
+}
+
+static int
+reactor_find_timer(reactor_timer_callback callback, void *data)
+{
+	int i;
+
+	for (i = 0; i < g_timers_count; i++)
+	{
+		if (g_timers[i].callback == callback && g_timers[i].data == data)
+			return i;
+	}
+	return -1;
+}
+
+/* Call callback with data in ms milliseconds, replacing a timer
+   already set for the same callback and data */
+void
+reactor_set_timer(reactor_timer_callback callback, void *data, uint32 ms)
+{
+	struct reactor_timer t;
+	int i;
+
+	reactor_cancel_timer(callback, data);
+
+	gettimeofday(&t.deadline, NULL);
+	t.deadline.tv_sec += ms / 1000;
+	t.deadline.tv_usec += (ms % 1000) * 1000;
+	if (t.deadline.tv_usec >= 1000000)
+	{
+		t.deadline.tv_sec++;
+		t.deadline.tv_usec -= 1000000;
+	}
+	t.callback = callback;
+	t.data = data;
+
+	if (g_timers_count == g_timers_size)
+	{
+		g_timers_size = MAX(16, g_timers_size * 2);
+		g_timers = xrealloc(g_timers, g_timers_size * sizeof(struct reactor_timer));
+	}
+
+	for (i = g_timers_count; i > 0 && timercmp(&g_timers[i - 1].deadline, &t.deadline, >); i--)
+		g_timers[i] = g_timers[i - 1];
+	g_timers[i] = t;
+	g_timers_count++;
+}
+
+void
+reactor_cancel_timer(reactor_timer_callback callback, void *data)
+{
+	int i;
+
+	i = reactor_find_timer(callback, data);
+	if (i == -1)
+		return;
+
+	g_timers_count--;
+	memmove(g_timers + i, g_timers + i + 1, (g_timers_count - i) * sizeof(struct reactor_timer));
+}
+
+/* Shorten a wait of ms milliseconds to the first timer */
+static int
+reactor_timeout(int ms)
+{
+	struct timeval now;
+	long due;
+
+	if (g_timers_count == 0)
+		return ms;
+
+	gettimeofday(&now, NULL);
+	due = (g_timers[0].deadline.tv_sec - now.tv_sec) * 1000 +
+		(g_timers[0].deadline.tv_usec - now.tv_usec + 999) / 1000;
+
+	return MAX(0, MIN(ms, due));
+}
+
+static void
+reactor_run_timers(void)
+{
+	struct reactor_timer t;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	/* callbacks may set new timers, so take each one off first */
+	while (g_timers_count > 0 && !timercmp(&g_timers[0].deadline, &now, >))
+	{
+		t = g_timers[0];
+		g_timers_count--;
+		memmove(g_timers, g_timers + 1, g_timers_count * sizeof(struct reactor_timer));
+		t.callback(t.data);
+	}
+}
+
+static void
+reactor_dispatch(int fd, int events)
+{
+	/* an earlier callback may have removed it */
+	if (!reactor_has(fd))
+		return;
+
+	events &= g_handlers[fd].events;
+	if (events == 0)
+		return;
+
+	g_handlers[fd].callback(fd, events, g_handlers[fd].data);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Wait up to ms milliseconds for registered descriptors and timers,
+   and run the callbacks of those that are ready. Returns the number of
+   ready descriptors. */
+int
+reactor_wait(int ms)
+{
+	struct epoll_event ev[MAX_EVENTS];
+	int i, ret, events;
+
+	if (!reactor_init())
+		return -1;
+
+	ret = epoll_wait(g_epfd, ev, MAX_EVENTS, reactor_timeout(ms));
+	for (i = 0; i < ret; i++)
+	{
+		events = 0;
+		if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			events |= REACTOR_READ;
+		if (ev[i].events & EPOLLOUT)
+			events |= REACTOR_WRITE;
+		reactor_dispatch(ev[i].data.fd, events);
+	}
+
+	reactor_run_timers();
+	return ret;
+}
+
+#else
+
+int
+reactor_wait(int ms)
+{
+	struct pollfd *p;
+	int i, fd, ret, events;
+
+	ret = poll(g_pollfds, g_pollfds_count, reactor_timeout(ms));
+
+	/* callbacks may remove slots, walk from the end */
+	for (i = g_pollfds_count - 1; ret > 0 && i >= 0; i--)
+	{
+		if (i >= g_pollfds_count)
+			continue;
+
+		p = &g_pollfds[i];
+		if (p->revents == 0)
+			continue;
+
+		fd = p->fd;
+		events = 0;
+		if (p->revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+			events |= REACTOR_READ;
+		if (p->revents & POLLOUT)
+			events |= REACTOR_WRITE;
+		p->revents = 0;
+		reactor_dispatch(fd, events);
+	}
+
+	reactor_run_timers();
+	return ret;
+}
+
+#endif
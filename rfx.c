@@ -0,0 +1,683 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   RemoteFX codec decoder [MS-RDPRFX]
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+
+/* A tile is 64x64 pixels, decoded from three 4096 coefficient
+   components. Tiles of a tileset are independent of each other and
+   are decoded on the bitmap worker pool straight into the canvas. */
+#define TILE_SIZE	64
+#define TILE_PIXELS	(TILE_SIZE * TILE_SIZE)
+
+/* RLGR adaptation parameters, 3.1.8.1.7.1 */
+#define KPMAX	80
+#define LSGR	3
+#define UP_GR	4
+#define DN_GR	6
+#define UQ_GR	3
+#define DQ_GR	3
+
+typedef struct _RFX_TILE_JOB
+{
+	uint8 *data[3];		/* Y, Cb and Cr */
+	int size[3];
+	uint8 *quant[3];
+	int x, y;
+	RD_BOOL ok;
+}
+RFX_TILE_JOB;
+
+typedef struct _RFX_RECT
+{
+	uint16 x, y, cx, cy;
+}
+RFX_RECT;
+
+static int g_rfx_entropy = CLW_ENTROPY_RLGR1;
+
+/* Canvas of the surface bits command being decoded, and the rows of
+   a rectangle to paint. Both only grow. */
+static uint8 *g_rfx_canvas;
+static size_t g_rfx_canvas_size;
+static int g_rfx_width, g_rfx_height;
+static uint8 *g_rfx_paint;
+static size_t g_rfx_paint_size;
+
+static RFX_TILE_JOB *g_rfx_jobs;
+static int g_rfx_jobs_size;
+
+static RFX_RECT *g_rfx_rects;
+static int g_rfx_rects_size;
+static int g_rfx_num_rects;
+
+struct rfx_bits
+{
+	uint8 *p, *end;
+	uint32 acc;		/* left aligned */
+	int nbits;
+	int overrun;		/* bits read past the end */
+};
+
+static void
+rfx_bits_refill(struct rfx_bits *b)
+{
+	while (b->nbits <= 24)
+	{
+		if (b->p < b->end)
+			b->acc |= (uint32) (*b->p++) << (24 - b->nbits);
+		else
+			b->overrun += 8;
+		b->nbits += 8;
+	}
+}
+
+/* Read up to 24 bits, MSB first */
+static uint32
+rfx_getbits(struct rfx_bits *b, int n)
+{
+	uint32 v;
+
+	if (n == 0)
+		return 0;
+
+	rfx_bits_refill(b);
+	v = b->acc >> (32 - n);
+	b->acc <<= n;
+	b->nbits -= n;
+	return v;
+}
+
+static RD_BOOL
+rfx_bits_exhausted(struct rfx_bits *b)
+{
+	return b->overrun > 0 && b->nbits <= b->overrun;
+}
+
+/* Number of consecutive bits equal to bit, and the terminating one */
+static int
+rfx_count_bits(struct rfx_bits *b, int bit)
+{
+	int n = 0;
+
+	while (!rfx_bits_exhausted(b) && rfx_getbits(b, 1) == (uint32) bit)
+		n++;
+	return n;
+}
+
+#define UPDATE_PARAM(param, delta, k) \
+	{ \
+		param += delta; \
+		if (param > KPMAX) param = KPMAX; \
+		if (param < 0) param = 0; \
+		k = param >> LSGR; \
+	}
+
+/* Golomb-Rice code with adaptive parameter kr */
+static uint32
+rfx_gr_code(struct rfx_bits *b, int *krp, int *kr)
+{
+	int vk;
+	uint32 mag;
+
+	vk = rfx_count_bits(b, 1);
+	mag = ((uint32) vk << *kr) | rfx_getbits(b, *kr);
+
+	if (vk == 0)
+	{
+		UPDATE_PARAM(*krp, -2, *kr);
+	}
+	else if (vk != 1)
+	{
+		UPDATE_PARAM(*krp, vk, *kr);
+	}
+
+	return mag;
+}
+
+static sint16
+rfx_2magsign(uint32 v)
+{
+	return (v & 1) ? -(sint16) ((v + 1) >> 1) : (sint16) (v >> 1);
+}
+
+static int
+rfx_min_bits(uint32 v)
+{
+	int n = 0;
+
+	while (v)
+	{
+		n++;
+		v >>= 1;
+	}
+	return n;
+}
+
+/* Decode count coefficients of RLGR1 or RLGR3 data, 3.1.8.1.7.1.
+   Coefficients missing from the input are zero. */
+static RD_BOOL
+rfx_rlgr_decode(int mode, uint8 * data, int size, sint16 * out, int count)
+{
+	struct rfx_bits b;
+	int k = 1, kp = 1 << LSGR, kr = 1, krp = 1 << LSGR;
+	int pos = 0, run, nidx;
+	uint32 mag, val1, val2, sign;
+
+	memset(&b, 0, sizeof(b));
+	b.p = data;
+	b.end = data + size;
+
+	while (pos < count && !rfx_bits_exhausted(&b))
+	{
+		if (k)
+		{
+			/* run-length mode, each 0 is a run of 1 << k zeros */
+			while (!rfx_bits_exhausted(&b) && rfx_getbits(&b, 1) == 0)
+			{
+				run = MIN(1 << k, count - pos);
+				memset(out + pos, 0, run * sizeof(sint16));
+				pos += run;
+				UPDATE_PARAM(kp, UP_GR, k);
+			}
+
+			run = rfx_getbits(&b, k);
+			run = MIN(run, count - pos);
+			memset(out + pos, 0, run * sizeof(sint16));
+			pos += run;
+			if (pos >= count)
+				break;
+
+			sign = rfx_getbits(&b, 1);
+			mag = rfx_gr_code(&b, &krp, &kr) + 1;
+			out[pos++] = sign ? -(sint16) mag : (sint16) mag;
+			UPDATE_PARAM(kp, -DN_GR, k);
+		}
+		else if (mode == CLW_ENTROPY_RLGR1)
+		{
+			mag = rfx_gr_code(&b, &krp, &kr);
+			out[pos++] = rfx_2magsign(mag);
+			if (mag == 0)
+			{
+				UPDATE_PARAM(kp, UQ_GR, k);
+			}
+			else
+			{
+				UPDATE_PARAM(kp, -DQ_GR, k);
+			}
+		}
+		else
+		{
+			/* RLGR3 codes two values as their sum and the first one */
+			mag = rfx_gr_code(&b, &krp, &kr);
+			nidx = rfx_min_bits(mag);
+			val1 = nidx > 24 ? 0 : rfx_getbits(&b, nidx);
+			val2 = mag - val1;
+
+			if (val1 && val2)
+			{
+				UPDATE_PARAM(kp, -2 * DQ_GR, k);
+			}
+			else if (!val1 && !val2)
+			{
+				UPDATE_PARAM(kp, 2 * UQ_GR, k);
+			}
+
+			out[pos++] = rfx_2magsign(val1);
+			if (pos < count)
+				out[pos++] = rfx_2magsign(val2);
+		}
+	}
+
+	if (pos < count)
+		memset(out + pos, 0, (count - pos) * sizeof(sint16));
+
+	return True;
+}
+
+/* Scale the subbands back up, quant holds the 5 byte TS_RFX_CODEC_QUANT */
+static void
+rfx_dequantize(sint16 * buffer, uint8 * quant)
+{
+	/* offset, size and nibble index of each subband */
+	static const int bands[10][3] = {
+		{0, 1024, 8},	/* HL1 */
+		{1024, 1024, 7},	/* LH1 */
+		{2048, 1024, 9},	/* HH1 */
+		{3072, 256, 5},	/* HL2 */
+		{3328, 256, 4},	/* LH2 */
+		{3584, 256, 6},	/* HH2 */
+		{3840, 64, 2},	/* HL3 */
+		{3904, 64, 1},	/* LH3 */
+		{3968, 64, 3},	/* HH3 */
+		{4032, 64, 0}	/* LL3 */
+	};
+	int i, n, q, shift;
+	sint16 *p;
+
+	for (i = 0; i < 10; i++)
+	{
+		q = bands[i][2];
+		q = (q & 1) ? quant[q >> 1] >> 4 : quant[q >> 1] & 0xf;
+		shift = q - 1;
+		if (shift <= 0)
+			continue;
+
+		p = buffer + bands[i][0];
+		for (n = 0; n < bands[i][1]; n++)
+			p[n] = (sint16) (p[n] << shift);
+	}
+}
+
+/* One level of the inverse 5/3 wavelet, from the HL, LH, HH and LL
+   subbands of width w at buffer to a 2w x 2w block at buffer */
+static void
+rfx_idwt_level(sint16 * buffer, sint16 * tmp, int w)
+{
+	sint16 *hl, *lh, *hh, *ll, *l, *h, *even, *odd;
+	int n, x, y, w2 = w * 2;
+
+	hl = buffer;
+	lh = buffer + w * w;
+	hh = buffer + 2 * w * w;
+	ll = buffer + 3 * w * w;
+
+	/* horizontal, L rows to the top half of tmp and H rows to the bottom */
+	for (y = 0; y < w; y++)
+	{
+		l = tmp + y * w2;
+		h = tmp + (w + y) * w2;
+
+		l[0] = ll[0] - ((hl[0] + hl[0] + 1) >> 1);
+		h[0] = lh[0] - ((hh[0] + hh[0] + 1) >> 1);
+		for (n = 1; n < w; n++)
+		{
+			l[2 * n] = ll[n] - ((hl[n - 1] + hl[n] + 1) >> 1);
+			h[2 * n] = lh[n] - ((hh[n - 1] + hh[n] + 1) >> 1);
+		}
+		for (n = 0; n < w - 1; n++)
+		{
+			l[2 * n + 1] = (hl[n] << 1) + ((l[2 * n] + l[2 * n + 2]) >> 1);
+			h[2 * n + 1] = (hh[n] << 1) + ((h[2 * n] + h[2 * n + 2]) >> 1);
+		}
+		l[2 * n + 1] = (hl[n] << 1) + l[2 * n];
+		h[2 * n + 1] = (hh[n] << 1) + h[2 * n];
+
+		hl += w;
+		lh += w;
+		hh += w;
+		ll += w;
+	}
+
+	/* vertical, a whole row at a time so the inner loops run over
+	   contiguous memory */
+	l = tmp;
+	h = tmp + w * w2;
+	even = buffer;
+	for (x = 0; x < w2; x++)
+		even[x] = l[x] - ((h[x] * 2 + 1) >> 1);
+
+	for (n = 1; n < w; n++)
+	{
+		l = tmp + n * w2;
+		h = tmp + (w + n) * w2;
+		even = buffer + 2 * n * w2;
+		odd = even - w2;
+		for (x = 0; x < w2; x++)
+		{
+			even[x] = l[x] - ((h[x - w2] + h[x] + 1) >> 1);
+			odd[x] = (h[x - w2] << 1) + ((odd[x - w2] + even[x]) >> 1);
+		}
+	}
+
+	h = tmp + (2 * w - 1) * w2;
+	even = buffer + (w2 - 2) * w2;
+	odd = even + w2;
+	for (x = 0; x < w2; x++)
+		odd[x] = (h[x] << 1) + even[x];
+}
+
+static RD_BOOL
+rfx_decode_component(int mode, uint8 * data, int size, uint8 * quant, sint16 * buffer,
+		     sint16 * tmp)
+{
+	int i;
+
+	if (!rfx_rlgr_decode(mode, data, size, buffer, TILE_PIXELS))
+		return False;
+
+	/* the LL3 band is delta coded */
+	for (i = 4033; i < TILE_PIXELS; i++)
+		buffer[i] += buffer[i - 1];
+
+	rfx_dequantize(buffer, quant);
+
+	rfx_idwt_level(buffer + 3840, tmp, 8);
+	rfx_idwt_level(buffer + 3072, tmp, 16);
+	rfx_idwt_level(buffer, tmp, 32);
+
+	return True;
+}
+
+static uint8
+rfx_clamp(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* ICT colour conversion of 11.5 fixed point YCbCr to BGRX rows of
+   cx pixels */
+static void
+rfx_ycbcr_to_bgrx(sint16 * yp, sint16 * cbp, sint16 * crp, uint8 * out, int stride, int cx,
+		  int cy)
+{
+	int x, row, y, cb, cr;
+	uint8 *p;
+
+	for (row = 0; row < cy; row++)
+	{
+		p = out + row * stride;
+		for (x = 0; x < cx; x++)
+		{
+			y = (yp[x] + 4096) * 1024;
+			cb = cbp[x];
+			cr = crp[x];
+
+			p[4 * x + 0] = rfx_clamp((y + 1812 * cb) >> 15);
+			p[4 * x + 1] = rfx_clamp((y - 352 * cb - 732 * cr) >> 15);
+			p[4 * x + 2] = rfx_clamp((y + 1436 * cr) >> 15);
+			p[4 * x + 3] = 0xff;
+		}
+		yp += TILE_SIZE;
+		cbp += TILE_SIZE;
+		crp += TILE_SIZE;
+	}
+}
+
+static void
+rfx_decode_tile(void *arg)
+{
+	RFX_TILE_JOB *job = (RFX_TILE_JOB *) arg;
+	sint16 buffer[3][TILE_PIXELS], tmp[TILE_PIXELS];
+	int i, cx, cy;
+
+	for (i = 0; i < 3; i++)
+	{
+		if (!rfx_decode_component(g_rfx_entropy, job->data[i], job->size[i],
+					  job->quant[i], buffer[i], tmp))
+		{
+			job->ok = False;
+			return;
+		}
+	}
+
+	/* tiles along the right and bottom edges may be partly outside */
+	cx = MIN(TILE_SIZE, g_rfx_width - job->x);
+	cy = MIN(TILE_SIZE, g_rfx_height - job->y);
+	if (cx > 0 && cy > 0)
+		rfx_ycbcr_to_bgrx(buffer[0], buffer[1], buffer[2],
+				  g_rfx_canvas + (job->y * g_rfx_width + job->x) * 4,
+				  g_rfx_width * 4, cx, cy);
+	job->ok = True;
+}
+
+static RD_BOOL
+rfx_process_region(STREAM s)
+{
+	int i;
+	uint16 num_rects;
+
+	in_uint8s(s, 1);	/* regionFlags */
+	in_uint16_le(s, num_rects);
+	if (!s_check_rem(s, num_rects * 8))
+		return False;
+
+	if (num_rects > g_rfx_rects_size)
+	{
+		g_rfx_rects_size = num_rects;
+		g_rfx_rects = xrealloc(g_rfx_rects, g_rfx_rects_size * sizeof(RFX_RECT));
+	}
+
+	for (i = 0; i < num_rects; i++)
+	{
+		in_uint16_le(s, g_rfx_rects[i].x);
+		in_uint16_le(s, g_rfx_rects[i].y);
+		in_uint16_le(s, g_rfx_rects[i].cx);
+		in_uint16_le(s, g_rfx_rects[i].cy);
+	}
+	g_rfx_num_rects = num_rects;
+
+	return True;
+}
+
+static RD_BOOL
+rfx_process_tileset(STREAM s)
+{
+	uint16 subtype, num_tiles, properties, block_type, xidx, yidx, len[3];
+	uint32 block_len;
+	uint8 num_quant, quant_idx[3], *quants;
+	size_t next;
+	int i, c, count;
+	RFX_TILE_JOB *job;
+
+	in_uint16_le(s, subtype);
+	if (subtype != CBT_TILESET)
+		return False;
+
+	in_uint8s(s, 2);	/* idx */
+	in_uint16_le(s, properties);
+	in_uint8(s, num_quant);
+	in_uint8s(s, 1);	/* tileSize */
+	in_uint16_le(s, num_tiles);
+	in_uint8s(s, 4);	/* tilesDataSize */
+
+	g_rfx_entropy = (properties >> 10) & 0xf;
+
+	if (num_quant == 0 || !s_check_rem(s, num_quant * 5))
+		return False;
+	in_uint8p(s, quants, num_quant * 5);
+
+	if (num_tiles > g_rfx_jobs_size)
+	{
+		g_rfx_jobs_size = num_tiles;
+		g_rfx_jobs = xrealloc(g_rfx_jobs, g_rfx_jobs_size * sizeof(RFX_TILE_JOB));
+	}
+
+	count = 0;
+	for (i = 0; i < num_tiles; i++)
+	{
+		if (!s_check_rem(s, 19))
+			return False;
+
+		in_uint16_le(s, block_type);
+		in_uint32_le(s, block_len);
+		next = s_tell(s) + block_len - 6;
+		if (block_type != CBT_TILE || block_len < 19 || !s_check_rem(s, block_len - 6))
+			return False;
+
+		in_uint8(s, quant_idx[0]);
+		in_uint8(s, quant_idx[1]);
+		in_uint8(s, quant_idx[2]);
+		in_uint16_le(s, xidx);
+		in_uint16_le(s, yidx);
+		in_uint16_le(s, len[0]);
+		in_uint16_le(s, len[1]);
+		in_uint16_le(s, len[2]);
+
+		if ((uint32) (len[0] + len[1] + len[2]) > block_len - 19)
+			return False;
+
+		job = &g_rfx_jobs[count++];
+		for (c = 0; c < 3; c++)
+		{
+			if (quant_idx[c] >= num_quant)
+				return False;
+			job->quant[c] = quants + quant_idx[c] * 5;
+			job->size[c] = len[c];
+			in_uint8p(s, job->data[c], len[c]);
+		}
+		job->x = xidx * TILE_SIZE;
+		job->y = yidx * TILE_SIZE;
+
+		/* skip tiles entirely outside of the canvas */
+		if (job->x >= g_rfx_width || job->y >= g_rfx_height)
+			count--;
+
+		s_seek(s, next);
+	}
+
+	bitmap_run_jobs(rfx_decode_tile, g_rfx_jobs, sizeof(RFX_TILE_JOB), count);
+
+	for (i = 0; i < count; i++)
+		if (!g_rfx_jobs[i].ok)
+			return False;
+
+	return True;
+}
+
+/* Paint the parts of the canvas covered by the region rectangles */
+static void
+rfx_paint(int left, int top)
+{
+	RFX_RECT full, *r;
+	uint8 *buf;
+	int i, row, x, y, cx, cy;
+
+	if (g_rfx_num_rects == 0)
+	{
+		/* no rectangles means the whole canvas */
+		full.x = full.y = 0;
+		full.cx = g_rfx_width;
+		full.cy = g_rfx_height;
+	}
+
+	for (i = 0; i < MAX(g_rfx_num_rects, 1); i++)
+	{
+		r = g_rfx_num_rects ? &g_rfx_rects[i] : &full;
+		x = r->x;
+		y = r->y;
+		cx = MIN(r->cx, g_rfx_width - x);
+		cy = MIN(r->cy, g_rfx_height - y);
+		if (cx <= 0 || cy <= 0)
+			continue;
+
+		if (x == 0 && cx == g_rfx_width)
+		{
+			ui_paint_bitmap(left, top + y, cx, cy, cx, cy,
+					g_rfx_canvas + y * g_rfx_width * 4);
+			continue;
+		}
+
+		if ((size_t) cx * cy * 4 > g_rfx_paint_size)
+		{
+			g_rfx_paint_size = (size_t) cx * cy * 4;
+			g_rfx_paint = xrealloc(g_rfx_paint, g_rfx_paint_size);
+		}
+		buf = g_rfx_paint;
+		for (row = 0; row < cy; row++)
+			memcpy(buf + row * cx * 4,
+			       g_rfx_canvas + ((y + row) * g_rfx_width + x) * 4, cx * 4);
+		ui_paint_bitmap(left + x, top + y, cx, cy, cx, cy, buf);
+	}
+}
+
+/* Decode a RemoteFX message and paint it at left, top. The message is
+   clipped to width x height. */
+RD_BOOL
+rfx_process_message(uint8 * data, uint32 length, int left, int top, int width, int height)
+{
+	struct stream packet;
+	STREAM s = &packet;
+	uint16 block_type;
+	uint32 block_len, magic;
+	uint16 properties;
+	size_t next;
+	RD_BOOL ok = True;
+
+	memset(s, 0, sizeof(packet));
+	s->data = s->p = data;
+	s->end = data + length;
+	s->size = length;
+
+	g_rfx_width = width;
+	g_rfx_height = height;
+	if ((size_t) width * height * 4 > g_rfx_canvas_size)
+	{
+		g_rfx_canvas_size = (size_t) width * height * 4;
+		g_rfx_canvas = xrealloc(g_rfx_canvas, g_rfx_canvas_size);
+	}
+	memset(g_rfx_canvas, 0, (size_t) width * height * 4);
+	g_rfx_num_rects = 0;
+
+	while (ok && s_check_rem(s, 6))
+	{
+		in_uint16_le(s, block_type);
+		in_uint32_le(s, block_len);
+		if (block_len < 6 || !s_check_rem(s, block_len - 6))
+		{
+			ok = False;
+			break;
+		}
+		next = s_tell(s) + block_len - 6;
+
+		/* codec channel blocks carry codecId and channelId */
+		if (block_type >= WBT_CONTEXT && block_type <= WBT_EXTENSION)
+			in_uint8s(s, 2);
+
+		switch (block_type)
+		{
+			case WBT_SYNC:
+				in_uint32_le(s, magic);
+				if (magic != WF_MAGIC)
+					ok = False;
+				break;
+
+			case WBT_CONTEXT:
+				in_uint8s(s, 3);	/* ctxId, tileSize */
+				in_uint16_le(s, properties);
+				g_rfx_entropy = (properties >> 9) & 0xf;
+				break;
+
+			case WBT_REGION:
+				ok = rfx_process_region(s);
+				break;
+
+			case WBT_EXTENSION:
+				ok = rfx_process_tileset(s);
+				break;
+
+			case WBT_CODEC_VERSIONS:
+			case WBT_CHANNELS:
+			case WBT_FRAME_BEGIN:
+			case WBT_FRAME_END:
+				break;
+
+			default:
+				logger(Graphics, Warning,
+				       "rfx_process_message(), unhandled block type 0x%x", block_type);
+		}
+
+		s_seek(s, next);
+	}
+
+	if (ok)
+		rfx_paint(left, top);
+	else
+		logger(Graphics, Error, "rfx_process_message(), invalid message");
+
+	return ok;
+}
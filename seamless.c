@@ -480,23 +480,6 @@ seamless_send_position(unsigned long id, int x, int y, int width, int height, un
 }
 
 
-/* Update select timeout */
-void
-seamless_select_timeout(struct timeval *tv)
-{
-	struct timeval ourtimeout = { 0, SEAMLESSRDP_POSITION_TIMER };
-
-	if (g_seamless_rdp)
-	{
-		if (timercmp(&ourtimeout, tv, <))
-		{
-			tv->tv_sec = ourtimeout.tv_sec;
-			tv->tv_usec = ourtimeout.tv_usec;
-		}
-	}
-}
-
-
 unsigned int
 seamless_send_zchange(unsigned long id, unsigned long below, unsigned long flags)
 {
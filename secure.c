@@ -32,6 +32,7 @@ extern int g_keyboard_subtype;
 extern int g_keyboard_functionkeys;
 extern RD_BOOL g_encryption;
 extern RD_BOOL g_licence_issued;
+extern RD_BOOL g_gfx;
 extern RD_BOOL g_licence_error_result;
 extern RDP_VERSION g_rdp_version;
 extern RD_BOOL g_console_session;
@@ -374,6 +375,57 @@ sec_send(STREAM s, uint32 flags)
 	sec_send_to_channel(s, flags, MCS_GLOBAL_CHANNEL);
 }
 
+/* Transmit a fast-path input PDU, bypassing the MCS and ISO layers */
+void
+sec_send_fastpath_input(int numevents, uint8 * data, int datalen)
+{
+	STREAM s;
+	int length;
+	uint8 *signature, *events;
+
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_SEC);
+#endif
+
+	/* fpInputHeader and a one or two byte length */
+	length = 2 + (g_encryption ? 8 : 0) + datalen;
+	if (length > 0x7f)
+		length++;
+
+	s = tcp_init(length);
+	out_uint8(s, FASTPATH_INPUT_ACTION_FASTPATH | (numevents << 2) |
+		  (g_encryption ? FASTPATH_INPUT_ENCRYPTED : 0));
+	if (length > 0x7f)
+	{
+		out_uint16_be(s, 0x8000 | length);
+	}
+	else
+	{
+		out_uint8(s, length);
+	}
+
+	signature = NULL;
+	if (g_encryption)
+		out_uint8p(s, signature, 8);
+
+	out_uint8p(s, events, datalen);
+	memcpy(events, data, datalen);
+	s_mark_end(s);
+
+	if (g_encryption)
+	{
+		sec_sign(signature, 8, g_sec_sign_key, g_rc4_key_len, events, datalen);
+		sec_encrypt(events, datalen);
+	}
+
+	tcp_send(s);
+	s_free(s);
+
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_SEC);
+#endif
+}
+
 
 /* Transfer the client random to the server */
 static void
@@ -461,6 +513,8 @@ sec_out_mcs_connect_initial_pdu(STREAM s, uint32 selected_protocol)
 	out_uint16_le(s, MIN(g_server_depth, 24));
 	if (g_server_depth == 32)
 		capflags |= RNS_UD_CS_WANT_32BPP_SESSION;
+	if (g_gfx)
+		capflags |= RNS_UD_CS_SUPPORT_DYNVC_GFX_PROTOCOL;
 
 	out_uint16_le(s, colorsupport);	/* supportedColorDepths */
 	out_uint16_le(s, capflags);	/* earlyCapabilityFlags */
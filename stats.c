@@ -0,0 +1,310 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Performance counters
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "rdesktop.h"
+
+/* Histogram bucket n counts durations of less than 2^(n+1)
+   microseconds, the last one everything longer */
+#define STATS_BUCKETS	24
+
+/* Counters are updated by the decoder and receive threads too */
+#if defined(__GNUC__)
+#define STATS_ATOMIC_ADD(p, n)	__sync_fetch_and_add(p, n)
+#else
+#define STATS_ATOMIC_ADD(p, n)	(*(p) += (n))
+#endif
+
+typedef struct _STATS_HISTOGRAM
+{
+	uint64 count;
+	uint64 total;		/* microseconds */
+	uint64 buckets[STATS_BUCKETS];
+}
+STATS_HISTOGRAM;
+
+struct stats_text
+{
+	char *data;
+	size_t length, size;
+};
+
+extern VCHANNEL g_channels[];
+extern unsigned int g_num_channels;
+
+static const char *g_stats_counter_names[STATS_COUNTERS] = {
+	"bytes_received",
+	"bytes_sent",
+	"pdus_received",
+	"pdus_sent",
+	"mppc_compressed_bytes",
+	"mppc_expanded_bytes",
+	"bitmap_cache_hits",
+	"bitmap_cache_misses",
+	"glyph_cache_hits",
+	"glyph_cache_misses",
+	"brush_cache_hits",
+	"brush_cache_misses",
+	"cursor_cache_hits",
+	"cursor_cache_misses",
+	"x_flushes",
+	"audio_underruns",
+	"receive_queued_pdus",
+	"receive_queue_depth_total",
+	"receive_queue_full"
+};
+
+static const char *g_stats_timer_names[STATS_TIMERS] = {
+	"decode_interleaved",
+	"decode_planar",
+	"decode_remotefx",
+	"decode_nscodec",
+	"paint",
+	"audio_latency"
+};
+
+static uint64 g_stats_counters[STATS_COUNTERS];
+static STATS_HISTOGRAM g_stats_timers[STATS_TIMERS];
+static uint64 g_stats_start;
+static char *g_stats_dump_path = NULL;
+
+/* Monotonic time in microseconds */
+uint64
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+stats_init(void)
+{
+	g_stats_start = stats_now();
+}
+
+void
+stats_add(STATS_COUNTER counter, uint32 n)
+{
+	STATS_ATOMIC_ADD(&g_stats_counters[counter], n);
+}
+
+/* Add the time since start, from stats_now(), to a histogram */
+void
+stats_record(STATS_TIMER timer, uint64 start)
+{
+	STATS_HISTOGRAM *h = &g_stats_timers[timer];
+	uint64 elapsed = stats_now() - start;
+	int bucket = 0;
+
+	while (bucket < STATS_BUCKETS - 1 && (elapsed >> (bucket + 1)) != 0)
+		bucket++;
+
+	STATS_ATOMIC_ADD(&h->count, 1);
+	STATS_ATOMIC_ADD(&h->total, elapsed);
+	STATS_ATOMIC_ADD(&h->buckets[bucket], 1);
+}
+
+static void
+stats_printf(struct stats_text *t, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	while (1)
+	{
+		va_start(ap, format);
+		n = vsnprintf(t->data + t->length, t->size - t->length, format, ap);
+		va_end(ap);
+
+		if (n >= 0 && (size_t) n < t->size - t->length)
+			break;
+
+		t->size = MAX(t->size * 2, t->length + n + 1);
+		t->data = xrealloc(t->data, t->size);
+	}
+
+	t->length += n;
+}
+
+/* A JSON string of at most length characters from str */
+static void
+stats_string_json(struct stats_text *t, const char *str, size_t length)
+{
+	unsigned char c;
+	size_t i;
+
+	stats_printf(t, "\"");
+	for (i = 0; i < length && str[i] != '\0'; i++)
+	{
+		c = (unsigned char) str[i];
+		if (c == '"' || c == '\\')
+			stats_printf(t, "\\%c", c);
+		else if (c < 0x20 || c >= 0x7f)
+			stats_printf(t, "\\u%04x", c);
+		else
+			stats_printf(t, "%c", c);
+	}
+	stats_printf(t, "\"");
+}
+
+static double
+stats_ratio(uint64 numerator, uint64 denominator)
+{
+	return denominator ? (double) numerator / denominator : 0.0;
+}
+
+/* Upper bound of the bucket holding the given fraction of samples */
+static uint64
+stats_percentile(STATS_HISTOGRAM * h, double fraction)
+{
+	uint64 seen = 0;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen > 0 && seen >= fraction * h->count)
+			break;
+	}
+
+	return (uint64) 1 << MIN(i + 1, STATS_BUCKETS);
+}
+
+static void
+stats_cache_json(struct stats_text *t, const char *name, STATS_COUNTER hits, int last)
+{
+	uint64 h = g_stats_counters[hits];
+	uint64 m = g_stats_counters[hits + 1];
+
+	stats_printf(t, "\"%s\":{\"hits\":%llu,\"misses\":%llu,\"hit_rate\":%.4f}%s", name,
+		     (unsigned long long) h, (unsigned long long) m, stats_ratio(h, h + m),
+		     last ? "" : ",");
+}
+
+/* All counters as a JSON object on a single line, to be freed by the
+   caller */
+char *
+stats_json(void)
+{
+	struct stats_text t;
+	STATS_HISTOGRAM *h;
+	double elapsed, seconds;
+	unsigned int i;
+	int j;
+
+	t.size = 4096;
+	t.length = 0;
+	t.data = xmalloc(t.size);
+	t.data[0] = '\0';
+
+	elapsed = (stats_now() - g_stats_start) / 1000000.0;
+	seconds = MAX(elapsed, 0.001);
+	stats_printf(&t, "{\"elapsed\":%.3f,\"counters\":{", elapsed);
+	for (i = 0; i < STATS_COUNTERS; i++)
+		stats_printf(&t, "\"%s\":%llu%s", g_stats_counter_names[i],
+			     (unsigned long long) g_stats_counters[i],
+			     i + 1 < STATS_COUNTERS ? "," : "");
+
+	stats_printf(&t, "},\"rates\":{\"bytes_received_per_second\":%.1f,"
+		     "\"pdus_received_per_second\":%.1f,\"bytes_sent_per_second\":%.1f,"
+		     "\"pdus_sent_per_second\":%.1f,\"x_flushes_per_second\":%.1f}",
+		     g_stats_counters[STATS_BYTES_RECEIVED] / seconds,
+		     g_stats_counters[STATS_PDUS_RECEIVED] / seconds,
+		     g_stats_counters[STATS_BYTES_SENT] / seconds,
+		     g_stats_counters[STATS_PDUS_SENT] / seconds,
+		     g_stats_counters[STATS_X_FLUSHES] / seconds);
+
+	stats_printf(&t, ",\"channels\":{");
+	for (i = 0; i < g_num_channels; i++)
+	{
+		stats_string_json(&t, g_channels[i].name, sizeof(g_channels[i].name));
+		stats_printf(&t,
+			     ":{\"bytes_in\":%u,\"bytes_out\":%u,"
+			     "\"bytes_in_per_second\":%.1f,\"bytes_out_per_second\":%.1f}%s",
+			     g_channels[i].bytes_in, g_channels[i].bytes_out,
+			     g_channels[i].bytes_in / seconds, g_channels[i].bytes_out / seconds,
+			     i + 1 < g_num_channels ? "," : "");
+	}
+
+	stats_printf(&t, "},\"caches\":{");
+	stats_cache_json(&t, "bitmap", STATS_BITMAP_CACHE_HITS, 0);
+	stats_cache_json(&t, "glyph", STATS_GLYPH_CACHE_HITS, 0);
+	stats_cache_json(&t, "brush", STATS_BRUSH_CACHE_HITS, 0);
+	stats_cache_json(&t, "cursor", STATS_CURSOR_CACHE_HITS, 1);
+
+	stats_printf(&t, "},\"mppc_ratio\":%.3f,\"receive_queue_mean_depth\":%.1f,"
+		     "\"latency\":{",
+		     stats_ratio(g_stats_counters[STATS_MPPC_EXPANDED],
+				 g_stats_counters[STATS_MPPC_COMPRESSED]),
+		     stats_ratio(g_stats_counters[STATS_RECEIVE_QUEUE_DEPTH],
+				 g_stats_counters[STATS_RECEIVE_QUEUED]));
+	for (i = 0; i < STATS_TIMERS; i++)
+	{
+		h = &g_stats_timers[i];
+		stats_printf(&t, "\"%s\":{\"count\":%llu,\"mean_us\":%.1f,\"p50_us\":%llu,"
+			     "\"p90_us\":%llu,\"p99_us\":%llu,\"buckets\":[",
+			     g_stats_timer_names[i], (unsigned long long) h->count,
+			     stats_ratio(h->total, h->count),
+			     (unsigned long long) (h->count ? stats_percentile(h, 0.5) : 0),
+			     (unsigned long long) (h->count ? stats_percentile(h, 0.9) : 0),
+			     (unsigned long long) (h->count ? stats_percentile(h, 0.99) : 0));
+		for (j = 0; j < STATS_BUCKETS; j++)
+			stats_printf(&t, "%llu%s", (unsigned long long) h->buckets[j],
+				     j + 1 < STATS_BUCKETS ? "," : "");
+		stats_printf(&t, "]}%s", i + 1 < STATS_TIMERS ? "," : "");
+	}
+	stats_printf(&t, "}}");
+
+	return t.data;
+}
+
+static void
+stats_dump(void)
+{
+	FILE *fp;
+	char *json;
+
+	fp = fopen(g_stats_dump_path, "w");
+	if (fp == NULL)
+	{
+		logger(Core, Error, "stats_dump(), failed to open %s: %s", g_stats_dump_path,
+		       strerror(errno));
+		return;
+	}
+
+	json = stats_json();
+	fprintf(fp, "%s\n", json);
+	fclose(fp);
+	xfree(json);
+}
+
+/* Write the counters as JSON to path when rdesktop exits */
+void
+stats_dump_at_exit(const char *path)
+{
+	if (g_stats_dump_path == NULL)
+		atexit(stats_dump);
+
+	xfree(g_stats_dump_path);
+	g_stats_dump_path = xstrdup(path);
+}
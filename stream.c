@@ -20,19 +20,124 @@
 #include <errno.h>
 #include <iconv.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "rdesktop.h"
 
+/* Freed streams are kept for reuse in power of two size classes,
+   from 256 bytes to 64 kilobytes */
+#define STREAM_POOL_MIN_SHIFT	8
+#define STREAM_POOL_CLASSES	9
+#define STREAM_POOL_DEPTH	16
+
 extern char g_codepage[16];
 
+static struct
+{
+	STREAM free[STREAM_POOL_CLASSES][STREAM_POOL_DEPTH];
+	int count[STREAM_POOL_CLASSES];
+	unsigned int allocator_calls;
+} g_stream_pool;
+
+/* streams are allocated and freed by the smartcard and receive
+   threads too */
+static pthread_mutex_t g_stream_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Take a stream with room for size bytes from the pool */
+static STREAM
+s_pool_get(unsigned int size)
+{
+	STREAM s = NULL;
+	int c;
+
+	for (c = 0; c < STREAM_POOL_CLASSES; c++)
+		if (size <= (1u << (c + STREAM_POOL_MIN_SHIFT)))
+			break;
+	if (c == STREAM_POOL_CLASSES)
+		return NULL;
+
+	pthread_mutex_lock(&g_stream_pool_lock);
+	if (g_stream_pool.count[c] > 0)
+		s = g_stream_pool.free[c][--g_stream_pool.count[c]];
+	pthread_mutex_unlock(&g_stream_pool_lock);
+
+	if (s != NULL)
+		s_reset(s);
+	return s;
+}
+
+/* Keep a stream in the largest class its buffer can serve, False if
+   that class is full or the buffer is bigger than the largest class */
+static RD_BOOL
+s_pool_put(STREAM s)
+{
+	RD_BOOL kept = False;
+	int c;
+
+	if (s->capacity > (1u << (STREAM_POOL_CLASSES - 1 + STREAM_POOL_MIN_SHIFT)))
+		return False;
+
+	for (c = STREAM_POOL_CLASSES - 1; c >= 0; c--)
+		if (s->capacity >= (1u << (c + STREAM_POOL_MIN_SHIFT)))
+			break;
+	if (c < 0)
+		return False;
+
+	pthread_mutex_lock(&g_stream_pool_lock);
+	if (g_stream_pool.count[c] < STREAM_POOL_DEPTH)
+	{
+		g_stream_pool.free[c][g_stream_pool.count[c]++] = s;
+		kept = True;
+	}
+	pthread_mutex_unlock(&g_stream_pool_lock);
+
+	return kept;
+}
+
+static void
+s_count_allocator_calls(unsigned int calls)
+{
+	pthread_mutex_lock(&g_stream_pool_lock);
+	g_stream_pool.allocator_calls += calls;
+	pthread_mutex_unlock(&g_stream_pool_lock);
+}
+
+/* Number of malloc, realloc and free calls made for streams */
+unsigned int
+s_allocator_calls(void)
+{
+	unsigned int calls;
+
+	pthread_mutex_lock(&g_stream_pool_lock);
+	calls = g_stream_pool.allocator_calls;
+	pthread_mutex_unlock(&g_stream_pool_lock);
+
+	return calls;
+}
+
 STREAM
 s_alloc(unsigned int size)
 {
 	STREAM s;
+	unsigned int rounded;
+
+	s = s_pool_get(size);
+	if (s != NULL)
+	{
+		s->size = size;
+		return s;
+	}
+
+	/* round up so that the buffer can be reused */
+	rounded = 1u << STREAM_POOL_MIN_SHIFT;
+	while (rounded < size && rounded < (1u << (STREAM_POOL_CLASSES - 1 + STREAM_POOL_MIN_SHIFT)))
+		rounded <<= 1;
 
 	s = xmalloc(sizeof(struct stream));
+	s_count_allocator_calls(1);
 	memset(s, 0, sizeof(struct stream));
-	s_realloc(s, size);
+	s_realloc(s, MAX(size, rounded));
+	s->size = size;
 
 	return s;
 }
@@ -45,7 +150,7 @@ s_inherit(unsigned char *data, unsigned int size)
 	s = xmalloc(sizeof(struct stream));
 	memset(s, 0, sizeof(struct stream));
 	s->p = s->data = data;
-	s->size = size;
+	s->size = s->capacity = size;
 
 	return s;
 }
@@ -58,9 +163,17 @@ s_realloc(STREAM s, unsigned int size)
 	if (s->size >= size)
 		return;
 
+	/* a pooled buffer may already have the room */
+	if (s->capacity >= size)
+	{
+		s->size = size;
+		return;
+	}
+
 	data = s->data;
-	s->size = size;
+	s->size = s->capacity = size;
 	s->data = xrealloc(data, size);
+	s_count_allocator_calls(1);
 	s->p = s->data + (s->p - data);
 	s->end = s->data + (s->end - data);
 	s->iso_hdr = s->data + (s->iso_hdr - data);
@@ -77,17 +190,30 @@ s_reset(STREAM s)
 	tmp = *s;
 	memset(s, 0, sizeof(struct stream));
 	s->size = tmp.size;
+	s->capacity = tmp.capacity;
 	s->end = s->p = s->data = tmp.data;
 }
 
 
+void
+s_slice(STREAM s, unsigned char *data, unsigned int length)
+{
+	memset(s, 0, sizeof(struct stream));
+	s->p = s->data = data;
+	s->end = data + length;
+	s->size = length;
+}
+
 void
 s_free(STREAM s)
 {
 	if (s == NULL)
 		return;
+	if (s->data != NULL && s_pool_put(s))
+		return;
 	free(s->data);
 	free(s);
+	s_count_allocator_calls(2);
 }
 
 static iconv_t
@@ -30,6 +30,7 @@ typedef struct stream
 	unsigned char *end;
 	unsigned char *data;
 	unsigned int size;
+	unsigned int capacity;	/* of data, when pooled buffers are bigger than size */
 
 	/* Offsets of various headers */
 	unsigned char *iso_hdr;
@@ -51,6 +52,11 @@ void s_realloc(STREAM s, unsigned int size);
 void s_free(STREAM s);
 /* Reset all internal offsets, but keep the allocated size */
 void s_reset(STREAM s);
+/* Point STREAM at a buffer it does not own, for parsing in place. It
+   must not be freed or reallocated. */
+void s_slice(STREAM s, unsigned char *data, unsigned int length);
+/* Number of allocator calls made for STREAM objects so far */
+unsigned int s_allocator_calls(void);
 
 void out_utf16s(STREAM s, const char *string);
 void out_utf16s_padded(STREAM s, const char *string, size_t width, unsigned char pad);
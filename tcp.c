@@ -30,9 +30,12 @@
 #include <netinet/tcp.h>	/* TCP_NODELAY */
 #include <arpa/inet.h>		/* inet_addr */
 #include <errno.h>		/* errno */
+#include <fcntl.h>		/* fcntl O_NONBLOCK */
 #include <assert.h>
 #endif
 
+#include <pthread.h>
+
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 
@@ -71,15 +74,42 @@ static RD_BOOL g_ssl_initialized = False;
 static int g_sock;
 static RD_BOOL g_run_ui = False;
 static struct stream g_in;
+static uint32 g_received_pdus = 0;
 int g_tcp_port_rdp = TCP_PORT_RDP;
 
 extern RD_BOOL g_exit_mainloop;
 extern RD_BOOL g_network_error;
 extern RD_BOOL g_reconnect_loop;
 extern char g_tls_version[];
+extern int g_receive_queue_size;
 
 static gnutls_session_t g_tls_session;
 
+/* Complete PDUs read and TLS decrypted ahead of the UI thread. Standard
+   RDP security and MPPC state advance as the upper layers parse each
+   PDU, so those stay on the UI thread. */
+static struct
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	RD_BOOL running;
+	RD_BOOL stop;
+	RD_BOOL closed;		/* no more PDUs will be queued */
+	RD_BOOL error;		/* closed by a network error */
+	int wake[2];		/* a byte per queued PDU, selected by the UI */
+	int quit[2];		/* interrupts the thread's select */
+	STREAM *ring;
+	int size, head, count;
+	STREAM current;		/* the PDU being parsed */
+	uint32 filled;		/* its length, its end grows as it is read */
+	/* statistics */
+	uint32 pdus, bytes;
+	uint32 depth_sum;
+	int max_depth;
+	uint32 waits;		/* times the queue was full */
+} g_receiver;
+
 /* wait till socket is ready to write or timeout */
 static RD_BOOL
 tcp_can_send(int sck, int millis)
@@ -118,6 +148,9 @@ tcp_send(STREAM s)
 	if (g_network_error == True)
 		return;
 
+	stats_add(STATS_PDUS_SENT, 1);
+	stats_add(STATS_BYTES_SENT, s_length(s));
+
 #ifdef WITH_SCARD
 	scard_lock(SCARD_LOCK_TCP);
 #endif
@@ -177,6 +210,129 @@ tcp_send(STREAM s)
 #endif
 }
 
+/* Wait for a PDU from the receive thread, NULL if there will be none */
+static STREAM
+tcp_receiver_head(void)
+{
+	STREAM pdu;
+	RD_BOOL closed, error;
+	char buf[64];
+
+	while (1)
+	{
+		/* the thread only fills slots after the queued ones */
+		pthread_mutex_lock(&g_receiver.lock);
+		pdu = g_receiver.count > 0 ? g_receiver.ring[g_receiver.head] : NULL;
+		closed = g_receiver.closed;
+		error = g_receiver.error;
+		pthread_mutex_unlock(&g_receiver.lock);
+
+		if (pdu != NULL)
+		{
+			/* do not let a backlog starve input and the other
+			   descriptors */
+			ui_poll(g_receiver.wake[0]);
+			if (g_exit_mainloop == True)
+				return NULL;
+			return pdu;
+		}
+
+		if (closed)
+		{
+			if (error)
+				g_network_error = True;
+			return NULL;
+		}
+
+		ui_select(g_receiver.wake[0]);
+		while (read(g_receiver.wake[0], buf, sizeof(buf)) > 0);
+
+		/* break out of recv, if request of exiting
+		   main loop has been done */
+		if (g_exit_mainloop == True)
+			return NULL;
+	}
+}
+
+/* Remove the head PDU from the queue, making room for the thread */
+static void
+tcp_receiver_pop(void)
+{
+	pthread_mutex_lock(&g_receiver.lock);
+	g_receiver.head = (g_receiver.head + 1) % g_receiver.size;
+	g_receiver.count--;
+	pthread_cond_signal(&g_receiver.cond);
+	pthread_mutex_unlock(&g_receiver.lock);
+}
+
+/* Read from the PDUs queued by the receive thread. A PDU read from its
+   start is handed out as it is, without copying. */
+static STREAM
+tcp_recv_queued(STREAM s, uint32 length)
+{
+	STREAM pdu;
+	size_t before;
+	uint32 n;
+
+	if (s == NULL)
+	{
+		/* the previous PDU has been parsed by now */
+		s_free(g_receiver.current);
+		g_receiver.current = NULL;
+
+		pdu = tcp_receiver_head();
+		if (pdu == NULL)
+			return NULL;
+
+		if (s_tell(pdu) == 0)
+		{
+			tcp_receiver_pop();
+			g_receiver.current = s = pdu;
+			g_receiver.filled = s_length(pdu);
+			s->end = s->data;
+		}
+		else
+		{
+			s_realloc(&g_in, length);
+			s_reset(&g_in);
+			s = &g_in;
+		}
+	}
+
+	while (length > 0)
+	{
+		if (s == g_receiver.current && (uint32) s_length(s) < g_receiver.filled)
+		{
+			n = MIN(length, g_receiver.filled - s_length(s));
+			s->end += n;
+			length -= n;
+			continue;
+		}
+
+		/* the PDU framing did not match the reads, copy */
+		pdu = tcp_receiver_head();
+		if (pdu == NULL)
+			return NULL;
+
+		n = MIN(length, s_remaining(pdu));
+		s_realloc(s, s_length(s) + n);
+		before = s_tell(s);
+		s_seek(s, s_length(s));
+		out_uint8stream(s, pdu, n);
+		s_mark_end(s);
+		s_seek(s, before);
+		length -= n;
+
+		if (s_check_end(pdu))
+		{
+			tcp_receiver_pop();
+			s_free(pdu);
+		}
+	}
+
+	return s;
+}
+
 /* Receive a message on the TCP layer */
 STREAM
 tcp_recv(STREAM s, uint32 length)
@@ -188,6 +344,16 @@ tcp_recv(STREAM s, uint32 length)
 	if (g_network_error == True)
 		return NULL;
 
+	if (s == NULL)
+	{
+		g_received_pdus++;
+		stats_add(STATS_PDUS_RECEIVED, 1);
+	}
+	stats_add(STATS_BYTES_RECEIVED, length);
+
+	if (g_receiver.running)
+		return tcp_recv_queued(s, length);
+
 	if (s == NULL)
 	{
 		/* read into "new" stream */
@@ -267,6 +433,251 @@ tcp_recv(STREAM s, uint32 length)
 	return s;
 }
 
+/* Read exactly length bytes on the receive thread, False on errors,
+   end of file or when stopped */
+static RD_BOOL
+tcp_receiver_read(uint8 * data, int length)
+{
+	fd_set rfds;
+	int rcvd;
+
+	while (length > 0)
+	{
+		if (!g_ssl_initialized || (gnutls_record_check_pending(g_tls_session) <= 0))
+		{
+			FD_ZERO(&rfds);
+			FD_SET(g_sock, &rfds);
+			FD_SET(g_receiver.quit[0], &rfds);
+			if (select(MAX(g_sock, g_receiver.quit[0]) + 1, &rfds, NULL, NULL, NULL) ==
+			    -1)
+			{
+				if (errno == EINTR)
+					continue;
+				logger(Core, Error, "tcp_receiver_read(), select() failed: %s",
+				       TCP_STRERROR);
+				g_receiver.error = True;
+				return False;
+			}
+
+			if (FD_ISSET(g_receiver.quit[0], &rfds))
+				return False;
+		}
+
+		if (g_ssl_initialized)
+		{
+			rcvd = gnutls_record_recv(g_tls_session, data, length);
+			if (rcvd < 0)
+			{
+				if (gnutls_error_is_fatal(rcvd))
+				{
+					logger(Core, Error,
+					       "tcp_receiver_read(), gnutls_record_recv() failed with %d: %s",
+					       rcvd, gnutls_strerror(rcvd));
+					g_receiver.error = True;
+					return False;
+				}
+				rcvd = 0;
+			}
+			else if (rcvd == 0)
+			{
+				logger(Core, Error, "tcp_receiver_read(), connection closed by peer");
+				return False;
+			}
+		}
+		else
+		{
+			rcvd = recv(g_sock, data, length, 0);
+			if (rcvd < 0)
+			{
+				if (rcvd == -1 && TCP_BLOCKS)
+				{
+					rcvd = 0;
+				}
+				else
+				{
+					logger(Core, Error, "tcp_receiver_read(), recv() failed: %s",
+					       TCP_STRERROR);
+					g_receiver.error = True;
+					return False;
+				}
+			}
+			else if (rcvd == 0)
+			{
+				logger(Core, Error, "tcp_receiver_read(), connection closed by peer");
+				return False;
+			}
+		}
+
+		data += rcvd;
+		length -= rcvd;
+	}
+
+	return True;
+}
+
+/* Read slow and fast path PDUs, framed as in iso_recv_msg(), into the
+   queue until it is full */
+static void *
+tcp_receiver_thread(void *arg)
+{
+	uint8 header[4];
+	uint32 length;
+	STREAM pdu;
+	UNUSED(arg);
+
+	while (tcp_receiver_read(header, 4))
+	{
+		if (header[0] == T123_HEADER_VERSION)
+		{
+			length = (header[2] << 8) | header[3];
+		}
+		else
+		{
+			length = header[1];
+			if (length & 0x80)
+				length = ((length & 0x7f) << 8) | header[2];
+		}
+
+		/* iso_recv_msg() rejects these */
+		if (length < 4)
+			length = 4;
+
+		pdu = s_alloc(length);
+		out_uint8a(pdu, header, 4);
+		if (!tcp_receiver_read(pdu->p, length - 4))
+		{
+			s_free(pdu);
+			break;
+		}
+		pdu->p += length - 4;
+		s_mark_end(pdu);
+		s_seek(pdu, 0);
+
+		pthread_mutex_lock(&g_receiver.lock);
+		if (g_receiver.count == g_receiver.size)
+		{
+			g_receiver.waits++;
+			stats_add(STATS_RECEIVE_QUEUE_FULL, 1);
+		}
+		while (!g_receiver.stop && g_receiver.count == g_receiver.size)
+			pthread_cond_wait(&g_receiver.cond, &g_receiver.lock);
+		if (g_receiver.stop)
+		{
+			pthread_mutex_unlock(&g_receiver.lock);
+			s_free(pdu);
+			break;
+		}
+
+		g_receiver.ring[(g_receiver.head + g_receiver.count) % g_receiver.size] = pdu;
+		g_receiver.count++;
+		g_receiver.pdus++;
+		g_receiver.bytes += length;
+		g_receiver.depth_sum += g_receiver.count;
+		g_receiver.max_depth = MAX(g_receiver.max_depth, g_receiver.count);
+		stats_add(STATS_RECEIVE_QUEUED, 1);
+		stats_add(STATS_RECEIVE_QUEUE_DEPTH, g_receiver.count);
+		pthread_mutex_unlock(&g_receiver.lock);
+
+		/* a full pipe already wakes the UI */
+		if (write(g_receiver.wake[1], "", 1) != 1 && errno != EAGAIN)
+			break;
+	}
+
+	pthread_mutex_lock(&g_receiver.lock);
+	g_receiver.closed = True;
+	pthread_mutex_unlock(&g_receiver.lock);
+	if (write(g_receiver.wake[1], "", 1) != 1)
+		logger(Core, Debug, "tcp_receiver_thread(), could not wake the UI");
+
+	return NULL;
+}
+
+/* Move receiving to a thread, so that reading and decrypting overlaps
+   with drawing */
+static void
+tcp_start_receiver(int size)
+{
+	if (g_receiver.running)
+		return;
+
+	memset(&g_receiver, 0, sizeof(g_receiver));
+	if (pipe(g_receiver.wake) == -1)
+	{
+		logger(Core, Error, "tcp_start_receiver(), pipe() failed: %s", TCP_STRERROR);
+		return;
+	}
+	if (pipe(g_receiver.quit) == -1)
+	{
+		logger(Core, Error, "tcp_start_receiver(), pipe() failed: %s", TCP_STRERROR);
+		close(g_receiver.wake[0]);
+		close(g_receiver.wake[1]);
+		return;
+	}
+	fcntl(g_receiver.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(g_receiver.wake[1], F_SETFL, O_NONBLOCK);
+
+	g_receiver.size = size;
+	g_receiver.ring = (STREAM *) xmalloc(size * sizeof(STREAM));
+
+	pthread_mutex_init(&g_receiver.lock, NULL);
+	pthread_cond_init(&g_receiver.cond, NULL);
+	if (pthread_create(&g_receiver.thread, NULL, tcp_receiver_thread, NULL) != 0)
+	{
+		logger(Core, Error, "tcp_start_receiver(), failed to start receive thread");
+		pthread_cond_destroy(&g_receiver.cond);
+		pthread_mutex_destroy(&g_receiver.lock);
+		close(g_receiver.wake[0]);
+		close(g_receiver.wake[1]);
+		close(g_receiver.quit[0]);
+		close(g_receiver.quit[1]);
+		xfree(g_receiver.ring);
+		return;
+	}
+
+	g_receiver.running = True;
+	logger(Core, Debug, "tcp_start_receiver(), queueing up to %d PDUs", size);
+}
+
+/* Stop the receive thread, dropping the PDUs not consumed yet */
+static void
+tcp_stop_receiver(void)
+{
+	if (!g_receiver.running)
+		return;
+
+	pthread_mutex_lock(&g_receiver.lock);
+	g_receiver.stop = True;
+	pthread_cond_signal(&g_receiver.cond);
+	pthread_mutex_unlock(&g_receiver.lock);
+	if (write(g_receiver.quit[1], "", 1) != 1)
+		logger(Core, Warning, "tcp_stop_receiver(), could not wake the thread");
+	pthread_join(g_receiver.thread, NULL);
+
+	while (g_receiver.count > 0)
+	{
+		s_free(g_receiver.ring[g_receiver.head]);
+		g_receiver.head = (g_receiver.head + 1) % g_receiver.size;
+		g_receiver.count--;
+	}
+	s_free(g_receiver.current);
+
+	logger(Core, Debug,
+	       "tcp_stop_receiver(), %u PDUs, %u bytes, queue depth %u average %d max, full %u times",
+	       g_receiver.pdus, g_receiver.bytes,
+	       g_receiver.pdus ? g_receiver.depth_sum / g_receiver.pdus : 0,
+	       g_receiver.max_depth, g_receiver.waits);
+
+	pthread_cond_destroy(&g_receiver.cond);
+	pthread_mutex_destroy(&g_receiver.lock);
+	reactor_remove(g_receiver.wake[0]);
+	close(g_receiver.wake[0]);
+	close(g_receiver.wake[1]);
+	close(g_receiver.quit[0]);
+	close(g_receiver.quit[1]);
+	xfree(g_receiver.ring);
+	g_receiver.running = False;
+}
+
 /*
  * Callback during handshake to verify peer certificate
  */
@@ -712,6 +1123,12 @@ tcp_connect(char *server)
 void
 tcp_disconnect(void)
 {
+	tcp_stop_receiver();
+
+	if (g_received_pdus > 0)
+		logger(Core, Debug, "tcp_disconnect(), %u PDUs received, %.2f stream allocator calls per PDU",
+		       g_received_pdus, (double) s_allocator_calls() / g_received_pdus);
+
 	if (g_ssl_initialized) {
 		(void)gnutls_bye(g_tls_session, GNUTLS_SHUT_WR);
 		gnutls_deinit(g_tls_session);
@@ -721,6 +1138,7 @@ tcp_disconnect(void)
 		g_ssl_initialized = False;
 	}
 
+	reactor_remove(g_sock);
 	TCP_CLOSE(g_sock);
 	g_sock = -1;
 
@@ -768,4 +1186,9 @@ void
 tcp_run_ui(RD_BOOL run)
 {
 	g_run_ui = run;
+
+	if (run && g_receive_queue_size > 0)
+		tcp_start_receiver(g_receive_queue_size);
+	else if (!run)
+		tcp_stop_receiver();
 }
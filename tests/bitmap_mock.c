@@ -5,3 +5,13 @@ RD_BOOL bitmap_decompress(uint8 * output, int width, int height, uint8 * input,
 {
   return mock(output, width, height, input, size, Bpp);
 };
+
+void bitmap_decompress_batch(BITMAP_JOB * jobs, int count)
+{
+  mock(jobs, count);
+}
+
+void bitmap_run_jobs(bitmap_job_func func, void *jobs, int size, int count)
+{
+  mock(func, jobs, size, count);
+}
@@ -0,0 +1,495 @@
+#include <cgreen/cgreen.h>
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+/* Boilerplate */
+Describe(Bitmap);
+BeforeEach(Bitmap) {};
+AfterEach(Bitmap) {};
+
+#include "../bitmap.c"
+
+/* malloc; exit if out of memory */
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xmalloc, failed to allocate %d bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* Reference decoder, one pixel at a time, for all of 1, 2 and 3 Bpp.
+   Pixels are handled as Bpp raw bytes, which is what the CVAL2 host
+   order loads of the 16 bpp decoder amount to. */
+static RD_BOOL
+ref_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp)
+{
+	uint8 *end = input + size;
+	uint8 *prevline = NULL, *line = NULL;
+	int opcode, count, offset, isfillormix, x = width;
+	int lastopcode = -1, insertmix = False, bicolour = False;
+	uint8 code, colour1[3] = { 0, 0, 0 }, colour2[3] = { 0, 0, 0 };
+	uint8 mix[3] = { 0xff, 0xff, 0xff };
+	uint8 mixmask, mask = 0;
+	int fom_mask, k, usemix;
+
+	while (input < end)
+	{
+		fom_mask = 0;
+		code = *input++;
+		opcode = code >> 4;
+		switch (opcode)
+		{
+			case 0xc:
+			case 0xd:
+			case 0xe:
+				opcode -= 6;
+				count = code & 0xf;
+				offset = 16;
+				break;
+			case 0xf:
+				opcode = code & 0xf;
+				if (opcode < 9)
+				{
+					count = input[0] | (input[1] << 8);
+					input += 2;
+				}
+				else
+					count = (opcode < 0xb) ? 8 : 1;
+				offset = 0;
+				break;
+			default:
+				opcode >>= 1;
+				count = code & 0x1f;
+				offset = 32;
+				break;
+		}
+		if (offset != 0)
+		{
+			isfillormix = ((opcode == 2) || (opcode == 7));
+			if (count == 0)
+				count = *input++ + (isfillormix ? 1 : offset);
+			else if (isfillormix)
+				count <<= 3;
+		}
+		switch (opcode)
+		{
+			case 0:
+				if ((lastopcode == opcode) && !((x == width) && (prevline == NULL)))
+					insertmix = True;
+				break;
+			case 8:
+				memcpy(colour1, input, Bpp);
+				memcpy(colour2, input + Bpp, Bpp);
+				input += 2 * Bpp;
+				break;
+			case 3:
+				memcpy(colour2, input, Bpp);
+				input += Bpp;
+				break;
+			case 6:
+			case 7:
+				memcpy(mix, input, Bpp);
+				input += Bpp;
+				opcode -= 5;
+				break;
+			case 9:
+			case 0xa:
+				fom_mask = mask = (opcode == 9) ? 3 : 5;
+				opcode = 2;
+				break;
+		}
+		lastopcode = opcode;
+		mixmask = 0;
+		while (count > 0)
+		{
+			if (x >= width)
+			{
+				if (height <= 0)
+					return False;
+				x = 0;
+				height--;
+				prevline = line;
+				line = output + height * width * Bpp;
+			}
+			for (k = 0; k < Bpp; k++)
+			{
+				uint8 above = prevline ? prevline[x * Bpp + k] : 0;
+				uint8 *px = &line[x * Bpp + k];
+
+				switch (opcode)
+				{
+					case 0:
+						*px = insertmix ? above ^ mix[k] : above;
+						break;
+					case 1:
+						*px = above ^ mix[k];
+						break;
+					case 2:
+						if (k == 0)
+						{
+							mixmask <<= 1;
+							if (mixmask == 0)
+							{
+								mask = fom_mask ? fom_mask : *input++;
+								mixmask = 1;
+							}
+						}
+						usemix = mask & mixmask;
+						*px = usemix ? above ^ mix[k] : above;
+						break;
+					case 3:
+						*px = colour2[k];
+						break;
+					case 4:
+						*px = *input++;
+						break;
+					case 8:
+						*px = bicolour ? colour2[k] : colour1[k];
+						break;
+					case 0xd:
+						*px = 0xff;
+						break;
+					case 0xe:
+						*px = 0;
+						break;
+					default:
+						return False;
+				}
+			}
+			if (opcode == 8)
+			{
+				bicolour = !bicolour;
+				if (bicolour)
+					count++;
+			}
+			if (opcode == 0)
+				insertmix = False;
+			count--;
+			x++;
+		}
+	}
+	return True;
+}
+
+/* Emit a random but well formed order stream */
+static int
+generate_orders(uint8 * buf, int maxlen, int Bpp, int pixels)
+{
+	static const uint8 forms[] = { 0x00, 0x20, 0x40, 0x60, 0x80, 0xc0, 0xd0, 0xe0,
+		0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfd, 0xfe
+	};
+	uint8 *p = buf;
+	int i, opcode, count, n;
+	uint8 code;
+
+	while (pixels > 0 && (p - buf) < maxlen - 1024)
+	{
+		code = forms[rand() % sizeof(forms)];
+		if (code < 0xc0)
+		{
+			n = rand() % 0x20;
+			*p++ = code | n;
+			opcode = code >> 5;
+			count = n;
+			if (n == 0)
+			{
+				*p = rand() & 0xff;
+				count = *p++ + ((opcode == 2) ? 1 : 32);
+			}
+			else if (opcode == 2)
+				count <<= 3;
+		}
+		else if (code < 0xf0)
+		{
+			n = rand() % 0x10;
+			*p++ = code | n;
+			opcode = (code >> 4) - 6;
+			count = n;
+			if (n == 0)
+			{
+				*p = rand() & 0xff;
+				count = *p++ + ((opcode == 7) ? 1 : 16);
+			}
+			else if (opcode == 7)
+				count <<= 3;
+		}
+		else
+		{
+			*p++ = code;
+			opcode = code & 0xf;
+			if (opcode < 9)
+			{
+				count = rand() % 300;
+				*p++ = count & 0xff;
+				*p++ = count >> 8;
+			}
+			else
+				count = (opcode < 0xb) ? 8 : 1;
+		}
+
+		switch (opcode)
+		{
+			case 3:
+			case 6:
+			case 7:
+				n = Bpp;
+				break;
+			case 8:
+				n = 2 * Bpp;
+				break;
+			default:
+				n = 0;
+		}
+		if (opcode == 2 || opcode == 7)
+			n += (count + 7) / 8;
+		else if (opcode == 4)
+			n += count * Bpp;
+		for (i = 0; i < n; i++)
+			*p++ = rand() & 0xff;
+
+		pixels -= count;
+	}
+	return p - buf;
+}
+
+static void
+compare_with_reference(int Bpp, unsigned int seed, int rounds)
+{
+	int i, size, width, height, len;
+	uint8 *input, *expected, *actual;
+	RD_BOOL rv_expected, rv_actual;
+
+	srand(seed);
+	size = 256 * 1024;
+	input = calloc(1, size + 64 * 1024);
+
+	for (i = 0; i < rounds; i++)
+	{
+		width = 1 + rand() % 72;
+		height = 1 + rand() % 72;
+		len = generate_orders(input, size, Bpp, width * height);
+
+		expected = malloc(width * height * Bpp);
+		actual = malloc(width * height * Bpp);
+		memset(expected, 0x5a, width * height * Bpp);
+		memset(actual, 0x5a, width * height * Bpp);
+
+		rv_expected = ref_decompress(expected, width, height, input, len, Bpp);
+		rv_actual = bitmap_decompress(actual, width, height, input, len, Bpp);
+
+		assert_that(rv_actual, is_equal_to(rv_expected));
+		assert_that(actual, is_equal_to_contents_of(expected, width * height * Bpp));
+
+		free(expected);
+		free(actual);
+	}
+	free(input);
+}
+
+Ensure(Bitmap, DecompressesColourRunAcrossScanlines)
+{
+	/* colour run of 5 pixels of 0x42 on a 3x2 bitmap */
+	uint8 input[] = { 0x65, 0x42 };
+	uint8 output[6];
+	/* bottom-up, so the second scanline is the one only partially written */
+	uint8 expected[6] = { 0x42, 0x42, 0x77, 0x42, 0x42, 0x42 };
+
+	memset(output, 0x77, sizeof(output));
+	assert_that(bitmap_decompress(output, 3, 2, input, sizeof(input), 1), is_equal_to(True));
+	assert_that(output, is_equal_to_contents_of(expected, sizeof(expected)));
+}
+
+Ensure(Bitmap, ConsecutiveFillsInsertMixPixel)
+{
+	/* copy 2 pixels, then two single pixel fills of the line above */
+	uint8 input[] = { 0xf4, 0x02, 0x00, 0x01, 0x02, 0x01, 0x01 };
+	uint8 output[4];
+	uint8 expected[4] = { 0x01, 0xfd, 0x01, 0x02 };
+
+	memset(output, 0, sizeof(output));
+	assert_that(bitmap_decompress(output, 2, 2, input, sizeof(input), 1), is_equal_to(True));
+	assert_that(output, is_equal_to_contents_of(expected, sizeof(expected)));
+}
+
+Ensure(Bitmap, MatchesReferenceDecoderFor8bpp)
+{
+	compare_with_reference(1, 1, 500);
+}
+
+Ensure(Bitmap, MatchesReferenceDecoderFor16bpp)
+{
+	compare_with_reference(2, 2, 500);
+}
+
+Ensure(Bitmap, MatchesReferenceDecoderFor24bpp)
+{
+	compare_with_reference(3, 3, 500);
+}
+
+Ensure(Bitmap, BatchDecodesLikeSequentialCalls)
+{
+	BITMAP_JOB jobs[16];
+	uint8 *input, *expected;
+	int i, y, len, Bpp = 2, pixels = 64 * 64;
+
+	srand(4);
+	input = calloc(16, 64 * 1024);
+	expected = malloc(16 * pixels * Bpp);
+
+	for (i = 0; i < 16; i++)
+	{
+		len = generate_orders(input + i * 64 * 1024, 64 * 1024, Bpp, pixels);
+		jobs[i].width = jobs[i].height = 64;
+		jobs[i].Bpp = Bpp;
+		jobs[i].input = input + i * 64 * 1024;
+		jobs[i].size = len;
+		jobs[i].compressed = (i != 3);
+		jobs[i].output = malloc(pixels * Bpp);
+		jobs[i].row_func = NULL;
+		memset(jobs[i].output, 0x5a, pixels * Bpp);
+		memset(expected + i * pixels * Bpp, 0x5a, pixels * Bpp);
+		if (jobs[i].compressed)
+			bitmap_decompress(expected + i * pixels * Bpp, 64, 64, jobs[i].input, len, Bpp);
+		else
+			for (y = 0; y < 64; y++)
+				memcpy(expected + i * pixels * Bpp + (63 - y) * 64 * Bpp,
+				       jobs[i].input + y * 64 * Bpp, 64 * Bpp);
+	}
+
+	bitmap_init_workers(4);
+	bitmap_decompress_batch(jobs, 16);
+
+	for (i = 0; i < 16; i++)
+	{
+		assert_that(jobs[i].output, is_equal_to_contents_of(expected + i * pixels * Bpp, pixels * Bpp));
+		free(jobs[i].output);
+	}
+	free(expected);
+	free(input);
+}
+
+/* widen 16 bit pixels to 32 bits */
+static void
+widen_row(const uint8 * in, uint8 * out, uint8 * end)
+{
+	while (out < end)
+	{
+		out[0] = *in++;
+		out[1] = *in++;
+		out[2] = out[3] = 0;
+		out += 4;
+	}
+}
+
+Ensure(Bitmap, RowFunctionConvertsWhileDecoding)
+{
+	BITMAP_JOB jobs[2];
+	uint8 *input, *decoded, *expected;
+	int i, len, pixels = 64 * 64;
+
+	/* a colour image row, 31 rows filled from above, then 32 more image rows */
+	srand(5);
+	input = calloc(1, 16 * 1024);
+	len = 0;
+	input[len++] = 0xf4;
+	input[len++] = 64;
+	input[len++] = 0;
+	for (i = 0; i < 64 * 2; i++)
+		input[len++] = rand() & 0xff;
+	input[len++] = 0xf0;
+	input[len++] = (64 * 31) & 0xff;
+	input[len++] = (64 * 31) >> 8;
+	input[len++] = 0xf4;
+	input[len++] = (64 * 32) & 0xff;
+	input[len++] = (64 * 32) >> 8;
+	for (i = 0; i < 64 * 32 * 2; i++)
+		input[len++] = rand() & 0xff;
+	decoded = calloc(pixels, 2);
+	expected = malloc(pixels * 4);
+	assert_that(bitmap_decompress(decoded, 64, 64, input, len, 2), is_true);
+	widen_row(decoded, expected, expected + pixels * 4);
+
+	/* compressed, and uncompressed bottom-up rows */
+	for (i = 0; i < 2; i++)
+	{
+		jobs[i].width = jobs[i].height = 64;
+		jobs[i].Bpp = 2;
+		jobs[i].compressed = (i == 0);
+		jobs[i].output = malloc(pixels * 2);
+		jobs[i].row_func = widen_row;
+		jobs[i].row_output = malloc(pixels * 4);
+		jobs[i].row_Bpp = 4;
+	}
+	jobs[0].input = input;
+	jobs[0].size = len;
+	jobs[1].input = malloc(pixels * 2);
+	jobs[1].size = pixels * 2;
+	for (i = 0; i < 64; i++)
+		memcpy(jobs[1].input + i * 128, decoded + (63 - i) * 128, 128);
+
+	bitmap_decompress_batch(jobs, 2);
+
+	for (i = 0; i < 2; i++)
+	{
+		assert_that(jobs[i].ok, is_true);
+		assert_that(jobs[i].row_output, is_equal_to_contents_of(expected, pixels * 4));
+		free(jobs[i].output);
+		free(jobs[i].row_output);
+	}
+	free(jobs[1].input);
+	free(expected);
+	free(decoded);
+	free(input);
+}
+
+Ensure(Bitmap, DecompressesRawPlanarWithoutAlpha)
+{
+	/* R, G and B planes of a 2x1 bitmap */
+	uint8 input[] = { PLANAR_HEADER_NO_ALPHA, 1, 2, 3, 4, 5, 6 };
+	uint8 output[8];
+	uint8 expected[8] = { 5, 3, 1, 0xff, 6, 4, 2, 0xff };
+
+	assert_that(bitmap_decompress_planar(output, 2, 1, input, sizeof(input)), is_equal_to(True));
+	assert_that(output, is_equal_to_contents_of(expected, sizeof(expected)));
+}
+
+Ensure(Bitmap, DecompressesRlePlanarTopDown)
+{
+	/* each plane: two raw values, then two deltas to the line above */
+	uint8 input[] = { PLANAR_HEADER_RLE | PLANAR_HEADER_NO_ALPHA,
+		0x20, 10, 20, 0x20, 2, 1,	/* R: 11, 19 on the second line */
+		0x20, 30, 40, 0x20, 0, 0,	/* G */
+		0x20, 50, 60, 0x20, 4, 3	/* B: 52, 58 on the second line */
+	};
+	uint8 output[16];
+	uint8 expected[16] = {
+		50, 30, 10, 0xff, 60, 40, 20, 0xff,
+		52, 30, 11, 0xff, 58, 40, 19, 0xff
+	};
+
+	assert_that(bitmap_decompress_planar(output, 2, 2, input, sizeof(input)), is_equal_to(True));
+	assert_that(output, is_equal_to_contents_of(expected, sizeof(expected)));
+}
+
+Ensure(Bitmap, RejectsTruncatedPlanar)
+{
+	uint8 input[] = { PLANAR_HEADER_RLE | PLANAR_HEADER_NO_ALPHA, 0x20, 10 };
+	uint8 output[8];
+
+	assert_that(bitmap_decompress_planar(output, 2, 1, input, sizeof(input)), is_equal_to(False));
+}
+
+Ensure(Bitmap, RejectsPlanarSizesOutOfRange)
+{
+	uint8 input[] = { PLANAR_HEADER_NO_ALPHA, 0, 0, 0 };
+	uint8 output[8];
+
+	assert_that(bitmap_decompress_planar(output, 0, 1, input, sizeof(input)), is_equal_to(False));
+	assert_that(bitmap_decompress_planar(output, 65535, 65535, input, sizeof(input)),
+		    is_equal_to(False));
+}
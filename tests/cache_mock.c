@@ -50,3 +50,27 @@ cache_save_state()
 {
   mock();
 }
+
+void
+cache_log_bitmap_stats()
+{
+  mock();
+}
+
+uint32
+cache_get_bmpcache2_cells()
+{
+  return (uint32) mock();
+}
+
+RD_HBITMAP
+cache_get_offscreen_bitmap(uint16 idx, int *width, int *height)
+{
+  return (RD_HBITMAP) mock(idx, width, height);
+}
+
+void
+cache_put_offscreen_bitmap(uint16 idx, RD_HBITMAP bitmap, int width, int height)
+{
+  mock(idx, bitmap, width, height);
+}
@@ -13,6 +13,13 @@ dvc_channels_register(const char *name, dvc_channel_process_fn handler)
   return mock(name, handler);
 }
 
+RD_BOOL
+dvc_channels_register_with_open(const char *name, dvc_channel_process_fn handler,
+				dvc_channel_open_fn open_handler)
+{
+  return mock(name, handler, open_handler);
+}
+
 RD_BOOL
 dvc_channels_is_available(const char *name)
 {
@@ -0,0 +1,144 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Bulk decompression benchmark
+
+   Replays compressed data recorded with -o mppc-capture=<file> and
+   reports the decompression speed per codec.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/time.h>
+#include "../rdesktop.h"
+
+extern RDPCOMP g_mppc_dict;
+
+void
+logger(log_subject_t s, log_level_t lvl, char *format, ...)
+{
+	UNUSED(s);
+	UNUSED(lvl);
+	UNUSED(format);
+}
+
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+		exit(1);
+	return mem;
+}
+
+void
+xfree(void *mem)
+{
+	free(mem);
+}
+
+struct codec
+{
+	const char *name;
+	uint64 in, out, usec;
+	int packets;
+};
+
+static double
+now_usec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+int
+main(int argc, char *argv[])
+{
+	/* indexed by the compression type */
+	struct codec codecs[4] = { {"MPPC 8K", 0, 0, 0, 0}, {"MPPC 64K", 0, 0, 0, 0},
+	{"NCRUSH", 0, 0, 0, 0}, {"XCRUSH", 0, 0, 0, 0}
+	};
+	uint8 *capture, *p, *end, *rdata, ctype;
+	uint32 clen, rlen;
+	long size;
+	int i, rounds, failed = 0;
+	double start;
+	struct codec *c;
+	FILE *f;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <capture file> [rounds]\n", argv[0]);
+		return 1;
+	}
+	rounds = (argc > 2) ? atoi(argv[2]) : 20;
+
+	f = fopen(argv[1], "rb");
+	if (f == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	capture = malloc(size);
+	if (capture == NULL || fread(capture, 1, size, f) != (size_t) size)
+	{
+		fprintf(stderr, "failed to read %s\n", argv[1]);
+		return 1;
+	}
+	fclose(f);
+
+	for (i = 0; i < rounds; i++)
+	{
+		free(g_mppc_dict.l1_hist);
+		memset(&g_mppc_dict, 0, sizeof(g_mppc_dict));
+		p = capture;
+		end = capture + size;
+		while (p + 5 <= end)
+		{
+			ctype = p[0];
+			clen = p[1] | (p[2] << 8) | (p[3] << 16) | ((uint32) p[4] << 24);
+			p += 5;
+			if (clen > (uint32) (end - p))
+				break;
+
+			c = &codecs[ctype & 3];
+			start = now_usec();
+			if (mppc_expand(p, clen, ctype, &rdata, &rlen) == -1)
+				failed++;
+			c->usec += now_usec() - start;
+			c->in += clen;
+			c->out += rlen;
+			c->packets++;
+			p += clen;
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+	{
+		c = &codecs[i];
+		if (c->packets == 0)
+			continue;
+		printf("%-10s %8d packets %10.1f MB in %10.1f MB out %8.1f MB/s\n", c->name,
+		       c->packets / rounds, c->in / 1e6 / rounds, c->out / 1e6 / rounds,
+		       c->usec ? c->out / (double) c->usec : 0.0);
+	}
+	if (failed)
+		printf("%d packets failed to decompress\n", failed / rounds);
+
+	free(capture);
+	return 0;
+}
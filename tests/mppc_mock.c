@@ -2,7 +2,13 @@
 #include "../rdesktop.h"
 
 int
-mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen)
+mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint8 ** rdata, uint32 * rlen)
 {
-  return mock(data, clen, ctype, roff, rlen);
+  return mock(data, clen, ctype, rdata, rlen);
+}
+
+void
+mppc_reset_state(void)
+{
+  mock();
 }
@@ -0,0 +1,404 @@
+#include <cgreen/cgreen.h>
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+/* Boilerplate */
+Describe(Mppc);
+BeforeEach(Mppc) {};
+
+#include "../mppc.c"
+
+AfterEach(Mppc)
+{
+	free(g_mppc_dict.l1_hist);
+	memset(&g_mppc_dict, 0, sizeof(g_mppc_dict));
+};
+
+/* malloc; exit if out of memory */
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xmalloc, failed to allocate %d bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+void
+xfree(void *mem)
+{
+	free(mem);
+}
+
+/* Random bytes from a small alphabet, with copies of earlier data at
+   a handful of recurring distances mixed in */
+static void
+generate_data(uint8 * buf, int len)
+{
+	static const int distances[] = { 1, 2, 4, 64, 640, 1280, 5000 };
+	int pos = 0, n, dist;
+
+	while (pos < len)
+	{
+		n = 3 + rand() % 40;
+		if (n > len - pos)
+			n = len - pos;
+		dist = distances[rand() % 7];
+		if (rand() % 3 != 0 && dist <= pos)
+		{
+			for (; n > 0; n--, pos++)
+				buf[pos] = buf[pos - dist];
+		}
+		else
+		{
+			for (; n > 0; n--, pos++)
+				buf[pos] = "abcdefgh\x00\xff"[rand() % 10];
+		}
+	}
+}
+
+Ensure(Mppc, MppcRoundTripsThroughTheCompressor)
+{
+	RDPCOMP_ENC *enc = malloc(sizeof(RDPCOMP_ENC));
+	uint8 data[3000], *rdata;
+	uint32 clen, rlen;
+	uint8 ctype;
+	int i;
+
+	srand(1);
+	mppc_enc_reset(enc);
+	for (i = 0; i < 8; i++)
+	{
+		generate_data(data, sizeof(data));
+		ctype = mppc_compress(enc, data, sizeof(data), &clen);
+		assert_that(ctype & RDP_MPPC_COMPRESSED, is_true);
+
+		assert_that(mppc_expand(enc->out, clen, ctype, &rdata, &rlen), is_equal_to(0));
+		assert_that(rlen, is_equal_to(sizeof(data)));
+		assert_that(rdata, is_equal_to_contents_of(data, sizeof(data)));
+	}
+	free(enc);
+}
+
+Ensure(Mppc, MppcFlushesReceiverAfterReset)
+{
+	RDPCOMP_ENC *enc = malloc(sizeof(RDPCOMP_ENC));
+	uint8 data[1000];
+	uint32 clen;
+	uint8 ctype;
+
+	srand(1);
+	generate_data(data, sizeof(data));
+	mppc_enc_reset(enc);
+	ctype = mppc_compress(enc, data, sizeof(data), &clen);
+	assert_that(ctype & (RDP_MPPC_RESET | RDP_MPPC_FLUSH),
+		    is_equal_to(RDP_MPPC_RESET | RDP_MPPC_FLUSH));
+
+	ctype = mppc_compress(enc, data, sizeof(data), &clen);
+	assert_that(ctype & (RDP_MPPC_RESET | RDP_MPPC_FLUSH), is_equal_to(0));
+
+	/* as on reactivation */
+	mppc_enc_reset(enc);
+	ctype = mppc_compress(enc, data, sizeof(data), &clen);
+	assert_that(ctype & RDP_MPPC_COMPRESSED, is_true);
+	assert_that(ctype & (RDP_MPPC_RESET | RDP_MPPC_FLUSH),
+		    is_equal_to(RDP_MPPC_RESET | RDP_MPPC_FLUSH));
+	free(enc);
+}
+
+/* RDP 6.0 encoder, for testing the decoder against */
+struct ncrush_enc
+{
+	uint32 lec_codes[294], lom_codes[32];
+	uint32 cache[4];
+	uint8 hist[RDP_MPPC_DICT_SIZE];
+	int hoff;
+	uint8 *p;
+	uint32 bits;
+	int nbits;
+	int cache_hits, offsets;
+};
+
+static void
+ncrush_put(struct ncrush_enc *enc, uint32 value, int n)
+{
+	enc->bits |= value << enc->nbits;
+	enc->nbits += n;
+	while (enc->nbits >= 8)
+	{
+		*enc->p++ = enc->bits;
+		enc->bits >>= 8;
+		enc->nbits -= 8;
+	}
+}
+
+/* canonical codes, reversed to be written first bit lowest */
+static void
+ncrush_codes(uint32 * codes, const uint8 * lengths, int count)
+{
+	uint32 code = 0;
+	int len, sym, i;
+
+	for (len = 1; len <= 13; len++)
+	{
+		for (sym = 0; sym < count; sym++)
+		{
+			if (lengths[sym] != len)
+				continue;
+			codes[sym] = 0;
+			for (i = 0; i < len; i++)
+				codes[sym] |= ((code >> i) & 1) << (len - 1 - i);
+			code++;
+		}
+		code <<= 1;
+	}
+}
+
+static void
+ncrush_put_lec(struct ncrush_enc *enc, int sym)
+{
+	ncrush_put(enc, enc->lec_codes[sym], ncrush_lec_lengths[sym]);
+}
+
+static void
+ncrush_put_match(struct ncrush_enc *enc, int dist, int len)
+{
+	int i, tmp;
+
+	for (i = 0; i < 4 && enc->cache[i] != (uint32) dist; i++);
+	if (i < 4)
+	{
+		ncrush_put_lec(enc, 289 + i);
+		tmp = enc->cache[0];
+		enc->cache[0] = enc->cache[i];
+		enc->cache[i] = tmp;
+		enc->cache_hits++;
+	}
+	else
+	{
+		for (i = 31; ncrush_offset_base[i] > (uint32) dist + 1; i--);
+		ncrush_put_lec(enc, 257 + i);
+		ncrush_put(enc, dist + 1 - ncrush_offset_base[i], ncrush_offset_bits[i]);
+		memmove(enc->cache + 1, enc->cache, 3 * sizeof(uint32));
+		enc->cache[0] = dist;
+		enc->offsets++;
+	}
+
+	for (i = 27; ncrush_lom_base[i] > len; i--);
+	ncrush_put(enc, enc->lom_codes[i], ncrush_lom_lengths[i]);
+	ncrush_put(enc, len - ncrush_lom_base[i], ncrush_lom_bits[i]);
+}
+
+/* Greedy longest match against the last 8K, returns the packet length */
+static int
+ncrush_compress(struct ncrush_enc *enc, uint8 * data, int len, uint8 * out)
+{
+	int pos, dist, n, best, best_dist;
+
+	enc->p = out;
+	enc->bits = 0;
+	enc->nbits = 0;
+	memcpy(enc->hist + enc->hoff, data, len);
+
+	for (pos = enc->hoff; pos < enc->hoff + len;)
+	{
+		best = best_dist = 0;
+		for (dist = 1; dist <= pos && dist <= 8192; dist++)
+		{
+			for (n = 0; pos + n < enc->hoff + len && n < 700
+			     && enc->hist[pos + n - dist] == enc->hist[pos + n]; n++);
+			if (n > best)
+			{
+				best = n;
+				best_dist = dist;
+			}
+		}
+
+		if (best >= 3)
+		{
+			ncrush_put_match(enc, best_dist, best);
+			pos += best;
+		}
+		else
+		{
+			ncrush_put_lec(enc, enc->hist[pos]);
+			pos++;
+		}
+	}
+	ncrush_put_lec(enc, 256);
+	if (enc->nbits > 0)
+		*enc->p++ = enc->bits;
+	enc->hoff += len;
+
+	return enc->p - out;
+}
+
+static struct ncrush_enc *
+ncrush_enc_new(void)
+{
+	struct ncrush_enc *enc = calloc(1, sizeof(struct ncrush_enc));
+
+	ncrush_codes(enc->lec_codes, ncrush_lec_lengths, 294);
+	ncrush_codes(enc->lom_codes, ncrush_lom_lengths, 32);
+	return enc;
+}
+
+Ensure(Mppc, NcrushTablesAreComplete)
+{
+	uint8 out[16], *rdata;
+	uint32 rlen;
+	int i;
+
+	/* builds the tables, an empty stream is just the end of stream code */
+	struct ncrush_enc *enc = ncrush_enc_new();
+	assert_that(ncrush_compress(enc, NULL, 0, out), is_equal_to(2));
+	assert_that(mppc_expand(out, 2, RDP_MPPC_TYPE_RDP6 | RDP_MPPC_COMPRESSED | RDP_MPPC_FLUSH,
+				&rdata, &rlen), is_equal_to(0));
+	assert_that(rlen, is_equal_to(0));
+
+	/* every input maps to a code, nothing is left over */
+	for (i = 0; i < (1 << 13); i++)
+		assert_that(ncrush_lec_table[i], is_not_equal_to(0));
+	for (i = 0; i < (1 << 9); i++)
+		assert_that(ncrush_lom_table[i], is_not_equal_to(0));
+	free(enc);
+}
+
+Ensure(Mppc, NcrushRoundTripsAcrossPackets)
+{
+	struct ncrush_enc *enc = ncrush_enc_new();
+	uint8 data[12000], out[16000], *rdata;
+	uint8 ctype = RDP_MPPC_TYPE_RDP6 | RDP_MPPC_COMPRESSED | RDP_MPPC_FLUSH;
+	uint32 rlen;
+	int i, clen;
+
+	srand(2);
+	for (i = 0; i < 8; i++)
+	{
+		/* keep the last 32K once the history is full */
+		if (enc->hoff + (int) sizeof(data) > RDP_MPPC_DICT_SIZE)
+		{
+			memmove(enc->hist, enc->hist + enc->hoff - 32768, 32768);
+			enc->hoff = 32768;
+			ctype |= RDP_MPPC_RESET;
+		}
+
+		generate_data(data, sizeof(data));
+		clen = ncrush_compress(enc, data, sizeof(data), out);
+
+		assert_that(mppc_expand(out, clen, ctype, &rdata, &rlen), is_equal_to(0));
+		assert_that(rlen, is_equal_to(sizeof(data)));
+		assert_that(rdata, is_equal_to_contents_of(data, sizeof(data)));
+		ctype = RDP_MPPC_TYPE_RDP6 | RDP_MPPC_COMPRESSED;
+	}
+
+	/* both ways of coding an offset were used */
+	assert_that(enc->cache_hits, is_greater_than(100));
+	assert_that(enc->offsets, is_greater_than(100));
+	free(enc);
+}
+
+Ensure(Mppc, NcrushRejectsTruncatedData)
+{
+	struct ncrush_enc *enc = ncrush_enc_new();
+	uint8 data[2000], out[3000], *rdata;
+	uint32 rlen;
+	int clen;
+
+	srand(3);
+	generate_data(data, sizeof(data));
+	clen = ncrush_compress(enc, data, sizeof(data), out);
+
+	assert_that(mppc_expand(out, clen / 2, RDP_MPPC_TYPE_RDP6 | RDP_MPPC_COMPRESSED |
+				RDP_MPPC_FLUSH, &rdata, &rlen), is_equal_to(-1));
+	free(enc);
+}
+
+static uint8 *
+put_match(uint8 * p, int len, int out, uint32 hist)
+{
+	*p++ = len;
+	*p++ = len >> 8;
+	*p++ = out;
+	*p++ = out >> 8;
+	*p++ = hist;
+	*p++ = hist >> 8;
+	*p++ = hist >> 16;
+	*p++ = hist >> 24;
+	return p;
+}
+
+Ensure(Mppc, XcrushCopiesMatchesFromHistory)
+{
+	uint8 packet[64], *p, *rdata;
+	uint8 ctype = RDP_MPPC_TYPE_RDP61 | RDP_MPPC_COMPRESSED;
+	uint32 rlen;
+
+	/* uncompressed level 1 data goes into the history as it is */
+	p = packet;
+	*p++ = RDP61_L1_NO_COMPRESSION | RDP61_L1_PACKET_AT_FRONT;
+	*p++ = 0;
+	memcpy(p, "0123456789", 10);
+	p += 10;
+	assert_that(mppc_expand(packet, p - packet, ctype, &rdata, &rlen), is_equal_to(0));
+	assert_that(rlen, is_equal_to(10));
+	assert_that(rdata, is_equal_to_contents_of("0123456789", 10));
+
+	/* "ab", 4 bytes from offset 3, "-", 5 bytes repeating the last
+	   two, "cd" */
+	p = packet;
+	*p++ = RDP61_L1_COMPRESSED;
+	*p++ = 0;
+	*p++ = 2;
+	*p++ = 0;
+	p = put_match(p, 4, 2, 3);
+	p = put_match(p, 5, 7, 15);
+	memcpy(p, "ab-cd", 5);
+	p += 5;
+	assert_that(mppc_expand(packet, p - packet, ctype, &rdata, &rlen), is_equal_to(0));
+	assert_that(rlen, is_equal_to(14));
+	assert_that(rdata, is_equal_to_contents_of("ab3456-6-6-6cd", 14));
+
+	/* a match reaching past the end of the history */
+	p = packet;
+	*p++ = RDP61_L1_COMPRESSED;
+	*p++ = 0;
+	*p++ = 1;
+	*p++ = 0;
+	p = put_match(p, 100, 0, RDP61_HIST_SIZE - 50);
+	assert_that(mppc_expand(packet, p - packet, ctype, &rdata, &rlen), is_equal_to(-1));
+}
+
+Ensure(Mppc, XcrushExpandsInnerMppc)
+{
+	/* 64K MPPC: literals "abc", then offset 3 and length 9 */
+	uint8 packet[] = { RDP61_L1_NO_COMPRESSION | RDP61_L1_INNER_COMPRESSION |
+		RDP61_L1_PACKET_AT_FRONT, RDP_MPPC_COMPRESSED | RDP_MPPC_FLUSH,
+		0x61, 0x62, 0x63, 0xf8, 0x78, 0x80
+	};
+	uint8 *rdata;
+	uint32 rlen;
+
+	assert_that(mppc_expand(packet, sizeof(packet), RDP_MPPC_TYPE_RDP61 | RDP_MPPC_COMPRESSED,
+				&rdata, &rlen), is_equal_to(0));
+	assert_that(rlen, is_equal_to(12));
+	assert_that(rdata, is_equal_to_contents_of("abcabcabcabc", 12));
+}
+
+Ensure(Mppc, ResetStateFreesXcrushHistory)
+{
+	uint8 packet[] = { RDP61_L1_NO_COMPRESSION | RDP61_L1_PACKET_AT_FRONT, 0, 0x61 };
+	uint8 *rdata;
+	uint32 rlen;
+
+	assert_that(mppc_expand(packet, sizeof(packet), RDP_MPPC_TYPE_RDP61 | RDP_MPPC_COMPRESSED,
+				&rdata, &rlen), is_equal_to(0));
+	assert_that(g_mppc_dict.l1_hist, is_non_null);
+
+	mppc_reset_state();
+	assert_that(g_mppc_dict.l1_hist, is_null);
+	assert_that(g_mppc_dict.l1_off, is_equal_to(0));
+}
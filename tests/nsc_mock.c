@@ -0,0 +1,8 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+RD_BOOL
+nsc_decode(uint8 * output, int width, int height, uint8 * data, uint32 length)
+{
+  return mock(output, width, height, data, length);
+}
@@ -23,6 +23,7 @@ uint32 g_rdp5_performanceflags;
 int g_server_depth;
 RD_BOOL g_bitmap_cache;
 RD_BOOL g_bitmap_cache_persist_enable;
+uint32 g_offscreen_cache_size;
 RD_BOOL g_numlock_sync;
 RD_BOOL g_pending_resize;
 RD_BOOL g_network_error;
@@ -137,3 +138,20 @@ Ensure(RDP, ProcessBitmapCapsCallsUiResizeWindow) {
 
   free(s.data);
 }
+
+Ensure(RDP, BatchedPointerMovesAreCoalesced) {
+  g_fastpath_input = True;
+
+  /* move, button down, move; 7 bytes each */
+  expect(sec_send_fastpath_input,
+	 when(numevents, is_equal_to(3)),
+	 when(datalen, is_equal_to(21)));
+
+  rdp_begin_input_batch();
+  rdp_send_input(0, RDP_INPUT_MOUSE, MOUSE_FLAG_MOVE, 1, 1);
+  rdp_send_input(0, RDP_INPUT_MOUSE, MOUSE_FLAG_MOVE, 2, 2);
+  rdp_send_input(0, RDP_INPUT_MOUSE, MOUSE_FLAG_BUTTON1 | MOUSE_FLAG_DOWN, 2, 2);
+  rdp_send_input(0, RDP_INPUT_MOUSE, MOUSE_FLAG_MOVE, 3, 3);
+  rdp_send_input(0, RDP_INPUT_MOUSE, MOUSE_FLAG_MOVE, 4, 4);
+  rdp_end_input_batch();
+}
@@ -0,0 +1,517 @@
+#include <cgreen/cgreen.h>
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+/* Boilerplate */
+Describe(SoundDSP);
+BeforeEach(SoundDSP) {};
+AfterEach(SoundDSP) {};
+
+#include "../rdpsnd_dsp.c"
+
+/* malloc; exit if out of memory */
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xmalloc, failed to allocate %d bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* realloc; exit if out of memory */
+void *
+xrealloc(void *oldmem, size_t size)
+{
+	void *mem;
+
+	if (size == 0)
+		size = 1;
+	mem = realloc(oldmem, size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xrealloc, failed to reallocate %ld bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+void
+xfree(void *mem)
+{
+	free(mem);
+}
+
+#define BLOCK_ALIGN	256
+#define BLOCKS		3
+
+/* Input that both ADPCM variants track well, a tone and some noise */
+static sint16
+test_sample(int i, int ch)
+{
+	return (sint16) (8000 * ((i / (20 + ch * 7)) % 2 ? 1 : -1) + (rand() % 2001) - 1000);
+}
+
+static RD_WAVEFORMATEX
+test_format(uint16 tag, uint16 channels)
+{
+	RD_WAVEFORMATEX format;
+
+	memset(&format, 0, sizeof(format));
+	format.wFormatTag = tag;
+	format.nChannels = channels;
+	format.nSamplesPerSec = 22050;
+	format.nBlockAlign = BLOCK_ALIGN * channels;
+	format.wBitsPerSample = 4;
+	return format;
+}
+
+/* Reference encoders try every nibble and keep the one whose
+   reconstruction is closest to the input. The reconstruction is what the
+   decoder has to produce. */
+static int
+ima_try(int predictor, int index, int nibble)
+{
+	return rdpsnd_dsp_ima_adpcm_sample(&predictor, &index, nibble);
+}
+
+static uint8
+ima_encode(int *predictor, int *index, sint16 value, sint16 * expected)
+{
+	int nibble, best = 0;
+
+	for (nibble = 1; nibble < 16; nibble++)
+		if (abs(ima_try(*predictor, *index, nibble) - value) <
+		    abs(ima_try(*predictor, *index, best) - value))
+			best = nibble;
+
+	*expected = rdpsnd_dsp_ima_adpcm_sample(predictor, index, best);
+	return best;
+}
+
+static int
+ms_try(struct ms_adpcm_channel c, int nibble)
+{
+	return rdpsnd_dsp_ms_adpcm_sample(&c, nibble);
+}
+
+static uint8
+ms_encode(struct ms_adpcm_channel *c, sint16 value, sint16 * expected)
+{
+	int nibble, best = 0;
+
+	for (nibble = 1; nibble < 16; nibble++)
+		if (abs(ms_try(*c, nibble) - value) < abs(ms_try(*c, best) - value))
+			best = nibble;
+
+	*expected = rdpsnd_dsp_ms_adpcm_sample(c, best);
+	return best;
+}
+
+static void
+put16(uint8 ** p, sint16 value)
+{
+	*(*p)++ = value & 0xff;
+	*(*p)++ = (value >> 8) & 0xff;
+}
+
+/* Blocks of interleaved 4 byte runs per channel after a 4 byte header
+   per channel. Returns the number of samples per channel. */
+static int
+ima_encode_blocks(int channels, uint8 * data, sint16 * expected)
+{
+	int predictor[2], index[2];
+	int block, ch, i, j, n = 0;
+	sint16 recon;
+	uint8 nibble, *p = data;
+
+	for (block = 0; block < BLOCKS; block++)
+	{
+		for (ch = 0; ch < channels; ch++)
+		{
+			predictor[ch] = test_sample(n, ch);
+			index[ch] = 20;
+			expected[n * channels + ch] = predictor[ch];
+			put16(&p, predictor[ch]);
+			*p++ = index[ch];
+			*p++ = 0;
+		}
+		n++;
+
+		for (i = 0; i < (BLOCK_ALIGN - 4) / 4; i++)
+		{
+			for (ch = 0; ch < channels; ch++)
+			{
+				for (j = 0; j < 8; j += 2)
+				{
+					nibble = ima_encode(&predictor[ch], &index[ch],
+							    test_sample(n + j, ch),
+							    &expected[(n + j) * channels + ch]);
+					nibble |= ima_encode(&predictor[ch], &index[ch],
+							     test_sample(n + j + 1, ch),
+							     &recon) << 4;
+					expected[(n + j + 1) * channels + ch] = recon;
+					*p++ = nibble;
+				}
+			}
+			n += 8;
+		}
+	}
+
+	return n;
+}
+
+/* A 7 byte header per channel, then nibbles high first with channels
+   interleaved. Returns the number of samples per channel. */
+static int
+ms_encode_blocks(int channels, uint8 * data, sint16 * expected)
+{
+	struct ms_adpcm_channel c[2];
+	int block, ch, i, n = 0;
+	uint8 *p = data;
+
+	for (block = 0; block < BLOCKS; block++)
+	{
+		for (ch = 0; ch < channels; ch++)
+		{
+			/* predictors 1 and 5, to cover both coefficients */
+			*p++ = ch ? 5 : 1;
+			c[ch].coef1 = ms_adpcm_coefficients[ch ? 5 : 1][0];
+			c[ch].coef2 = ms_adpcm_coefficients[ch ? 5 : 1][1];
+			c[ch].delta = 256;
+			c[ch].sample2 = test_sample(n, ch);
+			c[ch].sample1 = test_sample(n + 1, ch);
+		}
+		for (ch = 0; ch < channels; ch++)
+			put16(&p, c[ch].delta);
+		for (ch = 0; ch < channels; ch++)
+			put16(&p, c[ch].sample1);
+		for (ch = 0; ch < channels; ch++)
+			put16(&p, c[ch].sample2);
+		for (ch = 0; ch < channels; ch++)
+		{
+			expected[n * channels + ch] = c[ch].sample2;
+			expected[(n + 1) * channels + ch] = c[ch].sample1;
+		}
+		n += 2;
+
+		for (i = 0; i < (BLOCK_ALIGN - 7) * channels * 2; i += 2)
+		{
+			if (channels == 1)
+			{
+				*p = ms_encode(&c[0], test_sample(n, 0), &expected[n]) << 4;
+				*p++ |= ms_encode(&c[0], test_sample(n + 1, 0), &expected[n + 1]);
+				n += 2;
+			}
+			else
+			{
+				*p = ms_encode(&c[0], test_sample(n, 0), &expected[n * 2]) << 4;
+				*p++ |= ms_encode(&c[1], test_sample(n, 1), &expected[n * 2 + 1]);
+				n++;
+			}
+		}
+	}
+
+	return n;
+}
+
+static void
+decode_and_compare(RD_WAVEFORMATEX * format, uint8 * data, int samples, sint16 * expected)
+{
+	STREAM out;
+	int i, max_err = 0;
+	sint16 value;
+
+	assert_that(rdpsnd_dsp_decode_supported(format), is_equal_to(True));
+
+	out = rdpsnd_dsp_decode(data, BLOCKS * format->nBlockAlign, format);
+	assert_that(out, is_not_equal_to(NULL));
+	assert_that(s_remaining(out), is_equal_to(samples * format->nChannels * 2));
+
+	for (i = 0; i < samples * format->nChannels; i++)
+	{
+		in_uint16_le(out, value);
+		max_err = MAX(max_err, abs(value - expected[i]));
+	}
+	s_free(out);
+
+	assert_that(max_err, is_equal_to(0));
+}
+
+static void
+decode_known_block(RD_WAVEFORMATEX * format, uint8 * data, unsigned int size,
+		   sint16 * expected, int count)
+{
+	STREAM out;
+	sint16 samples[16];
+	int i;
+
+	out = rdpsnd_dsp_decode(data, size, format);
+	assert_that(s_remaining(out), is_equal_to(count * 2));
+	for (i = 0; i < count; i++)
+		in_uint16_le(out, samples[i]);
+	s_free(out);
+
+	assert_that(samples, is_equal_to_contents_of(expected, count * 2));
+}
+
+static void
+adpcm_round_trip(uint16 tag, int channels)
+{
+	RD_WAVEFORMATEX format = test_format(tag, channels);
+	uint8 data[BLOCKS * BLOCK_ALIGN * 2];
+	sint16 expected[BLOCKS * BLOCK_ALIGN * 2 * 2];
+	int samples;
+
+	srand(channels);
+	if (tag == WAVE_FORMAT_ADPCM)
+		samples = ms_encode_blocks(channels, data, expected);
+	else
+		samples = ima_encode_blocks(channels, data, expected);
+
+	decode_and_compare(&format, data, samples, expected);
+}
+
+Ensure(SoundDSP, ImaAdpcmMonoDecodesReferenceEncoding)
+{
+	adpcm_round_trip(WAVE_FORMAT_IMA_ADPCM, 1);
+}
+
+Ensure(SoundDSP, ImaAdpcmStereoDecodesReferenceEncoding)
+{
+	adpcm_round_trip(WAVE_FORMAT_IMA_ADPCM, 2);
+}
+
+Ensure(SoundDSP, MsAdpcmMonoDecodesReferenceEncoding)
+{
+	adpcm_round_trip(WAVE_FORMAT_ADPCM, 1);
+}
+
+Ensure(SoundDSP, MsAdpcmStereoDecodesReferenceEncoding)
+{
+	adpcm_round_trip(WAVE_FORMAT_ADPCM, 2);
+}
+
+Ensure(SoundDSP, DecodesToSixteenBitPcm)
+{
+	RD_WAVEFORMATEX format = test_format(WAVE_FORMAT_IMA_ADPCM, 2), pcm;
+
+	rdpsnd_dsp_decode_format(&format, &pcm);
+	assert_that(pcm.wFormatTag, is_equal_to(WAVE_FORMAT_PCM));
+	assert_that(pcm.nChannels, is_equal_to(2));
+	assert_that(pcm.nSamplesPerSec, is_equal_to(22050));
+	assert_that(pcm.wBitsPerSample, is_equal_to(16));
+	assert_that(pcm.nAvgBytesPerSec, is_equal_to(22050 * 4));
+}
+
+Ensure(SoundDSP, ImaAdpcmDecodesKnownBlock)
+{
+	RD_WAVEFORMATEX format = test_format(WAVE_FORMAT_IMA_ADPCM, 1);
+	uint8 data[8] = { 0x00, 0x00, 0x00, 0x00, 0xf7, 0x00, 0x00, 0x00 };
+	sint16 expected[9] = { 0, 11, -19, -15, -12, -9, -6, -4, -2 };
+
+	format.nBlockAlign = sizeof(data);
+	decode_known_block(&format, data, sizeof(data), expected, 9);
+}
+
+Ensure(SoundDSP, MsAdpcmDecodesKnownBlock)
+{
+	RD_WAVEFORMATEX format = test_format(WAVE_FORMAT_ADPCM, 1);
+	/* predictor 0, delta 16, samples 100 and 50 */
+	uint8 data[8] = { 0x00, 0x10, 0x00, 0x64, 0x00, 0x32, 0x00, 0x78 };
+	sint16 expected[4] = { 50, 100, 212, -92 };
+
+	format.nBlockAlign = sizeof(data);
+	decode_known_block(&format, data, sizeof(data), expected, 4);
+}
+
+Ensure(SoundDSP, RejectsPcmAndOddBlocks)
+{
+	RD_WAVEFORMATEX format = test_format(WAVE_FORMAT_PCM, 2);
+
+	assert_that(rdpsnd_dsp_decode_supported(&format), is_equal_to(False));
+
+	format = test_format(WAVE_FORMAT_IMA_ADPCM, 2);
+	format.nBlockAlign = 36;
+	assert_that(rdpsnd_dsp_decode_supported(&format), is_equal_to(False));
+
+	format = test_format(WAVE_FORMAT_ADPCM, 1);
+	format.nBlockAlign = 7;
+	assert_that(rdpsnd_dsp_decode_supported(&format), is_equal_to(False));
+}
+
+static struct audio_driver test_driver;
+
+static RD_WAVEFORMATEX
+pcm_format(uint32 rate, uint16 channels, uint16 bits)
+{
+	RD_WAVEFORMATEX format;
+
+	memset(&format, 0, sizeof(format));
+	format.wFormatTag = WAVE_FORMAT_PCM;
+	format.nChannels = channels;
+	format.nSamplesPerSec = rate;
+	format.wBitsPerSample = bits;
+	format.nBlockAlign = channels * bits / 8;
+	format.nAvgBytesPerSec = rate * format.nBlockAlign;
+	return format;
+}
+
+Ensure(SoundDSP, ProcessCopiesWithoutConversion)
+{
+	RD_WAVEFORMATEX format = pcm_format(44100, 2, 16);
+	uint8 data[64];
+	STREAM out;
+	int i;
+
+	for (i = 0; i < (int) sizeof(data); i++)
+		data[i] = i * 7;
+	memset(&test_driver, 0, sizeof(test_driver));
+
+	out = rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format);
+	assert_that(s_remaining(out), is_equal_to(sizeof(data)));
+	assert_that(out->p, is_equal_to_contents_of(data, sizeof(data)));
+	s_free(out);
+}
+
+Ensure(SoundDSP, ProcessAppliesSoftwareVolumePerChannel)
+{
+	RD_WAVEFORMATEX format = pcm_format(44100, 2, 16);
+	uint8 data[8] = { 0x00, 0x40, 0x00, 0x40, 0x00, 0xc0, 0x00, 0xc0 };
+	sint16 expected[4] = { 0x2000, 0x1000, -0x2000, -0x1000 };
+	sint16 samples[4];
+	STREAM out;
+	int i;
+
+	memset(&test_driver, 0, sizeof(test_driver));
+	test_driver.wave_out_volume = rdpsnd_dsp_softvol_set;
+	softvol_left = MAX_VOLUME / 2 + 1;
+	softvol_right = MAX_VOLUME / 4 + 1;
+
+	out = rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format);
+	for (i = 0; i < 4; i++)
+		in_uint16_le(out, samples[i]);
+	s_free(out);
+	softvol_left = softvol_right = MAX_VOLUME;
+
+	assert_that(samples, is_equal_to_contents_of(expected, sizeof(expected)));
+}
+
+Ensure(SoundDSP, ProcessWidensMonoEightBitToStereo)
+{
+	RD_WAVEFORMATEX format = pcm_format(22050, 1, 8);
+	uint8 data[3] = { 0x90, 0x80, 0x00 };
+	sint16 expected[6] = { 0x1000, 0x1000, 0, 0, -0x8000, -0x8000 };
+	sint16 samples[6];
+	STREAM out;
+	int i;
+
+	memset(&test_driver, 0, sizeof(test_driver));
+	test_driver.need_resampling = 1;
+	rdpsnd_dsp_resample_set(22050, 16, 2);
+
+	out = rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format);
+	assert_that(s_remaining(out), is_equal_to(sizeof(samples)));
+	for (i = 0; i < 6; i++)
+		in_uint16_le(out, samples[i]);
+	s_free(out);
+
+	assert_that(samples, is_equal_to_contents_of(expected, sizeof(expected)));
+}
+
+Ensure(SoundDSP, ResamplesAcrossPacketsWithoutGaps)
+{
+	RD_WAVEFORMATEX format = pcm_format(22050, 2, 16);
+	uint8 data[441 * 4];
+	unsigned int frames = 0;
+	sint16 value;
+	STREAM out;
+	int i, packet;
+
+	/* a constant level comes out unchanged, past the first frames */
+	for (i = 0; i < (int) sizeof(data); i += 2)
+	{
+		data[i] = 0x34;
+		data[i + 1] = 0x12;
+	}
+	memset(&test_driver, 0, sizeof(test_driver));
+	test_driver.need_resampling = 1;
+	rdpsnd_dsp_resample_set(44100, 16, 2);
+
+	for (packet = 0; packet < 4; packet++)
+	{
+		out = rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format);
+		for (i = 0; s_remaining(out) > 0; i++)
+		{
+			in_uint16_le(out, value);
+			if (packet > 0 || i >= 16)
+				assert_that(value, is_equal_to(0x1234));
+		}
+		frames += i / 2;
+		s_free(out);
+	}
+
+	assert_that(frames, is_greater_than(4 * 882 - 8));
+	assert_that(frames, is_less_than(4 * 882 + 1));
+}
+
+Ensure(SoundDSP, DriftCompensationShortensOutput)
+{
+	RD_WAVEFORMATEX format = pcm_format(22050, 2, 16);
+	uint8 data[441 * 4];
+	unsigned int frames = 0;
+	STREAM out;
+	int packet;
+
+	memset(data, 0, sizeof(data));
+	memset(&test_driver, 0, sizeof(test_driver));
+	/* set directly, rdpsnd_dsp_drift_set() logs */
+	drift_ppm = 5000;
+
+	for (packet = 0; packet < 4; packet++)
+	{
+		out = rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format);
+		frames += s_remaining(out) / 4;
+		s_free(out);
+	}
+	drift_ppm = 0;
+
+	/* half a percent faster */
+	assert_that(frames, is_greater_than(4 * 441 - 16));
+	assert_that(frames, is_less_than(4 * 441 - 4));
+}
+
+Ensure(SoundDSP, DriftCompensationStartsOverWhenResumed)
+{
+	RD_WAVEFORMATEX format = pcm_format(22050, 2, 16);
+	uint8 data[441 * 4];
+	STREAM out, fresh;
+	int i;
+
+	for (i = 0; i < (int) sizeof(data); i += 2)
+	{
+		data[i] = 0x34;
+		data[i + 1] = 0x12;
+	}
+	memset(&test_driver, 0, sizeof(test_driver));
+
+	drift_ppm = 5000;
+	s_free(rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format));
+	drift_ppm = 0;
+	s_free(rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format));
+	drift_ppm = 5000;
+	out = rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format);
+
+	/* the same as a resampler that never saw the earlier packets */
+	rdpsnd_dsp_resample_reset();
+	fresh = rdpsnd_dsp_process(data, sizeof(data), &test_driver, &format);
+	drift_ppm = 0;
+
+	assert_that(s_remaining(out), is_equal_to(s_remaining(fresh)));
+	assert_that(out->p, is_equal_to_contents_of(fresh->p, s_remaining(fresh)));
+	s_free(out);
+	s_free(fresh);
+}
@@ -0,0 +1,38 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+RD_BOOL
+reactor_has(int fd)
+{
+  return mock(fd);
+}
+
+void
+reactor_add(int fd, int events, reactor_callback callback, void *data)
+{
+  mock(fd, events, callback, data);
+}
+
+void
+reactor_remove(int fd)
+{
+  mock(fd);
+}
+
+void
+reactor_set_timer(reactor_timer_callback callback, void *data, uint32 ms)
+{
+  mock(callback, data, ms);
+}
+
+void
+reactor_cancel_timer(reactor_timer_callback callback, void *data)
+{
+  mock(callback, data);
+}
+
+int
+reactor_wait(int ms)
+{
+  return mock(ms);
+}
@@ -60,6 +60,7 @@ uint32 g_requested_session_width;
 uint32 g_requested_session_height;
 RD_BOOL g_bitmap_cache;
 RD_BOOL g_bitmap_cache_persist_enable;
+uint32 g_offscreen_cache_size;
 RD_BOOL g_numlock_sync;
 RD_BOOL g_pending_resize;
 RD_BOOL g_network_error;
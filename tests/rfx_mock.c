@@ -0,0 +1,8 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+RD_BOOL
+rfx_process_message(uint8 * data, uint32 length, int left, int top, int width, int height)
+{
+  return mock(data, length, left, top, width, height);
+}
@@ -0,0 +1,208 @@
+#include <cgreen/cgreen.h>
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+/* Boilerplate */
+Describe(RemoteFX);
+BeforeEach(RemoteFX) {};
+AfterEach(RemoteFX) {};
+
+#include "../rfx.c"
+
+/* malloc; exit if out of memory */
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xmalloc, failed to allocate %d bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* realloc; exit if out of memory */
+void *
+xrealloc(void *oldmem, size_t size)
+{
+	void *mem;
+
+	if (size == 0)
+		size = 1;
+	mem = realloc(oldmem, size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xrealloc, failed to reallocate %ld bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* Reference RLGR encoder, after the pseudo code of [MS-RDPRFX] 3.1.8.1.7.1 */
+struct encoder
+{
+	uint8 *buf;
+	int bits;
+	int k, kp, krp;
+};
+
+static void
+put_bits(struct encoder *e, uint32 value, int n)
+{
+	while (n-- > 0)
+	{
+		if ((value >> n) & 1)
+			e->buf[e->bits / 8] |= 0x80 >> (e->bits % 8);
+		e->bits++;
+	}
+}
+
+static void
+update_param(int *param, int delta)
+{
+	*param = MAX(0, MIN(KPMAX, *param + delta));
+}
+
+static void
+code_gr(struct encoder *e, uint32 val)
+{
+	int kr = e->krp >> LSGR;
+	uint32 vk = val >> kr;
+
+	while (vk-- > 0)
+		put_bits(e, 1, 1);
+	put_bits(e, 0, 1);
+	put_bits(e, val & ((1 << kr) - 1), kr);
+
+	vk = val >> kr;
+	if (vk == 0)
+		update_param(&e->krp, -2);
+	else if (vk > 1)
+		update_param(&e->krp, vk);
+}
+
+static uint32
+two_mag_sign(sint16 v)
+{
+	return v < 0 ? 2 * (uint32) (-v) - 1 : 2 * (uint32) v;
+}
+
+static int
+rlgr_encode(int mode, sint16 * in, int count, uint8 * out)
+{
+	struct encoder e;
+	int i = 0, zeros;
+	uint32 m1, m2;
+
+	memset(&e, 0, sizeof(e));
+	e.buf = out;
+	e.kp = e.krp = 1 << LSGR;
+	e.k = 1;
+
+	while (i < count)
+	{
+		if (e.k)
+		{
+			for (zeros = 0; i < count && in[i] == 0; i++)
+				zeros++;
+			while (zeros >= (1 << e.k))
+			{
+				put_bits(&e, 0, 1);
+				zeros -= 1 << e.k;
+				update_param(&e.kp, UP_GR);
+				e.k = e.kp >> LSGR;
+			}
+			put_bits(&e, 1, 1);
+			put_bits(&e, zeros, e.k);
+			if (i == count)
+				break;
+
+			put_bits(&e, in[i] < 0, 1);
+			code_gr(&e, abs(in[i]) - 1);
+			i++;
+			update_param(&e.kp, -DN_GR);
+			e.k = e.kp >> LSGR;
+		}
+		else if (mode == CLW_ENTROPY_RLGR1)
+		{
+			m1 = two_mag_sign(in[i++]);
+			code_gr(&e, m1);
+			update_param(&e.kp, m1 ? -DQ_GR : UQ_GR);
+			e.k = e.kp >> LSGR;
+		}
+		else
+		{
+			m1 = two_mag_sign(in[i++]);
+			m2 = i < count ? two_mag_sign(in[i++]) : 0;
+			code_gr(&e, m1 + m2);
+			put_bits(&e, m1, rfx_min_bits(m1 + m2));
+			if (m1 && m2)
+				update_param(&e.kp, -2 * DQ_GR);
+			else if (!m1 && !m2)
+				update_param(&e.kp, 2 * UQ_GR);
+			e.k = e.kp >> LSGR;
+		}
+	}
+	return (e.bits + 7) / 8;
+}
+
+static void
+rlgr_round_trip(int mode, unsigned int seed)
+{
+	sint16 input[TILE_PIXELS], output[TILE_PIXELS];
+	uint8 *data;
+	int i, len;
+
+	srand(seed);
+	for (i = 0; i < TILE_PIXELS; i++)
+	{
+		/* mostly zero, like quantized high frequency subbands */
+		if (rand() % 4 == 0)
+			input[i] = (rand() % 2001) - 1000;
+		else
+			input[i] = 0;
+	}
+	/* and a long zero run at the end */
+	memset(input + TILE_PIXELS - 300, 0, 300 * sizeof(sint16));
+
+	data = calloc(1, TILE_PIXELS * 8);
+	len = rlgr_encode(mode, input, TILE_PIXELS, data);
+	memset(output, 0x5a, sizeof(output));
+
+	assert_that(rfx_rlgr_decode(mode, data, len, output, TILE_PIXELS), is_equal_to(True));
+	assert_that(output, is_equal_to_contents_of(input, sizeof(input)));
+	free(data);
+}
+
+Ensure(RemoteFX, RLGR1DecodesReferenceEncoding)
+{
+	rlgr_round_trip(CLW_ENTROPY_RLGR1, 1);
+}
+
+Ensure(RemoteFX, RLGR3DecodesReferenceEncoding)
+{
+	rlgr_round_trip(CLW_ENTROPY_RLGR3, 2);
+}
+
+Ensure(RemoteFX, FlatComponentDecodesToConstant)
+{
+	sint16 coeffs[TILE_PIXELS], buffer[TILE_PIXELS], tmp[TILE_PIXELS], expected[TILE_PIXELS];
+	/* quantization value 6 for all subbands */
+	uint8 quant[5] = { 0x66, 0x66, 0x66, 0x66, 0x66 };
+	uint8 data[64];
+	int i, len;
+
+	/* only the DC coefficient of LL3 is set */
+	memset(coeffs, 0, sizeof(coeffs));
+	coeffs[4032] = -37;
+	memset(data, 0, sizeof(data));
+	len = rlgr_encode(CLW_ENTROPY_RLGR1, coeffs, TILE_PIXELS, data);
+
+	for (i = 0; i < TILE_PIXELS; i++)
+		expected[i] = -37 * 32;
+
+	assert_that(rfx_decode_component(CLW_ENTROPY_RLGR1, data, len, quant, buffer, tmp),
+		    is_equal_to(True));
+	assert_that(buffer, is_equal_to_contents_of(expected, sizeof(expected)));
+}
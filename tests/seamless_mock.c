@@ -27,11 +27,6 @@ unsigned int seamless_send_position(unsigned long id, int x, int y,
   return mock(id, x, y, width, height, flags);
 }
 
-void seamless_select_timeout(struct timeval *tv)
-{
-  mock(tv);
-}
-
 unsigned int seamless_send_zchange(unsigned long id, unsigned long below, unsigned long flags)
 {
   return mock(id, below, flags);
@@ -31,6 +31,11 @@ void sec_send(STREAM s, uint32 flags)
   mock(s, flags);
 }
 
+void sec_send_fastpath_input(int numevents, uint8 * data, int datalen)
+{
+  mock(numevents, data, datalen);
+}
+
 void
 sec_hash_sha1_16(uint8 * out, uint8 * in, uint8 * salt1)
 {
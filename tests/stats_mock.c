@@ -0,0 +1,42 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+/* Counters are not of interest to the tests, so these are not mocked
+   strictly */
+
+uint64
+stats_now(void)
+{
+  return 0;
+}
+
+void
+stats_init(void)
+{
+}
+
+void
+stats_add(STATS_COUNTER counter, uint32 n)
+{
+  UNUSED(counter);
+  UNUSED(n);
+}
+
+void
+stats_record(STATS_TIMER timer, uint64 start)
+{
+  UNUSED(timer);
+  UNUSED(start);
+}
+
+char *
+stats_json(void)
+{
+  return NULL;
+}
+
+void
+stats_dump_at_exit(const char *path)
+{
+  UNUSED(path);
+}
@@ -29,6 +29,21 @@ void ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8
   mock(x,y,cx,cy,width,height,data);
 }
 
+bitmap_row_func ui_bitmap_row_func(int *Bpp)
+{
+  return (bitmap_row_func) mock(Bpp);
+}
+
+uint8 *ui_image_buffer(size_t size)
+{
+  return (uint8 *) mock(size);
+}
+
+void ui_paint_image(int x, int y, int cx, int cy, int width, int height, uint8 * data)
+{
+  mock(x,y,cx,cy,width,height,data);
+}
+
 void ui_begin_update()
 {
   mock();
@@ -118,3 +133,15 @@ ui_seamless_end()
 {
   mock();
 }
+
+RD_HBITMAP
+ui_create_surface(int width, int height)
+{
+  return (RD_HBITMAP) mock(width, height);
+}
+
+void
+ui_set_surface(RD_HBITMAP surface, int width, int height)
+{
+  mock(surface, width, height);
+}
@@ -171,13 +171,10 @@ Ensure(XWIN, UiSelectCallsProcessPendingResizeIfGPendingResizeIsTrue)
 {
   g_pending_resize = True;
 
-  expect(rdpdr_add_fds);
-  expect(rdpdr_check_fds);
+  expect(rdpdr_check_events);
 
-  expect(ctrl_add_fds);
-  expect(ctrl_check_fds);
-
-  expect(seamless_select_timeout);
+  expect(reactor_has, will_return(True));
+  expect(reactor_wait);
 
   expect(XPending, will_return(0));
 
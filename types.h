@@ -68,6 +68,12 @@ typedef struct _RD_POINT
 }
 RD_POINT;
 
+typedef struct _RD_RECT
+{
+	sint16 x, y, cx, cy;
+}
+RD_RECT;
+
 typedef struct _COLOURENTRY
 {
 	uint8 red;
@@ -129,7 +135,7 @@ typedef struct _FONTGLYPH
 	sint16 baseline;
 	uint16 width;
 	uint16 height;
-	RD_HBITMAP pixmap;
+	uint8 *data;		/* 1 bpp, MSB first, rows padded to bytes */
 
 }
 FONTGLYPH;
@@ -170,9 +176,32 @@ typedef struct _VCHANNEL
 	uint32 flags;
 	struct stream in;
 	void (*process) (STREAM);
+	uint32 bytes_in, bytes_out;
 }
 VCHANNEL;
 
+/* Converts decoded pixels from in into out, until out reaches end */
+typedef void (*bitmap_row_func) (const uint8 * in, uint8 * out, uint8 * end);
+
+/* A rectangle of a bitmap update, decoded by bitmap_decompress_batch.
+   With a row_func, the result is converted into row_output instead. */
+typedef struct _BITMAP_JOB
+{
+	uint16 x, y, cx, cy;
+	int width, height, Bpp;
+	uint8 *input;
+	int size;
+	RD_BOOL compressed;
+	uint8 *output;
+	bitmap_row_func row_func;
+	uint8 *row_output;
+	int row_Bpp;
+	RD_BOOL ok;
+}
+BITMAP_JOB;
+
+typedef void (*bitmap_job_func) (void *job);
+
 /* PSTCACHE */
 typedef uint8 HASH_KEY[8];
 
@@ -186,6 +215,18 @@ typedef struct _PSTCACHE_CELLHEADER
 }
 CELLHEADER;
 
+/* Header of the persistent bitmap cache file, followed by the cell index */
+typedef struct _PSTCACHE_HEADER
+{
+	uint32 magic;
+	uint32 version;
+	uint32 cells;
+	uint32 Bpp;
+	uint32 checksum;	/* of the cell index */
+	uint32 pad[3];
+}
+PSTCACHE_HEADER;
+
 #define MAX_CBSIZE 256
 
 /* RDPSND */
@@ -205,10 +246,23 @@ typedef struct _RDPCOMP
 {
 	uint32 roff;
 	uint8 hist[RDP_MPPC_DICT_SIZE];
+	uint32 offset_cache[4];	/* rdp 6.0 */
+	uint8 *l1_hist;		/* rdp 6.1 level 1, allocated on first use */
+	uint32 l1_off;
 	struct stream ns;
 }
 RDPCOMP;
 
+/* MPPC compressor with the 8K history */
+typedef struct _RDPCOMP_ENC
+{
+	uint32 hoff;
+	uint8 hist[RDP_MPPC_8K_HIST_SIZE];
+	sint16 hash[4096];	/* last history position of a 3 byte sequence */
+	uint8 out[RDP_MPPC_8K_HIST_SIZE];
+}
+RDPCOMP_ENC;
+
 /* RDPDR */
 typedef uint32 RD_NTSTATUS;
 typedef uint32 RD_NTHANDLE;
@@ -308,11 +362,19 @@ typedef struct fileinfo
 	RD_BOOL delete_on_close;
 	NOTIFY notify;
 	uint32 info_class;
+	int notify_wd;		/* inotify watch, 0 when polling */
+	STREAM notify_events;	/* FILE_NOTIFY_INFORMATION not sent yet */
+	size_t notify_last;	/* offset of the last queued entry */
+	RD_BOOL notify_overflow;
+	struct dir_cache *dir_cache;	/* entries read ahead by queries */
 }
 FILEINFO;
 
 typedef RD_BOOL(*str_handle_lines_t) (const char *line, void *data);
 
+typedef void (*reactor_callback) (int fd, int events, void *data);
+typedef void (*reactor_timer_callback) (void *data);
+
 typedef enum
 {
 	Fixed,
@@ -321,4 +383,41 @@ typedef enum
 	Fullscreen,
 } window_size_type_t;
 
+/* Performance counters, cache hits are followed by the misses */
+typedef enum _STATS_COUNTER
+{
+	STATS_BYTES_RECEIVED,
+	STATS_BYTES_SENT,
+	STATS_PDUS_RECEIVED,
+	STATS_PDUS_SENT,
+	STATS_MPPC_COMPRESSED,
+	STATS_MPPC_EXPANDED,
+	STATS_BITMAP_CACHE_HITS,
+	STATS_BITMAP_CACHE_MISSES,
+	STATS_GLYPH_CACHE_HITS,
+	STATS_GLYPH_CACHE_MISSES,
+	STATS_BRUSH_CACHE_HITS,
+	STATS_BRUSH_CACHE_MISSES,
+	STATS_CURSOR_CACHE_HITS,
+	STATS_CURSOR_CACHE_MISSES,
+	STATS_X_FLUSHES,
+	STATS_AUDIO_UNDERRUNS,
+	STATS_RECEIVE_QUEUED,
+	STATS_RECEIVE_QUEUE_DEPTH,	/* summed as each PDU is queued */
+	STATS_RECEIVE_QUEUE_FULL,
+	STATS_COUNTERS
+} STATS_COUNTER;
+
+/* Latency histograms */
+typedef enum _STATS_TIMER
+{
+	STATS_DECODE_INTERLEAVED,
+	STATS_DECODE_PLANAR,
+	STATS_DECODE_REMOTEFX,
+	STATS_DECODE_NSCODEC,
+	STATS_PAINT,
+	STATS_AUDIO_LATENCY,
+	STATS_TIMERS
+} STATS_TIMER;
+
 #endif /* _TYPES_H */
@@ -37,6 +37,11 @@
 #ifdef HAVE_XRANDR
 #include <X11/extensions/Xrandr.h>
 #endif
+#ifdef HAVE_XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 #ifdef __APPLE__
 #include <sys/param.h>
@@ -112,7 +117,6 @@ typedef struct _seamless_window
 	int width, height;
 	int state;		/* normal/minimized/maximized. */
 	unsigned int desktop;
-	struct timeval *position_timer;
 
 	RD_BOOL outstanding_position;
 	unsigned int outpos_serial;
@@ -184,6 +188,11 @@ static RD_BOOL g_compatible_arch;
  */
 static RD_BOOL g_no_translate_image = False;
 
+static XErrorHandler g_old_error_handler;
+static RD_BOOL g_error_expected = False;
+/* set by error_handler() for errors that were expected */
+static RD_BOOL g_error_caught = False;
+
 /* endianness */
 static RD_BOOL g_host_be;
 static RD_BOOL g_xserver_be;
@@ -194,6 +203,22 @@ static int g_red_shift_l, g_blue_shift_l, g_green_shift_l;
 extern RD_BOOL g_ownbackstore;
 static Pixmap g_backstore = 0;
 
+/* Offscreen surface targeted by drawing orders. While it is set g_wnd
+   is the surface pixmap, and the window is kept in g_surface_wnd. */
+static Pixmap g_surface = 0;
+static Window g_surface_wnd;
+static RD_BOOL g_surface_ownbackstore;
+static int g_surface_width, g_surface_height;
+
+/* Between ui_begin_update and ui_end_update, with a backing store, only
+   the backing store is drawn to. The damaged area is then copied to the
+   window and seamless windows at once. */
+static RD_BOOL g_deferred = False;
+static RD_BOOL g_surface_deferred;
+static Region g_damage = NULL;
+static GC g_damage_gc = NULL;
+static uint64 g_update_start = 0;
+
 /* Moving in single app mode */
 static RD_BOOL g_moving_wnd;
 static int g_move_x_offset = 0;
@@ -229,7 +254,7 @@ PixelColour;
         do { \
                 seamless_window *sw; \
                 XRectangle rect; \
-		if (!g_seamless_windows) break; \
+		if (!g_seamless_windows || g_surface || g_deferred) break; \
                 for (sw = g_seamless_windows; sw; sw = sw->next) { \
                     rect.x = g_clip_rectangle.x - sw->xoffset; \
                     rect.y = g_clip_rectangle.y - sw->yoffset; \
@@ -251,6 +276,108 @@ seamless_XFillPolygon(Drawable d, XPoint * points, int npoints, int xoffset, int
 	points[0].y += yoffset;
 }
 
+static void
+seamless_XFillRectangles(Drawable d, XRectangle * rects, int nrects, int xoffset, int yoffset)
+{
+	int i;
+
+	for (i = 0; i < nrects; i++)
+	{
+		rects[i].x -= xoffset;
+		rects[i].y -= yoffset;
+	}
+	XFillRectangles(g_display, d, g_gc, rects, nrects);
+	for (i = 0; i < nrects; i++)
+	{
+		rects[i].x += xoffset;
+		rects[i].y += yoffset;
+	}
+}
+
+/* Convert the rectangles of an order, at most MAX_DELTA_RECTS, for a
+   single X request */
+static void
+make_xrectangles(XRectangle * xrects, RD_RECT * rects, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		xrects[i].x = rects[i].x;
+		xrects[i].y = rects[i].y;
+		xrects[i].width = rects[i].cx;
+		xrects[i].height = rects[i].cy;
+	}
+}
+
+/* Note an area of the backing store that has not reached the window
+   yet, limited to the clip rectangle */
+static void
+add_damage(int x, int y, int cx, int cy)
+{
+	XRectangle r;
+	int x2, y2;
+
+	if (!g_deferred)
+		return;
+
+	x2 = MIN(x + cx, g_clip_rectangle.x + g_clip_rectangle.width);
+	y2 = MIN(y + cy, g_clip_rectangle.y + g_clip_rectangle.height);
+	x = MAX(x, g_clip_rectangle.x);
+	y = MAX(y, g_clip_rectangle.y);
+	if (x2 <= x || y2 <= y)
+		return;
+
+	r.x = x;
+	r.y = y;
+	r.width = x2 - x;
+	r.height = y2 - y;
+	if (g_damage == NULL)
+		g_damage = XCreateRegion();
+	XUnionRectWithRegion(&r, g_damage, g_damage);
+}
+
+/* Damage the bounding box of CoordModePrevious points */
+static void
+add_damage_points(XPoint * points, int npoints)
+{
+	int i, x, y, left, top, right, bottom;
+
+	if (!g_deferred || npoints < 1)
+		return;
+
+	x = left = right = points[0].x;
+	y = top = bottom = points[0].y;
+	for (i = 1; i < npoints; i++)
+	{
+		x += points[i].x;
+		y += points[i].y;
+		left = MIN(left, x);
+		right = MAX(right, x);
+		top = MIN(top, y);
+		bottom = MAX(bottom, y);
+	}
+
+	add_damage(left, top, right - left + 1, bottom - top + 1);
+}
+
+/* Show an area of the backing store in the window, now or at the end
+   of the update */
+static void
+copy_backstore(int x, int y, int cx, int cy)
+{
+	if (g_deferred)
+	{
+		add_damage(x, y, cx, cy);
+		return;
+	}
+
+	XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
+	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
+				(g_display, g_backstore, sw->wnd, g_gc, x, y, cx, cy,
+				 x - sw->xoffset, y - sw->yoffset));
+}
+
 static void
 seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int yoffset)
 {
@@ -263,10 +390,12 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 
 #define FILL_RECTANGLE(x,y,cx,cy)\
 { \
-	XFillRectangle(g_display, g_wnd, g_gc, x, y, cx, cy); \
+	if (!g_deferred) \
+		XFillRectangle(g_display, g_wnd, g_gc, x, y, cx, cy); \
         ON_ALL_SEAMLESS_WINDOWS(XFillRectangle, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy)); \
 	if (g_ownbackstore) \
 		XFillRectangle(g_display, g_backstore, g_gc, x, y, cx, cy); \
+	add_damage(x, y, cx, cy); \
 }
 
 #define FILL_RECTANGLE_BACKSTORE(x,y,cx,cy)\
@@ -274,12 +403,31 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 	XFillRectangle(g_display, g_ownbackstore ? g_backstore : g_wnd, g_gc, x, y, cx, cy); \
 }
 
+#define FILL_RECTANGLES(r,n)\
+{ \
+	int _i; \
+	if (!g_deferred) \
+		XFillRectangles(g_display, g_wnd, g_gc, r, n); \
+	ON_ALL_SEAMLESS_WINDOWS(seamless_XFillRectangles, (sw->wnd, r, n, sw->xoffset, sw->yoffset)); \
+	if (g_ownbackstore) \
+		XFillRectangles(g_display, g_backstore, g_gc, r, n); \
+	for (_i = 0; _i < n; _i++) \
+		add_damage(r[_i].x, r[_i].y, r[_i].width, r[_i].height); \
+}
+
+#define FILL_RECTANGLES_BACKSTORE(r,n)\
+{ \
+	XFillRectangles(g_display, g_ownbackstore ? g_backstore : g_wnd, g_gc, r, n); \
+}
+
 #define FILL_POLYGON(p,np)\
 { \
-	XFillPolygon(g_display, g_wnd, g_gc, p, np, Complex, CoordModePrevious); \
+	if (!g_deferred) \
+		XFillPolygon(g_display, g_wnd, g_gc, p, np, Complex, CoordModePrevious); \
 	if (g_ownbackstore) \
 		XFillPolygon(g_display, g_backstore, g_gc, p, np, Complex, CoordModePrevious); \
 	ON_ALL_SEAMLESS_WINDOWS(seamless_XFillPolygon, (sw->wnd, p, np, sw->xoffset, sw->yoffset)); \
+	add_damage_points(p, np); \
 }
 
 #define DRAW_ELLIPSE(x,y,cx,cy,m)\
@@ -287,18 +435,21 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 	switch (m) \
 	{ \
 		case 0:	/* Outline */ \
-			XDrawArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
+			if (!g_deferred) \
+				XDrawArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
                         ON_ALL_SEAMLESS_WINDOWS(XDrawArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
 			if (g_ownbackstore) \
 				XDrawArc(g_display, g_backstore, g_gc, x, y, cx, cy, 0, 360*64); \
 			break; \
 		case 1: /* Filled */ \
-			XFillArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
+			if (!g_deferred) \
+				XFillArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
 			ON_ALL_SEAMLESS_WINDOWS(XFillArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
 			if (g_ownbackstore) \
 				XFillArc(g_display, g_backstore, g_gc, x, y, cx, cy, 0, 360*64); \
 			break; \
 	} \
+	add_damage(x, y, cx + 1, cy + 1); \
 }
 
 /* colour maps */
@@ -358,6 +509,8 @@ sw_get_window_by_wnd(Window wnd)
 }
 
 
+static void sw_position_timer(void *data);
+
 static void
 sw_remove_window(seamless_window * win)
 {
@@ -373,7 +526,7 @@ sw_remove_window(seamless_window * win)
 				XDestroyWindow(g_display, sw->group->wnd);
 				xfree(sw->group);
 			}
-			xfree(sw->position_timer);
+			reactor_cancel_timer(sw_position_timer, sw);
 			xfree(sw);
 			return;
 		}
@@ -426,22 +579,11 @@ sw_update_position(seamless_window * sw)
 }
 
 
-/* Check if it's time to send our position */
+/* Send our position once the window has settled */
 static void
-sw_check_timers()
+sw_position_timer(void *data)
 {
-	seamless_window *sw;
-	struct timeval now;
-
-	gettimeofday(&now, NULL);
-	for (sw = g_seamless_windows; sw; sw = sw->next)
-	{
-		if (timerisset(sw->position_timer) && timercmp(sw->position_timer, &now, <))
-		{
-			timerclear(sw->position_timer);
-			sw_update_position(sw);
-		}
-	}
+	sw_update_position((seamless_window *) data);
 }
 
 
@@ -933,6 +1075,66 @@ translate_colour(uint32 colour)
 }
 /* *INDENT-ON* */
 
+typedef void (*translate_kernel) (const uint8 * data, uint8 * out, uint8 * end);
+
+/* Kernels are specialised for every combination of RDP depth, X
+   pixmap bpp, X server byte order and host byte order, so that the
+   inner loops do not need to look at any of these. The one to use is
+   picked by translate_select_kernel(). */
+
+#define LOAD16(in, x)		{ x = *(in++); }
+#define LOAD16_SWAP(in, x)	{ x = *(in++); BSWAP16(x); }
+#define LOAD24(in, x)		{ x = *(in++) << 16; x |= *(in++) << 8; x |= *(in++); }
+
+#define TRANSLATE_KERNEL(name, intype, load, split, store) \
+static void \
+name(const uint8 * data, uint8 * out, uint8 * end) \
+{ \
+	const intype *in = (const intype *) data; \
+	uint32 pixel; \
+	uint32 value; \
+	PixelColour pc; \
+ \
+	while (out < end) \
+	{ \
+		load(in, pixel); \
+		split(pixel, pc); \
+		value = MAKECOLOUR(pc); \
+		store(out, value); \
+	} \
+}
+
+TRANSLATE_KERNEL(translate15to16_be, uint16, LOAD16, SPLITCOLOUR15, BOUT16)
+TRANSLATE_KERNEL(translate15to16_le, uint16, LOAD16, SPLITCOLOUR15, LOUT16)
+TRANSLATE_KERNEL(translate15to16_be_swap, uint16, LOAD16_SWAP, SPLITCOLOUR15, BOUT16)
+TRANSLATE_KERNEL(translate15to16_le_swap, uint16, LOAD16_SWAP, SPLITCOLOUR15, LOUT16)
+TRANSLATE_KERNEL(translate15to24_be, uint16, LOAD16, SPLITCOLOUR15, BOUT24)
+TRANSLATE_KERNEL(translate15to24_le, uint16, LOAD16, SPLITCOLOUR15, LOUT24)
+TRANSLATE_KERNEL(translate15to24_be_swap, uint16, LOAD16_SWAP, SPLITCOLOUR15, BOUT24)
+TRANSLATE_KERNEL(translate15to24_le_swap, uint16, LOAD16_SWAP, SPLITCOLOUR15, LOUT24)
+TRANSLATE_KERNEL(translate15to32_be, uint16, LOAD16, SPLITCOLOUR15, BOUT32)
+TRANSLATE_KERNEL(translate15to32_le, uint16, LOAD16, SPLITCOLOUR15, LOUT32)
+TRANSLATE_KERNEL(translate15to32_be_swap, uint16, LOAD16_SWAP, SPLITCOLOUR15, BOUT32)
+TRANSLATE_KERNEL(translate15to32_le_swap, uint16, LOAD16_SWAP, SPLITCOLOUR15, LOUT32)
+TRANSLATE_KERNEL(translate16to16_be, uint16, LOAD16, SPLITCOLOUR16, BOUT16)
+TRANSLATE_KERNEL(translate16to16_le, uint16, LOAD16, SPLITCOLOUR16, LOUT16)
+TRANSLATE_KERNEL(translate16to16_be_swap, uint16, LOAD16_SWAP, SPLITCOLOUR16, BOUT16)
+TRANSLATE_KERNEL(translate16to16_le_swap, uint16, LOAD16_SWAP, SPLITCOLOUR16, LOUT16)
+TRANSLATE_KERNEL(translate16to24_be, uint16, LOAD16, SPLITCOLOUR16, BOUT24)
+TRANSLATE_KERNEL(translate16to24_le, uint16, LOAD16, SPLITCOLOUR16, LOUT24)
+TRANSLATE_KERNEL(translate16to24_be_swap, uint16, LOAD16_SWAP, SPLITCOLOUR16, BOUT24)
+TRANSLATE_KERNEL(translate16to24_le_swap, uint16, LOAD16_SWAP, SPLITCOLOUR16, LOUT24)
+TRANSLATE_KERNEL(translate16to32_be, uint16, LOAD16, SPLITCOLOUR16, BOUT32)
+TRANSLATE_KERNEL(translate16to32_le, uint16, LOAD16, SPLITCOLOUR16, LOUT32)
+TRANSLATE_KERNEL(translate16to32_be_swap, uint16, LOAD16_SWAP, SPLITCOLOUR16, BOUT32)
+TRANSLATE_KERNEL(translate16to32_le_swap, uint16, LOAD16_SWAP, SPLITCOLOUR16, LOUT32)
+TRANSLATE_KERNEL(translate24to16_be, uint8, LOAD24, SPLITCOLOUR24, BOUT16)
+TRANSLATE_KERNEL(translate24to16_le, uint8, LOAD24, SPLITCOLOUR24, LOUT16)
+TRANSLATE_KERNEL(translate24to24_be, uint8, LOAD24, SPLITCOLOUR24, BOUT24)
+TRANSLATE_KERNEL(translate24to24_le, uint8, LOAD24, SPLITCOLOUR24, LOUT24)
+TRANSLATE_KERNEL(translate24to32_be, uint8, LOAD24, SPLITCOLOUR24, BOUT32)
+TRANSLATE_KERNEL(translate24to32_le, uint8, LOAD24, SPLITCOLOUR24, LOUT32)
+
 static void
 translate8to8(const uint8 * data, uint8 * out, uint8 * end)
 {
@@ -941,577 +1143,266 @@ translate8to8(const uint8 * data, uint8 * out, uint8 * end)
 }
 
 static void
-translate8to16(const uint8 * data, uint8 * out, uint8 * end)
+translate8to16_compat(const uint8 * data, uint8 * out, uint8 * end)
+{
+	/* *INDENT-OFF* */
+	REPEAT2
+	(
+		*((uint16 *) out) = g_colmap[*(data++)];
+		out += 2;
+	)
+	/* *INDENT-ON* */
+}
+
+static void
+translate8to16_be(const uint8 * data, uint8 * out, uint8 * end)
 {
 	uint16 value;
 
-	if (g_compatible_arch)
-	{
-		/* *INDENT-OFF* */
-		REPEAT2
-		(
-			*((uint16 *) out) = g_colmap[*(data++)];
-			out += 2;
-		)
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
-	{
-		while (out < end)
-		{
-			value = (uint16) g_colmap[*(data++)];
-			BOUT16(out, value);
-		}
-	}
-	else
+	while (out < end)
 	{
-		while (out < end)
-		{
-			value = (uint16) g_colmap[*(data++)];
-			LOUT16(out, value);
-		}
+		value = (uint16) g_colmap[*(data++)];
+		BOUT16(out, value);
 	}
 }
 
-/* little endian - conversion happens when colourmap is built */
 static void
-translate8to24(const uint8 * data, uint8 * out, uint8 * end)
+translate8to16_le(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint32 value;
+	uint16 value;
 
-	if (g_compatible_arch)
-	{
-		while (out < end)
-		{
-			value = g_colmap[*(data++)];
-			BOUT24(out, value);
-		}
-	}
-	else
+	while (out < end)
 	{
-		while (out < end)
-		{
-			value = g_colmap[*(data++)];
-			LOUT24(out, value);
-		}
+		value = (uint16) g_colmap[*(data++)];
+		LOUT16(out, value);
 	}
 }
 
+/* little endian - conversion happens when colourmap is built */
 static void
-translate8to32(const uint8 * data, uint8 * out, uint8 * end)
+translate8to24_compat(const uint8 * data, uint8 * out, uint8 * end)
 {
 	uint32 value;
 
-	if (g_compatible_arch)
-	{
-		/* *INDENT-OFF* */
-		REPEAT4
-		(
-			*((uint32 *) out) = g_colmap[*(data++)];
-			out += 4;
-		)
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
-	{
-		while (out < end)
-		{
-			value = g_colmap[*(data++)];
-			BOUT32(out, value);
-		}
-	}
-	else
+	while (out < end)
 	{
-		while (out < end)
-		{
-			value = g_colmap[*(data++)];
-			LOUT32(out, value);
-		}
+		value = g_colmap[*(data++)];
+		BOUT24(out, value);
 	}
 }
 
 static void
-translate15to16(const uint16 * data, uint8 * out, uint8 * end)
+translate8to24(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint16 pixel;
-	uint16 value;
-	PixelColour pc;
+	uint32 value;
 
-	if (g_xserver_be)
-	{
-		while (out < end)
-		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			BOUT16(out, value);
-		}
-	}
-	else
+	while (out < end)
 	{
-		while (out < end)
-		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			LOUT16(out, value);
-		}
+		value = g_colmap[*(data++)];
+		LOUT24(out, value);
 	}
 }
 
 static void
-translate15to24(const uint16 * data, uint8 * out, uint8 * end)
+translate8to32_compat(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint32 value;
-	uint16 pixel;
-	PixelColour pc;
-
-	if (g_compatible_arch)
-	{
-		/* *INDENT-OFF* */
-		REPEAT3
-		(
-			pixel = *(data++);
-			SPLITCOLOUR15(pixel, pc);
-			*(out++) = pc.blue;
-			*(out++) = pc.green;
-			*(out++) = pc.red;
-		)
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
-	{
-		while (out < end)
-		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			BOUT24(out, value);
-		}
-	}
-	else
-	{
-		while (out < end)
-		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			LOUT24(out, value);
-		}
-	}
+	/* *INDENT-OFF* */
+	REPEAT4
+	(
+		*((uint32 *) out) = g_colmap[*(data++)];
+		out += 4;
+	)
+	/* *INDENT-ON* */
 }
 
 static void
-translate15to32(const uint16 * data, uint8 * out, uint8 * end)
+translate8to32_be(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint16 pixel;
 	uint32 value;
-	PixelColour pc;
 
-	if (g_compatible_arch)
+	while (out < end)
 	{
-		/* *INDENT-OFF* */
-		REPEAT4
-		(
-			pixel = *(data++);
-			SPLITCOLOUR15(pixel, pc);
-			*(out++) = pc.blue;
-			*(out++) = pc.green;
-			*(out++) = pc.red;
-			*(out++) = 0;
-		)
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
-	{
-		while (out < end)
-		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			BOUT32(out, value);
-		}
-	}
-	else
-	{
-		while (out < end)
-		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			LOUT32(out, value);
-		}
+		value = g_colmap[*(data++)];
+		BOUT32(out, value);
 	}
 }
 
 static void
-translate16to16(const uint16 * data, uint8 * out, uint8 * end)
+translate8to32_le(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint16 pixel;
-	uint16 value;
-	PixelColour pc;
+	uint32 value;
 
-	if (g_xserver_be)
-	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT16(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT16(out, value);
-			}
-		}
-	}
-	else
+	while (out < end)
 	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT16(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT16(out, value);
-			}
-		}
+		value = g_colmap[*(data++)];
+		LOUT32(out, value);
 	}
 }
 
 static void
-translate16to24(const uint16 * data, uint8 * out, uint8 * end)
+translate15to24_compat(const uint8 * in, uint8 * out, uint8 * end)
 {
-	uint32 value;
+	const uint16 *data = (const uint16 *) in;
 	uint16 pixel;
 	PixelColour pc;
 
-	if (g_compatible_arch)
-	{
-		/* *INDENT-OFF* */
-		REPEAT3
-		(
-			pixel = *(data++);
-			SPLITCOLOUR16(pixel, pc);
-			*(out++) = pc.blue;
-			*(out++) = pc.green;
-			*(out++) = pc.red;
-		)
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
-	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT24(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT24(out, value);
-			}
-		}
-	}
-	else
-	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT24(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT24(out, value);
-			}
-		}
-	}
+	/* *INDENT-OFF* */
+	REPEAT3
+	(
+		pixel = *(data++);
+		SPLITCOLOUR15(pixel, pc);
+		*(out++) = pc.blue;
+		*(out++) = pc.green;
+		*(out++) = pc.red;
+	)
+	/* *INDENT-ON* */
 }
 
 static void
-translate16to32(const uint16 * data, uint8 * out, uint8 * end)
+translate15to32_compat(const uint8 * in, uint8 * out, uint8 * end)
 {
+	const uint16 *data = (const uint16 *) in;
 	uint16 pixel;
-	uint32 value;
 	PixelColour pc;
 
-	if (g_compatible_arch)
-	{
-		/* *INDENT-OFF* */
-		REPEAT4
-		(
-			pixel = *(data++);
-			SPLITCOLOUR16(pixel, pc);
-			*(out++) = pc.blue;
-			*(out++) = pc.green;
-			*(out++) = pc.red;
-			*(out++) = 0;
-		)
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
-	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT32(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT32(out, value);
-			}
-		}
-	}
-	else
-	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT32(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT32(out, value);
-			}
-		}
-	}
+	/* *INDENT-OFF* */
+	REPEAT4
+	(
+		pixel = *(data++);
+		SPLITCOLOUR15(pixel, pc);
+		*(out++) = pc.blue;
+		*(out++) = pc.green;
+		*(out++) = pc.red;
+		*(out++) = 0;
+	)
+	/* *INDENT-ON* */
 }
 
 static void
-translate24to16(const uint8 * data, uint8 * out, uint8 * end)
+translate16to24_compat(const uint8 * in, uint8 * out, uint8 * end)
 {
-	uint32 pixel = 0;
-	uint16 value;
+	const uint16 *data = (const uint16 *) in;
+	uint16 pixel;
 	PixelColour pc;
 
-	while (out < end)
-	{
-		pixel = *(data++) << 16;
-		pixel |= *(data++) << 8;
-		pixel |= *(data++);
-		SPLITCOLOUR24(pixel, pc);
-		value = MAKECOLOUR(pc);
-		if (g_xserver_be)
-		{
-			BOUT16(out, value);
-		}
-		else
-		{
-			LOUT16(out, value);
-		}
-	}
+	/* *INDENT-OFF* */
+	REPEAT3
+	(
+		pixel = *(data++);
+		SPLITCOLOUR16(pixel, pc);
+		*(out++) = pc.blue;
+		*(out++) = pc.green;
+		*(out++) = pc.red;
+	)
+	/* *INDENT-ON* */
 }
 
 static void
-translate24to24(const uint8 * data, uint8 * out, uint8 * end)
+translate16to32_compat(const uint8 * in, uint8 * out, uint8 * end)
 {
-	uint32 pixel;
-	uint32 value;
+	const uint16 *data = (const uint16 *) in;
+	uint16 pixel;
 	PixelColour pc;
 
-	if (g_xserver_be)
-	{
-		while (out < end)
-		{
-			pixel = *(data++) << 16;
-			pixel |= *(data++) << 8;
-			pixel |= *(data++);
-			SPLITCOLOUR24(pixel, pc);
-			value = MAKECOLOUR(pc);
-			BOUT24(out, value);
-		}
-	}
-	else
-	{
-		while (out < end)
-		{
-			pixel = *(data++) << 16;
-			pixel |= *(data++) << 8;
-			pixel |= *(data++);
-			SPLITCOLOUR24(pixel, pc);
-			value = MAKECOLOUR(pc);
-			LOUT24(out, value);
-		}
-	}
+	/* *INDENT-OFF* */
+	REPEAT4
+	(
+		pixel = *(data++);
+		SPLITCOLOUR16(pixel, pc);
+		*(out++) = pc.blue;
+		*(out++) = pc.green;
+		*(out++) = pc.red;
+		*(out++) = 0;
+	)
+	/* *INDENT-ON* */
 }
 
 static void
-translate24to32(const uint8 * data, uint8 * out, uint8 * end)
+translate24to32_compat(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint32 pixel;
-	uint32 value;
-	PixelColour pc;
-
-	if (g_compatible_arch)
-	{
-		/* *INDENT-OFF* */
+	/* *INDENT-OFF* */
 #ifdef NEED_ALIGN
-		REPEAT4
-		(
-			*(out++) = *(data++);
-			*(out++) = *(data++);
-			*(out++) = *(data++);
-			*(out++) = 0;
-		)
+	REPEAT4
+	(
+		*(out++) = *(data++);
+		*(out++) = *(data++);
+		*(out++) = *(data++);
+		*(out++) = 0;
+	)
 #else
-		REPEAT4
-		(
-		 /* Only read 3 bytes. Reading 4 bytes means reading beyond buffer. */
-		 *((uint32 *) out) = *((uint16 *) data) + (*((uint8 *) data + 2) << 16);
-		 out += 4;
-		 data += 3;
-		)
+	REPEAT4
+	(
+	 /* Only read 3 bytes. Reading 4 bytes means reading beyond buffer. */
+	 *((uint32 *) out) = *((uint16 *) data) + (*((uint8 *) data + 2) << 16);
+	 out += 4;
+	 data += 3;
+	)
 #endif
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
-	{
-		while (out < end)
-		{
-			pixel = *(data++) << 16;
-			pixel |= *(data++) << 8;
-			pixel |= *(data++);
-			SPLITCOLOUR24(pixel, pc);
-			value = MAKECOLOUR(pc);
-			BOUT32(out, value);
-		}
-	}
-	else
-	{
-		while (out < end)
-		{
-			pixel = *(data++) << 16;
-			pixel |= *(data++) << 8;
-			pixel |= *(data++);
-			SPLITCOLOUR24(pixel, pc);
-			value = MAKECOLOUR(pc);
-			LOUT32(out, value);
-		}
-	}
+	/* *INDENT-ON* */
 }
 
-static uint8 *
-translate_image(int width, int height, uint8 * data)
+/* Kernel for the current RDP depth, NULL if the depth combination
+   is not supported. Only valid while g_translate_depth matches
+   g_server_depth, as the RDP depth may change during negotiation. */
+static translate_kernel g_translate_kernel = NULL;
+static RD_BOOL g_translate_needed = True;
+static int g_translate_depth = -1;
+
+/* pick one of the 16 bpp kernels, indexed by
+   [X server big endian][host big endian] */
+#define PICK_KERNEL16(table) (table[g_xserver_be ? 1 : 0][g_host_be ? 1 : 0])
+
+static void
+translate_select_kernel(void)
 {
-	int size;
-	uint8 *out;
-	uint8 *end;
+	/* *INDENT-OFF* */
+	static const translate_kernel k15to16[2][2] = {
+		{ translate15to16_le, translate15to16_le_swap },
+		{ translate15to16_be, translate15to16_be_swap } };
+	static const translate_kernel k15to24[2][2] = {
+		{ translate15to24_le, translate15to24_le_swap },
+		{ translate15to24_be, translate15to24_be_swap } };
+	static const translate_kernel k15to32[2][2] = {
+		{ translate15to32_le, translate15to32_le_swap },
+		{ translate15to32_be, translate15to32_be_swap } };
+	static const translate_kernel k16to16[2][2] = {
+		{ translate16to16_le, translate16to16_le_swap },
+		{ translate16to16_be, translate16to16_be_swap } };
+	static const translate_kernel k16to24[2][2] = {
+		{ translate16to24_le, translate16to24_le_swap },
+		{ translate16to24_be, translate16to24_be_swap } };
+	static const translate_kernel k16to32[2][2] = {
+		{ translate16to32_le, translate16to32_le_swap },
+		{ translate16to32_be, translate16to32_be_swap } };
+	/* *INDENT-ON* */
+
+	g_translate_depth = g_server_depth;
+	g_translate_kernel = NULL;
 
 	/*
 	   If RDP depth and X Visual depths match,
 	   and arch(endian) matches, no need to translate:
-	   just return data.
+	   just use the data as is.
 	   Note: select_visual should've already ensured g_no_translate
 	   is only set for compatible depths, but the RDP depth might've
 	   changed during connection negotiations.
 	 */
+	g_translate_needed = True;
 
 	/* todo */
 	if (g_server_depth == 32 && g_depth == 24)
-	{
-		return data;
-	}
+		g_translate_needed = False;
 
 	if (g_no_translate_image)
 	{
 		if ((g_depth == 15 && g_server_depth == 15) ||
 		    (g_depth == 16 && g_server_depth == 16) ||
 		    (g_depth == 24 && g_server_depth == 24))
-			return data;
+			g_translate_needed = False;
 	}
 
-	size = width * height * (g_bpp / 8);
-	out = (uint8 *) xmalloc(size);
-	end = out + size;
+	if (!g_translate_needed)
+		return;
 
 	switch (g_server_depth)
 	{
@@ -1519,13 +1410,19 @@ translate_image(int width, int height, uint8 * data)
 			switch (g_bpp)
 			{
 				case 32:
-					translate24to32(data, out, end);
+					if (g_compatible_arch)
+						g_translate_kernel = translate24to32_compat;
+					else
+						g_translate_kernel = g_xserver_be ?
+							translate24to32_be : translate24to32_le;
 					break;
 				case 24:
-					translate24to24(data, out, end);
+					g_translate_kernel = g_xserver_be ?
+						translate24to24_be : translate24to24_le;
 					break;
 				case 16:
-					translate24to16(data, out, end);
+					g_translate_kernel = g_xserver_be ?
+						translate24to16_be : translate24to16_le;
 					break;
 			}
 			break;
@@ -1533,13 +1430,15 @@ translate_image(int width, int height, uint8 * data)
 			switch (g_bpp)
 			{
 				case 32:
-					translate16to32((uint16 *) data, out, end);
+					g_translate_kernel = g_compatible_arch ?
+						translate16to32_compat : PICK_KERNEL16(k16to32);
 					break;
 				case 24:
-					translate16to24((uint16 *) data, out, end);
+					g_translate_kernel = g_compatible_arch ?
+						translate16to24_compat : PICK_KERNEL16(k16to24);
 					break;
 				case 16:
-					translate16to16((uint16 *) data, out, end);
+					g_translate_kernel = PICK_KERNEL16(k16to16);
 					break;
 			}
 			break;
@@ -1547,13 +1446,15 @@ translate_image(int width, int height, uint8 * data)
 			switch (g_bpp)
 			{
 				case 32:
-					translate15to32((uint16 *) data, out, end);
+					g_translate_kernel = g_compatible_arch ?
+						translate15to32_compat : PICK_KERNEL16(k15to32);
 					break;
 				case 24:
-					translate15to24((uint16 *) data, out, end);
+					g_translate_kernel = g_compatible_arch ?
+						translate15to24_compat : PICK_KERNEL16(k15to24);
 					break;
 				case 16:
-					translate15to16((uint16 *) data, out, end);
+					g_translate_kernel = PICK_KERNEL16(k15to16);
 					break;
 			}
 			break;
@@ -1561,23 +1462,263 @@ translate_image(int width, int height, uint8 * data)
 			switch (g_bpp)
 			{
 				case 8:
-					translate8to8(data, out, end);
+					g_translate_kernel = translate8to8;
 					break;
 				case 16:
-					translate8to16(data, out, end);
+					if (g_compatible_arch)
+						g_translate_kernel = translate8to16_compat;
+					else
+						g_translate_kernel = g_xserver_be ?
+							translate8to16_be : translate8to16_le;
 					break;
 				case 24:
-					translate8to24(data, out, end);
+					g_translate_kernel = g_compatible_arch ?
+						translate8to24_compat : translate8to24;
 					break;
 				case 32:
-					translate8to32(data, out, end);
+					if (g_compatible_arch)
+						g_translate_kernel = translate8to32_compat;
+					else
+						g_translate_kernel = g_xserver_be ?
+							translate8to32_be : translate8to32_le;
 					break;
 			}
 			break;
 	}
+
+	if (g_translate_kernel == NULL)
+		logger(GUI, Warning, "No image translation from RDP depth %d to %d bpp",
+		       g_server_depth, g_bpp);
+}
+
+static RD_BOOL
+translate_image_needed(void)
+{
+	if (g_translate_depth != g_server_depth)
+		translate_select_kernel();
+
+	return g_translate_needed;
+}
+
+/* Translate a server depth image into a caller provided buffer
+   of width * height pixels of g_bpp */
+static void
+translate_image_to(int width, int height, uint8 * data, uint8 * out)
+{
+	if (g_translate_depth != g_server_depth)
+		translate_select_kernel();
+
+	if (g_translate_kernel != NULL)
+		g_translate_kernel(data, out, out + width * height * (g_bpp / 8));
+}
+
+static uint8 *
+translate_image(int width, int height, uint8 * data)
+{
+	uint8 *out;
+
+	if (!translate_image_needed())
+		return data;
+
+	out = (uint8 *) xmalloc(width * height * (g_bpp / 8));
+	translate_image_to(width, height, data, out);
 	return out;
 }
 
+/* The kernel converting server depth scanlines to the X visual, for
+   decoders to apply as they go. NULL when the decoded data is painted
+   as it is. */
+bitmap_row_func
+ui_bitmap_row_func(int *Bpp)
+{
+	if (g_owncolmap || !translate_image_needed())
+		return NULL;
+
+	*Bpp = g_bpp / 8;
+	return g_translate_kernel;
+}
+
+#ifdef HAVE_XSHM
+/* Shared memory segments used to push bitmap updates to a local X
+   server without copying them through the socket. The segments are
+   reused round robin and grown on demand. */
+#define SHM_POOL_SIZE 4
+#define SHM_SEGMENT_ROUND 65536
+
+typedef struct _shm_segment
+{
+	XShmSegmentInfo info;
+	size_t size;
+	/* serial of the last request reading from this segment */
+	unsigned long serial;
+} shm_segment;
+
+static shm_segment g_shm_pool[SHM_POOL_SIZE];
+static int g_shm_next = 0;
+static RD_BOOL g_use_shm = False;
+/* the segment last handed out by ui_image_buffer() */
+static shm_segment *g_shm_image = NULL;
+
+static void
+shm_segment_free(shm_segment * seg)
+{
+	if (seg->size == 0)
+		return;
+
+	XShmDetach(g_display, &seg->info);
+	shmdt(seg->info.shmaddr);
+	seg->size = 0;
+	seg->serial = 0;
+}
+
+static RD_BOOL
+shm_segment_alloc(shm_segment * seg, size_t size)
+{
+	size = (size + SHM_SEGMENT_ROUND - 1) & ~(size_t) (SHM_SEGMENT_ROUND - 1);
+
+	seg->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (seg->info.shmid == -1)
+	{
+		logger(GUI, Debug, "shm_segment_alloc(), shmget() failed: %s", strerror(errno));
+		return False;
+	}
+
+	seg->info.shmaddr = shmat(seg->info.shmid, NULL, 0);
+	if (seg->info.shmaddr == (char *) -1)
+	{
+		logger(GUI, Debug, "shm_segment_alloc(), shmat() failed: %s", strerror(errno));
+		shmctl(seg->info.shmid, IPC_RMID, NULL);
+		return False;
+	}
+	seg->info.readOnly = True;
+
+	g_error_caught = False;
+	g_error_expected = True;
+	XShmAttach(g_display, &seg->info);
+	XSync(g_display, False);
+	g_error_expected = False;
+
+	/* the segment goes away as soon as both ends have detached */
+	shmctl(seg->info.shmid, IPC_RMID, NULL);
+
+	if (g_error_caught)
+	{
+		shmdt(seg->info.shmaddr);
+		return False;
+	}
+
+	seg->size = size;
+	seg->serial = 0;
+	return True;
+}
+
+/* Get the next segment of at least size bytes, waiting until the X
+   server is done with its previous contents */
+static shm_segment *
+shm_segment_get(size_t size)
+{
+	shm_segment *seg;
+
+	seg = &g_shm_pool[g_shm_next];
+	g_shm_next = (g_shm_next + 1) % SHM_POOL_SIZE;
+
+	if (seg->size < size)
+	{
+		shm_segment_free(seg);
+		if (!shm_segment_alloc(seg, size))
+			return NULL;
+	}
+	else if (LastKnownRequestProcessed(g_display) < seg->serial)
+	{
+		XSync(g_display, False);
+	}
+
+	return seg;
+}
+
+static void
+shm_init(void)
+{
+	char *name;
+	shm_segment *seg;
+
+	g_use_shm = False;
+
+	if (g_owncolmap || !XShmQueryExtension(g_display))
+		return;
+
+	/* A remote X server would attach a segment from its own
+	   namespace, so only consider local connections */
+	name = DisplayString(g_display);
+	if (name[0] != ':' && strncmp(name, "unix:", 5) != 0)
+		return;
+
+	seg = &g_shm_pool[0];
+	if (!shm_segment_alloc(seg, 1))
+	{
+		logger(GUI, Debug, "shm_init(), MIT-SHM not usable, using XPutImage");
+		return;
+	}
+
+	logger(GUI, Debug, "shm_init(), using MIT-SHM for bitmap updates");
+	g_use_shm = True;
+}
+
+static void
+shm_deinit(void)
+{
+	int i;
+
+	if (!g_use_shm)
+		return;
+
+	for (i = 0; i < SHM_POOL_SIZE; i++)
+		shm_segment_free(&g_shm_pool[i]);
+	g_shm_image = NULL;
+	g_use_shm = False;
+}
+
+/* Translate a bitmap straight into shared memory and put it on
+   drawable. Returns False if the caller should use the regular path. */
+static RD_BOOL
+shm_put_bitmap(Drawable drawable, int x, int y, int cx, int cy, int width, int height,
+	       uint8 * data)
+{
+	XImage *image;
+	shm_segment *seg;
+	int bytes_per_line;
+
+	bytes_per_line = width * (g_bpp / 8);
+	seg = shm_segment_get((size_t) bytes_per_line * height);
+	if (seg == NULL)
+		return False;
+
+	image = XShmCreateImage(g_display, g_visual, g_depth, ZPixmap, NULL, &seg->info, width,
+				height);
+	if (image == NULL)
+		return False;
+
+	/* the translation routines write unpadded scanlines */
+	if (image->bytes_per_line != bytes_per_line)
+	{
+		XFree(image);
+		return False;
+	}
+	image->data = seg->info.shmaddr;
+
+	if (translate_image_needed())
+		translate_image_to(width, height, data, (uint8 *) image->data);
+	else
+		memcpy(image->data, data, bytes_per_line * height);
+
+	seg->serial = NextRequest(g_display);
+	XShmPutImage(g_display, drawable, g_gc, image, 0, 0, x, y, cx, cy, False);
+
+	XFree(image);
+	return True;
+}
+#endif
+
 static void
 xwin_refresh_pointer_map(void)
 {
@@ -1847,8 +1988,6 @@ select_visual(int screen_num)
 	return True;
 }
 
-static XErrorHandler g_old_error_handler;
-static RD_BOOL g_error_expected = False;
 
 /* Check if the X11 window corresponding to a seamless window with
    specified id exists. */
@@ -1878,11 +2017,23 @@ static int
 error_handler(Display * dpy, XErrorEvent * eev)
 {
 	if (g_error_expected)
+	{
+		g_error_caught = True;
 		return 0;
+	}
 
 	return g_old_error_handler(dpy, eev);
 }
 
+/* Events are read by xwin_process_events(), this only ends the wait */
+static void
+x_socket_ready(int fd, int events, void *data)
+{
+	UNUSED(fd);
+	UNUSED(events);
+	UNUSED(data);
+}
+
 static void
 set_wm_client_machine(Display * dpy, Window win)
 {
@@ -1983,6 +2134,7 @@ ui_init(void)
 	g_xserver_be = (ImageByteOrder(g_display) == MSBFirst);
 	screen_num = DefaultScreen(g_display);
 	g_x_socket = ConnectionNumber(g_display);
+	reactor_add(g_x_socket, REACTOR_READ, x_socket_ready, NULL);
 	g_screen = ScreenOfDisplay(g_display, screen_num);
 	g_depth = DefaultDepthOfScreen(g_screen);
 
@@ -2023,6 +2175,10 @@ ui_init(void)
 		g_ownbackstore = True;
 	}
 
+#ifdef HAVE_XSHM
+	shm_init();
+#endif
+
 	g_mod_map = XGetModifierMapping(g_display);
 	xwin_refresh_pointer_map();
 
@@ -2091,7 +2247,12 @@ ui_deinit(void)
 
 	XFreeModifiermap(g_mod_map);
 
+#ifdef HAVE_XSHM
+	shm_deinit();
+#endif
+
 	XFreeGC(g_display, g_gc);
+	reactor_remove(g_x_socket);
 	XCloseDisplay(g_display);
 	g_display = NULL;
 }
@@ -2615,6 +2776,10 @@ xwin_process_events(void)
 	seamless_window *sw;
 	static RD_BOOL is_g_wnd_mapped = False;
 
+	/* send the input of this drain in one PDU, with pointer
+	   motion coalesced */
+	rdp_begin_input_batch();
+
 	while ((XPending(g_display) > 0) && events++ < 20)
 	{
 		XNextEvent(g_display, &xevent);
@@ -2653,8 +2818,11 @@ xwin_process_events(void)
 						   serverside instead of terminating rdesktop */
 						sw = sw_get_window_by_wnd(xevent.xclient.window);
 						if (!sw)
+						{
 							/* Otherwise, quit */
+							rdp_end_input_batch();
 							return 0;
+						}
 						/* send seamless destroy process message */
 						seamless_send_destroy(sw->id);
 					}
@@ -3020,23 +3188,15 @@ xwin_process_events(void)
 				if (!sw)
 					break;
 
-				gettimeofday(sw->position_timer, NULL);
-				if (sw->position_timer->tv_usec + SEAMLESSRDP_POSITION_TIMER >=
-				    1000000)
-				{
-					sw->position_timer->tv_usec +=
-						SEAMLESSRDP_POSITION_TIMER - 1000000;
-					sw->position_timer->tv_sec += 1;
-				}
-				else
-				{
-					sw->position_timer->tv_usec += SEAMLESSRDP_POSITION_TIMER;
-				}
+				reactor_set_timer(sw_position_timer, sw,
+						  SEAMLESSRDP_POSITION_TIMER / 1000);
 
 				sw_handle_restack(sw);
 				break;
 		}
 	}
+	rdp_end_input_batch();
+
 	/* Keep going */
 	return 1;
 }
@@ -3053,67 +3213,35 @@ time_difference_in_ms(struct timeval then, struct timeval now)
 
 time_t g_wait_for_deactivate_ts = 0;
 
+static RD_BOOL g_rdp_socket_ready = False;
+
+static void
+rdp_socket_ready(int fd, int events, void *data)
+{
+	UNUSED(fd);
+	UNUSED(events);
+	UNUSED(data);
+	g_rdp_socket_ready = True;
+}
+
 static RD_BOOL
 process_fds(int rdp_socket, int ms)
 {
-	int n, ret;
-	fd_set rfds, wfds;
-	struct timeval tv;
-	RD_BOOL s_timeout = False;
-
-	n = (rdp_socket > g_x_socket) ? rdp_socket : g_x_socket;
-
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
-	FD_SET(rdp_socket, &rfds);
-	FD_SET(g_x_socket, &rfds);
-
-	/* default timeout */
-	tv.tv_sec = ms / 1000;
-	tv.tv_usec = (ms - (tv.tv_sec * 1000)) * 1000;
-
-#ifdef WITH_RDPSND
-	rdpsnd_add_fds(&n, &rfds, &wfds, &tv);
-#endif
-
-	/* add redirection handles */
-	rdpdr_add_fds(&n, &rfds, &wfds, &tv, &s_timeout);
-	seamless_select_timeout(&tv);
-
-	/* add ctrl slaves handles */
-	ctrl_add_fds(&n, &rfds);
+	/* everything waited for is registered with the reactor, the
+	   RDP socket on first use */
+	if (!reactor_has(rdp_socket))
+		reactor_add(rdp_socket, REACTOR_READ, rdp_socket_ready, NULL);
 
-	n++;
+	g_rdp_socket_ready = False;
 
-	ret = select(n, &rfds, &wfds, NULL, &tv);
-	if (ret <= 0)
+	if (reactor_wait(ms) == -1)
 	{
-		if (ret == -1)
-		{
-			logger(GUI, Error, "process_fds(), select failed: %s", strerror(errno));
-		}
-#ifdef WITH_RDPSND
-		rdpsnd_check_fds(&rfds, &wfds);
-#endif
-
-		/* Abort serial read calls */
-		if (s_timeout)
-			rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) True);
-		return False;
+		logger(GUI, Error, "process_fds(), reactor_wait() failed: %s", strerror(errno));
 	}
 
-#ifdef WITH_RDPSND
-	rdpsnd_check_fds(&rfds, &wfds);
-#endif
-
-	rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) False);
-
-	ctrl_check_fds(&rfds, &wfds);
-
-	if (FD_ISSET(rdp_socket, &rfds))
-		return True;
+	rdpdr_check_events();
 
-	return False;
+	return g_rdp_socket_ready;
 }
 
 static RD_BOOL
@@ -3229,10 +3357,11 @@ process_pending_resize()
    function to the calling tcp_recv().
 
    This function will return if there is data available for reading on
-   rdp_socket or if g_exit_mainloop flag is set.
+   rdp_socket or if g_exit_mainloop flag is set. Without wait it
+   returns after a single pass that does not block.
 */
-void
-ui_select(int rdp_socket)
+static void
+ui_select_loop(int rdp_socket, RD_BOOL wait)
 {
 	int timeout;
 	RD_BOOL rdp_socket_has_data = False;
@@ -3259,35 +3388,49 @@ ui_select(int rdp_socket)
 			}
 		}
 
-		if (g_seamless_active)
-			sw_check_timers();
-
 		/* process_fds() is a little special, it does two
-		   things in one. It will perform a select() on all
-		   filedescriptors; rdpsnd / rdpdr / ctrl and
-		   rdp_socket passed as argument. If data is available
-		   on any filedescriptor except rdp_socket, it will be processed.
+		   things in one. It will wait for all descriptors
+		   and timers registered with the reactor; rdpsnd /
+		   rdpdr / ctrl / seamless and rdp_socket passed as
+		   argument. If data is available on any of them
+		   except rdp_socket, it will be processed.
 
 		   If data is available on rdp_socket, the call return
 		   true and we exit from ui_select() to let tcp_recv()
 		   read data from rdp_socket.
 
-		   Use 60 seconds as default timeout for select. If
+		   Use 60 seconds as default timeout for the wait. If
 		   there is more X11 events on queue or g_pend is set,
 		   use a low timeout.
 		 */
 
-		timeout = 60000;
+		timeout = wait ? 60000 : 0;
 
 		if (XPending(g_display) > 0)
 			timeout = 0;
 		else if (g_pending_resize == True)
-			timeout = 100;
+			timeout = MIN(timeout, 100);
 
 		rdp_socket_has_data = process_fds(rdp_socket, timeout);
+		if (!wait)
+			break;
 	}
 }
 
+void
+ui_select(int rdp_socket)
+{
+	ui_select_loop(rdp_socket, True);
+}
+
+/* Handle X11 events and descriptors that are ready, without waiting,
+   for callers that have data to process ahead of rdp_socket */
+void
+ui_poll(int rdp_socket)
+{
+	ui_select_loop(rdp_socket, False);
+}
+
 void
 ui_move_pointer(int x, int y)
 {
@@ -3327,13 +3470,92 @@ ui_create_bitmap(int width, int height, uint8 * data)
 	return (RD_HBITMAP) bitmap;
 }
 
+static void
+paint_image_done(int x, int y, int cx, int cy)
+{
+	if (g_ownbackstore)
+	{
+		copy_backstore(x, y, cx, cy);
+	}
+	else
+	{
+		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
+					(g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
+					 x - sw->xoffset, y - sw->yoffset));
+	}
+}
+
 void
 ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * data)
 {
-	XImage *image;
 	uint8 *tdata;
+
+#ifdef HAVE_XSHM
+	if (g_use_shm
+	    && shm_put_bitmap(g_ownbackstore ? g_backstore : g_wnd, x, y, cx, cy, width, height,
+			      data))
+	{
+		paint_image_done(x, y, cx, cy);
+		return;
+	}
+#endif
+
+	tdata = (g_owncolmap ? data : translate_image(width, height, data));
+	ui_paint_image(x, y, cx, cy, width, height, tdata);
+	if (tdata != data)
+		xfree(tdata);
+}
+
+/* A buffer for size bytes of image in the X visual format, valid until
+   the next call. Shared with the X server when MIT-SHM is in use. */
+uint8 *
+ui_image_buffer(size_t size)
+{
+	static uint8 *buffer = NULL;
+	static size_t buffer_size = 0;
+
+#ifdef HAVE_XSHM
+	g_shm_image = g_use_shm ? shm_segment_get(size) : NULL;
+	if (g_shm_image != NULL)
+		return (uint8 *) g_shm_image->info.shmaddr;
+#endif
+
+	if (size > buffer_size)
+	{
+		buffer = (uint8 *) xrealloc(buffer, size);
+		buffer_size = size;
+	}
+	return buffer;
+}
+
+/* Paint an image that is already in the X visual format */
+void
+ui_paint_image(int x, int y, int cx, int cy, int width, int height, uint8 * data)
+{
+	XImage *image;
+	Drawable drawable = g_ownbackstore ? g_backstore : g_wnd;
 	int bitmap_pad;
 
+#ifdef HAVE_XSHM
+	if (g_shm_image != NULL && (char *) data >= g_shm_image->info.shmaddr
+	    && (char *) data < g_shm_image->info.shmaddr + g_shm_image->size)
+	{
+		image = XShmCreateImage(g_display, g_visual, g_depth, ZPixmap, NULL,
+					&g_shm_image->info, width, height);
+		if (image != NULL && image->bytes_per_line == width * (g_bpp / 8))
+		{
+			image->data = (char *) data;
+			g_shm_image->serial = NextRequest(g_display);
+			XShmPutImage(g_display, drawable, g_gc, image, 0, 0, x, y, cx, cy, False);
+			XFree(image);
+			paint_image_done(x, y, cx, cy);
+			return;
+		}
+		if (image != NULL)
+			XFree(image);
+	}
+#endif
+
 	if (g_server_depth == 8)
 	{
 		bitmap_pad = 8;
@@ -3346,29 +3568,11 @@ ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * dat
 			bitmap_pad = 32;
 	}
 
-	tdata = (g_owncolmap ? data : translate_image(width, height, data));
 	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
-			     (char *) tdata, width, height, bitmap_pad, 0);
-
-	if (g_ownbackstore)
-	{
-		XPutImage(g_display, g_backstore, g_gc, image, 0, 0, x, y, cx, cy);
-		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_backstore, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
-	}
-	else
-	{
-		XPutImage(g_display, g_wnd, g_gc, image, 0, 0, x, y, cx, cy);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
-	}
-
+			     (char *) data, width, height, bitmap_pad, 0);
+	XPutImage(g_display, drawable, g_gc, image, 0, 0, x, y, cx, cy);
 	XFree(image);
-	if (tdata != data)
-		xfree(tdata);
+	paint_image_done(x, y, cx, cy);
 }
 
 void
@@ -3377,6 +3581,49 @@ ui_destroy_bitmap(RD_HBITMAP bmp)
 	XFreePixmap(g_display, (Pixmap) bmp);
 }
 
+/* Create an offscreen surface, its contents are undefined until drawn */
+RD_HBITMAP
+ui_create_surface(int width, int height)
+{
+	return (RD_HBITMAP) XCreatePixmap(g_display, g_wnd, width, height, g_depth);
+}
+
+/* Redirect drawing to an offscreen surface, or back to the window when
+   surface is NULL */
+void
+ui_set_surface(RD_HBITMAP surface, int width, int height)
+{
+	if (surface == NULL)
+	{
+		if (!g_surface)
+			return;
+
+		g_wnd = g_surface_wnd;
+		g_ownbackstore = g_surface_ownbackstore;
+		g_deferred = g_surface_deferred;
+		g_surface = 0;
+		ui_reset_clip();
+		return;
+	}
+
+	if (!g_surface)
+	{
+		g_surface_wnd = g_wnd;
+		g_surface_ownbackstore = g_ownbackstore;
+		g_surface_deferred = g_deferred;
+	}
+
+	/* the surface pixmap stands in for the window, without a
+	   backing store or seamless windows */
+	g_surface = (Pixmap) surface;
+	g_surface_width = width;
+	g_surface_height = height;
+	g_wnd = (Window) g_surface;
+	g_ownbackstore = False;
+	g_deferred = False;
+	ui_reset_clip();
+}
+
 RD_HGLYPH
 ui_create_glyph(int width, int height, uint8 * data)
 {
@@ -3770,6 +4017,13 @@ void
 ui_reset_clip(void)
 {
 	XWindowAttributes attr;
+
+	if (g_surface)
+	{
+		ui_set_clip(0, 0, g_surface_width, g_surface_height);
+		return;
+	}
+
 	XGetWindowAttributes(g_display, g_wnd, &attr);
 	ui_set_clip(0, 0, attr.width, attr.height);
 }
@@ -3789,6 +4043,18 @@ ui_destblt(uint8 opcode,
 	RESET_FUNCTION(opcode);
 }
 
+void
+ui_multi_destblt(uint8 opcode,
+		 /* dest */ RD_RECT * rects, int count)
+{
+	XRectangle xrects[MAX_DELTA_RECTS];
+
+	make_xrectangles(xrects, rects, count);
+	SET_FUNCTION(opcode);
+	FILL_RECTANGLES(xrects, count);
+	RESET_FUNCTION(opcode);
+}
+
 static uint8 hatch_patterns[] = {
 	0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00,	/* 0 - bsHorizontal */
 	0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,	/* 1 - bsVertical */
@@ -3802,17 +4068,34 @@ void
 ui_patblt(uint8 opcode,
 	  /* dest */ int x, int y, int cx, int cy,
 	  /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	RD_RECT rect;
+
+	rect.x = x;
+	rect.y = y;
+	rect.cx = cx;
+	rect.cy = cy;
+	ui_multi_patblt(opcode, &rect, 1, brush, bgcolour, fgcolour);
+}
+
+void
+ui_multi_patblt(uint8 opcode,
+		/* dest */ RD_RECT * rects, int count,
+		/* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
 {
 	Pixmap fill;
+	XRectangle xrects[MAX_DELTA_RECTS];
 	uint8 i, ipattern[8];
+	int r;
 
+	make_xrectangles(xrects, rects, count);
 	SET_FUNCTION(opcode);
 
 	switch (brush->style)
 	{
 		case 0:	/* Solid */
 			SET_FOREGROUND(fgcolour);
-			FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
+			FILL_RECTANGLES_BACKSTORE(xrects, count);
 			break;
 
 		case 2:	/* Hatch */
@@ -3823,7 +4106,7 @@ ui_patblt(uint8 opcode,
 			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
 			XSetStipple(g_display, g_gc, fill);
 			XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-			FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
+			FILL_RECTANGLES_BACKSTORE(xrects, count);
 			XSetFillStyle(g_display, g_gc, FillSolid);
 			XSetTSOrigin(g_display, g_gc, 0, 0);
 			ui_destroy_glyph((RD_HGLYPH) fill);
@@ -3840,7 +4123,7 @@ ui_patblt(uint8 opcode,
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
 				XSetStipple(g_display, g_gc, fill);
 				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
+				FILL_RECTANGLES_BACKSTORE(xrects, count);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
 				ui_destroy_glyph((RD_HGLYPH) fill);
@@ -3851,7 +4134,7 @@ ui_patblt(uint8 opcode,
 				XSetFillStyle(g_display, g_gc, FillTiled);
 				XSetTile(g_display, g_gc, fill);
 				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
+				FILL_RECTANGLES_BACKSTORE(xrects, count);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
 				ui_destroy_bitmap((RD_HBITMAP) fill);
@@ -3864,7 +4147,7 @@ ui_patblt(uint8 opcode,
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
 				XSetStipple(g_display, g_gc, fill);
 				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
+				FILL_RECTANGLES_BACKSTORE(xrects, count);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
 				ui_destroy_glyph((RD_HGLYPH) fill);
@@ -3878,11 +4161,16 @@ ui_patblt(uint8 opcode,
 
 	RESET_FUNCTION(opcode);
 
-	if (g_ownbackstore)
-		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, g_ownbackstore ? g_backstore : g_wnd, sw->wnd, g_gc,
-				 x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	for (r = 0; r < count; r++)
+	{
+		if (g_ownbackstore)
+			copy_backstore(rects[r].x, rects[r].y, rects[r].cx, rects[r].cy);
+		else
+			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
+						(g_display, g_wnd, sw->wnd, g_gc, rects[r].x,
+						 rects[r].y, rects[r].cx, rects[r].cy,
+						 rects[r].x - sw->xoffset, rects[r].y - sw->yoffset));
+	}
 }
 
 void
@@ -3891,7 +4179,12 @@ ui_screenblt(uint8 opcode,
 	     /* src */ int srcx, int srcy)
 {
 	SET_FUNCTION(opcode);
-	if (g_ownbackstore)
+	if (g_deferred)
+	{
+		XCopyArea(g_display, g_backstore, g_backstore, g_gc, srcx, srcy, cx, cy, x, y);
+		add_damage(x, y, cx, cy);
+	}
+	else if (g_ownbackstore)
 	{
 		XCopyArea(g_display, g_Unobscured ? g_wnd : g_backstore,
 			  g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
@@ -3915,12 +4208,14 @@ ui_memblt(uint8 opcode,
 	  /* src */ RD_HBITMAP src, int srcx, int srcy)
 {
 	SET_FUNCTION(opcode);
-	XCopyArea(g_display, (Pixmap) src, g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
+	if (!g_deferred)
+		XCopyArea(g_display, (Pixmap) src, g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
 	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
 				(g_display, (Pixmap) src, sw->wnd, g_gc,
 				 srcx, srcy, cx, cy, x - sw->xoffset, y - sw->yoffset));
 	if (g_ownbackstore)
 		XCopyArea(g_display, (Pixmap) src, g_backstore, g_gc, srcx, srcy, cx, cy, x, y);
+	add_damage(x, y, cx, cy);
 	RESET_FUNCTION(opcode);
 }
 
@@ -3964,12 +4259,15 @@ ui_line(uint8 opcode,
 {
 	SET_FUNCTION(opcode);
 	SET_FOREGROUND(pen->colour);
-	XDrawLine(g_display, g_wnd, g_gc, startx, starty, endx, endy);
+	if (!g_deferred)
+		XDrawLine(g_display, g_wnd, g_gc, startx, starty, endx, endy);
 	ON_ALL_SEAMLESS_WINDOWS(XDrawLine, (g_display, sw->wnd, g_gc,
 					    startx - sw->xoffset, starty - sw->yoffset,
 					    endx - sw->xoffset, endy - sw->yoffset));
 	if (g_ownbackstore)
 		XDrawLine(g_display, g_backstore, g_gc, startx, starty, endx, endy);
+	add_damage(MIN(startx, endx), MIN(starty, endy),
+		   abs(endx - startx) + 1, abs(endy - starty) + 1);
 	RESET_FUNCTION(opcode);
 }
 
@@ -3982,6 +4280,18 @@ ui_rect(
 	FILL_RECTANGLE(x, y, cx, cy);
 }
 
+void
+ui_multi_rect(
+		     /* dest */ RD_RECT * rects, int count,
+		     /* brush */ uint32 colour)
+{
+	XRectangle xrects[MAX_DELTA_RECTS];
+
+	make_xrectangles(xrects, rects, count);
+	SET_FOREGROUND(colour);
+	FILL_RECTANGLES(xrects, count);
+}
+
 void
 ui_polygon(uint8 opcode,
 	   /* mode */ uint8 fillmode,
@@ -4088,10 +4398,12 @@ ui_polyline(uint8 opcode,
 	/* TODO: set join style */
 	SET_FUNCTION(opcode);
 	SET_FOREGROUND(pen->colour);
-	XDrawLines(g_display, g_wnd, g_gc, (XPoint *) points, npoints, CoordModePrevious);
+	if (!g_deferred)
+		XDrawLines(g_display, g_wnd, g_gc, (XPoint *) points, npoints, CoordModePrevious);
 	if (g_ownbackstore)
 		XDrawLines(g_display, g_backstore, g_gc, (XPoint *) points, npoints,
 			   CoordModePrevious);
+	add_damage_points((XPoint *) points, npoints);
 
 	ON_ALL_SEAMLESS_WINDOWS(seamless_XDrawLines,
 				(sw->wnd, (XPoint *) points, npoints, sw->xoffset, sw->yoffset));
@@ -4232,41 +4544,160 @@ ui_draw_glyph(int mixmode,
   }\
   if (glyph != NULL)\
   {\
-    x1 = x + glyph->offset;\
-    y1 = y + glyph->baseline;\
-    XSetStipple(g_display, g_gc, (Pixmap) glyph->pixmap);\
-    XSetTSOrigin(g_display, g_gc, x1, y1);\
-    FILL_RECTANGLE_BACKSTORE(x1, y1, glyph->width, glyph->height);\
+    text_run_add(glyph, x + glyph->offset, y + glyph->baseline);\
     if (flags & TEXT2_IMPLICIT_X)\
       x += glyph->width;\
   }\
 }
 
+/* Glyphs of a text run, drawn with a single stippled fill */
+typedef struct
+{
+	FONTGLYPH *glyph;
+	int x, y;
+}
+TEXT_RUN_GLYPH;
+
+static TEXT_RUN_GLYPH *g_text_run = NULL;
+static int g_text_run_size = 0;
+static int g_text_run_count = 0;
+
+static uint8 *g_text_bits = NULL;
+static int g_text_bits_size = 0;
+static Pixmap g_text_mask = 0;
+static int g_text_mask_width = 0;
+static int g_text_mask_height = 0;
+
+static void
+text_run_add(FONTGLYPH * glyph, int x, int y)
+{
+	if (g_text_run_count == g_text_run_size)
+	{
+		g_text_run_size = MAX(64, g_text_run_size * 2);
+		g_text_run = xrealloc(g_text_run, g_text_run_size * sizeof(TEXT_RUN_GLYPH));
+	}
+
+	g_text_run[g_text_run_count].glyph = glyph;
+	g_text_run[g_text_run_count].x = x;
+	g_text_run[g_text_run_count].y = y;
+	g_text_run_count++;
+}
+
+/* Compose the glyphs of the run into one 1 bpp image, clipped to the
+   clip rectangle, and fill through it with the foreground colour */
+static void
+text_run_draw(void)
+{
+	TEXT_RUN_GLYPH *g;
+	XImage *image;
+	int i, gx, gy, px, py, left, top, right, bottom, width, height, scanline, gscanline;
+
+	if (g_text_run_count == 0)
+		return;
+
+	left = top = INT_MAX;
+	right = bottom = INT_MIN;
+	for (i = 0; i < g_text_run_count; i++)
+	{
+		g = &g_text_run[i];
+		left = MIN(left, g->x);
+		top = MIN(top, g->y);
+		right = MAX(right, g->x + g->glyph->width);
+		bottom = MAX(bottom, g->y + g->glyph->height);
+	}
+
+	left = MAX(left, g_clip_rectangle.x);
+	top = MAX(top, g_clip_rectangle.y);
+	right = MIN(right, g_clip_rectangle.x + g_clip_rectangle.width);
+	bottom = MIN(bottom, g_clip_rectangle.y + g_clip_rectangle.height);
+	width = right - left;
+	height = bottom - top;
+	if (width <= 0 || height <= 0)
+	{
+		g_text_run_count = 0;
+		return;
+	}
+
+	scanline = (width + 7) / 8;
+	if (g_text_bits_size < scanline * height)
+	{
+		g_text_bits_size = scanline * height;
+		g_text_bits = xrealloc(g_text_bits, g_text_bits_size);
+	}
+	memset(g_text_bits, 0, scanline * height);
+
+	for (i = 0; i < g_text_run_count; i++)
+	{
+		g = &g_text_run[i];
+		gscanline = (g->glyph->width + 7) / 8;
+		for (gy = 0; gy < g->glyph->height; gy++)
+		{
+			py = g->y + gy - top;
+			if (py < 0 || py >= height)
+				continue;
+
+			for (gx = 0; gx < g->glyph->width; gx++)
+			{
+				px = g->x + gx - left;
+				if (px < 0 || px >= width)
+					continue;
+				if (g->glyph->data[gy * gscanline + gx / 8] & (0x80 >> (gx % 8)))
+					g_text_bits[py * scanline + px / 8] |= 0x80 >> (px % 8);
+			}
+		}
+	}
+	g_text_run_count = 0;
+
+	/* the mask only grows, so it is rarely recreated */
+	if (width > g_text_mask_width || height > g_text_mask_height)
+	{
+		if (g_text_mask)
+			XFreePixmap(g_display, g_text_mask);
+		g_text_mask_width = MAX(width, g_text_mask_width);
+		g_text_mask_height = MAX(height, g_text_mask_height);
+		g_text_mask = XCreatePixmap(g_display, g_wnd, g_text_mask_width,
+					    g_text_mask_height, 1);
+		if (g_create_glyph_gc == 0)
+			g_create_glyph_gc = XCreateGC(g_display, g_text_mask, 0, NULL);
+	}
+
+	image = XCreateImage(g_display, g_visual, 1, ZPixmap, 0, (char *) g_text_bits,
+			     width, height, 8, scanline);
+	image->byte_order = MSBFirst;
+	image->bitmap_bit_order = MSBFirst;
+	XInitImage(image);
+	XPutImage(g_display, g_text_mask, g_create_glyph_gc, image, 0, 0, 0, 0, width, height);
+	XFree(image);
+
+	XSetStipple(g_display, g_gc, g_text_mask);
+	XSetTSOrigin(g_display, g_gc, left, top);
+	FILL_RECTANGLE_BACKSTORE(left, top, width, height);
+}
+
 void
 ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 	     int clipx, int clipy, int clipcx, int clipcy,
 	     int boxx, int boxy, int boxcx, int boxcy, BRUSH * brush,
 	     uint32 bgcolour, uint32 fgcolour, uint8 * text, uint8 length)
 {
-	XWindowAttributes attr;
 	UNUSED(opcode);
 	UNUSED(brush);
 
-	XGetWindowAttributes(g_display, g_wnd, &attr);
-
 	/* TODO: use brush appropriately */
 
 	FONTGLYPH *glyph;
-	int i, j, xyoffset, x1, y1;
+	int i, j, xyoffset, width;
 	DATABLOB *entry;
 
+	width = g_surface ? g_surface_width : g_session_width;
+
 	SET_FOREGROUND(bgcolour);
 
 	/* Sometimes, the boxcx value is something really large, like
 	   32691. This makes XCopyArea fail with Xvnc. The code below
 	   is a quick fix. */
-	if (boxx + boxcx > attr.width)
-		boxcx = attr.width - boxx;
+	if (boxx + boxcx > width)
+		boxcx = width - boxx;
 
 	if (boxcx > 1)
 	{
@@ -4281,7 +4712,7 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 	SET_BACKGROUND(bgcolour);
 	XSetFillStyle(g_display, g_gc, FillStippled);
 
-	/* Paint text, character by character */
+	/* Collect the glyphs, then paint them together */
 	for (i = 0; i < length;)
 	{
 		switch (text[i])
@@ -4343,30 +4774,15 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 		}
 	}
 
+	text_run_draw();
 	XSetFillStyle(g_display, g_gc, FillSolid);
 
 	if (g_ownbackstore)
 	{
 		if (boxcx > 1)
-		{
-			XCopyArea(g_display, g_backstore, g_wnd, g_gc, boxx,
-				  boxy, boxcx, boxcy, boxx, boxy);
-			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-						(g_display, g_backstore, sw->wnd, g_gc,
-						 boxx, boxy,
-						 boxcx, boxcy,
-						 boxx - sw->xoffset, boxy - sw->yoffset));
-		}
+			copy_backstore(boxx, boxy, boxcx, boxcy);
 		else
-		{
-			XCopyArea(g_display, g_backstore, g_wnd, g_gc, clipx,
-				  clipy, clipcx, clipcy, clipx, clipy);
-			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-						(g_display, g_backstore, sw->wnd, g_gc,
-						 clipx, clipy,
-						 clipcx, clipcy, clipx - sw->xoffset,
-						 clipy - sw->yoffset));
-		}
+			copy_backstore(clipx, clipy, clipcx, clipcy);
 	}
 }
 
@@ -4413,10 +4829,7 @@ ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
 	if (g_ownbackstore)
 	{
 		XPutImage(g_display, g_backstore, g_gc, image, 0, 0, x, y, cx, cy);
-		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_backstore, sw->wnd, g_gc,
-					 x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+		copy_backstore(x, y, cx, cy);
 	}
 	else
 	{
@@ -4429,16 +4842,63 @@ ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
 	XFree(image);
 }
 
-/* these do nothing here but are used in uiports */
+/* Hold back drawing to the window until ui_end_update, when the
+   backing store makes that possible */
 void
 ui_begin_update(void)
 {
+	g_update_start = stats_now();
+	if (g_ownbackstore && g_backstore && !g_surface)
+		g_deferred = True;
 }
 
+/* Copy everything drawn since ui_begin_update to the window and the
+   seamless windows, one request per window */
 void
 ui_end_update(void)
 {
+	XRectangle box;
+	seamless_window *sw;
+
+	if (g_deferred)
+	{
+		g_deferred = False;
+
+		if (g_damage != NULL && !XEmptyRegion(g_damage))
+		{
+			if (g_damage_gc == NULL)
+			{
+				g_damage_gc = XCreateGC(g_display, g_wnd, 0, NULL);
+				XSetGraphicsExposures(g_display, g_damage_gc, False);
+			}
+
+			XClipBox(g_damage, &box);
+			XSetRegion(g_display, g_damage_gc, g_damage);
+			XCopyArea(g_display, g_backstore, g_wnd, g_damage_gc, box.x, box.y,
+				  box.width, box.height, box.x, box.y);
+
+			for (sw = g_seamless_windows; sw; sw = sw->next)
+			{
+				XSetClipOrigin(g_display, g_damage_gc, -sw->xoffset,
+					       -sw->yoffset);
+				XCopyArea(g_display, g_backstore, sw->wnd, g_damage_gc, box.x,
+					  box.y, box.width, box.height, box.x - sw->xoffset,
+					  box.y - sw->yoffset);
+			}
+			XSetClipOrigin(g_display, g_damage_gc, 0, 0);
+
+			XDestroyRegion(g_damage);
+			g_damage = NULL;
+		}
+	}
+
 	XFlush(g_display);
+	stats_add(STATS_X_FLUSHES, 1);
+	if (g_update_start != 0)
+	{
+		stats_record(STATS_PAINT, g_update_start);
+		g_update_start = 0;
+	}
 }
 
 
@@ -4657,8 +5117,6 @@ ui_seamless_create_window(unsigned long id, unsigned long group, unsigned long p
 	sw->group->refcnt++;
 	sw->state = SEAMLESSRDP_NOTYETMAPPED;
 	sw->desktop = 0;
-	sw->position_timer = xmalloc(sizeof(struct timeval));
-	timerclear(sw->position_timer);
 
 	sw->outstanding_position = False;
 	sw->outpos_serial = 0;
@@ -0,0 +1,301 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   RDP 8.0 bulk decompression [MS-RDPEGFX] 3.1.9.1
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+
+#define ZGFX_HISTORY_SIZE	2500000
+
+#define ZGFX_SEGMENTED_SINGLE		0xe0
+#define ZGFX_SEGMENTED_MULTIPART	0xe1
+
+#define ZGFX_PACKET_COMPR_TYPE_RDP8	0x04
+#define ZGFX_PACKET_COMPRESSED		0x20
+
+/* Prefix codes of literals (type 0) and matches (type 1), shortest
+   first. A match distance is base plus value_bits more bits. */
+static const struct
+{
+	int prefix_len;
+	uint32 prefix;
+	int value_bits;
+	int type;
+	uint32 base;
+}
+zgfx_tokens[] = {
+	{1, 0, 8, 0, 0},
+	{5, 17, 5, 1, 0},
+	{5, 18, 7, 1, 32},
+	{5, 19, 9, 1, 160},
+	{5, 20, 10, 1, 672},
+	{5, 21, 12, 1, 1696},
+	{5, 24, 0, 0, 0x00},
+	{5, 25, 0, 0, 0x01},
+	{6, 44, 14, 1, 5792},
+	{6, 45, 15, 1, 22176},
+	{6, 52, 0, 0, 0x02},
+	{6, 53, 0, 0, 0x03},
+	{6, 54, 0, 0, 0xff},
+	{7, 92, 18, 1, 54944},
+	{7, 93, 20, 1, 317088},
+	{7, 110, 0, 0, 0x04},
+	{7, 111, 0, 0, 0x05},
+	{7, 112, 0, 0, 0x06},
+	{7, 113, 0, 0, 0x07},
+	{7, 114, 0, 0, 0x08},
+	{7, 115, 0, 0, 0x09},
+	{7, 116, 0, 0, 0x0a},
+	{7, 117, 0, 0, 0x0b},
+	{7, 118, 0, 0, 0x3a},
+	{7, 119, 0, 0, 0x3b},
+	{7, 120, 0, 0, 0x3c},
+	{7, 121, 0, 0, 0x3d},
+	{7, 122, 0, 0, 0x3e},
+	{7, 123, 0, 0, 0x3f},
+	{7, 124, 0, 0, 0x40},
+	{7, 125, 0, 0, 0x80},
+	{8, 188, 20, 1, 1365664},
+	{8, 189, 21, 1, 2414240},
+	{8, 252, 0, 0, 0x0c},
+	{8, 253, 0, 0, 0x38},
+	{8, 254, 0, 0, 0x39},
+	{8, 255, 0, 0, 0x66},
+	{9, 380, 22, 1, 4511392},
+	{9, 381, 23, 1, 8705696},
+	{9, 382, 24, 1, 17094304},
+	{0, 0, 0, 0, 0}
+};
+
+static uint8 g_zgfx_history[ZGFX_HISTORY_SIZE];
+static uint32 g_zgfx_history_index = 0;
+
+/* Bits are read MSB first, a byte at a time so that the bits left
+   over can be dropped before an unencoded run */
+struct zgfx_bits
+{
+	uint8 *p, *end;
+	uint32 acc;
+	int nbits;
+	int remaining;		/* input bits left, excluding padding */
+};
+
+static uint32
+zgfx_getbits(struct zgfx_bits *b, int n)
+{
+	uint32 v;
+
+	while (b->nbits < n)
+	{
+		b->acc <<= 8;
+		if (b->p < b->end)
+			b->acc |= *b->p++;
+		b->nbits += 8;
+	}
+
+	b->nbits -= n;
+	b->remaining -= n;
+	v = (b->acc >> b->nbits) & ((1 << n) - 1);
+	return v;
+}
+
+static void
+zgfx_output(STREAM out, const uint8 * data, uint32 len)
+{
+	uint32 n;
+
+	if (s_left(out) < len)
+		s_realloc(out, s_tell(out) + len + 4096);
+	out_uint8a(out, data, len);
+
+	/* the history is a ring */
+	while (len > 0)
+	{
+		n = MIN(len, ZGFX_HISTORY_SIZE - g_zgfx_history_index);
+		memcpy(g_zgfx_history + g_zgfx_history_index, data, n);
+		g_zgfx_history_index = (g_zgfx_history_index + n) % ZGFX_HISTORY_SIZE;
+		data += n;
+		len -= n;
+	}
+}
+
+/* Copy count bytes from distance back in the history, byte by byte as
+   source and destination may overlap */
+static void
+zgfx_copy_match(STREAM out, uint32 distance, uint32 count)
+{
+	uint8 buf[256];
+	uint32 src, n, i;
+
+	src = (g_zgfx_history_index + ZGFX_HISTORY_SIZE - distance) % ZGFX_HISTORY_SIZE;
+	while (count > 0)
+	{
+		n = MIN(count, sizeof(buf));
+		for (i = 0; i < n; i++)
+		{
+			buf[i] = g_zgfx_history[src];
+			/* bytes already in buf are not in the history yet */
+			if (distance <= i)
+				buf[i] = buf[i - distance];
+			src = (src + 1) % ZGFX_HISTORY_SIZE;
+		}
+		zgfx_output(out, buf, n);
+		count -= n;
+	}
+}
+
+/* Decompress one RDP8_BULK_ENCODED_DATA */
+static RD_BOOL
+zgfx_decompress_segment(uint8 * data, uint32 size, STREAM out)
+{
+	struct zgfx_bits b;
+	uint8 header, c;
+	uint32 prefix, distance, count, extra;
+	int i, have;
+
+	if (size < 1)
+		return False;
+
+	header = data[0];
+	data++;
+	size--;
+
+	if ((header & 0x0f) != ZGFX_PACKET_COMPR_TYPE_RDP8)
+		return False;
+
+	if (!(header & ZGFX_PACKET_COMPRESSED))
+	{
+		zgfx_output(out, data, size);
+		return True;
+	}
+
+	/* the last byte holds the number of padding bits before it */
+	if (size < 1)
+		return False;
+
+	memset(&b, 0, sizeof(b));
+	b.p = data;
+	b.end = data + size - 1;
+	b.remaining = 8 * (size - 1) - data[size - 1];
+
+	while (b.remaining > 0)
+	{
+		prefix = 0;
+		have = 0;
+		for (i = 0; zgfx_tokens[i].prefix_len != 0; i++)
+		{
+			while (have < zgfx_tokens[i].prefix_len)
+			{
+				prefix = (prefix << 1) | zgfx_getbits(&b, 1);
+				have++;
+			}
+			if (prefix == zgfx_tokens[i].prefix)
+				break;
+		}
+
+		if (zgfx_tokens[i].prefix_len == 0)
+			return False;
+
+		if (zgfx_tokens[i].type == 0)
+		{
+			c = zgfx_tokens[i].base + zgfx_getbits(&b, zgfx_tokens[i].value_bits);
+			zgfx_output(out, &c, 1);
+			continue;
+		}
+
+		distance = zgfx_tokens[i].base + zgfx_getbits(&b, zgfx_tokens[i].value_bits);
+		if (distance == 0)
+		{
+			/* unencoded run, byte aligned */
+			count = zgfx_getbits(&b, 15);
+			b.remaining -= b.nbits;
+			b.nbits = 0;
+			if ((uint32) (b.end - b.p) < count)
+				return False;
+			zgfx_output(out, b.p, count);
+			b.p += count;
+			b.remaining -= 8 * count;
+			continue;
+		}
+
+		if (zgfx_getbits(&b, 1) == 0)
+		{
+			count = 3;
+		}
+		else
+		{
+			count = 4;
+			extra = 2;
+			while (zgfx_getbits(&b, 1) == 1)
+			{
+				count *= 2;
+				extra++;
+				if (extra > 24)
+					return False;
+			}
+			count += zgfx_getbits(&b, extra);
+		}
+
+		if (distance > ZGFX_HISTORY_SIZE)
+			return False;
+		zgfx_copy_match(out, distance, count);
+	}
+
+	return True;
+}
+
+/* Decompress RDP_SEGMENTED_DATA, appending to out */
+RD_BOOL
+zgfx_decompress(STREAM s, STREAM out)
+{
+	uint8 descriptor, *data;
+	uint16 segments;
+	uint32 size, i;
+
+	in_uint8(s, descriptor);
+	if (descriptor == ZGFX_SEGMENTED_SINGLE)
+	{
+		size = s_remaining(s);
+		in_uint8p(s, data, size);
+		return zgfx_decompress_segment(data, size, out);
+	}
+
+	if (descriptor != ZGFX_SEGMENTED_MULTIPART || !s_check_rem(s, 6))
+		return False;
+
+	in_uint16_le(s, segments);
+	in_uint8s(s, 4);	/* uncompressedSize */
+	for (i = 0; i < segments; i++)
+	{
+		if (!s_check_rem(s, 4))
+			return False;
+		in_uint32_le(s, size);
+		if (!s_check_rem(s, size))
+			return False;
+		in_uint8p(s, data, size);
+		if (!zgfx_decompress_segment(data, size, out))
+			return False;
+	}
+
+	return True;
+}
+
+/* Forget the history, when the channel is opened */
+void
+zgfx_reset(void)
+{
+	g_zgfx_history_index = 0;
+}